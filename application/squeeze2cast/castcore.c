@@ -17,6 +17,7 @@
 #include "cast_parse.h"
 #include "castcore.h"
 #include "castitf.h"
+#include "squeezeitf.h"
 
 #ifdef _WIN32
 #define bswap32(n) _byteswap_ulong((n))
@@ -121,6 +122,12 @@ static bool write_bytes(pthread_mutex_t *Mutex, SSL *ssl, void *buffer, uint16_t
 
 	free(buffer);
 
+	// first message sent with a new waitId is the request we'll wait an answer for
+	if (Ctx->waitId && Ctx->waitId != Ctx->stampId) {
+		Ctx->stampId = Ctx->waitId;
+		Ctx->stamp = gettime_ms();
+	}
+
 	if (!strcasestr(message.payload_utf8, "PING")) {
 		LOG_DEBUG("[%p]: Cast sending: %s", Ctx->ssl, message.payload_utf8);
 	}
@@ -307,6 +314,7 @@ void *CreateCastDevice(void *owner, bool group, bool stopReceiver, struct in_add
 
 	Ctx->reqId 		= 1;
 	Ctx->waitId 	= Ctx->waitMedia = Ctx->mediaSessionId = 0;
+	Ctx->stampId	= 0;
 	Ctx->sessionId 	= Ctx->transportId = NULL;
 	Ctx->owner 		= owner;
 	Ctx->Status 	= CAST_DISCONNECTED;
@@ -317,6 +325,10 @@ void *CreateCastDevice(void *owner, bool group, bool stopReceiver, struct in_add
 	Ctx->stopReceiver = stopReceiver;
 	Ctx->ssl  		= SSL_new(glSSLctx);
 
+	char labels[64];
+	snprintf(labels, sizeof(labels), "device=\"%s:%hu\"", inet_ntoa(ip), port);
+	Ctx->roundTrip = sq_metrics_register("cast_round_trip_seconds", "Cast request to response time", labels);
+
 	queue_init(&Ctx->eventQueue, false, NULL);
 	queue_init(&Ctx->reqQueue, false, NULL);
 	pthread_mutexattr_init(&mutexAttr);
@@ -377,6 +389,7 @@ void DeleteCastDevice(struct sCastCtx *Ctx) {
 	pthread_mutex_destroy(&Ctx->sslMutex);
 
 	LOG_INFO("[%p]: Cast device stopped", Ctx->owner);
+	sq_metrics_unregister(Ctx->roundTrip);
 	SSL_free(Ctx->ssl);
 	free(Ctx);
 }
@@ -637,6 +650,8 @@ static void *CastSocketThread(void *args) {
 			// expected request acknowledge (we know that str is still valid)
 			if (Ctx->waitId && Ctx->waitId == requestId) {
 
+				if (Ctx->stampId == requestId) sq_metrics_observe(Ctx->roundTrip, (gettime_ms() - Ctx->stamp) * 1000);
+
 				// reset waitId, might be set below
 				Ctx->waitId = 0;
 
@@ -93,6 +93,11 @@ void SaveConfig(char *name, void *ref, bool full) {
 		XMLUpdateNode(doc, root, false, "util_log",level2debug(util_loglevel));
 	}
 	XMLUpdateNode(doc, root, false, "log_limit", "%d", (int32_t) glLogLimit);
+	XMLUpdateNode(doc, root, false, "arena_size", "%u", glArenaSize);
+	XMLUpdateNode(doc, root, false, "buffer_budget", "%u", glBufferBudget);
+	XMLUpdateNode(doc, root, false, "cache_budget", "%u", glCacheBudget);
+	XMLUpdateNode(doc, root, false, "transcode_cache", "%s", glTranscodeCache);
+	XMLUpdateNode(doc, root, false, "transcode_cache_size", "%u", glTranscodeCacheSize);
 	XMLUpdateNode(doc, common, false, "streambuf_size", "%d", (uint32_t) glDeviceParam.streambuf_size);
 	XMLUpdateNode(doc, common, false, "output_size", "%d", (uint32_t) glDeviceParam.outputbuf_size);
 	XMLUpdateNode(doc, common, false, "stream_length", "%d", (int32_t) glDeviceParam.stream_length);
@@ -220,6 +225,11 @@ static void LoadGlobalItem(char *name, char *val) {
 	if (!strcmp(name, "cast_log")) cast_loglevel = debug2level(val);
 	if (!strcmp(name, "util_log")) util_loglevel = debug2level(val);
 	if (!strcmp(name, "log_limit")) glLogLimit = atol(val);
+	if (!strcmp(name, "arena_size")) glArenaSize = strtoul(val, NULL, 10);
+	if (!strcmp(name, "buffer_budget")) glBufferBudget = strtoul(val, NULL, 10);
+	if (!strcmp(name, "cache_budget")) glCacheBudget = strtoul(val, NULL, 10);
+	if (!strcmp(name, "transcode_cache")) strcpy(glTranscodeCache, val);
+	if (!strcmp(name, "transcode_cache_size")) glTranscodeCacheSize = strtoul(val, NULL, 10);
 
 	// deprecated
 	if (!strcmp(name, "upnp_socket")) strcpy(glBinding, val);
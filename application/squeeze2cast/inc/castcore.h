@@ -40,6 +40,9 @@ typedef struct sCastCtx {
 	SSL 			*ssl;
 	sockfd 			sock;
 	int				reqId, waitId, waitMedia;
+	int				stampId;		// request being timed and when it was sent
+	uint32_t		stamp;
+	void			*roundTrip;		// metrics handle
 	pthread_t 		Thread, PingThread;
 	pthread_mutex_t	Mutex, eventMutex, sslMutex;
 	pthread_cond_t	eventCond;
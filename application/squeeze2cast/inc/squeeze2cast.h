@@ -78,6 +78,11 @@ struct sMR {
 
 extern char 				glBinding[];
 extern int32_t				glLogLimit;
+extern uint32_t				glArenaSize;
+extern uint32_t				glBufferBudget;
+extern uint32_t				glCacheBudget;
+extern char					glTranscodeCache[];
+extern uint32_t				glTranscodeCacheSize;
 extern tMRConfig			glMRConfig;
 extern sq_dev_param_t		glDeviceParam;
 extern struct sMR			glMRDevices[MAX_RENDERERS];
@@ -54,6 +54,11 @@ enum { NEXT_GAPPED = 0, NEXT_UNDERRUN = 2 };
 /* globals 																	  */
 /*----------------------------------------------------------------------------*/
 int32_t		glLogLimit = -1;
+uint32_t	glArenaSize = ARENA_SIZE;
+uint32_t	glBufferBudget = BUFFER_BUDGET;
+uint32_t	glCacheBudget = CACHE_BUDGET;
+char		glTranscodeCache[STR_LEN] = "";
+uint32_t	glTranscodeCacheSize = TCACHE_SIZE;
 char		glBinding[128] = "?";
 struct sMR	glMRDevices[MAX_RENDERERS];
 
@@ -1064,7 +1069,8 @@ static bool Start(void) {
 	for (int i = 0; i < MAX_RENDERERS; i++) pthread_mutex_init(&glMRDevices[i].Mutex, 0);
 
 	// start squeezebox part
-	sq_init(Host, Port, glModelName);
+	sq_init(Host, Port, glModelName, glArenaSize, glBufferBudget, glCacheBudget,
+			glTranscodeCache, (size_t) glTranscodeCacheSize * 1024 * 1024);
 
 	// init mutex & cond no matter what
 	for (int i = 0; i < MAX_RENDERERS; i++) pthread_mutex_init(&glMRDevices[i].Mutex, 0);
@@ -1317,6 +1323,10 @@ int main(int argc, char *argv[]) {
 #if defined(SIGHUP)
 	signal(SIGHUP, sighandler);
 #endif
+#if defined(SIGPIPE)
+	// a renderer closing while we sendfile() to it must not kill us
+	signal(SIGPIPE, SIG_IGN);
+#endif
 
 	// otherwise some atof/strtod fail with '.'
 	setlocale(LC_NUMERIC, "C");
@@ -34,9 +34,7 @@ struct chunk_table {
 struct alac {
 	void *decoder;
 	u8_t *writebuf;
-	// following used for mp4 only
-	u32_t consume;
-	u32_t pos;
+	struct mp4_s mp4;
 	u32_t sample;
 	u32_t nextchunk;
 	void *stsc;
@@ -45,245 +43,143 @@ struct alac {
 	u64_t sttssamples;
 	bool  empty;
 	struct chunk_table *chunkinfo;
-	u32_t  *block_size, default_block_size, block_index;
 	unsigned sample_rate;
 	unsigned char channels, sample_size;
-	unsigned trak, play;
 };
 
 extern log_level decode_loglevel;
 static log_level *loglevel = &decode_loglevel;
 
-#define LOCK_S   mutex_lock(ctx->streambuf->mutex)
-#define UNLOCK_S mutex_unlock(ctx->streambuf->mutex)
-#define LOCK_O   mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(ctx->outputbuf->mutex)
+#define LOCK_S   metrics_lock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define UNLOCK_S metrics_unlock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define LOCK_O   metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
 #if PROCESS
-#define LOCK_O_direct   if (ctx->decode.direct) mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O_direct if (ctx->decode.direct) mutex_unlock(ctx->outputbuf->mutex)
+#define LOCK_O_direct   if (ctx->decode.direct) metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O_direct if (ctx->decode.direct) metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
 #define IF_DIRECT(x)    if (ctx->decode.direct) { x }
 #define IF_PROCESS(x)   if (!ctx->decode.direct) { x }
 #else
-#define LOCK_O_direct   mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O_direct mutex_unlock(ctx->outputbuf->mutex)
+#define LOCK_O_direct   metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O_direct metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
 #define IF_DIRECT(x)    { x }
 #define IF_PROCESS(x)
 #endif
 
-// read mp4 header to extract config data
-static int read_mp4_header(struct thread_ctx_s *ctx) {
+// parse boxes that are needed to decode, they are given in full
+static int parse_box(struct mp4_s *mp4, char *type, u8_t *data, u32_t len, struct thread_ctx_s *ctx) {
 	struct alac *l = ctx->decode.handle;
-	size_t bytes = min(_buf_used(ctx->streambuf), _buf_cont_read(ctx->streambuf));
-	char type[5];
-	u32_t len;
 
-	while (bytes >= 8) {
-		// count trak to find the first playable one
-		u32_t consume;
-
-		len = unpackN((u32_t *)ctx->streambuf->readp);
-		memcpy(type, ctx->streambuf->readp + 4, 4);
-		type[4] = '\0';
-
-		if (!strcmp(type, "moov")) {
-			l->trak = 0;
-			l->play = 0;
-		}
-		if (!strcmp(type, "trak")) {
-			l->trak++;
-		}
-
-		// extract audio config from within alac
-		if (!strcmp(type, "alac") && bytes > len) {
-			u8_t *ptr = ctx->streambuf->readp + 36;
-			unsigned int block_size;
-			l->play = l->trak;
-			l->decoder = alac_create_decoder(len - 36, ptr, &l->sample_size, &l->sample_rate, &l->channels, &block_size);
-			l->writebuf = malloc(block_size + 256);
-			LOG_INFO("[%p]: allocated write buffer of %u bytes", ctx, block_size);
-			if (!l->writebuf) {
-				LOG_ERROR("[%p]: allocation failed", ctx);
-				return -1;
-			}
+	// extract audio config from within alac
+	if (!strcmp(type, "alac")) {
+		u8_t *ptr = data + 36;
+		unsigned int block_size;
+		mp4->play = mp4->trak;
+		l->decoder = alac_create_decoder(len - 36, ptr, &l->sample_size, &l->sample_rate, &l->channels, &block_size);
+		l->writebuf = malloc(block_size + 256);
+		LOG_INFO("[%p]: allocated write buffer of %u bytes", ctx, block_size);
+		if (!l->writebuf) {
+			LOG_ERROR("[%p]: allocation failed", ctx);
+			return -1;
 		}
+	}
 
-		// extract the total number of samples from stts
-		if (!strcmp(type, "stsz") && bytes > len) {
-			u32_t i;
-			u8_t *ptr = ctx->streambuf->readp + 12;
-			l->default_block_size = unpackN((u32_t *) ptr); ptr += 4;
-			if (!l->default_block_size) {
-				u32_t entries = unpackN((u32_t *)ptr); ptr += 4;
-				l->block_size = malloc((entries + 1)* 4);
-				for (i = 0; i < entries; i++) {
-					l->block_size[i] = unpackN((u32_t *)ptr); ptr += 4;
-				}
-				l->block_size[entries] = 0;
-				LOG_DEBUG("[%p]: total blocksize contained in stsz %u", ctx, entries);
-			} else {
-				LOG_DEBUG("[%p]: fixed blocksize in stsz %u", ctx, l->default_block_size);
-            }
+	// extract the total number of samples from stts
+	if (!strcmp(type, "stts")) {
+		u32_t i;
+		u8_t *ptr = data + 12;
+		u32_t entries = unpackN((u32_t *)ptr);
+		ptr += 4;
+		for (i = 0; i < entries; ++i) {
+			u32_t count = unpackN((u32_t *)ptr);
+			u32_t size = unpackN((u32_t *)(ptr + 4));
+			l->sttssamples += count * size;
+			ptr += 8;
 		}
+		LOG_DEBUG("[%p]: total number of samples contained in stts: %" PRIu64, ctx, l->sttssamples);
+	}
 
-		// extract the total number of samples from stts
-		if (!strcmp(type, "stts") && bytes > len) {
-			u32_t i;
-			u8_t *ptr = ctx->streambuf->readp + 12;
-			u32_t entries = unpackN((u32_t *)ptr);
-			ptr += 4;
-			for (i = 0; i < entries; ++i) {
-				u32_t count = unpackN((u32_t *)ptr);
-				u32_t size = unpackN((u32_t *)(ptr + 4));
-				l->sttssamples += count * size;
-				ptr += 8;
-			}
-			LOG_DEBUG("[%p]: total number of samples contained in stts: %" PRIu64, ctx, l->sttssamples);
+	// stash sample to chunk info, assume it comes before stco
+	if (!strcmp(type, "stsc") && !l->chunkinfo) {
+		l->stsc = malloc(len - 12);
+		if (l->stsc == NULL) {
+			LOG_WARN("[%p]: malloc fail", ctx);
+			return -1;
 		}
+		memcpy(l->stsc, data + 12, len - 12);
+	}
 
-		// stash sample to chunk info, assume it comes before stco
-		if (!strcmp(type, "stsc") && bytes > len && !l->chunkinfo) {
-			l->stsc = malloc(len - 12);
-			if (l->stsc == NULL) {
-				LOG_WARN("[%p]: malloc fail", ctx);
-				return -1;
-			}
-			memcpy(l->stsc, ctx->streambuf->readp + 12, len - 12);
+	// build offsets table from stco and stored stsc
+	if (!strcmp(type, "stco") && mp4->play == mp4->trak) {
+		u32_t i;
+		// extract chunk offsets
+		u8_t *ptr = data + 12;
+		u32_t entries = unpackN((u32_t *)ptr);
+		ptr += 4;
+		l->chunkinfo = malloc(sizeof(struct chunk_table) * (entries + 1));
+		if (l->chunkinfo == NULL) {
+			LOG_WARN("[%p]: malloc fail", ctx);
+			return -1;
 		}
-
-		// build offsets table from stco and stored stsc
-		if (!strcmp(type, "stco") && bytes > len && l->play == l->trak) {
-			u32_t i;
-			// extract chunk offsets
-			u8_t *ptr = ctx->streambuf->readp + 12;
-			u32_t entries = unpackN((u32_t *)ptr);
-			ptr += 4;
-			l->chunkinfo = malloc(sizeof(struct chunk_table) * (entries + 1));
-			if (l->chunkinfo == NULL) {
-				LOG_WARN("[%p]: malloc fail", ctx);
-				return -1;
-			}
-			for (i = 0; i < entries; ++i) {
-				l->chunkinfo[i].offset = unpackN((u32_t *)ptr);
-				l->chunkinfo[i].sample = 0;
-				ptr += 4;
-			}
+		for (i = 0; i < entries; ++i) {
+			l->chunkinfo[i].offset = unpackN((u32_t *)ptr);
 			l->chunkinfo[i].sample = 0;
-			l->chunkinfo[i].offset = 0;
-			// fill in first sample id for each chunk from stored stsc
-			if (l->stsc) {
-				u32_t stsc_entries = unpackN((u32_t *)l->stsc);
-				u32_t sample = 0;
-				u32_t last = 0, last_samples = 0;
-				u8_t *ptr = (u8_t *)l->stsc + 4;
-				while (stsc_entries--) {
-					u32_t first = unpackN((u32_t *)ptr);
-					u32_t samples = unpackN((u32_t *)(ptr + 4));
-					if (last) {
-						for (i = last - 1; i < first - 1; ++i) {
-							l->chunkinfo[i].sample = sample;
-							sample += last_samples;
-						}
-					}
-					if (stsc_entries == 0) {
-						for (i = first - 1; i < entries; ++i) {
-							l->chunkinfo[i].sample = sample;
-							sample += samples;
-						}
-					}
-					last = first;
-					last_samples = samples;
-					ptr += 12;
-				}
-				free(l->stsc);
-				l->stsc = NULL;
-			}
+			ptr += 4;
 		}
-
-		// found media data, advance to start of first chunk and return
-		if (!strcmp(type, "mdat")) {
-			_buf_inc_readp(ctx->streambuf, 8);
-			l->pos += 8;
-			bytes  -= 8;
-			if (l->play) {
-				LOG_DEBUG("[%p]: type: mdat len: %u pos: %u", ctx, len, l->pos);
-				if (l->chunkinfo && l->chunkinfo[0].offset > l->pos) {
-					u32_t skip = l->chunkinfo[0].offset - l->pos;
-					LOG_DEBUG("[%p]: skipping: %u", ctx, skip);
-					if (skip <= bytes) {
-						_buf_inc_readp(ctx->streambuf, skip);
-						l->pos += skip;
-					} else {
-						l->consume = skip;
+		l->chunkinfo[i].sample = 0;
+		l->chunkinfo[i].offset = 0;
+		// fill in first sample id for each chunk from stored stsc
+		if (l->stsc) {
+			u32_t stsc_entries = unpackN((u32_t *)l->stsc);
+			u32_t sample = 0;
+			u32_t last = 0, last_samples = 0;
+			u8_t *ptr = (u8_t *)l->stsc + 4;
+			while (stsc_entries--) {
+				u32_t first = unpackN((u32_t *)ptr);
+				u32_t samples = unpackN((u32_t *)(ptr + 4));
+				if (last) {
+					for (i = last - 1; i < first - 1; ++i) {
+						l->chunkinfo[i].sample = sample;
+						sample += last_samples;
 					}
 				}
-				l->sample = l->nextchunk = 1;
-				l->block_index = 0;
-				return 1;
-			} else {
-				LOG_DEBUG("[%p]: type: mdat len: %u, no playable track found", ctx, len);
-				return -1;
-			}
-		}
-
-		// parse key-value atoms within ilst ---- entries to get encoder padding within iTunSMPB entry for gapless
-		if (!strcmp(type, "----") && bytes > len) {
-			u8_t *ptr = ctx->streambuf->readp + 8;
-			u32_t remain = len - 8, size;
-			if (!memcmp(ptr + 4, "mean", 4) && (size = unpackN((u32_t *)ptr)) < remain) {
-				ptr += size; remain -= size;
-			}
-			if (!memcmp(ptr + 4, "name", 4) && (size = unpackN((u32_t *)ptr)) < remain && !memcmp(ptr + 12, "iTunSMPB", 8)) {
-				ptr += size; remain -= size;
-			}
-			if (!memcmp(ptr + 4, "data", 4) && remain > 16 + 48) {
-				// data is stored as hex strings: 0 start end samples
-				u32_t b, c; u64_t d;
-				if (sscanf((const char *)(ptr + 16), "%x %x %x %" PRIx64, &b, &b, &c, &d) == 4) {
-					LOG_DEBUG("[%p]: iTunSMPB start: %u end: %u samples: %" PRIu64, ctx, b, c, d);
-					if (l->sttssamples && l->sttssamples < b + c + d) {
-						LOG_DEBUG("[%p]: reducing samples as stts count is less", ctx);
-						d = l->sttssamples - (b + c);
+				if (stsc_entries == 0) {
+					for (i = first - 1; i < entries; ++i) {
+						l->chunkinfo[i].sample = sample;
+						sample += samples;
 					}
-					l->skip = b;
-					l->samples = d;
 				}
+				last = first;
+				last_samples = samples;
+				ptr += 12;
 			}
+			free(l->stsc);
+			l->stsc = NULL;
 		}
+	}
 
-		// default to consuming entire box
-		consume = len;
-
-		// read into these boxes so reduce consume
-		if (!strcmp(type, "moov") || !strcmp(type, "trak") || !strcmp(type, "mdia") || !strcmp(type, "minf") || !strcmp(type, "stbl") ||
-			!strcmp(type, "udta") || !strcmp(type, "ilst")) {
-			consume = 8;
+	// parse key-value atoms within ilst ---- entries to get encoder padding within iTunSMPB entry for gapless
+	if (!strcmp(type, "----")) {
+		u8_t *ptr = data + 8;
+		u32_t remain = len - 8, size;
+		if (!memcmp(ptr + 4, "mean", 4) && (size = unpackN((u32_t *)ptr)) < remain) {
+			ptr += size; remain -= size;
 		}
-		// special cases which mix mix data in the enclosing box which we want to read into
-		if (!strcmp(type, "stsd")) consume = 16;
-		if (!strcmp(type, "mp4a")) consume = 36;
-		if (!strcmp(type, "meta")) consume = 12;
-
-		// consume rest of box if it has been parsed (all in the buffer) or is not one we want to parse
-		if (bytes >= consume) {
-			LOG_DEBUG("[%p]: type: %s len: %u consume: %u", ctx, type, len, consume);
-			_buf_inc_readp(ctx->streambuf, consume);
-			l->pos += consume;
-			bytes -= consume;
-		} else if ( !(!strcmp(type, "esds") || !strcmp(type, "stts") || !strcmp(type, "stsc") ||
-					  !strcmp(type, "stsz") || !strcmp(type, "stco") || !strcmp(type, "----")) ) {
-			LOG_DEBUG("[%p]: type: %s len: %u consume: %u - partial consume: %u", ctx, type, len, consume, bytes);
-			_buf_inc_readp(ctx->streambuf, bytes);
-			l->pos += bytes;
-			l->consume = consume - bytes;
-			break;
-		} else if (len >= ctx->streambuf->size) {
-			// can't process an atom larger than streambuf!
-			LOG_ERROR("[%p]: atom %s too large for buffer %u %u", ctx, type, len, ctx->streambuf->size);
-			return -1;
-		} else {
-			// make sure we have 'len' contiguous space in streambuf (large headers)
-			_buf_unwrap(ctx->streambuf, len);
-			break;
+		if (!memcmp(ptr + 4, "name", 4) && (size = unpackN((u32_t *)ptr)) < remain && !memcmp(ptr + 12, "iTunSMPB", 8)) {
+			ptr += size; remain -= size;
+		}
+		if (!memcmp(ptr + 4, "data", 4) && remain > 16 + 48) {
+			// data is stored as hex strings: 0 start end samples
+			u32_t b, c; u64_t d;
+			if (sscanf((const char *)(ptr + 16), "%x %x %x %" PRIx64, &b, &b, &c, &d) == 4) {
+				LOG_DEBUG("[%p]: iTunSMPB start: %u end: %u samples: %" PRIu64, ctx, b, c, d);
+				if (l->sttssamples && l->sttssamples < b + c + d) {
+					LOG_DEBUG("[%p]: reducing samples as stts count is less", ctx);
+					d = l->sttssamples - (b + c);
+				}
+				l->skip = b;
+				l->samples = d;
+			}
 		}
 	}
 
@@ -300,12 +196,12 @@ static decode_state alac_decode(struct thread_ctx_s *ctx) {
 	LOCK_S;
 
 	// data not reached yet
-	if (l->consume) {
-		u32_t consume = min(l->consume, _buf_used(ctx->streambuf));
-		LOG_DEBUG("[%p]: consume: %u of %u", ctx, consume, l->consume);
+	if (l->mp4.consume) {
+		u32_t consume = min(l->mp4.consume, _buf_used(ctx->streambuf));
+		LOG_DEBUG("[%p]: consume: %u of %u", ctx, consume, l->mp4.consume);
 		_buf_inc_readp(ctx->streambuf, consume);
-		l->pos += consume;
-		l->consume -= consume;
+		l->mp4.pos += consume;
+		l->mp4.consume -= consume;
 		UNLOCK_S;
 		return DECODE_RUNNING;
 	}
@@ -314,9 +210,22 @@ static decode_state alac_decode(struct thread_ctx_s *ctx) {
 		int found = 0;
 
 		// mp4 - read header
-		found = read_mp4_header(ctx);
+		found = _mp4_header(&l->mp4, ctx);
 
 		if (found == 1) {
+			// advance to start of first chunk
+			if (l->chunkinfo && l->chunkinfo[0].offset > l->mp4.pos) {
+				u32_t skip = l->chunkinfo[0].offset - l->mp4.pos;
+				LOG_DEBUG("[%p]: skipping: %u", ctx, skip);
+				if (skip <= _buf_used(ctx->streambuf)) {
+					_buf_inc_readp(ctx->streambuf, skip);
+					l->mp4.pos += skip;
+				} else {
+					l->mp4.consume = skip;
+				}
+			}
+			l->sample = l->nextchunk = 1;
+
 			LOG_INFO("[%p]: sample_rate: %u channels: %u", ctx, l->sample_rate, l->channels);
 			bytes = min(_buf_used(ctx->streambuf), _buf_cont_read(ctx->streambuf));
 
@@ -345,10 +254,10 @@ static decode_state alac_decode(struct thread_ctx_s *ctx) {
 	}
 
 	bytes = _buf_used(ctx->streambuf);
-	block_size = l->default_block_size ? l->default_block_size : l->block_size[l->block_index];
+	block_size = mp4_sample_size(&l->mp4);
 
-	// stream terminated
-	if (ctx->stream.state <= DISCONNECT && (bytes == 0 || block_size == 0)) {
+	// all samples decoded (whatever follows is not audio) or stream terminated
+	if (block_size == 0 || (ctx->stream.state <= DISCONNECT && bytes == 0)) {
 		UNLOCK_S;
 		LOG_DEBUG("[%p]: end of stream", ctx);
 		return DECODE_COMPLETE;
@@ -358,7 +267,7 @@ static decode_state alac_decode(struct thread_ctx_s *ctx) {
 	if (bytes < block_size) {
 		UNLOCK_S;
 		return DECODE_RUNNING;
-	} else if (block_size != l->default_block_size) l->block_index++;
+	} else mp4_sample_next(&l->mp4);
 
 	bytes = min(bytes, _buf_cont_read(ctx->streambuf));
 
@@ -383,13 +292,13 @@ static decode_state alac_decode(struct thread_ctx_s *ctx) {
 	endstream = false;
 	// mp4 end of chunk - skip to next offset
 	if (l->chunkinfo && l->chunkinfo[l->nextchunk].offset && l->sample++ == l->chunkinfo[l->nextchunk].sample) {
-		 if (l->chunkinfo[l->nextchunk].offset > l->pos) {
-			u32_t skip = l->chunkinfo[l->nextchunk].offset - l->pos;
+		 if (l->chunkinfo[l->nextchunk].offset > l->mp4.pos) {
+			u32_t skip = l->chunkinfo[l->nextchunk].offset - l->mp4.pos;
 			if (_buf_used(ctx->streambuf) >= skip) {
 				_buf_inc_readp(ctx->streambuf, skip);
-				l->pos += skip;
+				l->mp4.pos += skip;
 			} else {
-				l->consume = skip;
+				l->mp4.consume = skip;
 			}
 			l->nextchunk++;
 		 } else {
@@ -399,7 +308,7 @@ static decode_state alac_decode(struct thread_ctx_s *ctx) {
 	// mp4 when not at end of chunk
 	} else if (frames) {
 		_buf_inc_readp(ctx->streambuf, block_size);
-		l->pos += block_size;
+		l->mp4.pos += block_size;
 	} else {
 		endstream = true;
 	}
@@ -505,8 +414,8 @@ static void alac_cleanup (struct alac *l) {
 	if (l->decoder) alac_delete_decoder(l->decoder);
 	if (l->writebuf) free(l->writebuf);
 	if (l->chunkinfo) free(l->chunkinfo);
-	if (l->block_size) free(l->block_size);
 	if (l->stsc) free(l->stsc);
+	mp4_close(&l->mp4);
 	memset(l, 0, sizeof(struct alac));
 }
 
@@ -517,6 +426,8 @@ static void alac_open(u8_t sample_size, u32_t sample_rate, u8_t channels, u8_t e
 		if ((l = calloc(1, sizeof(struct alac))) == NULL) return;
 		ctx->decode.handle = l;
 	} else alac_cleanup(l);
+
+	mp4_open(&l->mp4, "alac,stts,stsc,stco,----", parse_box);
 }
 
 static void alac_close(struct thread_ctx_s *ctx) {
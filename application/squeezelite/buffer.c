@@ -22,16 +22,248 @@
 // fifo bufffers 
 
 #include "squeezelite.h"
+#include "cache.h"
+
+#if LINUX
+#include <sys/mman.h>
+#endif
+
+extern log_level 	output_loglevel;
+static log_level 	*loglevel = &output_loglevel;
+
+/* Mirrored buffers have their memory mapped twice back-to-back so that anything up 
+ * to the buffer size can be accessed contiguously from any position. This is only 
+ * valid as long as buffer size has not been adjusted. Size is rounded up to keep a 
+ * multiple of 3 frames, like streambuf does. Don't use that for buffers where the 
+ * position of pointers is compared (outputbuf and its track/fade markers) */
+#define MIRRORED(b) ((b)->mirror && (b)->mirror == (b)->size)
+
+#if WIN
+// MSVC gives acquire/release semantic to volatile accesses (x86/x64)
+#define LOAD_ACQUIRE(p)		(*(volatile size_t*) (p))
+#define STORE_RELEASE(p, v)	(*(volatile size_t*) (p) = (v))
+#define LOAD_PTR(p)			(*(u8_t* volatile*) (p))
+#define STORE_PTR(p, v)		(*(u8_t* volatile*) (p) = (v))
+#else
+#define LOAD_ACQUIRE(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define LOAD_PTR(p)			LOAD_ACQUIRE(p)
+#define STORE_PTR(p, v)		STORE_RELEASE(p, v)
+#endif
+
+// spsc buffers can't have their memory nor writep moved while producer is filling
+#define PRODUCER_LOCK(b)	if ((b)->spsc) mutex_lock((b)->producer)
+#define PRODUCER_UNLOCK(b)	if ((b)->spsc) mutex_unlock((b)->producer)
+
+/* outputbuf is shrunk when a player stops and grown back on the next track. Rather 
+ * than going through malloc/free and page faults every time, big buffers borrow slabs 
+ * from a bridge-wide arena where they are kept pre-faulted (on huge pages if possible)
+ * for any player asking for the same size. Idle slabs are evicted when a new size does
+ * not fit under the cap and requests above the cap just fall back to malloc */
+#define ARENA_MIN_SIZE	(64*1024)
+#define ARENA_HUGE_SIZE	(2*1024*1024)
+#define ARENA_SLABS		(MAX_PLAYER * 4)
+
+static struct {
+	bool init;
+	mutex_type mutex;
+	struct {
+		u8_t *buf;
+		size_t size;
+		bool used;
+	} slabs[ARENA_SLABS];
+	struct buf_arena_stats stats;
+} arena;
+
+static u8_t *arena_map(size_t size) {
+#if LINUX
+	u8_t *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+	if (size >= ARENA_HUGE_SIZE) madvise(p, size, MADV_HUGEPAGE);
+#endif
+#else
+	u8_t *p = malloc(size);
+	if (!p) return NULL;
+#endif
+	touch_memory(p, size);
+	return p;
+}
+
+static void arena_unmap(u8_t *p, size_t size) {
+#if LINUX
+	munmap(p, size);
+#else
+	free(p);
+#endif
+}
+
+static u8_t *arena_get(size_t size) {
+	int i, slot = -1;
+	u8_t *p = NULL;
+
+	if (!arena.init || size < ARENA_MIN_SIZE) return NULL;
+
+	// slabs are rounded so that close sizes share them
+	size = (size + ARENA_MIN_SIZE - 1) & ~(size_t) (ARENA_MIN_SIZE - 1);
+	if (size >= ARENA_HUGE_SIZE) size = (size + ARENA_HUGE_SIZE - 1) & ~(size_t) (ARENA_HUGE_SIZE - 1);
+
+	mutex_lock(arena.mutex);
+	arena.stats.borrowed++;
+
+	for (i = 0; i < ARENA_SLABS; i++) {
+		if (arena.slabs[i].buf && !arena.slabs[i].used && arena.slabs[i].size == size) break;
+		if (!arena.slabs[i].buf && slot < 0) slot = i;
+	}
+
+	if (i < ARENA_SLABS) {
+		arena.slabs[i].used = true;
+		arena.stats.reused++;
+		arena.stats.used += size;
+		p = arena.slabs[i].buf;
+	} else {
+		// make room by releasing idle slabs of other sizes
+		for (i = 0; i < ARENA_SLABS && arena.stats.held + size > arena.stats.cap; i++) {
+			if (!arena.slabs[i].buf || arena.slabs[i].used) continue;
+			arena_unmap(arena.slabs[i].buf, arena.slabs[i].size);
+			arena.stats.held -= arena.slabs[i].size;
+			arena.stats.evicted++;
+			arena.slabs[i].buf = NULL;
+			if (slot < 0 || i < slot) slot = i;
+		}
+
+		if (slot >= 0 && arena.stats.held + size <= arena.stats.cap && (p = arena_map(size)) != NULL) {
+			arena.slabs[slot].buf = p;
+			arena.slabs[slot].size = size;
+			arena.slabs[slot].used = true;
+			arena.stats.created++;
+			arena.stats.held += size;
+			arena.stats.used += size;
+		} else {
+			arena.stats.fallback++;
+		}
+	}
+
+	mutex_unlock(arena.mutex);
+	return p;
+}
+
+static bool arena_put(u8_t *p) {
+	int i;
+
+	if (!arena.init || !p) return false;
+
+	mutex_lock(arena.mutex);
+	for (i = 0; i < ARENA_SLABS && arena.slabs[i].buf != p; i++);
+	if (i < ARENA_SLABS) {
+		arena.slabs[i].used = false;
+		arena.stats.used -= arena.slabs[i].size;
+	}
+	mutex_unlock(arena.mutex);
+
+	return i < ARENA_SLABS;
+}
+
+void buf_arena_init(size_t cap) {
+	if (!cap || arena.init) return;
+	memset(&arena, 0, sizeof(arena));
+	mutex_create(arena.mutex);
+	arena.stats.cap = cap;
+	arena.init = true;
+	LOG_INFO("buffer arena capped at %zu bytes", cap);
+}
+
+void buf_arena_end(void) {
+	bool lent = false;
+
+	if (!arena.init) return;
+
+	mutex_lock(arena.mutex);
+	LOG_INFO("buffer arena: borrowed %" PRIu64 ", reused %" PRIu64 ", created %" PRIu64 ", evicted %" PRIu64 ", fallback %" PRIu64,
+			 arena.stats.borrowed, arena.stats.reused, arena.stats.created, arena.stats.evicted, arena.stats.fallback);
+	for (int i = 0; i < ARENA_SLABS; i++) {
+		if (!arena.slabs[i].buf) continue;
+		if (arena.slabs[i].used) lent = true;
+		else {
+			arena_unmap(arena.slabs[i].buf, arena.slabs[i].size);
+			arena.stats.held -= arena.slabs[i].size;
+			arena.slabs[i].buf = NULL;
+		}
+	}
+	mutex_unlock(arena.mutex);
+
+	// a buffer still holding a slab must be able to return it
+	if (lent) {
+		LOG_WARN("buffer arena still has %zu bytes lent", arena.stats.used);
+		return;
+	}
+
+	arena.init = false;
+	mutex_destroy(arena.mutex);
+}
+
+void buf_arena_stats(struct buf_arena_stats *stats) {
+	if (!arena.init) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+	mutex_lock(arena.mutex);
+	*stats = arena.stats;
+	mutex_unlock(arena.mutex);
+}
+
+/* Buffers sized per track (streambuf and outputbuf) are charged against a global 
+ * budget so that many players can share memory. A buffer always gets its floor 
+ * size even when the budget is exhausted, which a 0 budget makes unlimited */
+static struct {
+	mutex_type mutex;
+	size_t budget, charged;
+} budget;
+
+void buf_budget_init(size_t size) {
+	mutex_create(budget.mutex);
+	budget.budget = size;
+	budget.charged = 0;
+	if (size) LOG_INFO("buffer budget %zu bytes", size);
+}
+
+static void buf_budget_release(struct buffer *buf) {
+	if (!buf->charged) return;
+	mutex_lock(budget.mutex);
+	budget.charged -= buf->charged;
+	mutex_unlock(budget.mutex);
+	buf->charged = 0;
+}
 
 // _* called with muxtex locked
 
+static u8_t *buf_alloc(struct buffer *buf, size_t *size, bool mirror) {
+	u8_t *p = mirror ? cache_mirror_alloc(size, BYTES_PER_FRAME * 3) : NULL;
+
+	if (p) buf->mirror = *size;
+	else {
+		buf->mirror = 0;
+		p = arena_get(*size);
+		if (!p) p = malloc(*size);
+	}
+
+	return p;
+}
+
+static void buf_free(struct buffer *buf) {
+	if (buf->mirror) cache_mirror_free(buf->buf, buf->mirror);
+	else if (!arena_put(buf->buf)) free(buf->buf);
+	buf->mirror = 0;
+}
+
 
 bool _buf_wrap(struct buffer *buf) {
-	return buf->writep <= buf->readp ? true : false;
+	return LOAD_PTR(&buf->writep) <= LOAD_PTR(&buf->readp) ? true : false;
 }
 
 unsigned _buf_used(struct buffer *buf) {
-	return buf->writep >= buf->readp ? buf->writep - buf->readp : buf->size - (buf->readp - buf->writep);
+	u8_t *readp = LOAD_PTR(&buf->readp), *writep = LOAD_PTR(&buf->writep);
+	return writep >= readp ? writep - readp : buf->size - (readp - writep);
 }
 
 unsigned _buf_space(struct buffer *buf) {
@@ -39,78 +271,149 @@ unsigned _buf_space(struct buffer *buf) {
 }
 
 unsigned _buf_cont_read(struct buffer *buf) {
-	return buf->writep >= buf->readp ? buf->writep - buf->readp : buf->wrap - buf->readp;
+	u8_t *readp = LOAD_PTR(&buf->readp), *writep = LOAD_PTR(&buf->writep);
+	if (MIRRORED(buf)) return _buf_used(buf);
+	return writep >= readp ? writep - readp : buf->wrap - readp;
 }
 
 unsigned _buf_cont_write(struct buffer *buf) {
-	return buf->writep >= buf->readp ? buf->wrap - buf->writep : buf->readp - buf->writep;
+	u8_t *readp = LOAD_PTR(&buf->readp), *writep = LOAD_PTR(&buf->writep);
+	if (MIRRORED(buf)) return _buf_space(buf);
+	return writep >= readp ? buf->wrap - writep : readp - writep;
+}
+
+// end of memory that can be accessed contiguously from any point in the buffer
+u8_t *_buf_end(struct buffer *buf) {
+	return MIRRORED(buf) ? buf->wrap + buf->size : buf->wrap;
 }
 
 void _buf_inc_readp(struct buffer *buf, unsigned by) {
-	buf->readp += by;
-	if (buf->readp >= buf->wrap) {
-		buf->readp -= buf->size;
+	u8_t *readp = buf->readp + by;
+	if (readp >= buf->wrap) {
+		readp -= buf->size;
 	}
+	// data must have been consumed before producer can see space
+	STORE_PTR(&buf->readp, readp);
 }
 
 void _buf_inc_writep(struct buffer *buf, unsigned by) {
-	buf->writep += by;
-	if (buf->writep >= buf->wrap) {
-		buf->writep -= buf->size;
+	u8_t *writep = buf->writep + by;
+	if (writep >= buf->wrap) {
+		writep -= buf->size;
 	}
+	// data must be written before consumer can see it
+	STORE_PTR(&buf->writep, writep);
+}
+
+/* Producer of a spsc buffer calls this with mutex locked to get where and how much it 
+ * can write contiguously, then it can release the mutex while filling and finally call
+ * buf_produced (without the mutex). Consumer can keep reading in the meantime and any 
+ * operation that moves memory or writep (flush, resize...) waits for buf_produced */
+u8_t *_buf_produce(struct buffer *buf, size_t *space) {
+	mutex_lock(buf->producer);
+	*space = min(_buf_space(buf), _buf_cont_write(buf));
+	return buf->writep;
+}
+
+void buf_produced(struct buffer *buf, unsigned by) {
+	if (by) _buf_inc_writep(buf, by);
+	mutex_unlock(buf->producer);
 }
 
 void buf_flush(struct buffer *buf) {
 	mutex_lock(buf->mutex);
+	PRODUCER_LOCK(buf);
 	buf->readp  = buf->buf;
 	buf->writep = buf->buf;
+	PRODUCER_UNLOCK(buf);
 	mutex_unlock(buf->mutex);
 }
 
 bool _buf_reset(struct buffer *buf) {
-	if (buf->readp != buf->writep) return false;
-	buf->readp  = buf->buf;
-	buf->writep = buf->buf;
-	return true;
+	bool reset = false;
+	PRODUCER_LOCK(buf);
+	if (buf->readp == buf->writep) {
+		buf->readp  = buf->buf;
+		buf->writep = buf->buf;
+		reset = true;
+	}
+	PRODUCER_UNLOCK(buf);
+	return reset;
 }
 
 // adjust buffer to multiple of mod bytes so reading in multiple always wraps on frame boundary
 void buf_adjust(struct buffer *buf, size_t mod) {
 	size_t size;
 	mutex_lock(buf->mutex);
+	PRODUCER_LOCK(buf);
 	size = ((unsigned)(buf->base_size / mod)) * mod;
 	buf->readp  = buf->buf;
 	buf->writep = buf->buf;
 	buf->wrap   = buf->buf + size;
 	buf->size   = size;
+	PRODUCER_UNLOCK(buf);
 	mutex_unlock(buf->mutex);
 }
 
 // called with mutex locked to resize, does not retain contents, reverts to original size if fails
 void _buf_resize(struct buffer *buf, size_t size) {
-	if (buf->size == size) return;
-	free(buf->buf);
-	buf->buf = malloc(size);
+	size_t base_size = size;
+	bool mirror = buf->mirror != 0;
+	// mirrored buffers might be bigger than requested
+	if (buf->size == size || buf->base_size == size) return;
+	PRODUCER_LOCK(buf);
+	buf_free(buf);
+	buf->buf = buf_alloc(buf, &size, mirror);
 	if (!buf->buf) {
-		size    = buf->size;
-		buf->buf= malloc(size);
+		size    = base_size = buf->size;
+		buf->buf= buf_alloc(buf, &size, mirror);
 		if (!buf->buf) {
-			size = 0;
+			size = base_size = 0;
 		}
 	}
 	buf->readp  = buf->buf;
 	buf->writep = buf->buf;
 	buf->wrap   = buf->buf + size;
 	buf->size   = size;
-	buf->base_size = size;
+	buf->base_size = base_size;
+	PRODUCER_UNLOCK(buf);
+}
+
+// called with mutex locked, resize as close as possible to size within budget, returns new size
+size_t _buf_resize_budget(struct buffer *buf, size_t size, size_t floor) {
+	mutex_lock(budget.mutex);
+	if (budget.budget) {
+		size_t others = budget.charged - buf->charged;
+		size_t avail = budget.budget > others ? budget.budget - others : 0;
+		size = max(min(size, avail), floor);
+	}
+	mutex_unlock(budget.mutex);
+
+	_buf_resize(buf, size);
+
+	// mirrored buffers might be bigger than requested
+	mutex_lock(budget.mutex);
+	budget.charged += buf->size - buf->charged;
+	mutex_unlock(budget.mutex);
+	buf->charged = buf->size;
+
+	return buf->size;
 }
 
+static void _buf_unwrap_locked(struct buffer *buf, size_t cont);
+
 void _buf_unwrap(struct buffer *buf, size_t cont) {
-	ssize_t len, by = cont - (buf->wrap - buf->readp);
-	size_t size;
+	// do nothing if we have enough space or if we are mirrored
+	if ((ssize_t) (cont - (buf->wrap - buf->readp)) <= 0 || cont >= buf->size || MIRRORED(buf)) return;
+	PRODUCER_LOCK(buf);
+	_buf_unwrap_locked(buf, cont);
+	PRODUCER_UNLOCK(buf);
+}
+
+static void _buf_unwrap_locked(struct buffer *buf, size_t cont) {
+	ssize_t len, size, by = cont - (buf->wrap - buf->readp);
 	u8_t *scratch;
 
-	// do nothing if we have enough space
 	if (by <= 0 || cont >= buf->size) return;
 
 	// buffer already unwrapped, just move it up
@@ -150,28 +453,48 @@ void _buf_unwrap(struct buffer *buf, size_t cont) {
 		memcpy(buf->writep - size, scratch, size);
 		free(scratch);
 	} else {
-		_buf_unwrap(buf, cont / 2);
-        _buf_unwrap(buf, cont - cont / 2);
+		_buf_unwrap_locked(buf, cont / 2);
+        _buf_unwrap_locked(buf, cont - cont / 2);
 	}
 }
 
-void buf_init(struct buffer *buf, size_t size) {
-	buf->buf    = malloc(size);
+static void _buf_init(struct buffer *buf, size_t size, bool mirror, bool spsc) {
+	size_t base_size = size;
+	buf->buf    = buf_alloc(buf, &size, mirror);
 	buf->readp  = buf->buf;
 	buf->writep = buf->buf;
 	buf->wrap   = buf->buf + size;
 	buf->size   = size;
-	buf->base_size = size;
+	buf->base_size = base_size;
+	buf->charged = 0;
+	buf->spsc = spsc;
 	mutex_create_p(buf->mutex);
+	if (spsc) mutex_create(buf->producer);
+}
+
+void buf_init(struct buffer *buf, size_t size) {
+	_buf_init(buf, size, false, false);
+}
+
+// try to create a mirrored buffer, falls back to a normal one
+void buf_init_mirror(struct buffer *buf, size_t size) {
+	_buf_init(buf, size, true, false);
+}
+
+// mirrored buffer with one producer that fills it without holding the mutex
+void buf_init_spsc(struct buffer *buf, size_t size) {
+	_buf_init(buf, size, true, true);
 }
 
 void buf_destroy(struct buffer *buf) {
 	if (buf->buf) {
-		free(buf->buf);
+		buf_budget_release(buf);
+		buf_free(buf);
 		buf->buf = NULL;
 		buf->size = 0;
 		buf->base_size = 0;
 		mutex_destroy(buf->mutex);
+		if (buf->spsc) mutex_destroy(buf->producer);
 	}
 }
 
@@ -199,3 +522,63 @@ unsigned _buf_write(struct buffer *buf, void *src, unsigned size) {
 }
 
 
+
+/* Single producer / single consumer ring, no mutex. Each side only writes its own
+ * counter, which are free-running so that full and empty can be told apart. Size
+ * is a power of 2 so that wrapping is a mask. Only one thread may call spsc_write
+ * and one (other) thread spsc_read, spsc_used/space can be called from both */
+
+bool spsc_init(struct spsc *ring, size_t size) {
+	for (ring->size = 1; ring->size < size; ring->size <<= 1);
+	ring->readp = ring->writep = 0;
+	ring->buf = malloc(ring->size);
+	return ring->buf != NULL;
+}
+
+void spsc_destroy(struct spsc *ring) {
+	free(ring->buf);
+	ring->buf = NULL;
+	ring->size = 0;
+}
+
+// only when neither producer nor consumer is active
+void spsc_reset(struct spsc *ring) {
+	ring->readp = ring->writep = 0;
+}
+
+size_t spsc_used(struct spsc *ring) {
+	// read readp first so that it can't be ahead of writep
+	size_t readp = LOAD_ACQUIRE(&ring->readp);
+	return LOAD_ACQUIRE(&ring->writep) - readp;
+}
+
+size_t spsc_space(struct spsc *ring) {
+	return ring->size - spsc_used(ring);
+}
+
+size_t spsc_write(struct spsc *ring, const void *src, size_t size) {
+	size_t writep = ring->writep, readp = LOAD_ACQUIRE(&ring->readp);
+	size_t pos = writep & (ring->size - 1), cont;
+
+	// only producer modifies writep, so no need for acquire on it
+	size = min(size, ring->size - (writep - readp));
+	cont = min(size, ring->size - pos);
+	memcpy(ring->buf + pos, src, cont);
+	memcpy(ring->buf, (u8_t*) src + cont, size - cont);
+	STORE_RELEASE(&ring->writep, writep + size);
+
+	return size;
+}
+
+size_t spsc_read(struct spsc *ring, void *dst, size_t size) {
+	size_t readp = ring->readp, writep = LOAD_ACQUIRE(&ring->writep);
+	size_t pos = readp & (ring->size - 1), cont;
+
+	size = min(size, writep - readp);
+	cont = min(size, ring->size - pos);
+	memcpy(dst, ring->buf + pos, cont);
+	memcpy((u8_t*) dst + cont, ring->buf, size - cont);
+	STORE_RELEASE(&ring->readp, readp + size);
+
+	return size;
+}
@@ -10,12 +10,26 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "platform.h"
 #include "cache.h"
+#include "spool.h"
+
+#if LINUX
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
 
 static bool ring_construct(cache_buffer* self);
 static bool file_construct(cache_buffer* self);
+static bool mirror_construct(cache_buffer* self);
+static bool tier_construct(cache_buffer* self);
+static void views_update(cache_buffer* self);
 
 cache_buffer* cache_create(enum cache_type_e type, size_t buffer_size) {
 	bool success;
@@ -23,9 +37,11 @@ cache_buffer* cache_create(enum cache_type_e type, size_t buffer_size) {
 	cache_buffer* cache = calloc(sizeof(cache_buffer), 1);
 	cache->type = type;
 	cache->size = buffer_size;
-	cache->infinite = cache->type != CACHE_RING;
+	cache->infinite = cache->type != CACHE_RING && cache->type != CACHE_MIRROR;
 
 	if (type == CACHE_FILE) success = file_construct(cache);
+	else if (type == CACHE_MIRROR) success = mirror_construct(cache);
+	else if (type == CACHE_INFINITE) success = tier_construct(cache);
 	else success = ring_construct(cache);
 
 	if (success && !cache->buffer) {
@@ -47,13 +63,24 @@ void cache_delete(cache_buffer* cache) {
 	free(cache);
 }
 
+void cache_notify(cache_buffer* cache, void (*ready)(void* arg), void* arg) {
+	// a view is served by its source's read-ahead
+	if (cache->type == CACHE_VIEW) return;
+
+	cache->ready = ready;
+	cache->ready_arg = arg;
+	if (cache->type == CACHE_FILE || cache->type == CACHE_STORED) spool_notify(cache->file.spool, ready, arg);
+	else if (cache->type == CACHE_INFINITE && cache->tier.spool) spool_notify(cache->tier.spool, ready, arg);
+}
+
 /****************************************************************************************
  * Ring buffer
  */
 
 static void ring_destruct(cache_buffer* self) { }
+static size_t ring_room(cache_buffer* self) { return SIZE_MAX; }
 static size_t ring_level(cache_buffer* self) { return self->total < self->size ? self->total : self->size - 1; }
-static void ring_flush(cache_buffer* self) { self->ring.read_p = self->ring.write_p = self->buffer; self->total = 0; }
+static void ring_flush(cache_buffer* self) { self->ring.read_p = self->ring.write_p = self->buffer; self->total = 0; views_update(self); }
 
 static size_t ring_pending(cache_buffer* self) { 
 	return self->ring.write_p >= self->ring.read_p ? 
@@ -67,6 +94,12 @@ static ssize_t ring_scope(cache_buffer* self, size_t offset) {
 	else return offset - self->total + self->level(self);
 }
 
+static size_t ring_tell(cache_buffer* self) {
+	return self->total - (self->ring.write_p >= self->ring.read_p ?
+						  self->ring.write_p - self->ring.read_p :
+						  self->size - (self->ring.read_p - self->ring.write_p));
+}
+
 static void ring_set_offset(cache_buffer* self, size_t offset) {
 	if (offset >= self->total) self->ring.read_p = self->ring.write_p;
 	else if (offset < self->total - self->level(self)) self->ring.read_p = (self->ring.write_p + 1) == self->ring.wrap ? self->buffer : self->ring.write_p + 1;
@@ -98,7 +131,7 @@ static uint8_t* ring_read_inner(cache_buffer* self, size_t* size) {
 	return *size ? p : NULL;
 }
 
-static void ring_write(cache_buffer* self, const uint8_t* src, size_t size) {
+static size_t ring_write(cache_buffer* self, const uint8_t* src, size_t size) {
 	size_t cont = min(size, (size_t)(self->ring.wrap - self->ring.write_p));
 	memcpy(self->ring.write_p, src, cont);
 	memcpy(self->buffer, src + cont, size - cont);
@@ -108,10 +141,25 @@ static void ring_write(cache_buffer* self, const uint8_t* src, size_t size) {
 
 	if (self->ring.write_p >= self->ring.wrap) self->ring.write_p -= self->size;
 	if (self->level(self) == self->size - 1) self->ring.read_p = self->ring.write_p + 1 == self->ring.wrap ? self->ring.wrap : self->ring.write_p + 1;
+	views_update(self);
+	return size;
+}
+
+static ssize_t ring_send_to(cache_buffer* self, int sock, size_t size) {
+	// only send what is contiguous, the rest will come in next call
+	size = min(size, self->pending(self));
+	if (!size) return 0;
+
+	ssize_t sent = send(sock, (void*) self->ring.read_p, size, MSG_NOSIGNAL);
+	if (sent <= 0) return sent;
+
+	self->ring.read_p += sent;
+	if (self->ring.read_p >= self->ring.wrap) self->ring.read_p -= self->size;
+	return sent;
 }
 
 static bool ring_construct(cache_buffer* self) {
-	if (!self->size) self->size = 8 * 1024 * 1024;
+	if (!self->size) self->size = CACHE_BUFFER_SIZE;
 
 	self->buffer = malloc(self->size);
 	if (!self->buffer) return false;
@@ -125,7 +173,10 @@ static bool ring_construct(cache_buffer* self) {
 	self->read = ring_read;
 	self->read_inner = ring_read_inner;
 	self->set_offset= ring_set_offset;
+	self->tell = ring_tell;
 	self->write = ring_write;
+	self->send_to = ring_send_to;
+	self->room = ring_room;
 	self->flush = ring_flush;
 	self->destruct = ring_destruct;
 
@@ -136,19 +187,22 @@ static bool ring_construct(cache_buffer* self) {
  * File buffer
  */
 
-static void file_destruct(cache_buffer* self) { if (self->file.fd) fclose(self->file.fd); }
+#define FILE_SPOOL	(1024*1024)
+
+static void file_destruct(cache_buffer* self) { spool_close(self->file.spool, true); }
 static size_t file_pending(cache_buffer *self) { return self->total - self->file.read_offset; }
 static size_t file_level(cache_buffer* self) { return self->total; }
-static void file_flush(cache_buffer* self) { self->file.read_offset = self->total = 0; }
+static void file_flush(cache_buffer* self) { spool_rewind(self->file.spool); self->file.read_offset = self->total = 0; views_update(self); }
 static ssize_t file_scope(cache_buffer* self, size_t offset) { return offset >= self->total ? offset - self->total + 1 : 0; }
 static void file_set_offset(cache_buffer* self, size_t offset) { self->file.read_offset = offset; }
+static size_t file_tell(cache_buffer* self) { return self->file.read_offset; }
+static size_t file_room(cache_buffer* self) { return spool_room(self->file.spool); }
 
 static size_t file_read(cache_buffer* self, uint8_t* dst, size_t size, size_t min) {
 	size = min(self->size, self->total);
 	if (size < min) return 0;
 
-	fseek(self->file.fd, self->file.read_offset, SEEK_SET);
-	size_t bytes = fread(dst, 1, size, self->file.fd);
+	size_t bytes = spool_read(self->file.spool, dst, self->file.read_offset, size);
 	self->file.read_offset += bytes;
 
 	return bytes;
@@ -161,26 +215,44 @@ static uint8_t* file_read_inner(cache_buffer* self, size_t* size) {
 		self->size = *size;
 	}
 
-	// caller *must* consume ALL data
+	// caller *must* consume ALL data, what is on disk comes once it has been read ahead
 	*size = min(*size, self->total);
 
-	fseek(self->file.fd, self->file.read_offset, SEEK_SET);
-	*size = fread(self->buffer, 1, *size, self->file.fd);
+	*size = spool_peek(self->file.spool, self->buffer, self->file.read_offset, *size);
 	self->file.read_offset += *size;
 
 	return *size ? self->buffer : NULL;
 }
 
-static void file_write(cache_buffer* self, const uint8_t* src, size_t size) {
-	fseek(self->file.fd, 0, SEEK_END);
-	fwrite(src, 1, size, self->file.fd);
+static size_t file_write(cache_buffer* self, const uint8_t* src, size_t size) {
+	// writing is done in background, caller must check room first or it will be lost
+	size = spool_write(self->file.spool, src, size);
 	self->total += size;
+	views_update(self);
+	return size;
+}
+
+static ssize_t file_send_to(cache_buffer* self, int sock, size_t size) {
+	/* no sendfile() as it would wait for the disk, read_inner does not and returns 
+	 * nothing until what is on disk has been read ahead */
+	size = min(size, self->total - self->file.read_offset);
+	if (!size) return 0;
+
+	uint8_t* p = self->read_inner(self, &size);
+	if (!p) return 0;
+	ssize_t sent = send(sock, (void*) p, size, MSG_NOSIGNAL);
+	// rewind what has not been sent
+	self->file.read_offset -= size;
+
+	if (sent > 0) self->file.read_offset += sent;
+	return sent;
 }
 
 static bool file_construct(cache_buffer* self) {
 	if (!self->size) self->size = 128 * 1024;
 	self->file.fd = tmpfile();
-	if (!self->file.fd) return false;
+	self->file.spool = spool_open(self->file.fd, FILE_SPOOL);
+	if (!self->file.spool) return false;
 
 	self->pending = file_pending;
 	self->scope = file_scope;
@@ -188,10 +260,517 @@ static bool file_construct(cache_buffer* self) {
 	self->read = file_read;
 	self->read_inner = file_read_inner;
 	self->set_offset = file_set_offset;
+	self->tell = file_tell;
 	self->write = file_write;
+	self->send_to = file_send_to;
+	self->room = file_room;
 	self->flush = file_flush;
 	self->destruct = file_destruct;
 
 	return true;
 }
 
+
+/****************************************************************************************
+ * Stored file
+ */
+
+static void stored_destruct(cache_buffer* self) { spool_close(self->file.spool, true); }
+static size_t stored_room(cache_buffer* self) { return 0; }
+static size_t stored_write(cache_buffer* self, const uint8_t* src, size_t size) { return 0; }
+static void stored_flush(cache_buffer* self) { self->file.read_offset = 0; }
+
+static size_t stored_read(cache_buffer* self, uint8_t* dst, size_t size, size_t min) {
+	size = min(size, self->total - self->file.read_offset);
+	if (size < min) return 0;
+
+	size_t bytes = spool_read(self->file.spool, dst, self->file.read_offset, size);
+	self->file.read_offset += bytes;
+
+	return bytes;
+}
+
+static uint8_t* stored_read_inner(cache_buffer* self, size_t* size) {
+	// caller *must* consume ALL data, it comes once it has been read ahead
+	*size = min(*size, min(self->size, self->total - self->file.read_offset));
+	*size = spool_peek(self->file.spool, self->buffer, self->file.read_offset, *size);
+	self->file.read_offset += *size;
+	return *size ? self->buffer : NULL;
+}
+
+cache_buffer* cache_load(FILE* file) {
+	cache_buffer* self = file ? calloc(sizeof(cache_buffer), 1) : NULL;
+	if (self) self->buffer = malloc(128 * 1024);
+
+	if (!self || !self->buffer || fseek(file, 0, SEEK_END)) {
+		if (self) free(self->buffer);
+		if (file) fclose(file);
+		free(self);
+		return NULL;
+	}
+
+	self->type = CACHE_STORED;
+	self->size = 128 * 1024;
+	self->total = ftell(file);
+	self->infinite = true;
+	self->file.fd = file;
+
+	// spool owns the file from now on and reads ahead for read_inner
+	self->file.spool = spool_load(file);
+	if (!self->file.spool) {
+		free(self->buffer);
+		free(self);
+		return NULL;
+	}
+
+	self->pending = file_pending;
+	self->scope = file_scope;
+	self->level = file_level;
+	self->read = stored_read;
+	self->read_inner = stored_read_inner;
+	self->set_offset = file_set_offset;
+	self->tell = file_tell;
+	self->write = stored_write;
+	self->send_to = file_send_to;
+	self->room = stored_room;
+	self->flush = stored_flush;
+	self->destruct = stored_destruct;
+
+	return self;
+}
+
+/****************************************************************************************
+ * Mirrored buffer
+ */
+
+uint8_t* cache_mirror_alloc(size_t* size, size_t granularity) {
+#if LINUX && defined(SYS_memfd_create)
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t len = ((*size + page - 1) / page) * page;
+
+	// need to be a multiple of both page and granularity
+	while (len % granularity) len += page;
+
+	int fd = syscall(SYS_memfd_create, "cache", 0);
+	if (fd < 0) return NULL;
+
+	// reserve the whole zone first then map the same file twice in it
+	uint8_t* buffer = mmap(NULL, 2 * len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (buffer == MAP_FAILED || ftruncate(fd, len) ||
+		mmap(buffer, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+		mmap(buffer + len, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		if (buffer != MAP_FAILED) munmap(buffer, 2 * len);
+		buffer = NULL;
+	} else {
+		*size = len;
+	}
+
+	// mapping holds a reference on it
+	close(fd);
+	return buffer;
+#else
+	return NULL;
+#endif
+}
+
+void cache_mirror_free(uint8_t* buffer, size_t size) {
+#if LINUX
+	if (buffer) munmap(buffer, 2 * size);
+#endif
+}
+
+static void mirror_destruct(cache_buffer* self) { 
+	cache_mirror_free(self->buffer, self->size); 
+	self->buffer = NULL;
+}
+
+static size_t mirror_pending(cache_buffer* self) {
+	return self->ring.write_p >= self->ring.read_p ?
+		   self->ring.write_p - self->ring.read_p :
+		   self->size - (self->ring.read_p - self->ring.write_p);
+}
+
+static size_t mirror_read(cache_buffer* self, uint8_t* dst, size_t size, size_t min) {
+	size = min(size, self->pending(self));
+	if (size < min) return 0;
+
+	memcpy(dst, self->ring.read_p, size);
+
+	self->ring.read_p += size;
+	if (self->ring.read_p >= self->ring.wrap) self->ring.read_p -= self->size;
+	return size;
+}
+
+static uint8_t* mirror_read_inner(cache_buffer* self, size_t* size) {
+	// caller *must* consume ALL data
+	*size = min(*size, self->pending(self));
+
+	uint8_t* p = self->ring.read_p;
+	self->ring.read_p += *size;
+	if (self->ring.read_p >= self->ring.wrap) self->ring.read_p -= self->size;
+
+	return *size ? p : NULL;
+}
+
+static size_t mirror_write(cache_buffer* self, const uint8_t* src, size_t size) {
+	memcpy(self->ring.write_p, src, size);
+
+	self->ring.write_p += size;
+	self->total += size;
+
+	if (self->ring.write_p >= self->ring.wrap) self->ring.write_p -= self->size;
+	if (self->level(self) == self->size - 1) self->ring.read_p = self->ring.write_p + 1 == self->ring.wrap ? self->ring.wrap : self->ring.write_p + 1;
+	views_update(self);
+	return size;
+}
+
+static bool mirror_construct(cache_buffer* self) {
+	if (!self->size) self->size = CACHE_BUFFER_SIZE;
+
+	size_t size = self->size;
+	self->buffer = cache_mirror_alloc(&size, 1);
+
+	// can't mirror, use a normal ring
+	if (!self->buffer) {
+		self->type = CACHE_RING;
+		return ring_construct(self);
+	}
+
+	self->size = size;
+	self->ring.read_p = self->ring.write_p = self->buffer;
+	self->ring.wrap = self->buffer + self->size;
+
+	self->pending = mirror_pending;
+	self->scope = ring_scope;
+	self->level = ring_level;
+	self->read = mirror_read;
+	self->read_inner = mirror_read_inner;
+	self->set_offset = ring_set_offset;
+	self->tell = ring_tell;
+	self->write = mirror_write;
+	self->send_to = ring_send_to;
+	self->room = ring_room;
+	self->flush = ring_flush;
+	self->destruct = mirror_destruct;
+
+	return true;
+}
+
+/****************************************************************************************
+ * Tiered buffer
+ */
+
+#define TIER_MIN		(256*1024)
+#define TIER_SCRATCH	(128*1024)
+
+static struct {
+	pthread_mutex_t mutex;
+	size_t budget, charged;
+} tiers = { PTHREAD_MUTEX_INITIALIZER };
+
+void cache_budget_init(size_t budget) {
+	pthread_mutex_lock(&tiers.mutex);
+	tiers.budget = budget;
+	pthread_mutex_unlock(&tiers.mutex);
+}
+
+// grow memory as close as possible to size within window and budget
+static void tier_grow(cache_buffer* self, size_t size) {
+	pthread_mutex_lock(&tiers.mutex);
+
+	size = min(size, self->tier.window);
+	if (tiers.budget) {
+		size_t others = tiers.charged - self->size;
+		size = min(size, tiers.budget > others ? tiers.budget - others : 0);
+	}
+
+	uint8_t* buffer = size > self->size ? realloc(self->buffer, size) : NULL;
+	if (buffer) {
+		tiers.charged += size - self->size;
+		self->buffer = buffer;
+		self->size = size;
+	}
+
+	pthread_mutex_unlock(&tiers.mutex);
+}
+
+static size_t tier_level(cache_buffer* self) { return self->total - self->tier.start; }
+static size_t tier_pending(cache_buffer* self) { return self->total - self->tier.read_offset; }
+static size_t tier_tell(cache_buffer* self) { return self->tier.read_offset; }
+// what has left memory, it is on disk (unless lost)
+static size_t tier_spilled(cache_buffer* self) { return self->total - min(self->total, self->size); }
+
+static ssize_t tier_scope(cache_buffer* self, size_t offset) {
+	if (offset >= self->total) return offset - self->total + 1;
+	else if (offset >= self->tier.start) return 0;
+	else return offset - self->tier.start;
+}
+
+static void tier_set_offset(cache_buffer* self, size_t offset) {
+	self->tier.read_offset = min(max(offset, self->tier.start), self->total);
+}
+
+static size_t tier_room(cache_buffer* self) {
+	// without disk, it is just a ring that takes anything
+	if (!self->tier.spool && self->tier.start) return SIZE_MAX;
+	// spool is created on demand, then it can queue FILE_SPOOL (memory might also grow)
+	return self->size - min(self->total, self->size) + (self->tier.spool ? spool_room(self->tier.spool) : FILE_SPOOL);
+}
+
+static void tier_flush(cache_buffer* self) { 
+	if (self->tier.spool) spool_rewind(self->tier.spool);
+	self->tier.read_offset = self->tier.start = self->total = 0;
+	views_update(self);
+}
+
+static void tier_destruct(cache_buffer* self) { 
+	spool_close(self->tier.spool, true);
+	free(self->tier.scratch);
+	pthread_mutex_lock(&tiers.mutex);
+	tiers.charged -= self->size;
+	pthread_mutex_unlock(&tiers.mutex);
+}
+
+static uint8_t* tier_inner(cache_buffer* self, size_t* size, bool wait) {
+	// caller *must* consume ALL data
+	size_t offset = self->tier.read_offset, spilled = tier_spilled(self);
+	uint8_t* p;
+
+	*size = min(*size, self->total - offset);
+
+	if (offset < spilled) {
+		*size = min(*size, min(spilled - offset, (size_t) TIER_SCRATCH));
+		if (wait) *size = spool_read(self->tier.spool, self->tier.scratch, offset, *size);
+		else *size = spool_peek(self->tier.spool, self->tier.scratch, offset, *size);
+		p = self->tier.scratch;
+	} else {
+		*size = min(*size, self->size - offset % self->size);
+		p = self->buffer + offset % self->size;
+	}
+
+	self->tier.read_offset += *size;
+	return *size ? p : NULL;
+}
+
+// what has been spilled comes once it has been read ahead
+static uint8_t* tier_read_inner(cache_buffer* self, size_t* size) { return tier_inner(self, size, false); }
+
+static size_t tier_read(cache_buffer* self, uint8_t* dst, size_t size, size_t min) {
+	size = min(size, self->pending(self));
+	if (size < min) return 0;
+
+	for (size_t bytes = 0, chunk; bytes < size; bytes += chunk) {
+		chunk = size - bytes;
+		uint8_t* p = tier_inner(self, &chunk, true);
+		if (!p) return bytes;
+		memcpy(dst + bytes, p, chunk);
+	}
+
+	return size;
+}
+
+static void tier_put(cache_buffer* self, const uint8_t* src, size_t size) {
+	/* as long as nothing has been spilled, memory is not a ring and can be re-allocated, 
+	 * but not under views as a follower might be using what read_inner gave it */
+	if (self->total + size > self->size && !self->tier.spool && !self->tier.start && !self->views) {
+		tier_grow(self, max(2 * self->size, self->total + size));
+	}
+
+	// oldest bytes must leave memory to make room, they go to disk first
+	size_t spilled = tier_spilled(self);
+	size_t evict = self->total + size > self->size ? self->total + size - self->size - spilled : 0;
+
+	if (evict && !self->tier.spool && !self->tier.start) {
+		if (!self->tier.scratch) self->tier.scratch = malloc(TIER_SCRATCH);
+		if (self->tier.scratch) self->tier.spool = spool_open(tmpfile(), FILE_SPOOL);
+		if (self->tier.spool) spool_notify(self->tier.spool, self->ready, self->ready_arg);
+	}
+
+	if (evict && self->tier.spool) {
+		size_t from = spilled % self->size, cont = min(evict, self->size - from);
+		size_t bytes = spool_write(self->tier.spool, self->buffer + from, cont);
+		if (bytes == cont) bytes += spool_write(self->tier.spool, self->buffer, evict - cont);
+
+		// caller did not check room, disk is not usable anymore
+		if (bytes < evict) {
+			spool_close(self->tier.spool, true);
+			self->tier.spool = NULL;
+		}
+	}
+
+	size_t offset = self->total % self->size, cont = min(size, self->size - offset);
+	memcpy(self->buffer + offset, src, cont);
+	memcpy(self->buffer, src + cont, size - cont);
+	self->total += size;
+
+	// without disk, it is just a ring
+	if (!self->tier.spool) {
+		self->tier.start = tier_spilled(self);
+		self->tier.read_offset = max(self->tier.read_offset, self->tier.start);
+	}
+
+	views_update(self);
+}
+
+static size_t tier_write(cache_buffer* self, const uint8_t* src, size_t size) {
+	// memory is a ring so what evicts it can't be larger than it
+	for (size_t bytes = 0, chunk; bytes < size; bytes += chunk) {
+		chunk = min(size - bytes, self->size);
+		tier_put(self, src + bytes, chunk);
+	}
+
+	return size;
+}
+
+static ssize_t tier_send_to(cache_buffer* self, int sock, size_t size) {
+	uint8_t* p = self->read_inner(self, &size);
+	if (!p) return 0;
+
+	ssize_t sent = send(sock, (void*) p, size, MSG_NOSIGNAL);
+	// rewind what has not been sent
+	self->tier.read_offset -= size;
+
+	if (sent > 0) self->tier.read_offset += sent;
+	return sent;
+}
+
+static bool tier_construct(cache_buffer* self) {
+	// by default, only the budget (what others have left of it) limits memory
+	pthread_mutex_lock(&tiers.mutex);
+	self->tier.window = self->size ? self->size : tiers.budget ? tiers.budget : CACHE_BUFFER_SIZE;
+	pthread_mutex_unlock(&tiers.mutex);
+	self->size = min((size_t) TIER_MIN, self->tier.window);
+
+	// first block is always granted, even when over budget
+	self->buffer = malloc(self->size);
+	if (!self->buffer) return false;
+
+	pthread_mutex_lock(&tiers.mutex);
+	tiers.charged += self->size;
+	pthread_mutex_unlock(&tiers.mutex);
+
+	self->pending = tier_pending;
+	self->scope = tier_scope;
+	self->level = tier_level;
+	self->read = tier_read;
+	self->read_inner = tier_read_inner;
+	self->set_offset = tier_set_offset;
+	self->tell = tier_tell;
+	self->write = tier_write;
+	self->send_to = tier_send_to;
+	self->room = tier_room;
+	self->flush = tier_flush;
+	self->destruct = tier_destruct;
+
+	return true;
+}
+
+/****************************************************************************************
+ * View on a buffer
+ */
+
+static void views_update(cache_buffer* self) {
+	for (cache_buffer* view = self->views; view; view = view->view.next) view->total = self->total;
+}
+
+// park source's read position and move it to ours, unless source has already dropped it
+static cache_buffer* view_enter(cache_buffer* self, size_t* parked) {
+	cache_buffer* source = self->view.source;
+	if (self->view.lost || source->scope(source, self->view.offset) < 0) {
+		self->view.lost = true;
+		return NULL;
+	}
+	*parked = source->tell(source);
+	source->set_offset(source, self->view.offset);
+	return source;
+}
+
+static void view_leave(cache_buffer* self, size_t parked) {
+	cache_buffer* source = self->view.source;
+	self->view.offset = source->tell(source);
+	source->set_offset(source, parked);
+}
+
+static size_t view_level(cache_buffer* self) { return self->view.source->level(self->view.source); }
+static ssize_t view_scope(cache_buffer* self, size_t offset) { return self->view.source->scope(self->view.source, offset); }
+static void view_set_offset(cache_buffer* self, size_t offset) { self->view.offset = offset; self->view.lost = false; }
+static size_t view_tell(cache_buffer* self) { return self->view.offset; }
+static size_t view_room(cache_buffer* self) { return 0; }
+static size_t view_write(cache_buffer* self, const uint8_t* src, size_t size) { return 0; }
+static void view_flush(cache_buffer* self) { self->view.offset = 0; self->view.lost = false; }
+
+static void view_destruct(cache_buffer* self) {
+	cache_buffer** p = &self->view.source->views;
+	while (*p && *p != self) p = &(*p)->view.next;
+	if (*p) *p = self->view.next;
+}
+
+static size_t view_pending(cache_buffer* self) {
+	size_t parked;
+	cache_buffer* source = view_enter(self, &parked);
+	if (!source) return 0;
+	size_t pending = source->pending(source);
+	view_leave(self, parked);
+	return pending;
+}
+
+static size_t view_read(cache_buffer* self, uint8_t* dst, size_t size, size_t min) {
+	size_t parked;
+	cache_buffer* source = view_enter(self, &parked);
+	if (!source) return 0;
+	size = source->read(source, dst, size, min);
+	view_leave(self, parked);
+	return size;
+}
+
+static uint8_t* view_read_inner(cache_buffer* self, size_t* size) {
+	size_t parked;
+	cache_buffer* source = view_enter(self, &parked);
+	if (!source) return NULL;
+	uint8_t* p = source->read_inner(source, size);
+	view_leave(self, parked);
+	return p;
+}
+
+static ssize_t view_send_to(cache_buffer* self, int sock, size_t size) {
+	size_t parked;
+	cache_buffer* source = view_enter(self, &parked);
+	if (!source) return 0;
+	ssize_t sent = source->send_to(source, sock, size);
+	view_leave(self, parked);
+	return sent;
+}
+
+bool cache_view_lost(cache_buffer* self) {
+	return self->type == CACHE_VIEW && self->view.lost;
+}
+
+cache_buffer* cache_view(cache_buffer* source) {
+	cache_buffer* self = calloc(sizeof(cache_buffer), 1);
+	if (!self) return NULL;
+
+	self->type = CACHE_VIEW;
+	self->size = source->size;
+	self->total = source->total;
+	self->infinite = source->infinite;
+
+	self->view.source = source;
+	self->view.next = source->views;
+	source->views = self;
+
+	self->pending = view_pending;
+	self->scope = view_scope;
+	self->level = view_level;
+	self->read = view_read;
+	self->read_inner = view_read_inner;
+	self->set_offset = view_set_offset;
+	self->tell = view_tell;
+	self->write = view_write;
+	self->send_to = view_send_to;
+	self->room = view_room;
+	self->flush = view_flush;
+	self->destruct = view_destruct;
+
+	return self;
+}
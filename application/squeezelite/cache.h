@@ -25,7 +25,9 @@ typedef struct cache_buffer_s {
 	size_t total, size;
 	uint8_t* buffer;
 	bool infinite;
-	enum cache_type_e { CACHE_RING, CACHE_INFINITE, CACHE_FILE } type;
+	enum cache_type_e { CACHE_RING, CACHE_INFINITE, CACHE_FILE, CACHE_MIRROR, CACHE_VIEW, CACHE_STORED } type;
+	// views reading from that buffer
+	struct cache_buffer_s* views;
 
 	/* the private part should be a ptr to an anonymous struct but as it does 
 	 * not contain anything that drag exotic include files into client, we'll 
@@ -33,24 +35,81 @@ typedef struct cache_buffer_s {
 	union {
 		struct {
 			FILE* fd;
+			struct spool_s* spool;	// owns fd
 			size_t read_offset;
 		} file;
 		struct {
 			uint8_t* read_p, * write_p, * wrap;
 		} ring;
+		struct {
+			struct cache_buffer_s* source, * next;
+			size_t offset;
+			bool lost;
+		} view;
+		struct {
+			struct spool_s* spool;	// what has left memory
+			uint8_t* scratch;
+			size_t read_offset, start, window;
+		} tier;
 	};
 
+	// called from background when data that read_inner/send_to could not deliver is there
+	void (*ready)(void* arg);
+	void* ready_arg;
+
 	size_t (*pending)(struct cache_buffer_s* self);
 	size_t (*level)(struct cache_buffer_s* self);
 	ssize_t (*scope)(struct cache_buffer_s* self, size_t offset);
 	size_t(*read)(struct cache_buffer_s* self, uint8_t* dst, size_t size, size_t min);
 	uint8_t* (*read_inner)(struct cache_buffer_s* self, size_t* size);
 	void (*set_offset)(struct cache_buffer_s* self, size_t offset);
-	void (*write)(struct cache_buffer_s* self, const uint8_t* src, size_t size);
+	// absolute offset of read position
+	size_t (*tell)(struct cache_buffer_s* self);
+	// returns what has been accepted, FILE only takes what fits in room
+	size_t (*write)(struct cache_buffer_s* self, const uint8_t* src, size_t size);
+	// send up to size bytes to a socket from read position, 0 when nothing can be read now
+	ssize_t (*send_to)(struct cache_buffer_s* self, int sock, size_t size);
+	// how much can be written now (FILE is written in background by a bounded queue)
+	size_t (*room)(struct cache_buffer_s* self);
 	void (*flush)(struct cache_buffer_s* self);
 	void (*destruct)(struct cache_buffer_s* self);
 } cache_buffer;
 
+// default memory buffer of RING and MIRROR, and of INFINITE when there is no budget
+#define CACHE_BUFFER_SIZE	(8*1024*1024)
+
 // buffer_size is either the memory buffer for RING and INFINITE or the internal buffer for DISK. Leave to 0 for default
 cache_buffer* cache_create(enum cache_type_e type, size_t buffer_size);
-void cache_delete(cache_buffer* cache);
\ No newline at end of file
+void cache_delete(cache_buffer* cache);
+
+/* read_inner and send_to never wait for the disk. When what is at read position is on
+ * disk (FILE, STORED or INFINITE that has spilled), they return nothing while it is read
+ * ahead in background and ready is called once it is there. A VIEW is served by its
+ * source's read-ahead, so setting ready on it does nothing. Other reads still wait */
+void cache_notify(cache_buffer* cache, void (*ready)(void* arg), void* arg);
+
+/* INFINITE keeps recent data in memory and older data on disk. Memory starts small and
+ * grows up to buffer_size as long as the total of all INFINITE buffers is within budget,
+ * then it becomes a ring whose oldest bytes spill to a temporary file through a spool.
+ * When the disk can't be used, it falls back to a ring. Budget is 0 for unlimited. When
+ * buffer_size is 0, a buffer can grow up to the whole budget (CACHE_BUFFER_SIZE if none) */
+void cache_budget_init(size_t budget);
+
+/* STORED is a complete file that is only read, its total is known from the start. The
+ * cache owns the file */
+cache_buffer* cache_load(FILE* file);
+
+/* A VIEW is a read cursor on another buffer, with its own offset but sharing the
+ * same data. It can't be written and it must be deleted before its source. Nothing
+ * is thread-safe, caller must serialize all accesses to a source and its views. When
+ * a ring source has overwritten what the view has not read yet, the view is lost: it
+ * reads nothing until its offset is set again */
+cache_buffer* cache_view(cache_buffer* source);
+bool cache_view_lost(cache_buffer* view);
+
+/* MIRROR is a RING where the same pages are mapped twice back-to-back so that any 
+ * read or write of up to size bytes is contiguous. It falls back to a RING when the
+ * platform can't do that. The allocator is exposed so that other ring buffers can use 
+ * it. The mapped size is a multiple of page size and granularity */
+uint8_t* cache_mirror_alloc(size_t* size, size_t granularity);
+void cache_mirror_free(uint8_t* buffer, size_t size);
\ No newline at end of file
@@ -0,0 +1,673 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Philippe 2015-2023, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* LMS CLI client. There is one connection per server, shared by all players using
+ * it. Commands are sent as soon as they are submitted (pipelined) and each server
+ * has a thread that reads responses and matches them against pending requests by
+ * the echoed command, which starts with the player id. LMS answers in order, so
+ * the first pending request whose command prefixes a response line is the right
+ * one. Requests not answered within CLI_SEND_TO fail (NULL response).
+ * Notifications look exactly like responses ("<id> time 12.5"), so a second
+ * connection to the same server subscribes to playlist, time and metadata and
+ * only carries these. They flush the metadata cache of the player they are about.
+ * That cache is only valid while subscribed, so it is flushed as well when the
+ * subscription is acknowledged and when the connections are closed.
+ * Only the server's thread connects, so submitting never blocks on an unreachable
+ * server: requests are queued with their packet and sent once connected. After a
+ * failed connection, requests fail immediately until a backoff delay has expired.
+ * A server that no player uses anymore is retired once idle, so that its slot can
+ * be taken by another one. cli_server returns a server locked, so it can't be
+ * retired between being found and used */
+
+#include "squeezelite.h"
+
+#include <ctype.h>
+
+#define CLI_SERVERS			4
+#define CLI_SEND_TO			500
+#define CLI_CONNECT_TO		250
+#define CLI_BACKOFF_MIN		1000
+#define CLI_BACKOFF_MAX		(60*1000)
+#define CLI_IDLE			(60*1000)
+#define CLI_PACKET			4096
+#define CLI_LINE_MAX		(64*1024)
+#define CLI_SUBSCRIBE		"subscribe playlist,newmetadata,time,sync\n"
+
+extern log_level	slimmain_loglevel;
+static log_level	*loglevel = &slimmain_loglevel;
+
+struct cli_req_s {
+	char		*match;			// encoded command, as echoed by LMS
+	char		*packet;		// not sent yet (connection not opened)
+	size_t		len;
+	bool		decode;
+	u32_t		deadline;
+	cli_cb_t	callback;		// async request (can be NULL)
+	void		*arg;
+	bool		sync, done;		// sync request, waiter is on server's cond
+	char		*rsp;
+	struct cli_req_s *next;
+};
+
+struct cli_conn_s {
+	sockfd		sock;
+	char		*rx;
+	size_t		len, size;
+};
+
+static struct cli_server_s {
+	bool		running;
+	struct sockaddr_in addr;
+	struct cli_conn_s cmd, events;	// requests and responses, subscribed notifications
+	mutex_type	mutex;
+	pthread_cond_t cond;		// sync requests completion
+	struct wakeup_s wake;		// requests are waiting for a connection
+	pthread_t	thread;
+	struct cli_req_s *head, **tail;
+	u32_t		last;
+	u32_t		retry, backoff;	// don't connect before retry after a failure
+	int			waiting;		// sync requests still using the server
+} servers[CLI_SERVERS];
+
+static mutex_type cli_mutex;
+static bool cli_running;
+
+/*---------------------------------------------------------------------------*/
+static char from_hex(char ch) {
+  return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+}
+
+/*---------------------------------------------------------------------------*/
+static char to_hex(char code) {
+  static char hex[] = "0123456789abcdef";
+  return hex[code & 15];
+}
+
+/*---------------------------------------------------------------------------*/
+/* IMPORTANT: be sure to free() the returned string after use */
+static char *cli_encode(char *str) {
+  char *pstr = str, *buf = malloc(strlen(str) * 3 + 1), *pbuf = buf;
+  while (*pstr) {
+	if ( isalnum(*pstr) || *pstr == '-' || *pstr == '_' || *pstr == '.' ||
+						  *pstr == '~' || *pstr == ' ' || *pstr == ')' ||
+						  *pstr == '(' )
+	  *pbuf++ = *pstr;
+	else if (*pstr == '%') {
+	  *pbuf++ = '%',*pbuf++ = '2', *pbuf++ = '5';
+	}
+	else
+	  *pbuf++ = '%', *pbuf++ = to_hex(*pstr >> 4), *pbuf++ = to_hex(*pstr & 15);
+	pstr++;
+  }
+  *pbuf = '\0';
+  return buf;
+}
+
+/*---------------------------------------------------------------------------*/
+/* IMPORTANT: be sure to free() the returned string after use */
+static char *cli_decode(char *str) {
+  char *pstr = str, *buf = malloc(strlen(str) + 1), *pbuf = buf;
+  while (*pstr) {
+	if (*pstr == '%') {
+	  if (pstr[1] && pstr[2]) {
+		*pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
+		pstr += 2;
+	  }
+	} else {
+	  *pbuf++ = *pstr;
+	}
+	pstr++;
+  }
+  *pbuf = '\0';
+  return buf;
+}
+
+/*---------------------------------------------------------------------------*/
+static void _cli_unlink(struct cli_server_s *server, struct cli_req_s **prev) {
+	// called with server's mutex locked
+	struct cli_req_s *req = *prev;
+
+	*prev = req->next;
+	if (server->tail == &req->next) server->tail = prev;
+	req->next = NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static struct cli_req_s *_cli_complete(struct cli_server_s *server, struct cli_req_s *req, char *rsp,
+									   struct cli_req_s *done) {
+	// called with server's mutex locked, returns the list of async requests to callback
+	if (req->sync) {
+		req->rsp = rsp;
+		req->done = true;
+		pthread_cond_broadcast(&server->cond);
+		return done;
+	}
+
+	req->rsp = rsp;
+	req->next = done;
+	return req;
+}
+
+/*---------------------------------------------------------------------------*/
+static void cli_callback(struct cli_req_s *done) {
+	// async requests are called outside server's lock as they might send commands
+	while (done) {
+		struct cli_req_s *req = done;
+
+		done = done->next;
+		if (req->callback) req->callback(req->rsp, req->arg);
+		else NFREE(req->rsp);
+		free(req->match);
+		free(req);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static struct cli_req_s *_cli_fail(struct cli_server_s *server, bool all, struct cli_req_s *done) {
+	// called with server's mutex locked, fails pending requests (expired ones or all)
+	struct cli_req_s **prev = &server->head;
+	u32_t now = gettime_ms();
+
+	while (*prev) {
+		struct cli_req_s *req = *prev;
+
+		if (all || (s32_t) (now - req->deadline) >= 0) {
+			LOG_WARN("%s for CLI response (%s)", all ? "failed" : "timeout", req->match);
+			_cli_unlink(server, prev);
+			NFREE(req->packet);
+			done = _cli_complete(server, req, NULL, done);
+		} else prev = &req->next;
+	}
+
+	return done;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool _cli_serves(struct cli_server_s *server, struct thread_ctx_s *ctx) {
+	return ctx->in_use && ctx->running && ctx->config.use_cli && ctx->slimproto_ip == server->addr.sin_addr.s_addr &&
+		   htons(ctx->cli_port) == server->addr.sin_port;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool _cli_used(struct cli_server_s *server) {
+	for (int i = 0; i < MAX_PLAYER; i++) if (_cli_serves(server, thread_ctx + i)) return true;
+	return false;
+}
+
+/*---------------------------------------------------------------------------*/
+static void _cli_event(struct cli_server_s *server, char *line) {
+	// called with server's mutex locked, NULL line means all players of that server
+	char *id = NULL, *p = line ? strchr(line, ' ') : NULL;
+	bool sync = !line;
+
+	if (line) {
+		if (!p) return;
+		// whole group changes when one player (un)syncs and we might not be the one notified
+		sync = !strncasecmp(p + 1, "sync", 4) && (p[5] == ' ' || !p[5]);
+		if (!sync && strncasecmp(p + 1, "playlist ", 9) && strncasecmp(p + 1, "newmetadata", 11) &&
+			strncasecmp(p + 1, "time ", 5)) return;
+		*p = '\0';
+		id = cli_decode(line);
+		*p = ' ';
+	}
+
+	for (int i = 0; i < MAX_PLAYER; i++) {
+		struct thread_ctx_s *ctx = thread_ctx + i;
+
+		bool metadata = !line || (!sync && (!id || !strcasecmp(id, ctx->cli_id)));
+
+		if (!_cli_serves(server, ctx) || (!sync && !metadata)) continue;
+
+		LOG_DEBUG("[%p]: CLI notification %.64s", ctx, line ? p + 1 : "(subscription changed)");
+		if (sync) sync_cache_flush(ctx);
+		if (metadata) metadata_cache_flush(ctx, id != NULL);
+	}
+
+	NFREE(id);
+}
+
+/*---------------------------------------------------------------------------*/
+static void _cli_close(struct cli_server_s *server) {
+	// called with server's mutex locked
+	if (server->cmd.sock == -1) return;
+
+	// notifications are lost from now
+	_cli_event(server, NULL);
+
+	LOG_INFO("closing CLI sockets %d/%d", server->cmd.sock, server->events.sock);
+	closesocket(server->cmd.sock);
+	closesocket(server->events.sock);
+
+	server->cmd.sock = server->events.sock = -1;
+	server->cmd.len = server->events.len = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static sockfd cli_connect(struct cli_server_s *server) {
+	sockfd sock = socket(AF_INET, SOCK_STREAM, 0);
+
+	set_nonblock(sock);
+	set_nosigpipe(sock);
+
+	if (tcp_connect_timeout(sock, server->addr, CLI_CONNECT_TO)) {
+		closesocket(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/*---------------------------------------------------------------------------*/
+static struct cli_req_s *cli_open(struct cli_server_s *server) {
+	// only server's thread opens the sockets, so it can connect unlocked
+	sockfd cmd = cli_connect(server), events = cmd != -1 ? cli_connect(server) : -1;
+	struct cli_req_s *done = NULL;
+	u32_t now = gettime_ms();
+
+	if (cmd != -1 && events == -1) {
+		closesocket(cmd);
+		cmd = -1;
+	}
+
+	mutex_lock(server->mutex);
+
+	if (cmd == -1) {
+		server->backoff = server->backoff ? min(server->backoff * 2, CLI_BACKOFF_MAX) : CLI_BACKOFF_MIN;
+		server->retry = now + server->backoff;
+		LOG_ERROR("unable to connect to server %s:%hu with cli (retry in %u ms)", inet_ntoa(server->addr.sin_addr),
+				  ntohs(server->addr.sin_port), server->backoff);
+		done = _cli_fail(server, true, done);
+		mutex_unlock(server->mutex);
+		return done;
+	}
+
+	server->backoff = 0;
+	server->cmd.sock = cmd;
+	server->events.sock = events;
+	server->cmd.len = server->events.len = 0;
+	server->last = now;
+
+	// metadata cache can't be trusted without notifications
+	LOG_INFO("opened CLI sockets %d/%d", server->cmd.sock, server->events.sock);
+	send_packet((u8_t*) CLI_SUBSCRIBE, strlen(CLI_SUBSCRIBE), server->events.sock);
+
+	// everything queued while connecting, response time starts now
+	for (struct cli_req_s *req = server->head; req; req = req->next) {
+		if (!req->packet) continue;
+		req->deadline = now + CLI_SEND_TO;
+		send_packet((u8_t*) req->packet, req->len, server->cmd.sock);
+		NFREE(req->packet);
+	}
+
+	mutex_unlock(server->mutex);
+	return done;
+}
+
+/*---------------------------------------------------------------------------*/
+static struct cli_req_s *_cli_process(struct cli_server_s *server, struct cli_conn_s *conn, struct cli_req_s *done) {
+	// called with server's mutex locked, consumes all complete lines
+	char *line = conn->rx, *eol;
+
+	while ((eol = memchr(line, '\n', conn->rx + conn->len - line)) != NULL) {
+		struct cli_req_s **prev;
+
+		*eol = '\0';
+		if (eol > line && eol[-1] == '\r') eol[-1] = '\0';
+
+		if (conn == &server->events) {
+			// anything queried before the subscription is active might be stale
+			if (!strncasecmp(line, "subscribe ", 10)) _cli_event(server, NULL);
+			else _cli_event(server, line);
+			line = eol + 1;
+			continue;
+		}
+
+		for (prev = &server->head; *prev; prev = &(*prev)->next) {
+			size_t len = strlen((*prev)->match);
+			if (!strncasecmp(line, (*prev)->match, len) && (line[len] == ' ' || !line[len])) break;
+		}
+
+		if (*prev) {
+			struct cli_req_s *req = *prev;
+			char *p = line + strlen(req->match);
+
+			while (*p == ' ') p++;
+			LOG_SDEBUG("rsp %s", line);
+			_cli_unlink(server, prev);
+			done = _cli_complete(server, req, req->decode ? cli_decode(p) : strdup(p), done);
+		} else {
+			LOG_DEBUG("unsollicited CLI line %.64s", line);
+		}
+
+		line = eol + 1;
+	}
+
+	conn->len -= line - conn->rx;
+	memmove(conn->rx, line, conn->len);
+
+	return done;
+}
+
+/*---------------------------------------------------------------------------*/
+static struct cli_req_s *_cli_read(struct cli_server_s *server, struct cli_conn_s *conn, struct cli_req_s *done) {
+	// called with server's mutex locked
+	if (conn->size - conn->len < CLI_PACKET && conn->size < CLI_LINE_MAX) {
+		char *rx = realloc(conn->rx, conn->size * 2 + 1);
+		if (rx) {
+			conn->rx = rx;
+			conn->size *= 2;
+		}
+	}
+
+	int n = recv(conn->sock, conn->rx + conn->len, conn->size - conn->len, 0);
+
+	if (n > 0) {
+		conn->len += n;
+		done = _cli_process(server, conn, done);
+		// can't handle such a long line
+		if (conn->len == conn->size) {
+			LOG_ERROR("CLI line too long %zu", conn->len);
+			conn->len = 0;
+		}
+	} else if (n == 0 || last_error() != ERROR_WOULDBLOCK) {
+		LOG_WARN("CLI connection lost %d", conn->sock);
+		_cli_close(server);
+		done = _cli_fail(server, true, done);
+	}
+
+	return done;
+}
+
+/*---------------------------------------------------------------------------*/
+static void cli_free(struct cli_server_s *server) {
+	wakeup_destroy(&server->wake);
+	pthread_cond_destroy(&server->cond);
+	mutex_destroy(server->mutex);
+	free(server->cmd.rx);
+	free(server->events.rx);
+}
+
+/*---------------------------------------------------------------------------*/
+static bool cli_retire(struct cli_server_s *server) {
+	bool retire;
+
+	// same order as cli_server, which might be handing this server over
+	mutex_lock(cli_mutex);
+	mutex_lock(server->mutex);
+	retire = cli_running && server->cmd.sock == -1 && !server->head && !server->waiting &&
+			 gettime_ms() - server->last > CLI_IDLE && !_cli_used(server);
+	mutex_unlock(server->mutex);
+
+	if (retire) {
+		LOG_INFO("retiring CLI server %s:%hu", inet_ntoa(server->addr.sin_addr), ntohs(server->addr.sin_port));
+		server->running = false;
+		pthread_detach(server->thread);
+		cli_free(server);
+	}
+
+	mutex_unlock(cli_mutex);
+	return retire;
+}
+
+/*---------------------------------------------------------------------------*/
+static void *cli_thread(struct cli_server_s *server) {
+	while (server->running) {
+		struct cli_req_s *done = NULL;
+		struct pollfd pfds[2];
+		sockfd sock;
+		bool open;
+		int n;
+
+		mutex_lock(server->mutex);
+		sock = server->cmd.sock;
+		open = sock == -1 && server->head;
+		// keep the connection (and subscription) while some player uses that server
+		if (sock != -1 && !server->head && gettime_ms() - server->last > CLI_IDLE) {
+			if (_cli_used(server)) server->last = gettime_ms();
+			else {
+				_cli_close(server);
+				sock = -1;
+			}
+		}
+		pfds[0].fd = sock;
+		pfds[1].fd = server->events.sock;
+		mutex_unlock(server->mutex);
+
+		if (open) {
+			cli_callback(cli_open(server));
+			continue;
+		}
+
+		if (sock == -1) {
+			// slot is free once retired, nothing can be touched
+			if (cli_retire(server)) return NULL;
+			wakeup_wait(&server->wake, 1000);
+			continue;
+		}
+
+		pfds[0].events = pfds[1].events = POLLIN;
+		n = poll(pfds, 2, server->head ? 50 : 1000);
+
+		mutex_lock(server->mutex);
+
+		// connections might have been closed (and re-opened) meanwhile
+		if (n > 0 && server->cmd.sock == sock) {
+			if (pfds[0].revents) done = _cli_read(server, &server->cmd, done);
+			if (pfds[1].revents && server->cmd.sock == sock) done = _cli_read(server, &server->events, done);
+		}
+
+		done = _cli_fail(server, false, done);
+		mutex_unlock(server->mutex);
+
+		cli_callback(done);
+	}
+
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static struct cli_server_s *cli_server(struct thread_ctx_s *ctx) {
+	// returns server with its mutex locked
+	struct cli_server_s *server = NULL;
+
+	mutex_lock(cli_mutex);
+
+	if (!cli_running) {
+		mutex_unlock(cli_mutex);
+		return NULL;
+	}
+
+	for (int i = 0; i < CLI_SERVERS; i++) {
+		if (!servers[i].running) {
+			if (!server) server = servers + i;
+		} else if (servers[i].addr.sin_addr.s_addr == ctx->slimproto_ip &&
+				   servers[i].addr.sin_port == htons(ctx->cli_port)) {
+			mutex_lock(servers[i].mutex);
+			mutex_unlock(cli_mutex);
+			return servers + i;
+		}
+	}
+
+	if (server) {
+		pthread_attr_t attr;
+
+		memset(server, 0, sizeof(struct cli_server_s));
+		server->cmd.size = server->events.size = CLI_PACKET;
+		server->cmd.rx = malloc(server->cmd.size + 1);
+		server->events.rx = malloc(server->events.size + 1);
+
+		if (!server->cmd.rx || !server->events.rx) {
+			LOG_ERROR("[%p]: can't allocate CLI server", ctx);
+			NFREE(server->cmd.rx);
+			NFREE(server->events.rx);
+			mutex_unlock(cli_mutex);
+			return NULL;
+		}
+
+		server->addr.sin_family = AF_INET;
+		server->addr.sin_addr.s_addr = ctx->slimproto_ip;
+		server->addr.sin_port = htons(ctx->cli_port);
+		server->cmd.sock = server->events.sock = -1;
+		server->tail = &server->head;
+		server->last = gettime_ms();
+		mutex_create(server->mutex);
+		pthread_cond_init(&server->cond, NULL);
+		wakeup_create(&server->wake);
+		server->running = true;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + 32*1024);
+		pthread_create(&server->thread, &attr, (void *(*)(void*)) cli_thread, server);
+		pthread_attr_destroy(&attr);
+
+		mutex_lock(server->mutex);
+		LOG_INFO("[%p]: new CLI server %s:%hu", ctx, inet_ntoa(server->addr.sin_addr), ctx->cli_port);
+	} else {
+		LOG_ERROR("[%p]: no CLI server slot left", ctx);
+	}
+
+	mutex_unlock(cli_mutex);
+	return server;
+}
+
+/*---------------------------------------------------------------------------*/
+static struct cli_server_s *cli_submit(struct cli_req_s *req, char *cmd, bool query, struct thread_ctx_s *ctx) {
+	// returns server with its mutex locked when request has been queued
+	struct cli_server_s *server;
+	char *packet;
+	size_t len;
+
+	if (!cli_running || !ctx->config.use_cli || (server = cli_server(ctx)) == NULL) return NULL;
+
+	// only server's thread completes requests, it can't wait for one (e.g. from a callback)
+	if (req->sync && pthread_equal(pthread_self(), server->thread)) {
+		mutex_unlock(server->mutex);
+		LOG_ERROR("[%p]: can't wait for CLI response from a CLI callback (%s)", ctx, cmd);
+		return NULL;
+	}
+
+	req->match = cli_encode(cmd);
+	req->deadline = gettime_ms() + CLI_SEND_TO;
+	req->next = NULL;
+
+	packet = malloc(strlen(req->match) + 4);
+	if (query) len = sprintf(packet, "%s ?\n", req->match);
+	else len = sprintf(packet, "%s\n", req->match);
+
+	// a failed connection is not retried before backoff delay expires
+	if (server->cmd.sock == -1 && server->backoff && (s32_t) (gettime_ms() - server->retry) < 0) {
+		mutex_unlock(server->mutex);
+		LOG_DEBUG("[%p]: CLI server unreachable (%s)", ctx, cmd);
+		free(req->match);
+		free(packet);
+		return NULL;
+	}
+
+	LOG_SDEBUG("[%p]: cmd %s", ctx, packet);
+
+	// queue before sending so that the response can't be missed
+	*server->tail = req;
+	server->tail = &req->next;
+	server->last = gettime_ms();
+
+	if (server->cmd.sock != -1) {
+		send_packet((u8_t*) packet, len, server->cmd.sock);
+		free(packet);
+	} else {
+		// server's thread will send it once connected
+		req->packet = packet;
+		req->len = len;
+		wakeup_signal(&server->wake);
+	}
+
+	return server;
+}
+
+/*---------------------------------------------------------------------------*/
+bool cli_send_async(char *cmd, bool query, bool decode, cli_cb_t callback, void *arg, struct thread_ctx_s *ctx) {
+	struct cli_req_s *req = calloc(1, sizeof(struct cli_req_s));
+	struct cli_server_s *server;
+
+	req->decode = decode;
+	req->callback = callback;
+	req->arg = arg;
+
+	if ((server = cli_submit(req, cmd, query, ctx)) == NULL) {
+		free(req);
+		return false;
+	}
+
+	mutex_unlock(server->mutex);
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+char *cli_send_cmd(char *cmd, bool query, bool decode, struct thread_ctx_s *ctx) {
+	struct cli_req_s req = { .decode = decode, .sync = true };
+	struct cli_server_s *server;
+
+	if ((server = cli_submit(&req, cmd, query, ctx)) == NULL) return NULL;
+
+	// server's thread always completes requests, at worst when they expire
+	server->waiting++;
+	while (!req.done) pthread_cond_wait(&server->cond, &server->mutex);
+	server->waiting--;
+	mutex_unlock(server->mutex);
+
+	free(req.match);
+	return req.rsp;
+}
+
+/*---------------------------------------------------------------------------*/
+void cli_init(void) {
+	if (cli_running) return;
+	mutex_create(cli_mutex);
+	memset(servers, 0, sizeof(servers));
+	cli_running = true;
+}
+
+/*---------------------------------------------------------------------------*/
+void cli_end(void) {
+	if (!cli_running) return;
+
+	mutex_lock(cli_mutex);
+	cli_running = false;
+	mutex_unlock(cli_mutex);
+
+	for (int i = 0; i < CLI_SERVERS; i++) {
+		struct cli_server_s *server = servers + i;
+		struct cli_req_s *done;
+
+		if (!server->running) continue;
+
+		server->running = false;
+		wakeup_signal(&server->wake);
+		pthread_join(server->thread, NULL);
+
+		mutex_lock(server->mutex);
+		_cli_close(server);
+		done = _cli_fail(server, true, NULL);
+		mutex_unlock(server->mutex);
+		cli_callback(done);
+		cli_free(server);
+	}
+
+	mutex_destroy(cli_mutex);
+}
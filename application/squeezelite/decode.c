@@ -31,12 +31,12 @@ static log_level 	*loglevel = &decode_loglevel;
 
 struct codec	*codecs[MAX_CODECS];
 
-#define LOCK_S   mutex_lock(ctx->streambuf->mutex)
-#define UNLOCK_S mutex_unlock(ctx->streambuf->mutex)
-#define LOCK_O   mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(ctx->outputbuf->mutex)
-#define LOCK_D   mutex_lock(ctx->decode.mutex)
-#define UNLOCK_D mutex_unlock(ctx->decode.mutex)
+#define LOCK_S   metrics_lock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define UNLOCK_S metrics_unlock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define LOCK_O   metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define LOCK_D   metrics_lock(ctx->decode.mutex, METRICS_LOCK_D, ctx)
+#define UNLOCK_D metrics_unlock(ctx->decode.mutex, METRICS_LOCK_D, ctx)
 
 #if PROCESS
 #define IF_DIRECT(x)    if (ctx->decode.direct) { x }
@@ -79,7 +79,9 @@ static void *decode_thread(struct thread_ctx_s *ctx) {
 
 			if (space > min_space && (bytes > ctx->codec->min_read_bytes || toend)) {
 
+				u64_t start = metrics_on ? metrics_now() : 0;
 				ctx->decode.state = ctx->codec->decode(ctx);
+				if (start) metrics_observe(&ctx->metrics.decode, metrics_now() - start);
 
 				IF_PROCESS(
 					if (ctx->process.in_frames) {
@@ -109,8 +111,13 @@ static void *decode_thread(struct thread_ctx_s *ctx) {
 
 		UNLOCK_D;
 
-		if (!ran) {
-			usleep(100000);
+		if (ran) {
+			// output sessions waiting for data and stream waiting for space must be woken up
+			output_wake(ctx);
+			wakeup_signal(&ctx->stream.wake);
+		} else {
+			// woken up by stream (data), output (space) or controller (state)
+			wakeup_wait(&ctx->decode.wake, 1000);
 		}
 	}
 
@@ -134,6 +141,7 @@ void decode_init(void) {
 	codecs[i++] = register_m4a_thru();
 	codecs[i++] = register_flac_thru();
 	codecs[i++] = register_thru();
+	codecs[i++] = register_drain();
 #if RESAMPLE
 	register_soxr();
 #endif
@@ -198,6 +206,7 @@ void decode_close(struct thread_ctx_s *ctx) {
 	}
 	ctx->decode_running = false;
 	UNLOCK_D;
+	wakeup_signal(&ctx->decode.wake);
 	pthread_join(ctx->decode_thread, NULL);
 	mutex_destroy(ctx->decode.mutex);
 }
@@ -71,18 +71,18 @@ struct flac {
 extern log_level decode_loglevel;
 static log_level *loglevel = &decode_loglevel;
 
-#define LOCK_S   mutex_lock(ctx->streambuf->mutex)
-#define UNLOCK_S mutex_unlock(ctx->streambuf->mutex)
-#define LOCK_O   mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(ctx->outputbuf->mutex)
+#define LOCK_S   metrics_lock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define UNLOCK_S metrics_unlock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define LOCK_O   metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
 #if PROCESS
-#define LOCK_O_direct   if (ctx->decode.direct) mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O_direct if (ctx->decode.direct) mutex_unlock(ctx->outputbuf->mutex)
+#define LOCK_O_direct   if (ctx->decode.direct) metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O_direct if (ctx->decode.direct) metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
 #define IF_DIRECT(x)    if (ctx->decode.direct) { x }
 #define IF_PROCESS(x)   if (!ctx->decode.direct) { x }
 #else
-#define LOCK_O_direct   mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O_direct mutex_unlock(ctx->outputbuf->mutex)
+#define LOCK_O_direct   metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O_direct metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
 #define IF_DIRECT(x)    { x }
 #define IF_PROCESS(x)
 #endif
@@ -24,10 +24,10 @@
 extern log_level decode_loglevel;
 static log_level *loglevel = &decode_loglevel;
 
-#define LOCK_S   mutex_lock(ctx->streambuf->mutex)
-#define UNLOCK_S mutex_unlock(ctx->streambuf->mutex)
-#define LOCK_O   mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(ctx->outputbuf->mutex)
+#define LOCK_S   metrics_lock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define UNLOCK_S metrics_unlock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define LOCK_O   metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
 
 #if WIN
 #define lzcnt(x) __lzcnt(x)
@@ -43,7 +43,7 @@ static const u8_t	FLAC_CHANNELS[] = { 1, 2, 3, 4, 5, 6, 7, 8, 2, 2, 2, 0, 0, 0,
 static const u8_t	FLAC_SAMPLE_SIZE[] = { 0, 8, 12, 0, 16, 20, 24, 0 };
 
 static u8_t crc8[256];
-static u16_t crc16[256];
+static u16_t crc16[8][256];		// slicing-by-8, crc16[k] is for a byte followed by k zeros
 
 #define FLAC_MAX_SAMPLES 0xfffffffffLL
 
@@ -73,10 +73,13 @@ static u8_t flac_header[] = {
 };
 
 typedef struct {
-	enum { OFF, SYNC, CRC16 } state;
+	enum { OFF, SYNC, CRC16, META, FIRST } state;
 	bool ignore;
+	size_t meta;		// what's left to copy of current metadata block
+	bool last;			// current metadata block is the last one
 	u16_t crc16;
 	u64_t offset, position;
+	size_t bytes;		// sent to output since start of track
 	struct settings_s {
 		u32_t sample_rate;
 		u8_t channels, sample_size;
@@ -103,6 +106,8 @@ static u8_t write_utf8(u64_t v, u8_t* buf);
 static u16_t flac_block_size(u8_t block_size);
 static inline u16_t calc_crc16(u8_t* data, size_t n, u16_t crc);
 static inline u8_t calc_crc8(u8_t* data, size_t n, u8_t crc);
+static size_t find_sync(u8_t* data, size_t n, size_t from);
+static void peek(struct buffer *buf, void *dst, size_t n);
 
 /*---------------------------------------------------------------------------*/
 static decode_state flac_decode(struct thread_ctx_s *ctx) {
@@ -122,11 +127,26 @@ static decode_state flac_decode(struct thread_ctx_s *ctx) {
 	// need to do that before header increments pointer
 	if (ctx->decode.new_stream) {
 
-		// starting with "flAC" or headerless, no need to to anything
-		if (ctx->config.flac_header == FLAC_NO_HEADER || !memcmp(ctx->streambuf->readp, "fLaC", 4)) {
+		// headerless, no need to to anything but there is no seek table
+		if (ctx->config.flac_header == FLAC_NO_HEADER) {
+			LOCK_O;
+			_output_seektable(0, ctx);
 			ctx->output.track_start = ctx->outputbuf->writep;
+			UNLOCK_O;
 			ctx->decode.new_stream = false;
 			LOG_INFO("[%p]: flac thru no header needed", ctx);
+		} else if (!memcmp(ctx->streambuf->readp, "fLaC", 4)) {
+			// header is kept as is, seek table is armed when STREAMINFO is found
+			LOCK_O;
+			_output_seektable(0, ctx);
+			ctx->output.track_start = ctx->outputbuf->writep;
+			_buf_write(ctx->outputbuf, flac_header, 4);
+			UNLOCK_O;
+			_buf_inc_readp(ctx->streambuf, 4);
+			p->bytes = 4;
+			p->state = META;
+			ctx->decode.new_stream = false;
+			LOG_INFO("[%p]: flac thru with header", ctx);
 		} else {
 			// the min in and out are enough to process a full header (and stream has been flushed)
 			size_t n, avail = _buf_cont_read(ctx->streambuf);
@@ -154,9 +174,12 @@ static decode_state flac_decode(struct thread_ctx_s *ctx) {
 				LOCK_O;
 				_buf_write(ctx->outputbuf, flac_header, sizeof(flac_header));
 				_buf_write(ctx->outputbuf, streaminfo, sizeof(streaminfo_t));
+				p->bytes = sizeof(flac_header) + sizeof(streaminfo_t);
 #ifdef VORBIS_COMMENT
 				_buf_write(ctx->outputbuf, vorbis_comment, sizeof(vorbis_comment));
+				p->bytes += sizeof(vorbis_comment);
 #endif
+				_output_seektable(p->settings.sample_rate, ctx);
 				ctx->output.track_start = ctx->outputbuf->writep;
 				UNLOCK_O;
 				free(streaminfo);
@@ -174,6 +197,41 @@ static decode_state flac_decode(struct thread_ctx_s *ctx) {
 
 	LOCK_O;
 
+	// a block header (and STREAMINFO's sample rate) must be read at once
+	if (p->state == META && !p->meta) {
+		u8_t header[4 + 13];
+
+		peek(ctx->streambuf, header, min(sizeof(header), _buf_used(ctx->streambuf)));
+
+		if (_buf_used(ctx->streambuf) >= 4 && ((header[0] & 0x7f) || _buf_used(ctx->streambuf) >= sizeof(header))) {
+			p->last = header[0] & 0x80;
+			p->meta = 4 + ((header[1] << 16) | (header[2] << 8) | header[3]);
+			if ((header[0] & 0x7f) == 0) _output_seektable((header[14] << 12) | (header[15] << 4) | (header[16] >> 4), ctx);
+		} else if (ctx->stream.state <= DISCONNECT) {
+			// truncated, just send what's left
+			p->state = OFF;
+		}
+	}
+
+	/* Frames that follow the header are not renumbered (offset is their first number,
+	 * normally 0), they go through SYNC and CRC16 only to be indexed */
+	if (p->state == FIRST) {
+		frame_t frame;
+
+		if (_buf_used(ctx->streambuf) >= sizeof(frame_t)) {
+			peek(ctx->streambuf, &frame, sizeof(frame));
+			if (read_frame(&frame, &p->settings, &p->position, NULL)) {
+				p->offset = p->position;
+				p->state = SYNC;
+			} else {
+				LOG_WARN("[%p]: no frame after flac header, can't index", ctx);
+				p->state = OFF;
+			}
+		} else if (ctx->stream.state <= DISCONNECT) {
+			p->state = OFF;
+		}
+	}
+
 	if (p->state == SYNC) {
 		frame_t frame;
 		size_t in, out;
@@ -184,17 +242,23 @@ static decode_state flac_decode(struct thread_ctx_s *ctx) {
 		memcpy((u8_t*) &frame + in, ctx->streambuf->buf, sizeof(frame) - in);
 
 		bool first_frame = p->position == p->offset;
+		u64_t sample = (p->position - p->offset) * (p->settings.fixed_block ? p->settings.block_size : 1);
 
 		// if this is a frame, consume it and create the replacement
 		if ((in = create_frame(p, &frame, &out)) != 0) {
 			if (!first_frame) {
 				p->crc16 = htons(p->crc16);
 				_buf_write(ctx->outputbuf, &p->crc16, 2);
+				p->bytes += 2;
 			}
 
+			// frames are renumbered so index where they land in what we send
+			_output_seekpoint(sample, p->bytes, ctx);
+
 			// start a new frame
 			p->crc16 = calc_crc16((u8_t*)&frame, out, 0);
 			_buf_write(ctx->outputbuf, &frame, out);
+			p->bytes += out;
 
 			// remove frame and replenish queue
 			_buf_inc_readp(ctx->streambuf, in);
@@ -211,21 +275,29 @@ static decode_state flac_decode(struct thread_ctx_s *ctx) {
 	avail = min(avail, _buf_space(ctx->outputbuf));
 	avail = min(avail, _buf_cont_write(ctx->outputbuf));
 
-	// in CRC16 state, copy as much as we can
-	for (u8_t* iptr = ctx->streambuf->readp, *optr = ctx->outputbuf->writep; p->state == CRC16 && consumed < avail; consumed++) {
-		// if we've reached a potential SYNC word, we want to restart fresh
-		if (!p->ignore && *iptr == 0xff && (consumed == avail - 1 || (*(iptr + 1) & 0xf8) == 0xf8)) {
-			p->state = SYNC;
-			break;
+	/* In CRC16 state, copy everything up to the next potential SYNC word where we want 
+	 * to restart fresh. Output lags by the 2 bytes in queue as they might be the crc16 
+	 * of the frame which is only known when next frame is found */
+	if (p->state == CRC16) {
+		u8_t* iptr = ctx->streambuf->readp, *optr = ctx->outputbuf->writep;
+
+		consumed = find_sync(iptr, avail, p->ignore ? 1 : 0);
+		if (consumed < avail) p->state = SYNC;
+		if (consumed) p->ignore = false;
+
+		if (consumed >= 2) {
+			memcpy(optr, p->queue, 2);
+			memcpy(optr + 2, iptr, consumed - 2);
+			memcpy(p->queue, iptr + consumed - 2, 2);
+		} else if (consumed) {
+			*optr = p->queue[0];
+			p->queue[0] = p->queue[1];
+			p->queue[1] = *iptr;
 		}
-			
-		// write data & update crc16 as we now know that it is not part of crc16 itself
-		p->crc16 = calc_crc16(p->queue, 1, p->crc16);
-		*optr++ = p->queue[0];
-
-		p->queue[0] = p->queue[1];
-		p->queue[1] = *iptr++;
-		p->ignore = false;
+
+		// crc16 is for what we've just written
+		p->crc16 = calc_crc16(optr, consumed, p->crc16);
+		p->bytes += consumed;
 	}
 
 	// no need to re-process flac headers
@@ -234,6 +306,15 @@ static decode_state flac_decode(struct thread_ctx_s *ctx) {
 		consumed = avail;
 	}
 
+	// metadata blocks are copied as they are
+	if (p->state == META && p->meta) {
+		consumed = min(avail, p->meta);
+		memcpy(ctx->outputbuf->writep, ctx->streambuf->readp, consumed);
+		p->meta -= consumed;
+		p->bytes += consumed;
+		if (!p->meta && p->last) p->state = FIRST;
+	}
+
 	_buf_inc_readp(ctx->streambuf, consumed);
 	_buf_inc_writep(ctx->outputbuf, consumed);
 
@@ -277,8 +358,12 @@ struct codec *register_flac_thru(void) {
 
 	// x^16 + x^15 + x^2 + x^0 = 0x8005
 	for (int i = 0; i < 256; i++) {
-		crc16[i] = i << 8;
-		for (int j = 0; j < 8; j++) crc16[i] = (crc16[i] & 0x8000) ? (crc16[i] << 1) ^ 0x8005 : (crc16[i] << 1);
+		crc16[0][i] = i << 8;
+		for (int j = 0; j < 8; j++) crc16[0][i] = (crc16[0][i] & 0x8000) ? (crc16[0][i] << 1) ^ 0x8005 : (crc16[0][i] << 1);
+	}
+
+	for (int k = 1; k < 8; k++) {
+		for (int i = 0; i < 256; i++) crc16[k][i] = (crc16[k - 1][i] << 8) ^ crc16[0][crc16[k - 1][i] >> 8];
 	}
 
 	LOG_INFO("using flac thru", NULL);
@@ -420,7 +505,7 @@ static void bit_slicer(u8_t* data, u64_t* item, size_t bits, size_t* bitpos) {
 
 	for (u8_t c = *p << offset, n = bits; n;) {
 		*item |= c >> 7;
-		if (++offset % 8 == 0) c = *p++;
+		if (++offset % 8 == 0) c = n > 1 ? *++p : 0;
 		else c <<= 1;
 		if (--n) *item <<= 1;
 	}
@@ -476,10 +561,33 @@ static u16_t flac_block_size(u8_t block_size)
 
 /*---------------------------------------------------------------------------*/
 static inline u16_t calc_crc16(u8_t* data, size_t n, u16_t crc) {
-	while (n--) crc = (crc << 8) ^ crc16[*data++ ^ (crc >> 8)];
+	// 8 bytes at a time, the first two being combined with current crc
+	for (; n >= 8; n -= 8, data += 8) {
+		crc = crc16[7][data[0] ^ (crc >> 8)] ^ crc16[6][data[1] ^ (crc & 0xff)] ^
+			  crc16[5][data[2]] ^ crc16[4][data[3]] ^ crc16[3][data[4]] ^
+			  crc16[2][data[5]] ^ crc16[1][data[6]] ^ crc16[0][data[7]];
+	}
+	while (n--) crc = (crc << 8) ^ crc16[0][*data++ ^ (crc >> 8)];
 	return crc;
 }
 
+/*---------------------------------------------------------------------------*/
+static void peek(struct buffer *buf, void *dst, size_t n) {
+	// read without consuming, buffer might wrap
+	size_t cont = min(n, _buf_cont_read(buf));
+	memcpy(dst, buf->readp, cont);
+	memcpy((u8_t*) dst + cont, buf->buf, n - cont);
+}
+
+/*---------------------------------------------------------------------------*/
+static size_t find_sync(u8_t* data, size_t n, size_t from) {
+	// 0xff followed by 0xf8 mask or 0xff at the end as we don't know what's next
+	for (u8_t* p = data + from, *end = data + n; p < end && (p = memchr(p, 0xff, end - p)) != NULL; p++) {
+		if (p == end - 1 || (p[1] & 0xf8) == 0xf8) return p - data;
+	}
+	return n;
+}
+
 /*---------------------------------------------------------------------------*/
 static inline u8_t calc_crc8(u8_t* data, size_t n, u8_t crc) {
 	while (n--) crc = crc8[*data++ ^ crc];
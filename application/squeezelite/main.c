@@ -27,15 +27,16 @@
  */
 
 #include "squeezelite.h"
+#include "cache.h"
 
 #include <math.h>
 #include <signal.h>
 #include <ctype.h>
 
-#define LOCK_S   mutex_lock(ctx->streambuf->mutex)
-#define UNLOCK_S mutex_unlock(ctx->streambuf->mutex)
-#define LOCK_O	 mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(ctx->outputbuf->mutex)
+#define LOCK_S   metrics_lock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define UNLOCK_S metrics_unlock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define LOCK_O	 metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
 #define LOCK_P   mutex_lock(ctx->mutex)
 #define UNLOCK_P mutex_unlock(ctx->mutex)
 
@@ -65,6 +66,10 @@ void sq_wipe_device(struct thread_ctx_s *ctx) {
 	ctx->in_use = false;
 	mutex_unlock(ctx->cli_mutex);
 
+	metrics_barrier(ctx);
+	metadata_cache_flush(ctx, false);
+	sync_cache_flush(ctx);
+
 	slimproto_close(ctx);
 	output_flush(ctx, true);
 	output_close(ctx);
@@ -88,56 +93,6 @@ void sq_delete_device(sq_dev_handle_t handle) {
 }
 
 
-/*---------------------------------------------------------------------------*/
-static char from_hex(char ch) {
-  return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
-}
-
-/*---------------------------------------------------------------------------*/
-static char to_hex(char code) {
-  static char hex[] = "0123456789abcdef";
-  return hex[code & 15];
-}
-
-/*---------------------------------------------------------------------------*/
-/* IMPORTANT: be sure to free() the returned string after use */
-static char *cli_encode(char *str) {
-  char *pstr = str, *buf = malloc(strlen(str) * 3 + 1), *pbuf = buf;
-  while (*pstr) {
-	if ( isalnum(*pstr) || *pstr == '-' || *pstr == '_' || *pstr == '.' ||
-						  *pstr == '~' || *pstr == ' ' || *pstr == ')' ||
-						  *pstr == '(' )
-	  *pbuf++ = *pstr;
-	else if (*pstr == '%') {
-	  *pbuf++ = '%',*pbuf++ = '2', *pbuf++ = '5';
-	}
-	else
-	  *pbuf++ = '%', *pbuf++ = to_hex(*pstr >> 4), *pbuf++ = to_hex(*pstr & 15);
-	pstr++;
-  }
-  *pbuf = '\0';
-  return buf;
-}
-
-/*---------------------------------------------------------------------------*/
-/* IMPORTANT: be sure to free() the returned string after use */
-static char *cli_decode(char *str) {
-  char *pstr = str, *buf = malloc(strlen(str) + 1), *pbuf = buf;
-  while (*pstr) {
-	if (*pstr == '%') {
-	  if (pstr[1] && pstr[2]) {
-		*pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
-		pstr += 2;
-	  }
-	} else {
-	  *pbuf++ = *pstr;
-	}
-	pstr++;
-  }
-  *pbuf = '\0';
-  return buf;
-}
-
 /*---------------------------------------------------------------------------*/
 /* IMPORTANT: be sure to free() the returned string after use */
 static char *cli_find_tag(char *str, char *tag) {
@@ -160,115 +115,6 @@ static char *cli_find_tag(char *str, char *tag) {
 	return res;
 }
 
-/*---------------------------------------------------------------------------*/
-bool cli_open_socket(struct thread_ctx_s *ctx) {
-	struct sockaddr_in addr;
-
-	if (!ctx->config.use_cli) return false;
-	if (ctx->cli_sock > 0) return true;
-
-	ctx->cli_sock = socket(AF_INET, SOCK_STREAM, 0);
-	set_nonblock(ctx->cli_sock);
-	set_nosigpipe(ctx->cli_sock);
-
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = ctx->slimproto_ip;
-	addr.sin_port = htons(ctx->cli_port);
-
-	if (tcp_connect_timeout(ctx->cli_sock, addr, 250))  {
-		LOG_ERROR("[%p]: unable to connect to server with cli", ctx);
-		closesocket(ctx->cli_sock);
-		ctx->cli_sock = -1;
-		return false;
-	}
-
-	LOG_INFO("[%p]: opened CLI socket %d", ctx, ctx->cli_sock);
-	return true;
-}
-
-/*---------------------------------------------------------------------------*/
-#define CLI_SEND_SLEEP (10000)
-#define CLI_SEND_TO (1*500000)
-#define CLI_KEEP_DURATION (15*60*1000)
-#define CLI_PACKET 4096
-char *cli_send_cmd(char *cmd, bool req, bool decode, struct thread_ctx_s *ctx) {
-	char *packet;
-	int wait;
-	size_t len;
-	char *rsp = NULL;
-
-	mutex_lock(ctx->cli_mutex);
-
-	if (!cli_open_socket(ctx)) {
-		mutex_unlock(ctx->cli_mutex);
-		return NULL;
-	}
-
-	packet = malloc(CLI_PACKET + 1);
-	ctx->cli_timeout = gettime_ms() + CLI_KEEP_DURATION;
-	wait = CLI_SEND_TO / CLI_SEND_SLEEP;
-
-	cmd = cli_encode(cmd);
-
-	if (req) len = sprintf(packet, "%s ?\n", cmd);
-	else len = sprintf(packet, "%s\n", cmd);
-
-	LOG_SDEBUG("[%p]: cmd %s", ctx, packet);
-	send_packet((u8_t*) packet, len, ctx->cli_sock);
-
-	// first receive the tag and then point to the last '\n'
-	len = 0;
-	while (wait)	{
-		int k;
-		fd_set rfds;
-		struct timeval timeout = {0, CLI_SEND_SLEEP};
-
-		FD_ZERO(&rfds);
-		FD_SET(ctx->cli_sock, &rfds);
-
-		k = select(ctx->cli_sock + 1, &rfds, NULL, NULL, &timeout);
-
-		if (!k) {
-			wait--;
-			continue;
-		}
-
-		if (k < 0) break;
-
-		k = recv(ctx->cli_sock, packet + len, CLI_PACKET - len, 0);
-		if (k <= 0) break;
-
-		len += k;
-		packet[len] = '\0';
-		if (strchr(packet, '\n') && strcasestr(packet, cmd)) {
-			rsp = packet;
-			break;
-		}
-	}
-
-	if (!wait) {
-		LOG_WARN("[%p]: Timeout waiting for CLI reponse (%s)", ctx, cmd);
-	}
-
-	LOG_SDEBUG("[%p]: rsp %s", ctx, rsp);
-
-	if (rsp) {
-		rsp = strcasestr(rsp, cmd) + strlen(cmd);
-		while (*rsp && *rsp == ' ') rsp++;
-
-		if (decode) rsp = cli_decode(rsp);
-		else rsp = strdup(rsp);
-		*(strrchr(rsp, '\n')) = '\0';
-	}
-
-	mutex_unlock(ctx->cli_mutex);
-
-	free(cmd);
-	free(packet);
-
-	return rsp;
-}
-
 /*--------------------------------------------------------------------------*/
 u32_t sq_get_time(sq_dev_handle_t handle) {
 	struct thread_ctx_s *ctx = &thread_ctx[handle - 1];
@@ -322,12 +168,170 @@ bool sq_set_time(sq_dev_handle_t handle, char *pos) {
 	return true;
 }
 
+/*--------------------------------------------------------------------------*/
+void metadata_cache_flush(struct thread_ctx_s *ctx, bool refresh) {
+	mutex_lock(ctx->cli_mutex);
+	ctx->metadata_cache.generation++;
+	for (int i = 0; i < ARRAY_COUNT(ctx->metadata_cache.slots); i++) {
+		metadata_free(&ctx->metadata_cache.slots[i].metadata);
+	}
+	mutex_unlock(ctx->cli_mutex);
+
+	// live metadata are polled, so force that poll now
+	if (refresh && ctx->output.live_metadata.enabled) {
+		ctx->output.live_metadata.last = gettime_ms() - METADATA_UPDATE_TIME - 1;
+		wake_controller(ctx);
+	}
+}
+
+/*--------------------------------------------------------------------------*/
+void sync_cache_flush(struct thread_ctx_s *ctx) {
+	mutex_lock(ctx->cli_mutex);
+	ctx->sync_cache.generation++;
+	ctx->sync_cache.valid = ctx->sync_cache.pending = false;
+	// a notification or a new connection, so no reason to wait for a retry
+	ctx->sync_cache.backoff = 0;
+	NFREE(ctx->sync_cache.players);
+	mutex_unlock(ctx->cli_mutex);
+}
+
+/*--------------------------------------------------------------------------*/
+struct sync_query_s {
+	struct thread_ctx_s *ctx;
+	u32_t generation;
+};
+
+static void sync_cache_backoff(struct thread_ctx_s *ctx, bool success) {
+	// called with cli_mutex locked
+	if (success) ctx->sync_cache.backoff = 0;
+	else if (!ctx->sync_cache.backoff) ctx->sync_cache.backoff = SYNC_REFRESH_TIME;
+	else ctx->sync_cache.backoff = min(ctx->sync_cache.backoff * 2, SYNC_BACKOFF_MAX);
+	ctx->sync_cache.retry = gettime_ms() + ctx->sync_cache.backoff;
+}
+
+static void sync_cache_done(char *rsp, void *arg) {
+	struct sync_query_s *query = arg;
+	struct thread_ctx_s *ctx = query->ctx;
+
+	// NULL on failure, '-' when no player is synchronized with us
+	bool answered = rsp != NULL;
+	if (rsp && (!*rsp || *rsp == '-')) NFREE(rsp);
+
+	mutex_lock(ctx->cli_mutex);
+	// a sync notification arrived while we were querying, let next refresh ask again
+	if (ctx->sync_cache.generation == query->generation) {
+		ctx->sync_cache.pending = false;
+		ctx->sync_cache.valid = answered;
+		sync_cache_backoff(ctx, answered);
+		NFREE(ctx->sync_cache.players);
+		ctx->sync_cache.players = rsp;
+		rsp = NULL;
+	}
+	mutex_unlock(ctx->cli_mutex);
+
+	NFREE(rsp);
+	free(query);
+}
+
+/*--------------------------------------------------------------------------*/
+void sync_cache_refresh(struct thread_ctx_s *ctx) {
+	struct sync_query_s *query;
+	u32_t now = gettime_ms();
+	char cmd[128];
+
+	if (!ctx->in_use || !ctx->config.use_cli) return;
+
+	mutex_lock(ctx->cli_mutex);
+	bool query_needed = !ctx->sync_cache.valid && !ctx->sync_cache.pending &&
+						now - ctx->sync_cache.last >= SYNC_REFRESH_TIME &&
+						(!ctx->sync_cache.backoff || (s32_t) (now - ctx->sync_cache.retry) >= 0);
+	if (query_needed) {
+		ctx->sync_cache.pending = true;
+		ctx->sync_cache.last = now;
+	}
+	u32_t generation = ctx->sync_cache.generation;
+	mutex_unlock(ctx->cli_mutex);
+
+	if (!query_needed) return;
+
+	query = malloc(sizeof(struct sync_query_s));
+	query->ctx = ctx;
+	query->generation = generation;
+
+	sprintf(cmd, "%s sync", ctx->cli_id);
+	if (!cli_send_async(cmd, true, true, sync_cache_done, query, ctx)) {
+		free(query);
+		mutex_lock(ctx->cli_mutex);
+		if (ctx->sync_cache.generation == generation) {
+			ctx->sync_cache.pending = false;
+			sync_cache_backoff(ctx, false);
+		}
+		mutex_unlock(ctx->cli_mutex);
+	}
+}
+
+/*--------------------------------------------------------------------------*/
+bool sync_cache_has(struct thread_ctx_s *ctx, const char *player) {
+	// never queries LMS, an unknown sync group is reported as not synchronized
+	mutex_lock(ctx->cli_mutex);
+	bool found = ctx->sync_cache.valid && ctx->sync_cache.players && strcasestr(ctx->sync_cache.players, player);
+	mutex_unlock(ctx->cli_mutex);
+
+	return found;
+}
+
+/*--------------------------------------------------------------------------*/
+static bool metadata_cache_get(struct thread_ctx_s *ctx, int token, metadata_t *metadata, u32_t *hash, u32_t *generation) {
+	bool found = false;
+
+	mutex_lock(ctx->cli_mutex);
+	for (int i = 0; i < ARRAY_COUNT(ctx->metadata_cache.slots) && !found; i++) {
+		if (!ctx->metadata_cache.slots[i].metadata.valid || ctx->metadata_cache.slots[i].token != token) continue;
+		metadata_clone(&ctx->metadata_cache.slots[i].metadata, metadata);
+		*hash = ctx->metadata_cache.slots[i].hash;
+		found = true;
+
+		// pause, play and seek are notified, so in between time runs with the clock
+		if (ctx->metadata_cache.slots[i].playing) {
+			u32_t elapsed = gettime_ms() - ctx->metadata_cache.slots[i].at;
+			if (token == -1) {
+				metadata->position += elapsed;
+				if (metadata->duration) metadata->position = min(metadata->position, metadata->duration);
+			} else if (token == 0) {
+				metadata->duration = metadata->duration > elapsed ? metadata->duration - elapsed : 0;
+			}
+		}
+	}
+	*generation = ctx->metadata_cache.generation;
+	mutex_unlock(ctx->cli_mutex);
+
+	return found;
+}
+
+/*--------------------------------------------------------------------------*/
+static void metadata_cache_put(struct thread_ctx_s *ctx, int token, metadata_t *metadata, u32_t hash, u32_t at,
+							   bool playing, u32_t generation) {
+	mutex_lock(ctx->cli_mutex);
+	// a notification arrived while we were querying, these might be stale already
+	if (ctx->metadata_cache.generation == generation) {
+		int i = ctx->metadata_cache.next++ % ARRAY_COUNT(ctx->metadata_cache.slots);
+		ctx->metadata_cache.slots[i].token = token;
+		ctx->metadata_cache.slots[i].hash = hash;
+		ctx->metadata_cache.slots[i].at = at;
+		ctx->metadata_cache.slots[i].playing = playing;
+		metadata_clone(metadata, &ctx->metadata_cache.slots[i].metadata);
+	}
+	mutex_unlock(ctx->cli_mutex);
+}
+
 /*--------------------------------------------------------------------------*/
 uint32_t sq_get_metadata(sq_dev_handle_t handle, metadata_t *metadata, int token) {
 	struct thread_ctx_s *ctx = &thread_ctx[handle - 1];
 	char cmd[1024];
 	char *rsp, *p, *cur;
 	int index = token;
+	u32_t hash, generation, at;
+	bool found, playing = false;
 
 	metadata_init(metadata);
 	
@@ -339,10 +343,19 @@ uint32_t sq_get_metadata(sq_dev_handle_t handle, metadata_t *metadata, int token
 		return 0;
 	}
 
+	/* LMS notifies playlist, time and metadata changes so what we have cached for 
+	 * that token (relative index) is valid until then, except for position (and
+	 * remaining duration of next track) that are moved by the time since query */
+	if (metadata_cache_get(ctx, token, metadata, &hash, &generation)) {
+		LOG_DEBUG("[%p]: cached metadata for %d (idx %d)", ctx, token, metadata->index);
+		return hash;
+	}
+
 	// use -1 to get what's playing
 	if (token == -1) index = 0;
 
-	sprintf(cmd, "%s status - %d tags:xcfldatgrKNoITH", ctx->cli_id, index + 1);
+	sprintf(cmd, "%s status - %d tags:xcfldatgrKNoITHu", ctx->cli_id, index + 1);
+	at = gettime_ms();
 	rsp = cli_send_cmd(cmd, false, false, ctx);
 
 	if (!rsp || !*rsp) {
@@ -353,6 +366,11 @@ uint32_t sq_get_metadata(sq_dev_handle_t handle, metadata_t *metadata, int token
 
 	metadata->valid = true;
 
+	if ((p = cli_find_tag(rsp, "mode")) != NULL) {
+		playing = !strcasecmp(p, "play");
+		free(p);
+	}
+
 	// the tag means the it's a repeating stream whose length might be known
 	if ((p = cli_find_tag(rsp, "repeating_stream")) != NULL) {
 		index = 0;
@@ -375,6 +393,7 @@ uint32_t sq_get_metadata(sq_dev_handle_t handle, metadata_t *metadata, int token
 
 	sprintf(cmd, "playlist%%20index%%3a%d ", metadata->index);
 	cur = strcasestr(rsp, cmd);
+	found = cur != NULL;
 
 	if (cur) {
 		metadata->title = cli_find_tag(cur, "title");
@@ -383,6 +402,8 @@ uint32_t sq_get_metadata(sq_dev_handle_t handle, metadata_t *metadata, int token
 		metadata->genre = cli_find_tag(cur, "genre");
 		metadata->remote_title = cli_find_tag(cur, "remote_title");
 		metadata->artwork = cli_find_tag(cur, "artwork_url");
+		// leading space or it would be found in artwork_url
+		metadata->url = cli_find_tag(cur, " url");
 
 		if ((p = cli_find_tag(cur, "duration")) != NULL) {
 			/* when it's a repeating track, duration must hold the full block length while
@@ -483,7 +504,10 @@ uint32_t sq_get_metadata(sq_dev_handle_t handle, metadata_t *metadata, int token
 				metadata->duration, metadata->live_duration, metadata->position, 
 			    metadata->size,	metadata->artwork ? metadata->artwork : "");
 
-	return hash32(metadata->artist) ^ hash32(metadata->title) ^ hash32(metadata->artwork);
+	hash = hash32(metadata->artist) ^ hash32(metadata->title) ^ hash32(metadata->artwork);
+	if (found) metadata_cache_put(ctx, token, metadata, hash, at, playing, generation);
+
+	return hash;
 }
 
 /*--------------------------------------------------------------------------*/
@@ -509,7 +533,7 @@ u32_t sq_self_time(sq_dev_handle_t handle) {
 /*---------------------------------------------------------------------------*/
 void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...) {
 	struct thread_ctx_s *ctx = &thread_ctx[handle - 1];
-	char cmd[128], *rsp;
+	char cmd[128];
 
 	LOG_SDEBUG("[%p]: notif %d", ctx, event);
 
@@ -561,8 +585,7 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...) {
 				// unsollicited PLAY done on the player direclty
 				LOG_WARN("[%p]: unsollicited play", ctx);
 				sprintf(cmd, "%s play", ctx->cli_id);
-				rsp = cli_send_cmd(cmd, false, true, ctx);
-				NFREE(rsp);
+				cli_send_async(cmd, false, true, NULL, NULL, ctx);
 			}
 			break;
 		}
@@ -577,8 +600,7 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...) {
 			if (va_arg(args, int)) {
 				LOG_WARN("[%p]: unsollicited pause", ctx);
 				sprintf(cmd, "%s pause", ctx->cli_id);
-				rsp = cli_send_cmd(cmd, false, true, ctx);
-				NFREE(rsp);
+				cli_send_async(cmd, false, true, NULL, NULL, ctx);
 			}
 			break;
 		}
@@ -587,15 +609,13 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...) {
 				// stop if the renderer side is sure or if we had 2 stops in a row
 				LOG_INFO("[%p]: forced STOP", ctx);
 				sprintf(cmd, "%s stop", ctx->cli_id);
-				rsp = cli_send_cmd(cmd, false, true, ctx);
-				NFREE(rsp);
+				cli_send_async(cmd, false, true, NULL, NULL, ctx);
 			/* FIXME: not sure anymore what this tries to cover
 			} else if (ctx->stream.state <= DISCONNECT && !ctx->output.completed) {
 				// happens if streaming fails (spotty)
 				LOG_INFO("[%p] un-managed STOP, re-starting", ctx);
 				sprintf(cmd, "%s time -5.00", ctx->cli_id);
-				rsp = cli_send_cmd(cmd, false, true, ctx);
-				NFREE(rsp);
+				cli_send_async(cmd, false, true, NULL, NULL, ctx);
 			*/
 			} else {
 				// might be a STMu or a STMo, let slimproto decide
@@ -609,13 +629,11 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...) {
 			break;
 		case SQ_VOLUME:
 			sprintf(cmd, "%s mixer volume %d", ctx->cli_id, va_arg(args, int));
-			rsp = cli_send_cmd(cmd, false, true, ctx);
-			NFREE(rsp);
+			cli_send_async(cmd, false, true, NULL, NULL, ctx);
 			break;
 		case SQ_MUTE:
 			sprintf(cmd, "%s mixer muting %d", ctx->cli_id, va_arg(args, int) ? 1 : 0);
-			rsp = cli_send_cmd(cmd, false, true, ctx);
-			NFREE(rsp);
+			cli_send_async(cmd, false, true, NULL, NULL, ctx);
 			break;
 		case SQ_TIME: {
 			u32_t now, time = va_arg(args, u32_t);
@@ -687,14 +705,12 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...) {
 		}
 		case SQ_SETNAME: {
 			sprintf(cmd, "%s name %s", ctx->cli_id, va_arg(args, char*));
-			rsp = cli_send_cmd(cmd, false, false, ctx);
-			NFREE(rsp);
+			cli_send_async(cmd, false, false, NULL, NULL, ctx);
 			break;
 		}
 		case SQ_NEXT_FAILED: 
 			sprintf(cmd, "%s playlist index +1", ctx->cli_id);
-			rsp = cli_send_cmd(cmd, false, false, ctx);
-			NFREE(rsp);
+			cli_send_async(cmd, false, false, NULL, NULL, ctx);
 			break;
 		default:
 			LOG_WARN("[%p]: unknown notification %u", event);
@@ -705,14 +721,21 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...) {
  }
 
  /*---------------------------------------------------------------------------*/
-void sq_init(struct in_addr host, u16_t port, char *model_name) {
+void sq_init(struct in_addr host, u16_t port, char *model_name, size_t arena_size, size_t buffer_budget, size_t cache_budget,
+			 char *tcache_dir, size_t tcache_size) {
 	sq_local_host = host;
 	sq_local_port = port;
 	strcpy(sq_model_name, model_name);
 
+	buf_arena_init(arena_size);
+	buf_budget_init(buffer_budget);
+	cache_budget_init(cache_budget);
+	tcache_init(tcache_dir, tcache_size);
+	cli_init();
 	output_init();
 	decode_init();
 	stream_init();
+	metrics_init();
 }
 
 /*---------------------------------------------------------------------------*/
@@ -725,9 +748,14 @@ void sq_stop() {
 		}
 	}
 
+	metrics_end();
 	stream_end();
 	decode_end();
 	output_end();
+	// sessions are all closed, so recordings are either finishing or abandoned
+	tcache_end();
+	cli_end();
+	buf_arena_end();
 }
 
 /*---------------------------------------------------------------------------*/
@@ -27,6 +27,7 @@ void metadata_free(struct metadata_s* const self) {
 	__FREE__(self->remote_title);
 	__FREE__(self->artwork);
 	__FREE__(self->genre);
+	__FREE__(self->url);
 	metadata_init(self);
 }
 
@@ -42,6 +43,7 @@ struct metadata_s* metadata_clone(struct metadata_s* const self, struct metadata
 	clone->remote_title = __STRDUP__(self->remote_title);
 	clone->artwork = __STRDUP__(self->artwork);
 	clone->genre = __STRDUP__(self->genre);
+	clone->url = __STRDUP__(self->url);
 	return clone;
 }
 
@@ -20,6 +20,7 @@ typedef struct metadata_s {
 	char* remote_title;
 	char* artwork;
 	char *genre;
+	char* url;
 	// TODO: shall this two be merged?
 	uint32_t track, index, disc;
 	uint32_t duration, position;
@@ -0,0 +1,446 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Philippe 2015-2023, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Counters and histograms of the stream -> decode -> output pipeline, served in
+ * Prometheus text format on http://<host>:<port>/metrics where port is the first
+ * free one of the bridge's range. Timings are only taken for METRICS_LINGER after
+ * a scrape, otherwise the cost is the test of metrics_on. Histograms are updated
+ * by a single thread at a time (the one holding the lock or running the decoder,
+ * the player's reactor...) and read without lock, which is fine for statistics */
+
+#include "squeezelite.h"
+
+#if WIN
+#include <windows.h>
+#endif
+
+#define METRICS_LINGER	(60*1000)
+
+extern log_level	output_loglevel;
+static log_level 	*loglevel = &output_loglevel;
+
+volatile bool metrics_on;
+
+static struct {
+	bool running;
+	int sock;
+	u16_t port;
+	u32_t last;
+	thread_type thread;
+	mutex_type mutex;
+} metrics;
+
+// series registered by other modules (e.g. cast)
+static struct metrics_ext_s {
+	char *name, *help, *labels;
+	struct metrics_hist_s hist;
+	struct metrics_ext_s *next;
+} *externals;
+
+struct text_s {
+	char *buf;
+	size_t len, size;
+};
+
+static void *metrics_thread(void *arg);
+
+/*---------------------------------------------------------------------------*/
+u64_t metrics_now(void) {
+#if WIN
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (now.QuadPart * 1000000) / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+void metrics_observe(struct metrics_hist_s *hist, u64_t us) {
+	int i;
+
+	// bucket i holds what is <= 2^i µs, last one is +Inf
+	for (i = 0; i < METRICS_BUCKETS - 1 && us > (1ULL << i); i++);
+	hist->buckets[i]++;
+	hist->count++;
+	hist->sum += us;
+}
+
+/*---------------------------------------------------------------------------*/
+void _metrics_lock(mutex_type *mutex, struct metrics_s *m, metrics_lock_e id) {
+	u64_t start = metrics_now();
+
+	pthread_mutex_lock(mutex);
+
+	// we own the lock, so we are the only one writing these
+	m->lock_at[id] = metrics_now();
+	metrics_observe(m->lock_wait + id, m->lock_at[id] - start);
+}
+
+/*---------------------------------------------------------------------------*/
+void _metrics_unlock(mutex_type *mutex, struct metrics_s *m, metrics_lock_e id) {
+	// lock might have been taken before metrics were turned on
+	if (m->lock_at[id]) metrics_observe(m->lock_hold + id, metrics_now() - m->lock_at[id]);
+	m->lock_at[id] = 0;
+
+	pthread_mutex_unlock(mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+void _metrics_cond_wait(pthread_cond_t *cond, mutex_type *mutex, struct metrics_s *m, metrics_lock_e id) {
+	// lock is released while waiting, so that time is not accounted as holding it
+	if (m->lock_at[id]) metrics_observe(m->lock_hold + id, metrics_now() - m->lock_at[id]);
+	pthread_cond_wait(cond, mutex);
+	m->lock_at[id] = metrics_now();
+}
+
+/*---------------------------------------------------------------------------*/
+void metrics_barrier(struct thread_ctx_s *ctx) {
+	/* changes nothing, it is only a barrier: player is not in use anymore, so once we
+	 * had the lock no scrape is reading it and the next ones skip it, it can be released */
+	mutex_lock(metrics.mutex);
+	LOG_DEBUG("[%p]: player removed from metrics", ctx);
+	mutex_unlock(metrics.mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+void *sq_metrics_register(const char *name, const char *help, const char *labels) {
+	struct metrics_ext_s *ext = calloc(1, sizeof(struct metrics_ext_s));
+
+	ext->name = strdup(name);
+	ext->help = strdup(help);
+	ext->labels = strdup(labels ? labels : "");
+
+	mutex_lock(metrics.mutex);
+	ext->next = externals;
+	externals = ext;
+	mutex_unlock(metrics.mutex);
+
+	return ext;
+}
+
+/*---------------------------------------------------------------------------*/
+void sq_metrics_unregister(void *handle) {
+	struct metrics_ext_s **p;
+
+	if (!handle) return;
+
+	mutex_lock(metrics.mutex);
+	for (p = &externals; *p && *p != handle; p = &(*p)->next);
+	if (*p) *p = (*p)->next;
+	mutex_unlock(metrics.mutex);
+
+	free(((struct metrics_ext_s*) handle)->name);
+	free(((struct metrics_ext_s*) handle)->help);
+	free(((struct metrics_ext_s*) handle)->labels);
+	free(handle);
+}
+
+/*---------------------------------------------------------------------------*/
+void sq_metrics_observe(void *handle, u32_t us) {
+	if (handle && metrics_on) metrics_observe(&((struct metrics_ext_s*) handle)->hist, us);
+}
+
+/*---------------------------------------------------------------------------*/
+bool sq_metrics_active(void) {
+	return metrics_on;
+}
+
+/*---------------------------------------------------------------------------*/
+static void text_add(struct text_s *text, const char *fmt, ...) {
+	va_list args;
+	int len;
+
+	for (;;) {
+		va_start(args, fmt);
+		len = vsnprintf(text->buf + text->len, text->size - text->len, fmt, args);
+		va_end(args);
+
+		if (len < 0) return;
+		if (text->len + len < text->size) break;
+
+		text->size = max(2 * text->size, text->len + len + 1);
+		text->buf = realloc(text->buf, text->size);
+	}
+
+	text->len += len;
+}
+
+/*---------------------------------------------------------------------------*/
+static void text_hist(struct text_s *text, const char *name, const char *labels, struct metrics_hist_s *hist) {
+	const char *sep = *labels ? "," : "";
+	u64_t count = 0;
+
+	// Prometheus buckets are cumulative and in seconds
+	for (int i = 0; i < METRICS_BUCKETS - 1; i++) {
+		count += hist->buckets[i];
+		text_add(text, "%s_bucket{%s%sle=\"%.7g\"} %" PRIu64 "\n", name, labels, sep, (1ULL << i) / 1E6, count);
+	}
+
+	text_add(text, "%s_bucket{%s%sle=\"+Inf\"} %u\n", name, labels, sep, hist->count);
+	text_add(text, "%s_sum{%s} %.6f\n", name, labels, hist->sum / 1E6);
+	text_add(text, "%s_count{%s} %u\n", name, labels, hist->count);
+}
+
+/*---------------------------------------------------------------------------*/
+static void text_type(struct text_s *text, const char *name, const char *type, const char *help) {
+	text_add(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*---------------------------------------------------------------------------*/
+static char *player_label(struct thread_ctx_s *ctx, char *label, size_t size) {
+	size_t n = snprintf(label, size, "player=\"");
+
+	// label values must have '\' and '"' escaped
+	for (char *p = ctx->config.name; *p && n < size - 4; p++) {
+		if (*p == '"' || *p == '\\') label[n++] = '\\';
+		label[n++] = *p;
+	}
+
+	snprintf(label + n, size - n, "\"");
+	return label;
+}
+
+/*---------------------------------------------------------------------------*/
+static char *metrics_build(void) {
+	struct text_s text = { NULL, 0, 0 };
+	const char *locks[] = { "S", "D", "O" };
+	char label[STR_LEN*2 + 32], name[STR_LEN*2 + 64];
+
+	/* a metric family can't be split, so each of them iterates on all players. Buffer
+	 * levels are sampled first, under the player's locks */
+	struct {
+		u64_t streambuf[2], outputbuf[2], obuf;
+	} levels[MAX_PLAYER];
+
+	memset(levels, 0, sizeof(levels));
+
+	// prevents players from being wiped while we read them (see metrics_barrier)
+	mutex_lock(metrics.mutex);
+
+	for (int i = 0; i < MAX_PLAYER; i++) {
+		struct thread_ctx_s *ctx = thread_ctx + i;
+
+		if (ctx->in_use && ctx->running) {
+			mutex_lock(ctx->streambuf->mutex);
+			levels[i].streambuf[0] = _buf_used(ctx->streambuf);
+			levels[i].streambuf[1] = ctx->streambuf->size;
+			mutex_unlock(ctx->streambuf->mutex);
+
+			mutex_lock(ctx->outputbuf->mutex);
+			levels[i].outputbuf[0] = _buf_used(ctx->outputbuf);
+			levels[i].outputbuf[1] = ctx->outputbuf->size;
+			levels[i].obuf = 0;
+			for (int j = 0; j < ARRAY_COUNT(ctx->output_thread); j++) {
+				if (ctx->output_thread[j].active) levels[i].obuf += _buf_used(&ctx->output_thread[j].obuf);
+			}
+			mutex_unlock(ctx->outputbuf->mutex);
+		}
+	}
+
+#define FOR_PLAYERS for (int i = 0; i < MAX_PLAYER; i++) if (thread_ctx[i].in_use && thread_ctx[i].running)
+#define CTX (thread_ctx + i)
+	text_type(&text, "squeezelite_buffer_used_bytes", "gauge", "Bytes waiting in pipeline buffers");
+	FOR_PLAYERS {
+		player_label(CTX, label, sizeof(label));
+		text_add(&text, "squeezelite_buffer_used_bytes{%s,buffer=\"streambuf\"} %" PRIu64 "\n", label, levels[i].streambuf[0]);
+		text_add(&text, "squeezelite_buffer_used_bytes{%s,buffer=\"outputbuf\"} %" PRIu64 "\n", label, levels[i].outputbuf[0]);
+		text_add(&text, "squeezelite_buffer_used_bytes{%s,buffer=\"obuf\"} %" PRIu64 "\n", label, levels[i].obuf);
+	}
+
+	text_type(&text, "squeezelite_buffer_size_bytes", "gauge", "Size of pipeline buffers");
+	FOR_PLAYERS {
+		player_label(CTX, label, sizeof(label));
+		text_add(&text, "squeezelite_buffer_size_bytes{%s,buffer=\"streambuf\"} %" PRIu64 "\n", label, levels[i].streambuf[1]);
+		text_add(&text, "squeezelite_buffer_size_bytes{%s,buffer=\"outputbuf\"} %" PRIu64 "\n", label, levels[i].outputbuf[1]);
+	}
+
+	text_type(&text, "squeezelite_lock_wait_seconds", "histogram", "Time waiting to acquire a lock");
+	FOR_PLAYERS for (int j = 0; j < METRICS_LOCKS; j++) {
+		snprintf(name, sizeof(name), "%s,lock=\"%s\"", player_label(CTX, label, sizeof(label)), locks[j]);
+		text_hist(&text, "squeezelite_lock_wait_seconds", name, CTX->metrics.lock_wait + j);
+	}
+
+	text_type(&text, "squeezelite_lock_hold_seconds", "histogram", "Time a lock is held");
+	FOR_PLAYERS for (int j = 0; j < METRICS_LOCKS; j++) {
+		snprintf(name, sizeof(name), "%s,lock=\"%s\"", player_label(CTX, label, sizeof(label)), locks[j]);
+		text_hist(&text, "squeezelite_lock_hold_seconds", name, CTX->metrics.lock_hold + j);
+	}
+
+	text_type(&text, "squeezelite_decode_seconds", "histogram", "Duration of codec decode calls");
+	FOR_PLAYERS text_hist(&text, "squeezelite_decode_seconds", player_label(CTX, label, sizeof(label)), &CTX->metrics.decode);
+
+	text_type(&text, "squeezelite_fill_seconds", "histogram", "Duration of output fill (processing and encoding)");
+	FOR_PLAYERS text_hist(&text, "squeezelite_fill_seconds", player_label(CTX, label, sizeof(label)), &CTX->metrics.fill);
+
+	text_type(&text, "squeezelite_sent_bytes_total", "counter", "Bytes sent to player");
+	FOR_PLAYERS text_add(&text, "squeezelite_sent_bytes_total{%s} %" PRIu64 "\n", player_label(CTX, label, sizeof(label)), CTX->metrics.send_bytes);
+
+	text_type(&text, "squeezelite_send_blocked_total", "counter", "Sends that could not complete (EAGAIN)");
+	FOR_PLAYERS text_add(&text, "squeezelite_send_blocked_total{%s} %" PRIu64 "\n", player_label(CTX, label, sizeof(label)), CTX->metrics.send_blocked);
+#undef FOR_PLAYERS
+#undef CTX
+
+	mutex_unlock(metrics.mutex);
+
+	struct buf_arena_stats arena;
+	buf_arena_stats(&arena);
+
+	text_type(&text, "squeezelite_arena_bytes", "gauge", "Memory of the shared buffer arena");
+	text_add(&text, "squeezelite_arena_bytes{state=\"held\"} %zu\n", arena.held);
+	text_add(&text, "squeezelite_arena_bytes{state=\"used\"} %zu\n", arena.used);
+	text_add(&text, "squeezelite_arena_bytes{state=\"cap\"} %zu\n", arena.cap);
+
+	text_type(&text, "squeezelite_arena_slabs_total", "counter", "Shared buffer arena slab events");
+	text_add(&text, "squeezelite_arena_slabs_total{event=\"borrowed\"} %" PRIu64 "\n", arena.borrowed);
+	text_add(&text, "squeezelite_arena_slabs_total{event=\"reused\"} %" PRIu64 "\n", arena.reused);
+	text_add(&text, "squeezelite_arena_slabs_total{event=\"created\"} %" PRIu64 "\n", arena.created);
+	text_add(&text, "squeezelite_arena_slabs_total{event=\"evicted\"} %" PRIu64 "\n", arena.evicted);
+	text_add(&text, "squeezelite_arena_slabs_total{event=\"fallback\"} %" PRIu64 "\n", arena.fallback);
+
+	// external series, a family is declared only once
+	mutex_lock(metrics.mutex);
+	for (struct metrics_ext_s *ext = externals; ext; ext = ext->next) {
+		struct metrics_ext_s *p;
+		for (p = externals; p != ext && strcmp(p->name, ext->name); p = p->next);
+		if (p != ext) continue;
+		text_type(&text, ext->name, "histogram", ext->help);
+		for (p = ext; p; p = p->next) if (!strcmp(p->name, ext->name)) text_hist(&text, p->name, p->labels, &p->hist);
+	}
+	mutex_unlock(metrics.mutex);
+
+	return text.buf;
+}
+
+/*---------------------------------------------------------------------------*/
+static void metrics_serve(int sock) {
+	char *body = NULL, *request = NULL, *head;
+	key_data_t headers[64];
+	int len;
+
+	// sockets are blocking here, don't let a client stall us forever
+	struct timeval timeout = { 2, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*) &timeout, sizeof(timeout));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*) &timeout, sizeof(timeout));
+
+	if (!http_parse_simple(sock, &request, headers, &body, &len)) {
+		LOG_WARN("metrics http parsing error %s", request);
+		NFREE(body);
+		NFREE(request);
+		kd_free(headers);
+		return;
+	}
+
+	LOG_DEBUG("metrics request %s", request);
+
+	if (strncmp(request, "GET /metrics", 12)) {
+		head = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+		send(sock, head, strlen(head), MSG_NOSIGNAL);
+	} else {
+		// from now on, we measure
+		metrics.last = gettime_ms();
+		if (!metrics_on) LOG_INFO("metrics collection started");
+		metrics_on = true;
+
+		char response[256], *text = metrics_build();
+		len = text ? strlen(text) : 0;
+		snprintf(response, sizeof(response), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", len);
+		send(sock, response, strlen(response), MSG_NOSIGNAL);
+		if (len) send(sock, text, len, MSG_NOSIGNAL);
+		NFREE(text);
+	}
+
+	NFREE(body);
+	NFREE(request);
+	kd_free(headers);
+}
+
+/*---------------------------------------------------------------------------*/
+static void *metrics_thread(void *arg) {
+	while (metrics.running) {
+		fd_set rfds;
+		struct timeval timeout = { 1, 0 };
+
+		FD_ZERO(&rfds);
+		FD_SET(metrics.sock, &rfds);
+
+		// stop measuring if nobody is looking
+		if (metrics_on && gettime_ms() - metrics.last > METRICS_LINGER) {
+			LOG_INFO("metrics collection stopped");
+			metrics_on = false;
+		}
+
+		if (select(metrics.sock + 1, &rfds, NULL, NULL, &timeout) <= 0) continue;
+
+		int sock = accept(metrics.sock, NULL, NULL);
+		if (sock < 0) continue;
+
+		set_block(sock);
+		metrics_serve(sock);
+		shutdown_socket(sock);
+	}
+
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+void metrics_init(void) {
+	struct in_addr host = { INADDR_ANY };
+	static bool once;
+
+	if (!once) mutex_create(metrics.mutex);
+	once = true;
+
+	// same range as output sessions, they'll just skip this one
+	metrics.sock = -1;
+	metrics.port = sq_local_port;
+	for (int i = 0; i < 2 * MAX_PLAYER && metrics.sock <= 0; i++) {
+		metrics.sock = bind_socket(host, &metrics.port, SOCK_STREAM);
+		if (metrics.sock <= 0) metrics.port++;
+	}
+
+	if (metrics.sock <= 0 || listen(metrics.sock, 4)) {
+		LOG_ERROR("can't create metrics listener");
+		if (metrics.sock > 0) closesocket(metrics.sock);
+		metrics.sock = -1;
+		return;
+	}
+
+	metrics.running = true;
+	pthread_create(&metrics.thread, NULL, metrics_thread, NULL);
+
+	LOG_INFO("metrics available at http://%s:%hu/metrics", inet_ntoa(sq_local_host), metrics.port);
+}
+
+/*---------------------------------------------------------------------------*/
+void metrics_end(void) {
+	if (metrics.running) {
+		metrics.running = false;
+		pthread_join(metrics.thread, NULL);
+		closesocket(metrics.sock);
+	}
+
+	// mutex is kept as other modules might unregister after us
+	metrics_on = false;
+}
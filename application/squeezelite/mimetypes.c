@@ -236,7 +236,7 @@ char mimetype_to_format(char *mimetype) {
 }
 
 /*---------------------------------------------------------------------------*/
-char* format_to_dlna(char format, bool full_cache, bool live) {
+char* format_to_dlna(char format, bool full_cache, bool live, bool time_seek) {
 	char* buf, * DLNAOrgPN;
 
 	switch (format) {
@@ -264,7 +264,9 @@ char* format_to_dlna(char format, bool full_cache, bool live) {
 	 * don't have access to it until we have received full content. As it is supposed to 
 	 * represent what is accessible, not the media, we'll always set it. We can still use
 	 * in-memory cache, so b29 shall be set (then OP shall not be). If user has opted-out 
-	 * file-cache, we can only do b29. In any case, we don't support time-based seek */
+	 * file-cache, we can only do b29. Time-based seek is only possible when the codec has
+	 * indexed what it sent (see seektable) and then it's limited to what is in cache, so 
+	 * it's b30 and never OP */
 
 	uint32_t org_op = full_cache ? DLNA_ORG_OPERATION_RANGE : 0;
 	uint32_t org_flags = DLNA_ORG_FLAG_STREAMING_TRANSFERT_MODE | DLNA_ORG_FLAG_BACKGROUND_TRANSFERT_MODE |
@@ -273,6 +275,7 @@ char* format_to_dlna(char format, bool full_cache, bool live) {
 
 	if (live) org_flags |= DLNA_ORG_FLAG_S0_INCREASE;
 	if (!full_cache) org_flags |= DLNA_ORG_FLAG_BYTE_BASED_SEEK;
+	if (time_seek) org_flags |= DLNA_ORG_FLAG_TIME_BASED_SEEK;
 
 	(void)!asprintf(&buf, "%sDLNA.ORG_OP=%02u;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=%08x000000000000000000000000",
 						   DLNAOrgPN, org_op, org_flags);
@@ -0,0 +1,310 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *  (c) Philippe, philippe_44@outlook.com for raop/multi-instance modifications
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Streaming mp4 demuxer shared by mp4 based codecs. Boxes are walked as they arrive
+ * in streambuf and codecs are called for the ones they want in full (esds, alac...).
+ * The sample size table (stsz) is acquired as it comes so it can be larger than
+ * streambuf, it is stored in blocks of 16 bits sizes (unless one does not fit) and
+ * blocks are released as samples are consumed. When mdat comes before moov, the
+ * stream is re-opened with a range request on moov and then on mdat once moov has
+ * been parsed, which requires the source to support ranges */
+
+#include "squeezelite.h"
+
+#define MP4_BLOCK	4096
+
+// a block is allocated for u16_t sizes and replaced by one for u32_t when needed
+struct mp4_block_s {
+	bool wide;
+	u32_t sizes[];
+};
+
+#define NARROW(block)	((u16_t*) (block)->sizes)
+
+extern log_level decode_loglevel;
+static log_level *loglevel = &decode_loglevel;
+
+static void stsz_free(struct mp4_s *mp4);
+
+/*---------------------------------------------------------------------------*/
+static bool stsz_open(struct mp4_s *mp4, u32_t size, u32_t count) {
+	stsz_free(mp4);
+
+	mp4->stsz.size = size;
+	mp4->stsz.count = count;
+	mp4->stsz.left = size ? 0 : count;
+
+	if (mp4->stsz.left) {
+		mp4->stsz.blocks = calloc(count / MP4_BLOCK + 1, sizeof(struct mp4_block_s*));
+		if (!mp4->stsz.blocks) return false;
+	}
+
+	LOG_INFO("frame table of %u entries (size %u)", count, size);
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool stsz_fill(struct mp4_s *mp4, u8_t *ptr, u32_t n) {
+	for (; n--; ptr += 4) {
+		struct mp4_block_s **block = mp4->stsz.blocks + mp4->stsz.filled / MP4_BLOCK;
+		u32_t i = mp4->stsz.filled % MP4_BLOCK, size = unpackN((u32_t*) ptr);
+
+		if (!*block) {
+			*block = malloc(sizeof(struct mp4_block_s) + MP4_BLOCK * sizeof(u16_t));
+			if (!*block) return false;
+			(*block)->wide = false;
+		}
+
+		// a size does not fit in 16 bits, widen the whole block
+		if (size > 0xffff && !(*block)->wide) {
+			struct mp4_block_s *wide = malloc(sizeof(struct mp4_block_s) + MP4_BLOCK * sizeof(u32_t));
+			if (!wide) return false;
+			for (u32_t j = 0; j < i; j++) wide->sizes[j] = NARROW(*block)[j];
+			wide->wide = true;
+			free(*block);
+			*block = wide;
+		}
+
+		if ((*block)->wide) (*block)->sizes[i] = size;
+		else NARROW(*block)[i] = size;
+
+		mp4->stsz.filled++;
+		mp4->stsz.left--;
+	}
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+static void stsz_free(struct mp4_s *mp4) {
+	if (mp4->stsz.blocks) {
+		for (u32_t i = 0; i <= mp4->stsz.count / MP4_BLOCK; i++) free(mp4->stsz.blocks[i]);
+		free(mp4->stsz.blocks);
+	}
+	memset(&mp4->stsz, 0, sizeof(mp4->stsz));
+}
+
+/*---------------------------------------------------------------------------*/
+static bool wanted(char *boxes, char *type) {
+	for (char *p = boxes; p && (p = strstr(p, type)) != NULL; p++) {
+		if ((p == boxes || p[-1] == ',') && (p[4] == ',' || p[4] == '\0')) return true;
+	}
+	return false;
+}
+
+/*---------------------------------------------------------------------------*/
+static void unwrap(struct buffer *buf, size_t cont) {
+	// can only be done once we have all the data
+	if (_buf_used(buf) >= cont) _buf_unwrap(buf, cont);
+}
+
+/*---------------------------------------------------------------------------*/
+static int mdat_resume(struct mp4_s *mp4, struct thread_ctx_s *ctx) {
+	mp4->moov_end = 0;
+
+	if (!mp4->play) {
+		LOG_ERROR("[%p]: no playable track found after mdat", ctx);
+		return -1;
+	}
+
+	// now that we have moov, fetch mdat only
+	if (!_stream_range(mp4->mdat, mp4->mdat + mp4->mdat_len - 1, ctx)) {
+		LOG_ERROR("[%p]: can't go back to mdat at %" PRIu64, ctx, mp4->mdat);
+		return -1;
+	}
+
+	mp4->pos = mp4->mdat;
+	LOG_INFO("[%p]: back to mdat at %" PRIu64 " (len: %" PRIu64 ")", ctx, mp4->mdat, mp4->mdat_len);
+
+	return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+void mp4_open(struct mp4_s *mp4, char *boxes, mp4_parse_t parse) {
+	stsz_free(mp4);
+	memset(mp4, 0, sizeof(struct mp4_s));
+	mp4->boxes = boxes;
+	mp4->parse = parse;
+}
+
+/*---------------------------------------------------------------------------*/
+void mp4_close(struct mp4_s *mp4) {
+	stsz_free(mp4);
+}
+
+/*---------------------------------------------------------------------------*/
+u32_t mp4_sample_size(struct mp4_s *mp4) {
+	u32_t index = mp4->stsz.index;
+
+	if (index >= mp4->stsz.count) return 0;
+	if (mp4->stsz.size) return mp4->stsz.size;
+	if (index >= mp4->stsz.filled) return 0;
+
+	struct mp4_block_s *block = mp4->stsz.blocks[index / MP4_BLOCK];
+	return block->wide ? block->sizes[index % MP4_BLOCK] : NARROW(block)[index % MP4_BLOCK];
+}
+
+/*---------------------------------------------------------------------------*/
+void mp4_sample_next(struct mp4_s *mp4) {
+	if (mp4->stsz.index >= mp4->stsz.count) return;
+
+	// release blocks that have been fully consumed
+	if (++mp4->stsz.index % MP4_BLOCK == 0 && mp4->stsz.blocks) {
+		NFREE(mp4->stsz.blocks[mp4->stsz.index / MP4_BLOCK - 1]);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+// returns 1 when positioned at start of mdat data, 0 when more data is needed, -1 on error
+int _mp4_header(struct mp4_s *mp4, struct thread_ctx_s *ctx) {
+	struct buffer *buf = ctx->streambuf;
+	size_t bytes = min(_buf_used(buf), _buf_cont_read(buf));
+	char type[5];
+
+	// moov was after mdat and has been fully parsed
+	if (mp4->moov_end && mp4->pos >= mp4->moov_end) return mdat_resume(mp4, ctx);
+
+	// nothing more will come
+	if (ctx->stream.state <= DISCONNECT && !_buf_used(buf)) {
+		LOG_ERROR("[%p]: stream ended while parsing header", ctx);
+		return -1;
+	}
+
+	while (bytes >= 8 || (mp4->stsz.left && bytes >= 4)) {
+		u64_t len, consume;
+		size_t header = 8;
+
+		// sample size table is acquired as it comes
+		if (mp4->stsz.left) {
+			u32_t n = min(mp4->stsz.left, bytes / 4);
+			if (!stsz_fill(mp4, buf->readp, n)) {
+				LOG_ERROR("[%p]: can't allocate frame table", ctx);
+				return -1;
+			}
+			_buf_inc_readp(buf, n * 4);
+			mp4->pos += n * 4;
+			bytes -= n * 4;
+			continue;
+		}
+
+		len = unpackN((u32_t*) buf->readp);
+		memcpy(type, buf->readp + 4, 4);
+		type[4] = '\0';
+
+		// 64 bits length
+		if (len == 1) {
+			if (bytes < 16) break;
+			len = ((u64_t) unpackN((u32_t*) (buf->readp + 8)) << 32) | unpackN((u32_t*) (buf->readp + 12));
+			header = 16;
+		}
+
+		// count trak to find the first playable one
+		if (!strcmp(type, "moov")) {
+			mp4->trak = 0;
+			mp4->play = 0;
+			if (mp4->mdat) mp4->moov_end = mp4->pos + len;
+		}
+		if (!strcmp(type, "trak")) {
+			mp4->trak++;
+		}
+
+		// let codec parse what it wants, it has to be all in the buffer
+		if (wanted(mp4->boxes, type) && bytes > len) {
+			if (mp4->parse(mp4, type, buf->readp, len, ctx) < 0) return -1;
+		}
+
+		// found media data
+		if (!strcmp(type, "mdat")) {
+			_buf_inc_readp(buf, header);
+			mp4->pos += header;
+
+			if (mp4->play) {
+				LOG_DEBUG("[%p]: type: mdat len: %" PRIu64 " pos: %" PRIu64, ctx, len, mp4->pos);
+				return 1;
+			} else if (!mp4->mdat && len > header) {
+				// moov must be after mdat, so skip over (range) and come back later
+				mp4->mdat = mp4->pos;
+				mp4->mdat_len = len - header;
+				if (_stream_range(mp4->mdat + mp4->mdat_len, 0, ctx)) {
+					mp4->pos = mp4->mdat + mp4->mdat_len;
+					LOG_INFO("[%p]: mdat before moov, fetching moov at %" PRIu64, ctx, mp4->pos);
+					return 0;
+				}
+			}
+
+			LOG_ERROR("[%p]: type: mdat len: %" PRIu64 ", no playable track found", ctx, len);
+			return -1;
+		}
+
+		// default to consuming entire box
+		consume = len;
+
+		// sample size table of playable track, read header only and then acquire entries
+		if (!strcmp(type, "stsz") && mp4->play && mp4->play == mp4->trak) {
+			if (bytes < 20) {
+				unwrap(buf, 20);
+				break;
+			}
+			if (!stsz_open(mp4, unpackN((u32_t*) (buf->readp + 12)), unpackN((u32_t*) (buf->readp + 16)))) {
+				LOG_ERROR("[%p]: can't allocate frame table", ctx);
+				return -1;
+			}
+			consume = 20;
+		}
+
+		// read into these boxes so reduce consume
+		if (!strcmp(type, "moov") || !strcmp(type, "trak") || !strcmp(type, "mdia") || !strcmp(type, "minf") || !strcmp(type, "stbl") ||
+			!strcmp(type, "udta") || !strcmp(type, "ilst")) {
+			consume = header;
+		}
+		// special cases which mix mix data in the enclosing box which we want to read into
+		if (!strcmp(type, "stsd")) consume = 16;
+		if (!strcmp(type, "mp4a")) consume = 36;
+		if (!strcmp(type, "meta")) consume = 12;
+
+		// consume rest of box if it has been parsed (all in the buffer) or is not one we want to parse
+		if (bytes >= consume) {
+			LOG_DEBUG("[%p]: type: %s len: %" PRIu64 " consume: %" PRIu64, ctx, type, len, consume);
+			_buf_inc_readp(buf, consume);
+			mp4->pos += consume;
+			bytes -= consume;
+		} else if (!wanted(mp4->boxes, type)) {
+			LOG_DEBUG("[%p]: type: %s len: %" PRIu64 " consume: %" PRIu64 " - partial consume: %zu", ctx, type, len, consume, bytes);
+			_buf_inc_readp(buf, bytes);
+			mp4->pos += bytes;
+			mp4->consume = consume - bytes;
+			break;
+		} else if (len >= buf->size) {
+			// can't process an atom larger than streambuf!
+			LOG_ERROR("[%p]: atom %s too large for buffer %" PRIu64 " %zu", ctx, type, len, buf->size);
+			return -1;
+		} else {
+			// make sure we have 'len' contiguous space in streambuf (large headers)
+			unwrap(buf, len);
+			break;
+		}
+	}
+
+	// next box header might be wrapped
+	if (bytes < 16) unwrap(buf, 16);
+
+	return 0;
+}
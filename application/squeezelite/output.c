@@ -31,8 +31,8 @@
 extern log_level	output_loglevel;
 static log_level 	*loglevel = &output_loglevel;
 
-#define LOCK_O 	 mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(ctx->outputbuf->mutex)
+#define LOCK_O 	 metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
 
 #if PROCESS
 #define IF_DIRECT(x)    if (ctx->decode.direct) { x }
@@ -42,17 +42,42 @@ static log_level 	*loglevel = &output_loglevel;
 #define IF_PROCESS(x)
 #endif
 
+// fade gain is (position << 16) / duration, stepped exactly frame by frame
+struct fade_ramp_s {
+	u32_t gain, dur;
+	s32_t rem, step, rstep;
+};
+
 static size_t 	gain_and_fade(size_t frames, u8_t shift, struct thread_ctx_s *ctx);
 static void 	lpcm_pack(u8_t *dst, u8_t *src, size_t bytes, u8_t channels, int endian);
-static void 	apply_gain(s32_t *iptr, u32_t fade, u32_t gain, u8_t shift, size_t frames);
-static void 	apply_cross(struct buffer *outputbuf, s32_t *cptr, u32_t fade,
+static void 	fade_ramp(struct fade_ramp_s *ramp, frames_t pos, frames_t dur, bool up);
+static void 	apply_gain(s32_t *iptr, struct fade_ramp_s *fade, u32_t gain, u8_t shift, size_t frames);
+static void 	apply_cross(struct buffer *outputbuf, s32_t *cptr, struct fade_ramp_s *fade,
 							u32_t gain_in, u32_t gain_out, u8_t shift, size_t frames);
 static void 	scale_and_pack(void *dst, u32_t *src, size_t frames, u8_t channels,
 							   u8_t sample_size, int endian);
+static void 	store_write(spool_t *store, struct buffer *buf, u8_t *writep);
 #if CODECS
 static void 	to_mono(s32_t *iptr,  size_t frames);
 static int 		shine_make_config_valid(int freq, int *bitr);
 static FLAC__StreamEncoderWriteStatus flac_write_callback(const FLAC__StreamEncoder *encoder, const FLAC__byte buffer[], size_t bytes, unsigned samples, unsigned current_frame, void *client_data);
+static void 	flac_pool_init(void);
+static void 	flac_pool_end(void);
+static struct flac_mt_s* flac_mt_open(unsigned level, unsigned blocksize, struct thread_ctx_s *ctx);
+static void 	flac_mt_close(struct flac_mt_s *mt);
+static size_t 	flac_mt_room(struct flac_mt_s *mt);
+static void 	flac_mt_process(struct flac_mt_s *mt, s32_t *iptr, size_t frames);
+static bool 	flac_mt_drain(struct flac_mt_s *mt, struct buffer *obuf, bool flush);
+static FLAC__StreamEncoderWriteStatus encoder_flac_write(const FLAC__StreamEncoder *encoder, const FLAC__byte buffer[], size_t bytes, unsigned samples, unsigned current_frame, void *client_data);
+static struct encoder_s *encoder_open(size_t block, struct thread_ctx_s *ctx);
+static bool 	encoder_start(struct encoder_s *enc);
+static void 	encoder_stop(struct encoder_s *enc);
+static void 	encoder_finish(struct encoder_s *enc);
+static void 	encoder_close(struct encoder_s *enc);
+static void 	encoder_destroy(struct encoder_s *enc);
+static size_t 	encoder_space(struct encoder_s *enc);
+static void 	encoder_feed(struct encoder_s *enc, u8_t *src, size_t frames);
+static bool 	encoder_collect(struct encoder_s *enc, struct buffer *obuf);
 
 struct aac_private {
 	unsigned long in_samples, out_max_bytes;
@@ -84,8 +109,15 @@ static struct {
 #define FLAC_MAX_FRAMES	4096
 #define FLAC_MIN_SPACE	(FLAC_MAX_FRAMES * BYTES_PER_FRAME)
 
+// parallel FLAC: jobs in flight per stream, FLAC blocks per job (~1s) and max workers
+#define FLAC_MT_JOBS		8
+#define FLAC_MT_BLOCKS_MIN	4
+#define FLAC_MT_BLOCKS_MAX	16
+#define FLAC_MT_WORKERS		8
+
 #define DRAIN_LEN		3
-#define MAX_FRAMES_SEC 	10
+#define CROSS_FRAMES	256
+#define SEEKPOINT_INTERVAL	1	// in seconds
 
 #if LINKALL
 #define FLAC(h, fn, ...) (FLAC__ ## fn)(__VA_ARGS__)
@@ -184,9 +216,19 @@ static void little32(void *dst, u32_t src);
 static void big16(void *dst, u16_t src);
 static void big32(void *dst, u32_t src);
 
+/*---------------------------------------------------------------------------*/
+static void store_write(spool_t *store, struct buffer *buf, u8_t *writep) {
+	size_t bytes = buf->writep >= writep ? buf->writep - writep : buf->size - (writep - buf->writep);
+	size_t out = min(bytes, (size_t) (_buf_end(buf) - writep));
+
+	// a mirrored buffer never needs the second write, capture drops what disk can't take
+	size_t stored = spool_write(store, writep, out);
+	if (bytes > out) stored += spool_write(store, buf->buf, bytes - out);
+	if (stored < bytes) LOG_DEBUG("capture dropped %zu bytes", bytes - stored);
+}
 
 /*---------------------------------------------------------------------------*/
-bool _output_fill(struct buffer *buf, FILE *store, struct thread_ctx_s *ctx) {
+bool _output_fill(struct buffer *buf, spool_t *store, struct thread_ctx_s *ctx) {
 	size_t bytes = _buf_space(buf);
 	u8_t *writep = buf->writep;
 	struct outputstate *p = &ctx->output;
@@ -214,7 +256,7 @@ bool _output_fill(struct buffer *buf, FILE *store, struct thread_ctx_s *ctx) {
 		bytes = min(p->header.count, _buf_cont_write(buf));
 		memcpy(buf->writep, p->header.buffer + p->header.size - p->header.count, bytes);
 		_buf_inc_writep(buf, bytes);
-		if (store) fwrite(p->header.buffer + p->header.size - p->header.count, bytes, 1, store);
+		if (store) spool_write(store, p->header.buffer + p->header.size - p->header.count, bytes);
 		p->header.count -= bytes;
 
 		if (!p->header.count) {
@@ -257,6 +299,13 @@ bool _output_fill(struct buffer *buf, FILE *store, struct thread_ctx_s *ctx) {
 		// outputbuf is processed by BYTES_PER_FRAMES multiples => aligns fine
 		in = min(_buf_used(ctx->outputbuf), _buf_cont_read(ctx->outputbuf));
 
+#if CODECS
+		// parallel FLAC and encoder thread have data to deliver even when there is no more audio
+		if (p->encode.mode == ENCODE_FLAC && p->encode.codec_private &&
+			flac_mt_drain(p->encode.codec_private, buf, !in && ctx->decode.state > DECODE_RUNNING) && !in) return true;
+		if (p->encode.encoder && encoder_collect(p->encode.encoder, buf) && !in) return true;
+#endif
+
 		// no bytes may mean end of audio data - need at least one frame
 		if (!in) return false;
 		else if (in < BYTES_PER_FRAME) return true;
@@ -280,7 +329,6 @@ bool _output_fill(struct buffer *buf, FILE *store, struct thread_ctx_s *ctx) {
 
 			in = min(in, _buf_cont_read(ctx->outputbuf));
 			frames = min(in / BYTES_PER_FRAME, out / bytes_per_frame);
-			frames = min(frames, p->encode.sample_rate / MAX_FRAMES_SEC);
 
 			// L24_PCM and one frame or previous odd frames to process
 			if (p->encode.buffer && p->encode.count == 1) frames = 1;
@@ -321,90 +369,36 @@ bool _output_fill(struct buffer *buf, FILE *store, struct thread_ctx_s *ctx) {
 			if (optr == obuf) _buf_write(buf, optr, bytes_per_frame * process);
 			else _buf_inc_writep(buf, process * bytes_per_frame);
 #if CODECS
-		} else if (p->encode.mode == ENCODE_FLAC) {
+		} else if (p->encode.encoder) {
 			if (!p->encode.codec) return false;
 
-			// make sure FLAC has enough space to proceed
-			if (_buf_space(buf) < FLAC_MIN_SPACE) return true;
-
-			// FLAC can take a little as one frame, just need the cont'd space
-			frames = min(in / BYTES_PER_FRAME, FLAC_MAX_FRAMES);
-			frames = min(frames, p->encode.sample_rate / MAX_FRAMES_SEC);
+			// encoder thread does the work, just hand over as much as it can take
+			frames = encoder_space(p->encode.encoder);
+			frames = min(in / BYTES_PER_FRAME, frames);
 
 			// fading & gain
-			frames = gain_and_fade(frames, 32 - p->encode.sample_size, ctx);
+			frames = gain_and_fade(frames, p->encode.mode == ENCODE_FLAC ? 32 - p->encode.sample_size : 0, ctx);
 
 			// see comment in gain_and_fade
 			if (!frames) return true;
 
-			if (p->encode.channels == 1) to_mono((s32_t*) ctx->outputbuf->readp, frames);
-			FLAC(f, stream_encoder_process_interleaved, p->encode.codec, (FLAC__int32*) ctx->outputbuf->readp, frames);
-		} else if (p->encode.mode == ENCODE_MP3) {
-			if (!p->encode.codec) return false;
-
-			// this is the number of samples per channel (so number of frames...)
-			int block = shine_samples_per_pass(p->encode.codec);
-
-			// make sure we have enough space in output (assume 1:1 ratio ...)
-			if (_buf_space(buf) < SHINE_MAX_SAMPLES * 2) return true;
-
-			frames = min(in / BYTES_PER_FRAME, block - p->encode.count);
-			frames = min(frames, p->encode.sample_rate / MAX_FRAMES_SEC);
-
-			// fading & gain
-			frames = gain_and_fade(frames, 0, ctx);
-
-			// see comment in gain_and_fade
-			if (!frames) return true;
-
-			// aggregate the data in interim buffer
-			s32_t *iptr = (s32_t*) ctx->outputbuf->readp;
-			s16_t* optr = (s16_t*) p->encode.buffer + p->encode.count * p->encode.channels;
-			if (p->encode.channels == 2) for (int i = 0; i < frames * 2; i++) *optr++ = *iptr++ >> 16;
-			else for (int i = 0; i < frames; i++) *optr++ = iptr[2*i] >> 16;
-			p->encode.count += frames;
-
-			// full block available, encode it
-			if (p->encode.count == block) {
-				int bytes;
-
-				p->encode.count = 0;
-				u8_t* data = shine_encode_buffer_interleaved(p->encode.codec, (s16_t*) p->encode.buffer, &bytes);
-				_buf_write(buf, data, bytes);
-			}
-		 } else if (p->encode.mode == ENCODE_AAC) {
-#if LINKALL
-			if (!p->encode.codec) return false;
-
-			struct aac_private* aac = (struct aac_private*)p->encode.codec_private;
-
-			// make sure we have enough space in output
-			if (_buf_space(buf) < aac->out_max_bytes) return true;
+			encoder_feed(p->encode.encoder, ctx->outputbuf->readp, frames);
+		} else if (p->encode.mode == ENCODE_FLAC) {
+			if (!p->encode.codec || !p->encode.codec_private) return false;
 
-			frames = min(in / BYTES_PER_FRAME, (aac->in_samples / p->encode.channels) - p->encode.count);
-			frames = min(frames, p->encode.sample_rate / MAX_FRAMES_SEC);
+			/* FLAC can take a little as one frame, but all jobs might be busy. There is no
+			 * FLAC_MIN_SPACE check on buf as jobs keep what it can't take for flac_mt_drain */
+			frames = min(in / BYTES_PER_FRAME, FLAC_MAX_FRAMES);
+			frames = min(frames, flac_mt_room(p->encode.codec_private));
 
 			// fading & gain
-			frames = gain_and_fade(frames, 0, ctx);
+			frames = gain_and_fade(frames, 32 - p->encode.sample_size, ctx);
 
 			// see comment in gain_and_fade
 			if (!frames) return true;
 
-			// aggregate the data in interim buffer
-			s32_t* iptr = (s32_t*)ctx->outputbuf->readp;
-			s16_t *optr = (s16_t*)p->encode.buffer + p->encode.count * p->encode.channels;
-			if (p->encode.channels == 2) for (int i = 0; i < frames * 2; i++) *optr++ = *iptr++ >> 16;
-			else for (int i = 0; i < frames; i++) *optr++ = iptr[2 * i] >> 16;
-			p->encode.count += frames;
-
-			// full block available, encode it
-			if (p->encode.count == aac->in_samples / p->encode.channels) {	
-				// we could avoid the interim output but that means more passes
-				int bytes = faacEncEncode(p->encode.codec, (int32_t*) p->encode.buffer, p->encode.count * p->encode.channels, aac->buffer, aac->out_max_bytes);
-				_buf_write(buf, aac->buffer, bytes);
-				p->encode.count = 0;
-			}
-#endif
+			if (p->encode.channels == 1) to_mono((s32_t*) ctx->outputbuf->readp, frames);
+			flac_mt_process(p->encode.codec_private, (s32_t*) ctx->outputbuf->readp, frames);
 #endif
 		}
 
@@ -413,18 +407,13 @@ bool _output_fill(struct buffer *buf, FILE *store, struct thread_ctx_s *ctx) {
 		LOG_SDEBUG("[%p]: processed %u frames", ctx, frames);
 	}
 
-	if (store) {
-		size_t out, bytes = (buf->writep - writep) % buf->size;
-		out = min(bytes, buf->wrap - writep);
-		fwrite(writep, out, 1, store);
-		fwrite(buf->buf, bytes - out, 1, store);
-	}
+	if (store) store_write(store, buf, writep);
 
 	return (bytes != 0);
 }
 
 /*---------------------------------------------------------------------------*/
-void _output_new_stream(struct buffer *obuf, FILE *store, struct thread_ctx_s *ctx) {
+void _output_new_stream(struct buffer *obuf, spool_t *store, struct thread_ctx_s *ctx) {
 	struct outputstate *out = &ctx->output;
 	u8_t *writep = obuf->writep;
 	int bitrate;
@@ -514,23 +503,42 @@ void _output_new_stream(struct buffer *obuf, FILE *store, struct thread_ctx_s *c
 		double ratio[] = { 0.8, 0.79, 0.78, 0.75, 0.72, 0.71, 0.70, 0.68, 0.65 };
 		bitrate = (out->encode.channels * out->encode.sample_size * out->encode.sample_rate * ratio[level]) / 1000;
 
+		// this is what libFLAC would choose but parallel encoding needs to know it
+		unsigned blocksize = level < 3 ? 1152 : 4096;
+
 		FLAC__StreamEncoder* codec = FLAC(f, stream_encoder_new);
 		bool ok = FLAC(f, stream_encoder_set_verify,codec, false);
 		ok &= FLAC(f, stream_encoder_set_compression_level, codec, level);
 		ok &= FLAC(f, stream_encoder_set_channels, codec, out->encode.channels);
 		ok &= FLAC(f, stream_encoder_set_bits_per_sample, codec, out->encode.sample_size);
 		ok &= FLAC(f, stream_encoder_set_sample_rate, codec, out->encode.sample_rate);
-		ok &= FLAC(f, stream_encoder_set_blocksize, codec, 0);
+		ok &= FLAC(f, stream_encoder_set_blocksize, codec, blocksize);
 		ok &= FLAC(f, stream_encoder_set_streamable_subset, codec, false);
 		if (!out->encode.flow) ok &= FLAC(f, stream_encoder_set_total_samples_estimate, codec,
 										  (out->encode.sample_rate * (u64_t) out->duration + 10) / 1000);
-		ok &= !FLAC(f, stream_encoder_init_stream, codec, flac_write_callback, NULL, NULL, NULL, obuf);
+
+		/* with workers, this encoder only writes the stream header. Light encoding runs in
+		 * the encoder thread and flow can't wait for a partial job to be flushed */
+		bool parallel = !out->encode.flow && (level > 5 || out->encode.sample_rate > 96000);
+		out->encode.codec_private = parallel ? flac_mt_open(level, blocksize, ctx) : NULL;
+		if (!out->encode.codec_private) {
+			out->encode.encoder = encoder_open(0, ctx);
+			ok &= out->encode.encoder != NULL;
+		}
+
+		if (out->encode.encoder) ok &= !FLAC(f, stream_encoder_init_stream, codec, encoder_flac_write, NULL, NULL, NULL, out->encode.encoder);
+		else ok &= !FLAC(f, stream_encoder_init_stream, codec, flac_write_callback, NULL, NULL, NULL, obuf);
+		if (ok && out->encode.encoder) ok = encoder_start(out->encode.encoder);
+
 		if (ok) {
 			out->encode.codec = (void*) codec;
-			LOG_INFO("[%p]: FLAC-%u encoding r:%u s:%u c:%u", ctx, level, out->encode.sample_rate, 
-					 out->encode.sample_size, out->encode.channels);
+			LOG_INFO("[%p]: FLAC-%u encoding r:%u s:%u c:%u (parallel:%u)", ctx, level, out->encode.sample_rate, 
+					 out->encode.sample_size, out->encode.channels, out->encode.codec_private != NULL);
 		}
 		else {
+			if (out->encode.codec_private) flac_mt_close(out->encode.codec_private);
+			if (out->encode.encoder) encoder_close(out->encode.encoder);
+			out->encode.codec_private = out->encode.encoder = NULL;
 			FLAC(f, stream_encoder_delete, codec);
 			LOG_ERROR("[%p]: failed initializing flac-%u r:%u s:%u c:%u", ctx, level, out->encode.sample_rate,
 					  out->encode.sample_size, out->encode.channels);
@@ -551,13 +559,18 @@ void _output_new_stream(struct buffer *obuf, FILE *store, struct thread_ctx_s *c
 		// first make sure we find a solution
 		shine_make_config_valid(config.wave.samplerate, &config.mpeg.bitr);
 
-		out->encode.count = 0;
 		out->encode.codec = (void*) shine_initialise(&config);
 		if (out->encode.codec) {
-			out->encode.buffer = malloc(shine_samples_per_pass(out->encode.codec) * out->encode.channels * 2);
+			out->encode.encoder = encoder_open(shine_samples_per_pass(out->encode.codec) * out->encode.channels * 2, ctx);
+		}
+
+		if (out->encode.encoder && encoder_start(out->encode.encoder)) {
 			LOG_INFO("[%p]: MP3-%u encoding r:%u s:%u c:%u", ctx,config.mpeg.bitr, out->encode.sample_rate,
 					 out->encode.sample_size, out->encode.channels);
 		} else {
+			if (out->encode.encoder) encoder_close(out->encode.encoder);
+			if (out->encode.codec) shine_close(out->encode.codec);
+			out->encode.encoder = out->encode.codec = NULL;
 			LOG_ERROR("[%p]: failed initializing MP3-%u r:%u s:%u c:%u", ctx, config.mpeg.bitr, out->encode.sample_rate,
 					  out->encode.sample_size, out->encode.channels);
 		}
@@ -570,11 +583,8 @@ void _output_new_stream(struct buffer *obuf, FILE *store, struct thread_ctx_s *c
 
 		out->encode.codec = (void*) faacEncOpen(out->encode.sample_rate, out->encode.channels, &aac->in_samples, &aac->out_max_bytes);
 		out->encode.codec_private = aac;
-		out->encode.count = 0;
 
 		if (out->encode.codec) {
-			// in_samples is the *total* number of samples, not frames and we use 16 bits for aac
-			out->encode.buffer = malloc(aac->in_samples * 2);
 			aac->buffer = malloc(aac->out_max_bytes);
 
 			faacEncConfigurationPtr format = faacEncGetCurrentConfiguration(out->encode.codec);
@@ -585,9 +595,20 @@ void _output_new_stream(struct buffer *obuf, FILE *store, struct thread_ctx_s *c
 			format->inputFormat = FAAC_INPUT_16BIT;
 			faacEncSetConfiguration(out->encode.codec, format);
 
+			// in_samples is the *total* number of samples, not frames and we use 16 bits for aac
+			out->encode.encoder = encoder_open(aac->in_samples * 2, ctx);
+		}
+
+		if (out->encode.encoder && encoder_start(out->encode.encoder)) {
 			LOG_INFO("[%p]: AAC-%u encoding r:%u s:%u c:%u", ctx, bitrate, out->encode.sample_rate, 
 					 out->encode.sample_size, out->encode.channels);
 		} else {
+			if (out->encode.encoder) encoder_close(out->encode.encoder);
+			if (out->encode.codec) {
+				faacEncClose(out->encode.codec);
+				free(aac->buffer);
+			}
+			out->encode.encoder = out->encode.codec = out->encode.codec_private = NULL;
 			free(aac);
 			LOG_ERROR("[%p]: failed initializing AAC-%u r:%u s:%u c:%u", ctx, bitrate, out->encode.sample_rate,
 					  out->encode.sample_size, out->encode.channels);
@@ -608,45 +629,39 @@ void _output_new_stream(struct buffer *obuf, FILE *store, struct thread_ctx_s *c
 		LOG_INFO("[%p]: HTTP %" PRId64 " (estimated length : %" PRId64 ")", ctx, ctx->config.stream_length, out->length);
 	}
 
-	if (store) {
-		size_t out, bytes = (obuf->writep - writep) % obuf->size;
-		out = min(bytes, obuf->wrap - writep);
-		fwrite(writep, out, 1, store);
-		fwrite(obuf->buf, bytes - out, 1, store);
-	}
+	if (store) store_write(store, obuf, writep);
 }
 
 /*---------------------------------------------------------------------------*/
-void _output_end_stream(struct buffer *buf, struct thread_ctx_s *ctx) {
+// returns false when buf is set and encoders still have data to deliver, call again later
+bool _output_end_stream(struct buffer *buf, struct thread_ctx_s *ctx) {
 	struct outputstate *out = &ctx->output;
 
 #if CODECS
+	/* decoder might have finished after _output_fill last looked at it, so the last partial
+	 * job might not be submitted. Workers will wake us up when they are done */
+	if (buf && out->encode.mode == ENCODE_FLAC && out->encode.codec_private &&
+		flac_mt_drain(out->encode.codec_private, buf, true)) return false;
+
+	/* encoder thread must have encoded and delivered everything, then be stopped before codec
+	 * is touched. Only then can codec be flushed as its last bytes must come last */
+	if (out->encode.encoder) {
+		if (buf && encoder_collect(out->encode.encoder, buf)) return false;
+		encoder_stop(out->encode.encoder);
+	}
+
 	if (out->encode.codec) {
 		if (out->encode.mode == ENCODE_FLAC) {
 			// FLAC is a pain and requires a last encode call
 			LOG_INFO("[%p]: finishing FLAC", ctx);
+			if (out->encode.codec_private) flac_mt_close(out->encode.codec_private);
+			out->encode.codec_private = NULL;
 			if (buf) FLAC(f, stream_encoder_finish, out->encode.codec);
 			FLAC(f, stream_encoder_delete, out->encode.codec);
 			out->encode.codec = NULL;
 		} else if (out->encode.mode == ENCODE_MP3) {
 			LOG_INFO("[%p]: finishing MP3", ctx);
-			if (buf) {
-				int bytes;
-				u8_t* data;
-
-				// code remaining audio
-				if (out->encode.count) {
-					memset(out->encode.buffer + out->encode.count * out->encode.channels * 2,
-						0, (shine_samples_per_pass(out->encode.codec) - out->encode.count) * out->encode.channels * 2);
-					data = shine_encode_buffer_interleaved(out->encode.codec, (s16_t*)out->encode.buffer, &bytes);
-					_buf_write(buf, data, bytes);
-				}
-
-				// final encoder flush
-				data = shine_flush(out->encode.codec, &bytes);
-				_buf_write(buf, data, bytes);
-			}
-
+			if (buf && out->encode.encoder) encoder_finish(out->encode.encoder);
 			shine_close(out->encode.codec);
 			out->encode.codec = NULL;
 		} else if (out->encode.mode == ENCODE_AAC) {
@@ -654,20 +669,7 @@ void _output_end_stream(struct buffer *buf, struct thread_ctx_s *ctx) {
 			LOG_INFO("[%p]: finishing AAC", ctx);
 			struct aac_private* aac = (struct aac_private*)out->encode.codec_private;
 
-			if (buf) {
-				int bytes;
-
-				// code remaining audio
-				if (out->encode.count) {
-					bytes = faacEncEncode(out->encode.codec, (int32_t*) out->encode.buffer, out->encode.count * out->encode.channels, aac->buffer, aac->out_max_bytes);
-					_buf_write(buf, aac->buffer, bytes);
-				}
-
-				// final encoder flush
-				bytes = faacEncEncode(out->encode.codec, NULL, 0, aac->buffer, aac->out_max_bytes);
-				_buf_write(buf, aac->buffer, bytes);
-			}
-
+			if (buf && out->encode.encoder) encoder_finish(out->encode.encoder);
 			faacEncClose(out->encode.codec);
 			free(aac->buffer);
 			free(aac);
@@ -675,12 +677,21 @@ void _output_end_stream(struct buffer *buf, struct thread_ctx_s *ctx) {
 #endif
 		}
 	}
+
+	// codec's last bytes are in data ring, encoder can only be released once it is empty
+	if (out->encode.encoder) {
+		if (buf && encoder_collect(out->encode.encoder, buf)) return false;
+		encoder_close(out->encode.encoder);
+		out->encode.encoder = NULL;
+	}
 #endif
 
 	// free any buffer
 	NFREE(out->encode.buffer);
 	out->encode.count = 0;
 	out->fade_writep = NULL;
+
+	return true;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -695,12 +706,9 @@ bool output_flush(struct thread_ctx_s *ctx, bool full) {
 	if (ctx->output.state != OUTPUT_OFF && full) ctx->output.state = OUTPUT_STOPPED;
 
 	for (int i = 0; i < ARRAY_COUNT(ctx->output_thread); i++) {
-		if (!ctx->output_thread[i].running || (ctx->output_thread[i].lingering && !full)) continue;
-		ctx->output_thread[i].running = false;
-		UNLOCK_O;
-		LOG_INFO("[%p]: joining thread index:%d (slot:%d)", ctx, ctx->output_thread[i].index, ctx->output_thread[i].slot);
-		pthread_join(ctx->output_thread[i].thread, NULL);
-		LOCK_O;
+		if (!ctx->output_thread[i].active || (ctx->output_thread[i].lingering && !full)) continue;
+		LOG_INFO("[%p]: stopping session index:%d (slot:%d)", ctx, ctx->output_thread[i].index, ctx->output_thread[i].slot);
+		_output_stop(ctx, ctx->output_thread + i);
 	}
 
 	// this should only be done upon full flush, not just streaming
@@ -721,7 +729,7 @@ bool output_flush(struct thread_ctx_s *ctx, bool full) {
 	NFREE(ctx->output.header.buffer);
 	output_free_icy(ctx);
 	_output_end_stream(NULL, ctx);
-	_buf_resize(ctx->outputbuf, OUTPUTBUF_IDLE_SIZE);
+	_buf_resize_budget(ctx->outputbuf, OUTPUTBUF_IDLE_SIZE, OUTPUTBUF_IDLE_SIZE);
 
 	UNLOCK_O;
 
@@ -745,13 +753,18 @@ bool output_thread_init(struct thread_ctx_s *ctx) {
 	ctx->output.track_start = NULL;
 	ctx->output.encode.flow = false;
 	ctx->output.encode.codec = NULL;
+	ctx->output.encode.encoder = ctx->output.encode.worker = NULL;
 	ctx->output.fade_writep = NULL;
 	ctx->output.icy.artist = ctx->output.icy.title = ctx->output.icy.artwork = NULL;
+	ctx->output.pull.burst = 100;
 
 	for (int i = 0; i < ARRAY_COUNT(ctx->output_thread); i++) {
 		ctx->output_thread[i].running = ctx->output_thread[i].terminate = false;
+		ctx->output_thread[i].active = ctx->output_thread[i].lingering = false;
 		ctx->output_thread[i].slot = i;
-		ctx->output_thread[i].http = -1;
+		ctx->output_thread[i].http = ctx->output_thread[i].sock = -1;
+		ctx->output_thread[i].ctx = ctx;
+		pthread_cond_init(&ctx->output_thread[i].cond, NULL);
 	}
 	ctx->render.index = -1;
 
@@ -761,11 +774,20 @@ bool output_thread_init(struct thread_ctx_s *ctx) {
 /*---------------------------------------------------------------------------*/
 void output_close(struct thread_ctx_s *ctx) {
 	LOG_DEBUG("[%p] close media renderer", ctx);
+	for (int i = 0; i < ARRAY_COUNT(ctx->output_thread); i++) pthread_cond_destroy(&ctx->output_thread[i].cond);
 	buf_destroy(ctx->outputbuf);
+	NFREE(ctx->output.seektable.points);
+#if CODECS
+	if (ctx->output.encode.worker) encoder_destroy(ctx->output.encode.worker);
+	ctx->output.encode.worker = NULL;
+#endif
 }
 
 /*---------------------------------------------------------------------------*/
 bool output_init(void) {
+	output_simd_init();
+	if (!output_reactor_init()) return false;
+
 #if !LINKALL && CODECS
 	handle = dlopen(LIBFLAC, RTLD_NOW);
 
@@ -784,11 +806,15 @@ bool output_init(void) {
 		f.FLAC__stream_encoder_set_total_samples_estimate = dlsym(handle, "FLAC__stream_encoder_set_total_samples_estimate");
 		f.FLAC__stream_encoder_init_stream = dlsym(handle, "FLAC__stream_encoder_init_stream");
 		f.FLAC__stream_encoder_process_interleaved = dlsym(handle, "FLAC__stream_encoder_process_interleaved");
+		flac_pool_init();
 		return true;
 	} else {
 		LOG_INFO("failed loading FLAC: %s", dlerror());
 		return false;
 	}
+#elif CODECS
+	flac_pool_init();
+	return true;
 #else
 	return true;
 #endif
@@ -796,6 +822,10 @@ bool output_init(void) {
 
 /*---------------------------------------------------------------------------*/
 void output_end(void) {
+	output_reactor_end();
+#if CODECS
+	flac_pool_end();
+#endif
 #if !LINKALL && CODECS
 	if (handle) dlclose(handle);
 #endif
@@ -843,6 +873,59 @@ void _checkduration(u32_t frames, struct thread_ctx_s *ctx) {
 	}
 }
 
+/*---------------------------------------------------------------------------*/
+void _output_seektable(u32_t sample_rate, struct thread_ctx_s *ctx) {
+	// called by passthrough codecs when the track's first byte is written
+	ctx->output.seektable.index = ctx->output.index;
+	ctx->output.seektable.sample_rate = sample_rate;
+	ctx->output.seektable.count = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+void _output_seekpoint(u64_t sample, size_t offset, struct thread_ctx_s *ctx) {
+	size_t count = ctx->output.seektable.count;
+
+	// only keep one point every SEEKPOINT_INTERVAL, this is all we need to seek in cache
+	if (!ctx->output.seektable.sample_rate || (count && sample < ctx->output.seektable.points[count - 1].sample + 
+		(u64_t) ctx->output.seektable.sample_rate * SEEKPOINT_INTERVAL)) return;
+
+	if (count == ctx->output.seektable.size) {
+		size_t size = ctx->output.seektable.size ? ctx->output.seektable.size * 2 : 256;
+		struct seekpoint_s *points = realloc(ctx->output.seektable.points, size * sizeof(struct seekpoint_s));
+		if (!points) return;
+		ctx->output.seektable.points = points;
+		ctx->output.seektable.size = size;
+	}
+
+	ctx->output.seektable.points[count].sample = sample;
+	ctx->output.seektable.points[count].offset = offset;
+	ctx->output.seektable.count++;
+}
+
+/*---------------------------------------------------------------------------*/
+bool _output_seek(int index, u32_t *ms, size_t *offset, struct thread_ctx_s *ctx) {
+	struct outputstate *out = &ctx->output;
+
+	// table must be for that track and what's in the cache must be exactly what codec produced
+	if (out->seektable.index != index || !out->seektable.count || out->encode.mode != ENCODE_THRU || 
+		out->encode.flow || out->icy.active) return false;
+
+	u64_t sample = ((u64_t) *ms * out->seektable.sample_rate) / 1000;
+	size_t lo = 0, hi = out->seektable.count;
+
+	// last point at or before requested sample
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if (out->seektable.points[mid].sample <= sample) lo = mid;
+		else hi = mid;
+	}
+
+	*ms = (out->seektable.points[lo].sample * 1000) / out->seektable.sample_rate;
+	*offset = out->seektable.points[lo].offset;
+
+	return true;
+}
+
 /*---------------------------------------------------------------------------*/
 #if CODECS
 static FLAC__StreamEncoderWriteStatus flac_write_callback(const FLAC__StreamEncoder *encoder, const FLAC__byte buffer[], size_t bytes, unsigned samples, unsigned current_frame, void *client_data) {
@@ -865,6 +948,682 @@ static FLAC__StreamEncoderWriteStatus flac_write_callback(const FLAC__StreamEnco
 
 	return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
 }
+
+/*---------------------------------------------------------------------------*/
+/* Parallel FLAC cuts audio in jobs of contiguous blocks that a pool of workers
+ * encode as independent streams. Each worker keeps its encoder but it must be
+ * initialized and finished per job to flush the last block, so a job is about a
+ * second of audio to make that cost negligible (see bench_flac). The header of these is dropped and their frames
+ * are renumbered (and CRCs updated) so that they can follow, in order, the header
+ * written by the stream's own encoder. Jobs are filled, freed and their result
+ * delivered by the output under LOCK_O, workers only move them to DONE */
+
+struct flac_job_s {
+	struct flac_mt_s *mt;
+	struct flac_job_s *next;
+	enum { JOB_FREE, JOB_QUEUED, JOB_DONE } state;
+	u32_t index;
+	s32_t *pcm;
+	size_t frames;
+	u8_t *data;
+	size_t size, alloc, sent;
+};
+
+struct flac_mt_s {
+	struct thread_ctx_s *ctx;
+	unsigned level, blocksize, channels, sample_size, sample_rate;
+	unsigned blocks;			// per job
+	u32_t count;
+	int fill, send, busy;
+	struct flac_job_s jobs[FLAC_MT_JOBS];
+};
+
+static struct {
+	int count;
+	bool running;
+	thread_type threads[FLAC_MT_WORKERS];
+	mutex_type mutex;
+	pthread_cond_t cond, done;
+	struct flac_job_s *head;
+} flac_pool;
+
+static u8_t flac_crc8[256];
+static u16_t flac_crc16[256];
+
+/*---------------------------------------------------------------------------*/
+static size_t flac_utf8(u32_t v, u8_t *p) {
+	if (v < 0x80) {
+		*p = v;
+		return 1;
+	}
+
+	size_t n = v < 0x800 ? 2 : v < 0x10000 ? 3 : v < 0x200000 ? 4 : v < 0x4000000 ? 5 : 6;
+	for (size_t i = n - 1; i; i--, v >>= 6) p[i] = 0x80 | (v & 0x3f);
+	p[0] = (u8_t) (0xff00 >> n) | v;
+
+	return n;
+}
+
+/*---------------------------------------------------------------------------*/
+static size_t flac_renumber(u8_t *dst, const u8_t *src, size_t bytes, u32_t number) {
+	size_t len, extra = 0, out = 4;
+	u16_t crc = 0;
+	u8_t crc8 = 0;
+
+	// we only set fixed block size, so that's not a frame we know
+	if (bytes < 8 || src[0] != 0xff || src[1] != 0xf8) {
+		memcpy(dst, src, bytes);
+		return bytes;
+	}
+
+	// length of coded number and optional block size and sample rate
+	for (len = 0; len < 7 && (src[4] & (0x80 >> len)); len++);
+	if (!len) len = 1;
+	if ((src[2] >> 4) == 6) extra++;
+	else if ((src[2] >> 4) == 7) extra += 2;
+	if ((src[2] & 0x0f) == 12) extra++;
+	else if ((src[2] & 0x0f) == 13 || (src[2] & 0x0f) == 14) extra += 2;
+
+	memcpy(dst, src, 4);
+	out += flac_utf8(number, dst + out);
+	memcpy(dst + out, src + 4 + len, extra);
+	out += extra;
+
+	for (size_t i = 0; i < out; i++) crc8 = flac_crc8[dst[i] ^ crc8];
+	dst[out++] = crc8;
+
+	// frame body does not change but its CRC covers the header
+	memcpy(dst + out, src + 4 + len + extra + 1, bytes - (4 + len + extra + 1) - 2);
+	out += bytes - (4 + len + extra + 1) - 2;
+
+	for (size_t i = 0; i < out; i++) crc = (crc << 8) ^ flac_crc16[dst[i] ^ (crc >> 8)];
+	dst[out++] = crc >> 8;
+	dst[out++] = crc;
+
+	return out;
+}
+
+/*---------------------------------------------------------------------------*/
+static FLAC__StreamEncoderWriteStatus flac_mt_write(const FLAC__StreamEncoder *encoder, const FLAC__byte buffer[], size_t bytes, unsigned samples, unsigned current_frame, void *client_data) {
+	struct flac_job_s *job = (struct flac_job_s*) client_data;
+
+	// that's the header of the job's stream
+	if (!samples) return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+
+	// renumbering might need a few more bytes
+	if (job->size + bytes + 8 > job->alloc) {
+		u8_t *data = realloc(job->data, (job->size + bytes + 8) * 2);
+		if (!data) return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+		job->data = data;
+		job->alloc = (job->size + bytes + 8) * 2;
+	}
+
+	job->size += flac_renumber(job->data + job->size, buffer, bytes, job->index * job->mt->blocks + current_frame);
+	return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+static void *flac_mt_worker(void *arg) {
+	FLAC__StreamEncoder *codec = FLAC(f, stream_encoder_new);
+
+	mutex_lock(flac_pool.mutex);
+
+	while (flac_pool.running) {
+		struct flac_job_s *job = flac_pool.head;
+
+		if (!job) {
+			pthread_cond_wait(&flac_pool.cond, &flac_pool.mutex);
+			continue;
+		}
+
+		flac_pool.head = job->next;
+		mutex_unlock(flac_pool.mutex);
+
+		// encoder has to be re-initialized so that last block is flushed
+		struct flac_mt_s *mt = job->mt;
+		bool ok = FLAC(f, stream_encoder_set_verify, codec, false);
+		ok &= FLAC(f, stream_encoder_set_compression_level, codec, mt->level);
+		ok &= FLAC(f, stream_encoder_set_channels, codec, mt->channels);
+		ok &= FLAC(f, stream_encoder_set_bits_per_sample, codec, mt->sample_size);
+		ok &= FLAC(f, stream_encoder_set_sample_rate, codec, mt->sample_rate);
+		ok &= FLAC(f, stream_encoder_set_blocksize, codec, mt->blocksize);
+		ok &= FLAC(f, stream_encoder_set_streamable_subset, codec, false);
+		ok &= !FLAC(f, stream_encoder_init_stream, codec, flac_mt_write, NULL, NULL, NULL, job);
+
+		job->size = 0;
+		if (ok) ok = FLAC(f, stream_encoder_process_interleaved, codec, (FLAC__int32*) job->pcm, job->frames);
+		ok &= FLAC(f, stream_encoder_finish, codec);
+		if (!ok) LOG_ERROR("[%p]: FLAC job %u failed", mt->ctx, job->index);
+
+		mutex_lock(flac_pool.mutex);
+		job->state = JOB_DONE;
+		mt->busy--;
+		pthread_cond_broadcast(&flac_pool.done);
+		output_wake(mt->ctx);
+	}
+
+	mutex_unlock(flac_pool.mutex);
+
+	FLAC(f, stream_encoder_delete, codec);
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static void flac_pool_init(void) {
+#if WIN
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	int cpus = info.dwNumberOfProcessors;
+#else
+	int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	// tables for CRC-8 (x^8 + x^2 + x^1 + x^0) and CRC-16 (x^16 + x^15 + x^2 + x^0)
+	for (int i = 0; i < 256; i++) {
+		flac_crc8[i] = i;
+		flac_crc16[i] = i << 8;
+		for (int j = 0; j < 8; j++) {
+			flac_crc8[i] = (flac_crc8[i] & 0x80) ? (flac_crc8[i] << 1) ^ 0x07 : (flac_crc8[i] << 1);
+			flac_crc16[i] = (flac_crc16[i] & 0x8000) ? (flac_crc16[i] << 1) ^ 0x8005 : (flac_crc16[i] << 1);
+		}
+	}
+
+	// leave one core to the rest, but even one worker unloads output
+	flac_pool.count = min(max(cpus - 1, 1), FLAC_MT_WORKERS);
+	flac_pool.running = true;
+	flac_pool.head = NULL;
+	mutex_create(flac_pool.mutex);
+	pthread_cond_init(&flac_pool.cond, NULL);
+	pthread_cond_init(&flac_pool.done, NULL);
+
+	for (int i = 0; i < flac_pool.count; i++) {
+		pthread_create(flac_pool.threads + i, NULL, flac_mt_worker, NULL);
+	}
+
+	LOG_INFO("started %d FLAC encoding workers", flac_pool.count);
+}
+
+/*---------------------------------------------------------------------------*/
+static void flac_pool_end(void) {
+	if (!flac_pool.count) return;
+
+	mutex_lock(flac_pool.mutex);
+	flac_pool.running = false;
+	pthread_cond_broadcast(&flac_pool.cond);
+	mutex_unlock(flac_pool.mutex);
+
+	for (int i = 0; i < flac_pool.count; i++) pthread_join(flac_pool.threads[i], NULL);
+	flac_pool.count = 0;
+
+	pthread_cond_destroy(&flac_pool.cond);
+	pthread_cond_destroy(&flac_pool.done);
+	mutex_destroy(flac_pool.mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+static struct flac_mt_s* flac_mt_open(unsigned level, unsigned blocksize, struct thread_ctx_s *ctx) {
+	if (!flac_pool.count) return NULL;
+
+	struct flac_mt_s *mt = calloc(1, sizeof(struct flac_mt_s));
+	if (!mt) return NULL;
+
+	mt->ctx = ctx;
+	mt->level = level;
+	mt->blocksize = blocksize;
+	mt->channels = ctx->output.encode.channels;
+	mt->sample_size = ctx->output.encode.sample_size;
+	mt->sample_rate = ctx->output.encode.sample_rate;
+	mt->blocks = min(max(mt->sample_rate / blocksize, FLAC_MT_BLOCKS_MIN), FLAC_MT_BLOCKS_MAX);
+
+	for (int i = 0; i < FLAC_MT_JOBS; i++) {
+		mt->jobs[i].mt = mt;
+		mt->jobs[i].pcm = malloc(mt->blocks * blocksize * mt->channels * sizeof(s32_t));
+		if (!mt->jobs[i].pcm) {
+			flac_mt_close(mt);
+			return NULL;
+		}
+	}
+
+	return mt;
+}
+
+/*---------------------------------------------------------------------------*/
+static void flac_mt_close(struct flac_mt_s *mt) {
+	mutex_lock(flac_pool.mutex);
+
+	// remove our queued jobs and wait for the ones being encoded
+	for (struct flac_job_s **p = &flac_pool.head; *p;) {
+		if ((*p)->mt != mt) p = &(*p)->next;
+		else {
+			*p = (*p)->next;
+			mt->busy--;
+		}
+	}
+
+	while (mt->busy) pthread_cond_wait(&flac_pool.done, &flac_pool.mutex);
+
+	mutex_unlock(flac_pool.mutex);
+
+	for (int i = 0; i < FLAC_MT_JOBS; i++) {
+		free(mt->jobs[i].pcm);
+		free(mt->jobs[i].data);
+	}
+
+	free(mt);
+}
+
+/*---------------------------------------------------------------------------*/
+static void flac_mt_submit(struct flac_mt_s *mt) {
+	struct flac_job_s *job = mt->jobs + mt->fill, **p;
+
+	job->index = mt->count++;
+	job->sent = 0;
+	job->next = NULL;
+
+	mutex_lock(flac_pool.mutex);
+	job->state = JOB_QUEUED;
+	mt->busy++;
+	for (p = &flac_pool.head; *p; p = &(*p)->next);
+	*p = job;
+	pthread_cond_signal(&flac_pool.cond);
+	mutex_unlock(flac_pool.mutex);
+
+	mt->fill = (mt->fill + 1) % FLAC_MT_JOBS;
+}
+
+/*---------------------------------------------------------------------------*/
+static size_t flac_mt_room(struct flac_mt_s *mt) {
+	struct flac_job_s *job = mt->jobs + mt->fill;
+
+	// a worker might be setting that job DONE
+	mutex_lock(flac_pool.mutex);
+	bool idle = job->state == JOB_FREE;
+	mutex_unlock(flac_pool.mutex);
+
+	return idle ? mt->blocks * mt->blocksize - job->frames : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static void flac_mt_process(struct flac_mt_s *mt, s32_t *iptr, size_t frames) {
+	struct flac_job_s *job = mt->jobs + mt->fill;
+
+	memcpy(job->pcm + job->frames * mt->channels, iptr, frames * mt->channels * sizeof(s32_t));
+	job->frames += frames;
+
+	if (job->frames == mt->blocks * mt->blocksize) flac_mt_submit(mt);
+}
+
+/*---------------------------------------------------------------------------*/
+static bool flac_mt_drain(struct flac_mt_s *mt, struct buffer *obuf, bool flush) {
+	struct flac_job_s *job = mt->jobs + mt->fill;
+	bool pending;
+
+	// end of track, last job is a partial one (unless all are in use)
+	if (flush && job->frames && flac_mt_room(mt)) flac_mt_submit(mt);
+
+	// deliver in order whatever is encoded and fits
+	for (job = mt->jobs + mt->send; ; job = mt->jobs + mt->send) {
+		mutex_lock(flac_pool.mutex);
+		bool done = job->state == JOB_DONE;
+		mutex_unlock(flac_pool.mutex);
+
+		if (!done) break;
+
+		size_t bytes = min(job->size - job->sent, _buf_space(obuf));
+		if (bytes) flac_write_callback(NULL, job->data + job->sent, bytes, 0, 0, obuf);
+		job->sent += bytes;
+
+		if (job->sent < job->size) break;
+
+		job->frames = 0;
+		job->state = JOB_FREE;
+		mt->send = (mt->send + 1) % FLAC_MT_JOBS;
+	}
+
+	mutex_lock(flac_pool.mutex);
+	pending = mt->busy || mt->jobs[mt->send].state == JOB_DONE;
+	mutex_unlock(flac_pool.mutex);
+
+	return pending;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Other encoders run in a per-player thread so that LOCK_O is never held while 
+ * encoding. Under LOCK_O, the output only copies gain-applied frames into the 
+ * pcm ring and moves what the thread has encoded from the data ring to obuf. 
+ * Both rings are lock-free, the mutex is only there to sleep/wake the thread.
+ * The thread is created with the first track and then idles between tracks, 
+ * only rings and codec state are reset when a new track opens it */
+
+struct encoder_s {
+	struct thread_ctx_s *ctx;
+	thread_type thread;
+	bool running, active, busy;
+	mutex_type mutex;
+	pthread_cond_t cond;
+	struct spsc pcm, data;
+	s32_t scratch[FLAC_MAX_FRAMES * 2];
+	u8_t *block;				// MP3/AAC 16 bits samples waiting for a full pass
+	size_t count, alloc;		// frames in block and its allocated size
+	size_t room;				// data ring space required before a pass
+	struct {
+		u8_t *data;
+		size_t size, alloc;
+	} spill;					// encoded bytes data ring could not take, go first
+};
+
+/*---------------------------------------------------------------------------*/
+static bool encoder_put(struct encoder_s *enc, const u8_t *data, size_t bytes) {
+	// room in data ring is only an estimate, keep the rest in order
+	size_t n = enc->spill.size ? 0 : spsc_write(&enc->data, data, bytes);
+	if (n == bytes) return true;
+
+	if (enc->spill.size + bytes - n > enc->spill.alloc) {
+		u8_t *spill = realloc(enc->spill.data, enc->spill.size + bytes - n);
+		if (!spill) {
+			LOG_ERROR("[%p]: can't keep %zu encoded bytes", enc->ctx, bytes - n);
+			return false;
+		}
+		enc->spill.data = spill;
+		enc->spill.alloc = enc->spill.size + bytes - n;
+	}
+
+	memcpy(enc->spill.data + enc->spill.size, data + n, bytes - n);
+	enc->spill.size += bytes - n;
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+static void encoder_unspill(struct encoder_s *enc) {
+	size_t n = spsc_write(&enc->data, enc->spill.data, enc->spill.size);
+	memmove(enc->spill.data, enc->spill.data + n, enc->spill.size - n);
+	enc->spill.size -= n;
+}
+
+/*---------------------------------------------------------------------------*/
+static FLAC__StreamEncoderWriteStatus encoder_flac_write(const FLAC__StreamEncoder *encoder, const FLAC__byte buffer[], size_t bytes, unsigned samples, unsigned current_frame, void *client_data) {
+	struct encoder_s *enc = (struct encoder_s*) client_data;
+	return encoder_put(enc, buffer, bytes) ? FLAC__STREAM_ENCODER_WRITE_STATUS_OK : FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+}
+
+/*---------------------------------------------------------------------------*/
+static size_t encoder_room(struct outputstate *out) {
+	// room required in data ring before a pass can run (assume 1:1 ratio ...)
+	if (out->encode.mode == ENCODE_FLAC) return 2 * FLAC_MIN_SPACE;
+	else if (out->encode.mode == ENCODE_MP3) return SHINE_MAX_SAMPLES * 2;
+	else return ((struct aac_private*) out->encode.codec_private)->out_max_bytes;
+}
+
+/*---------------------------------------------------------------------------*/
+static void encoder_run(struct encoder_s *enc) {
+	struct outputstate *p = &enc->ctx->output;
+	s32_t *iptr = enc->scratch;
+	size_t frames = spsc_used(&enc->pcm) / BYTES_PER_FRAME;
+
+	if (p->encode.mode == ENCODE_FLAC) {
+		frames = spsc_read(&enc->pcm, iptr, min(frames, FLAC_MAX_FRAMES) * BYTES_PER_FRAME) / BYTES_PER_FRAME;
+		if (p->encode.channels == 1) to_mono(iptr, frames);
+		FLAC(f, stream_encoder_process_interleaved, p->encode.codec, (FLAC__int32*) iptr, frames);
+	} else if (p->encode.mode == ENCODE_MP3) {
+		// this is the number of samples per channel (so number of frames...)
+		int block = shine_samples_per_pass(p->encode.codec);
+
+		frames = min(frames, block - enc->count);
+		frames = spsc_read(&enc->pcm, iptr, min(frames, FLAC_MAX_FRAMES) * BYTES_PER_FRAME) / BYTES_PER_FRAME;
+
+		// aggregate the data in interim buffer
+		s16_t* optr = (s16_t*) enc->block + enc->count * p->encode.channels;
+		if (p->encode.channels == 2) for (int i = 0; i < frames * 2; i++) *optr++ = *iptr++ >> 16;
+		else for (int i = 0; i < frames; i++) *optr++ = iptr[2*i] >> 16;
+		enc->count += frames;
+
+		// full block available, encode it
+		if (enc->count == block) {
+			int bytes;
+
+			enc->count = 0;
+			u8_t* data = shine_encode_buffer_interleaved(p->encode.codec, (s16_t*) enc->block, &bytes);
+			encoder_put(enc, data, bytes);
+		}
+	} else if (p->encode.mode == ENCODE_AAC) {
+#if LINKALL
+		struct aac_private* aac = (struct aac_private*)p->encode.codec_private;
+
+		frames = min(frames, (aac->in_samples / p->encode.channels) - enc->count);
+		frames = spsc_read(&enc->pcm, iptr, min(frames, FLAC_MAX_FRAMES) * BYTES_PER_FRAME) / BYTES_PER_FRAME;
+
+		// aggregate the data in interim buffer
+		s16_t *optr = (s16_t*) enc->block + enc->count * p->encode.channels;
+		if (p->encode.channels == 2) for (int i = 0; i < frames * 2; i++) *optr++ = *iptr++ >> 16;
+		else for (int i = 0; i < frames; i++) *optr++ = iptr[2 * i] >> 16;
+		enc->count += frames;
+
+		// full block available, encode it
+		if (enc->count == aac->in_samples / p->encode.channels) {
+			int bytes = faacEncEncode(p->encode.codec, (int32_t*) enc->block, enc->count * p->encode.channels, aac->buffer, aac->out_max_bytes);
+			if (bytes > 0) encoder_put(enc, aac->buffer, bytes);
+			enc->count = 0;
+		}
+#endif
+	}
+
+	LOG_SDEBUG("[%p]: encoded %u frames", enc->ctx, frames);
+}
+
+/*---------------------------------------------------------------------------*/
+static void *encoder_thread(void *arg) {
+	struct encoder_s *enc = (struct encoder_s*) arg;
+
+	mutex_lock(enc->mutex);
+
+	while (enc->running) {
+		// no track, nothing to encode or no room for result, wait for output to wake us
+		if (!enc->active || (enc->spill.size ? !spsc_space(&enc->data) :
+			spsc_used(&enc->pcm) < BYTES_PER_FRAME || spsc_space(&enc->data) < enc->room)) {
+			pthread_cond_wait(&enc->cond, &enc->mutex);
+			continue;
+		}
+
+		enc->busy = true;
+		mutex_unlock(enc->mutex);
+
+		// what data ring could not take goes first
+		if (enc->spill.size) encoder_unspill(enc);
+		else encoder_run(enc);
+
+		// output sessions waiting for data must be woken up
+		output_wake(enc->ctx);
+
+		mutex_lock(enc->mutex);
+		enc->busy = false;
+
+		// encoder_stop might be waiting for that pass to end
+		if (!enc->active) pthread_cond_broadcast(&enc->cond);
+	}
+
+	mutex_unlock(enc->mutex);
+
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static struct encoder_s *encoder_open(size_t block, struct thread_ctx_s *ctx) {
+	struct encoder_s *enc = ctx->output.encode.worker;
+
+	// thread is already there and idle, just get it ready for the new track
+	if (enc) {
+		if (block > enc->alloc) {
+			u8_t *p = realloc(enc->block, block);
+			if (!p) return NULL;
+			enc->block = p;
+			enc->alloc = block;
+		}
+		spsc_reset(&enc->pcm);
+		spsc_reset(&enc->data);
+		enc->spill.size = enc->count = 0;
+		return enc;
+	}
+
+	enc = calloc(1, sizeof(struct encoder_s));
+	if (!enc) return NULL;
+
+	// pcm ring holds a few FLAC passes, data ring must take a header and 2 passes
+	if (!spsc_init(&enc->pcm, 4 * FLAC_MAX_FRAMES * BYTES_PER_FRAME) ||
+		!spsc_init(&enc->data, 4 * FLAC_MIN_SPACE) ||
+		(block && (enc->block = malloc(block)) == NULL)) {
+		spsc_destroy(&enc->pcm);
+		spsc_destroy(&enc->data);
+		free(enc);
+		return NULL;
+	}
+
+	enc->ctx = ctx;
+	enc->alloc = block;
+	mutex_create(enc->mutex);
+	pthread_cond_init(&enc->cond, NULL);
+
+	pthread_attr_t attr;
+	enc->running = true;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + DECODE_THREAD_STACK_SIZE);
+	if (pthread_create(&enc->thread, &attr, encoder_thread, enc)) enc->running = false;
+	pthread_attr_destroy(&attr);
+
+	if (!enc->running) {
+		LOG_ERROR("[%p]: can't create encoder thread", ctx);
+		encoder_destroy(enc);
+		return NULL;
+	}
+
+	ctx->output.encode.worker = enc;
+	return enc;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool encoder_start(struct encoder_s *enc) {
+	// codec is set, thread can start to use it
+	mutex_lock(enc->mutex);
+	enc->room = encoder_room(&enc->ctx->output);
+	enc->active = true;
+	pthread_cond_signal(&enc->cond);
+	mutex_unlock(enc->mutex);
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+static void encoder_stop(struct encoder_s *enc) {
+	// thread stays but must not touch codec anymore once we return
+	mutex_lock(enc->mutex);
+	enc->active = false;
+	while (enc->busy) pthread_cond_wait(&enc->cond, &enc->mutex);
+	mutex_unlock(enc->mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+static void encoder_finish(struct encoder_s *enc) {
+	// thread is stopped, so we are the producer now and codec's last bytes follow all others
+	struct outputstate *p = &enc->ctx->output;
+	int bytes;
+
+	if (p->encode.mode == ENCODE_MP3) {
+		u8_t *data;
+
+		// code remaining audio
+		if (enc->count) {
+			memset(enc->block + enc->count * p->encode.channels * 2, 0,
+				   (shine_samples_per_pass(p->encode.codec) - enc->count) * p->encode.channels * 2);
+			data = shine_encode_buffer_interleaved(p->encode.codec, (s16_t*) enc->block, &bytes);
+			encoder_put(enc, data, bytes);
+		}
+
+		// final encoder flush
+		data = shine_flush(p->encode.codec, &bytes);
+		encoder_put(enc, data, bytes);
+	} else if (p->encode.mode == ENCODE_AAC) {
+#if LINKALL
+		struct aac_private* aac = (struct aac_private*) p->encode.codec_private;
+
+		// code remaining audio
+		if (enc->count) {
+			bytes = faacEncEncode(p->encode.codec, (int32_t*) enc->block, enc->count * p->encode.channels, aac->buffer, aac->out_max_bytes);
+			if (bytes > 0) encoder_put(enc, aac->buffer, bytes);
+		}
+
+		// final encoder flush
+		bytes = faacEncEncode(p->encode.codec, NULL, 0, aac->buffer, aac->out_max_bytes);
+		if (bytes > 0) encoder_put(enc, aac->buffer, bytes);
+#endif
+	}
+
+	enc->count = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static void encoder_close(struct encoder_s *enc) {
+	// track is done, thread idles until encoder_open is called for the next one
+	encoder_stop(enc);
+}
+
+/*---------------------------------------------------------------------------*/
+static void encoder_destroy(struct encoder_s *enc) {
+	if (enc->running) {
+		mutex_lock(enc->mutex);
+		enc->active = enc->running = false;
+		pthread_cond_signal(&enc->cond);
+		mutex_unlock(enc->mutex);
+		pthread_join(enc->thread, NULL);
+	}
+
+	spsc_destroy(&enc->pcm);
+	spsc_destroy(&enc->data);
+	free(enc->block);
+	free(enc->spill.data);
+	pthread_cond_destroy(&enc->cond);
+	mutex_destroy(enc->mutex);
+	free(enc);
+}
+
+/*---------------------------------------------------------------------------*/
+static size_t encoder_space(struct encoder_s *enc) {
+	return spsc_space(&enc->pcm) / BYTES_PER_FRAME;
+}
+
+/*---------------------------------------------------------------------------*/
+static void encoder_feed(struct encoder_s *enc, u8_t *src, size_t frames) {
+	spsc_write(&enc->pcm, src, frames * BYTES_PER_FRAME);
+
+	mutex_lock(enc->mutex);
+	pthread_cond_signal(&enc->cond);
+	mutex_unlock(enc->mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+static bool encoder_collect(struct encoder_s *enc, struct buffer *obuf) {
+	size_t bytes = spsc_used(&enc->data);
+	bool pending;
+
+	bytes = min(bytes, _buf_space(obuf));
+
+	if (bytes) {
+		// obuf might wrap
+		size_t cont = min(bytes, _buf_cont_write(obuf));
+		spsc_read(&enc->data, obuf->writep, cont);
+		spsc_read(&enc->data, obuf->buf, bytes - cont);
+		_buf_inc_writep(obuf, bytes);
+	}
+
+	// once thread is stopped, we move what data ring could not take
+	if (!enc->active && enc->spill.size) encoder_unspill(enc);
+
+	// thread might be waiting for room in data ring, must be checked last (spill is ours when not busy)
+	mutex_lock(enc->mutex);
+	if (bytes) pthread_cond_signal(&enc->cond);
+	pending = enc->busy || spsc_used(&enc->pcm) || spsc_used(&enc->data) || enc->spill.size;
+	mutex_unlock(enc->mutex);
+
+	return pending;
+}
 #endif
 
 /*---------------------------------------------------------------------------*/
@@ -925,7 +1684,12 @@ void lpcm_pack(u8_t *dst, u8_t *src, size_t bytes, u8_t channels, int endian) {
 
 /*---------------------------------------------------------------------------*/
 void scale_and_pack(void *dst, u32_t *src, size_t frames, u8_t channels, u8_t sample_size, int endian) {
-	size_t count = frames * channels;
+	size_t count, done = simd_pack(dst, src, frames, channels, sample_size, endian);
+
+	// vector kernel does the bulk, finish with scalar
+	src += done * 2;
+	dst = (u8_t*) dst + done * channels * (sample_size / 8);
+	count = (frames - done) * channels;
 
 	if (channels == 2) {
 		if (sample_size == 8) {
@@ -989,7 +1753,7 @@ void scale_and_pack(void *dst, u32_t *src, size_t frames, u8_t channels, u8_t sa
 			} else while (count--) {
 				*optr++ = *src >> 24;
 				*optr++ = *src >> 16;
-				*optr++ = *src++ >> 8;
+				*optr++ = *src >> 8;
 				src += 2;
 			}
 		} else if (sample_size == 32) {
@@ -1088,7 +1852,7 @@ void _checkfade(bool start, struct thread_ctx_s *ctx) {
 /*---------------------------------------------------------------------------*/
 size_t gain_and_fade(size_t frames, u8_t shift, struct thread_ctx_s *ctx) {
 	struct outputstate *out = &ctx->output;
-	u32_t gain = 65536;
+	struct fade_ramp_s fade = { 65536 };
 	s32_t *cptr = NULL;
 
 	// need to align replay_gain change
@@ -1159,7 +1923,7 @@ size_t gain_and_fade(size_t frames, u8_t shift, struct thread_ctx_s *ctx) {
 			}
 		}
 
-		// if fade in progress set fade gain, ensure cont_frames reduced so we get to end of fade at start of chunk
+		// if fade in progress set fade ramp, ensure cont_frames reduced so we get to end of fade at start of chunk
 		if (out->fade) {
 			// don't overshoot fade end
 			if (out->fade_end > ctx->outputbuf->readp)
@@ -1167,12 +1931,12 @@ size_t gain_and_fade(size_t frames, u8_t shift, struct thread_ctx_s *ctx) {
 
 			if (out->fade_dir == FADE_UP || out->fade_dir == FADE_DOWN) {
 				if (out->fade_dir == FADE_DOWN) cur_f = dur_f - cur_f;
-				gain = ((u64_t) cur_f << 16) / dur_f;
+				fade_ramp(&fade, cur_f, dur_f, out->fade_dir == FADE_UP);
 			} else if (out->fade_dir == FADE_CROSS) {
 				// cross fade requires special treatment done below
 				if (_buf_used(ctx->outputbuf) / BYTES_PER_FRAME > dur_f) {
 					frames = min(frames, _buf_used(ctx->outputbuf) / BYTES_PER_FRAME - dur_f);
-					gain  = ((u64_t) cur_f << 16) / dur_f;
+					fade_ramp(&fade, cur_f, dur_f, true);
 					cptr = (s32_t *)(out->fade_end + cur_f * BYTES_PER_FRAME);
 				} else {
 					/*
@@ -1193,13 +1957,13 @@ size_t gain_and_fade(size_t frames, u8_t shift, struct thread_ctx_s *ctx) {
 			out->fade_writep = NULL;
 		}
 
-		LOG_DEBUG("[%p]: fade gain %d", ctx, gain);
+		LOG_DEBUG("[%p]: fade gain %d", ctx, fade.gain);
 	}
 
 	if (frames) {
 		// now can apply various gain & fading
-		if (cptr) apply_cross(ctx->outputbuf, cptr, gain, out->replay_gain, out->next_replay_gain, shift, frames);
-		else apply_gain((s32_t*) ctx->outputbuf->readp, gain, out->replay_gain, shift, frames);
+		if (cptr) apply_cross(ctx->outputbuf, cptr, &fade, out->replay_gain, out->next_replay_gain, shift, frames);
+		else apply_gain((s32_t*) ctx->outputbuf->readp, &fade, out->replay_gain, shift, frames);
 	} else {
 		// need to wait for more input frames to do cross-fade
 		LOG_INFO("[%p]: not enough frames yet for cross-fade", ctx);
@@ -1210,14 +1974,56 @@ size_t gain_and_fade(size_t frames, u8_t shift, struct thread_ctx_s *ctx) {
 
 #define MAX_VAL32 0x7fffffffffffLL
 /*---------------------------------------------------------------------------*/
-static void apply_gain(s32_t *iptr, u32_t fade, u32_t gain, u8_t shift, size_t frames) {
-	size_t count = frames * 2;
+static void fade_ramp(struct fade_ramp_s *ramp, frames_t pos, frames_t dur, bool up) {
+	u64_t num = (u64_t) pos << 16;
+
+	// gain(pos +/- n) = ((pos +/- n) << 16) / dur, as quotient and remainder
+	ramp->dur = dur;
+	ramp->gain = num / dur;
+	ramp->rem = num % dur;
+	ramp->step = up ? 65536 / dur : -(s32_t) (65536 / dur);
+	ramp->rstep = up ? 65536 % dur : -(s32_t) (65536 % dur);
+}
+
+static inline void fade_next(struct fade_ramp_s *ramp) {
+	ramp->gain += ramp->step;
+	ramp->rem += ramp->rstep;
+	if (ramp->rem >= (s32_t) ramp->dur) {
+		ramp->rem -= ramp->dur;
+		ramp->gain++;
+	} else if (ramp->rem < 0) {
+		ramp->rem += ramp->dur;
+		ramp->gain--;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static void apply_gain(s32_t *iptr, struct fade_ramp_s *fade, u32_t gain, u8_t shift, size_t frames) {
+	size_t done, count = frames * 2;
 	s64_t sample;
 
-	gain = gain ? ((u64_t) gain * fade) >> 16 : fade;
+	// fading, gain changes on every frame
+	if (fade->step || fade->rstep) {
+		while (frames--) {
+			u32_t fgain = gain ? ((u64_t) gain * fade->gain) >> 16 : fade->gain;
+			for (int i = 0; i < 2; i++) {
+				sample = *iptr * (s64_t) fgain;
+				if (sample > MAX_VAL32) sample = MAX_VAL32;
+				else if (sample < -MAX_VAL32) sample = -MAX_VAL32;
+				*iptr++ = sample >> (16 + shift);
+			}
+			fade_next(fade);
+		}
+		return;
+	}
+
+	gain = gain ? ((u64_t) gain * fade->gain) >> 16 : fade->gain;
 
 	if (gain == 65536 && !shift) return;
 
+	done = simd_gain(iptr, gain, shift, count);
+	iptr += done;
+	count -= done;
 
 	if (gain == 65536) {
 
@@ -1250,20 +2056,40 @@ static void apply_gain(s32_t *iptr, u32_t fade, u32_t gain, u8_t shift, size_t f
 }
 
 /*---------------------------------------------------------------------------*/
-void apply_cross(struct buffer *outputbuf, s32_t *cptr, u32_t fade, u32_t gain_in, u32_t gain_out, u8_t shift, size_t frames) {
+void apply_cross(struct buffer *outputbuf, s32_t *cptr, struct fade_ramp_s *fade, u32_t gain_in, u32_t gain_out, u8_t shift, size_t frames) {
 	s32_t *iptr = (s32_t *) outputbuf->readp;
+	s32_t gains[CROSS_FRAMES * 2];
 	frames_t count = frames * 2;
 	s64_t sample;
 
 	if (!gain_in) gain_in = 65536L;
 	if (!gain_out) gain_out = 65536L;
 
-	while (count--) {
-		if (cptr > (s32_t *) outputbuf->wrap) cptr -= outputbuf->size / BYTES_PER_FRAME * 2;
-		sample = ((*iptr * (s64_t) gain_in) >> 16) * (65536L - fade) + ((*cptr++ * (s64_t) gain_out) >> 16) * fade;
-		if (sample > MAX_VAL32) sample = MAX_VAL32;
-		else if (sample < -MAX_VAL32) sample = -MAX_VAL32;
-		*iptr++ = sample >> (16 + shift);
+	while (count) {
+		size_t i, done, n;
+
+		// process by contiguous spans of crossfaded samples
+		if (cptr >= (s32_t *) outputbuf->wrap) cptr -= outputbuf->size / BYTES_PER_FRAME * 2;
+		n = min(count, (s32_t *) outputbuf->wrap - cptr);
+		n = min(n, CROSS_FRAMES * 2);
+
+		// expand fade ramp for both channels
+		for (i = 0; i < n; i += 2) {
+			gains[i] = gains[i + 1] = fade->gain;
+			fade_next(fade);
+		}
+
+		done = simd_cross(iptr, cptr, gains, gain_in, gain_out, shift, n);
+		iptr += done;
+		cptr += done;
+		count -= n;
+
+		for (i = done; i < n; i++) {
+			sample = ((*iptr * (s64_t) gain_in) >> 16) * (65536L - gains[i]) + ((*cptr++ * (s64_t) gain_out) >> 16) * gains[i];
+			if (sample > MAX_VAL32) sample = MAX_VAL32;
+			else if (sample < -MAX_VAL32) sample = -MAX_VAL32;
+			*iptr++ = sample >> (16 + shift);
+		}
 	}
 }
 
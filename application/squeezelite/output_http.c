@@ -22,43 +22,190 @@
 #include "squeezelite.h"
 #include "cache.h"
 
+#if LINUX
+#include <sys/epoll.h>
+#define USE_EPOLL	1
+#else
+#define USE_EPOLL	0
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+#if WIN
+#define io_vec				WSABUF
+#define io_vec_set(v, p, n)	(v).buf = (char*) (p), (v).len = (ULONG) (n)
+#else
+#include <sys/uio.h>
+#define io_vec				struct iovec
+#define io_vec_set(v, p, n)	(v).iov_base = (void*) (p), (v).iov_len = (n)
+#endif
+
 /*----------------------------------------------------------------------------*/
 /* KeyNotes																	  */
 /*----------------------------------------------------------------------------*/
 
-/* The webserver thread will linger as long as not terminated once it has sent 
+/* The webserver session will linger as long as not terminated once it has sent 
  * all the available data. Now, when a track start is detected, all servers with 
- * indexes below the new one are terminated (not joined). The current server is 
- * also terminated when the player self-stops but only if it was lingering as a
- * stop might be follow by a LMS "next" and if the served track was the next one,
- * it would lead to a failure (webserver mute).
+ * indexes below the new one are terminated. The current server is also terminated
+ * when the player self-stops but only if it was lingering as a stop might be 
+ * follow by a LMS "next" and if the served track was the next one, it would lead 
+ * to a failure (webserver mute).
  * When LMS starts a new track, the logic is to find a free webserver and if none
  * can be found, then use a lingering one with the lowest index. There is no reason
  * why we should be in that situation as webservers are freed as soon as a new 
- * track start is detected, but... */
+ * track start is detected, but... 
+ * Sessions used to have their own thread but they are now served by a small and
+ * fixed pool of reactors, each owning the listening and client sockets of a set 
+ * of players. A reactor only wakes up on socket readiness, when a session has to
+ * be stopped or when the decoder produces data for a session that has nothing to
+ * send (starved). Starved sessions are also polled every TIMEOUT as slimproto 
+ * state and flow mode draining still need a timer. When io_uring is available, 
+ * frames sourced from obuf are queued instead of sent and each reactor submits
+ * them all at once per loop, completions come back through the wake event. 
+ * Reactors never wait for the disk either: response headers are sent when the
+ * socket can take them and what a cache has on disk is read ahead in background
+ * (see spool.c), the session is starved until the cache wakes it up. 
+ * A track whose body has been fully produced before is served from the transcode
+ * cache (see tcache.c) and, like for a follower, the decoder only drains the 
+ * stream */
 
 extern log_level	output_loglevel;
 static log_level 	*loglevel = &output_loglevel;
 
-#define LOCK_O 	 mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(ctx->outputbuf->mutex)
-#define LOCK_D   mutex_lock(ctx->decode.mutex)
-#define UNLOCK_D mutex_unlock(ctx->decode.mutex)
+#define LOCK_O 	 metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define LOCK_D   metrics_lock(ctx->decode.mutex, METRICS_LOCK_D, ctx)
+#define UNLOCK_D metrics_unlock(ctx->decode.mutex, METRICS_LOCK_D, ctx)
 
 #define MAX_BLOCK		(32*1024)
+#define MAX_SENDFILE	(256*1024)
 #define TIMEOUT			50
-#define DRAIN_MAX		(5000 / TIMEOUT)
+#define DRAIN_MAX		5000
+#define MAX_EVENTS		32
+
+// keep it below 64 sessions per reactor for Windows' select()
+#define OUTPUT_REACTORS	4
+
+#define IO_READ		0x01
+#define IO_WRITE	0x02
+#define IO_ERROR	0x04
+
+#define frame_size(f)	((f)->len[FRAME_HEAD] + (f)->len[FRAME_AUDIO] + (f)->len[FRAME_ICY] + (f)->len[FRAME_TAIL])
+#define frame_busy(f)	((f)->sent < frame_size(f))
+#define frame_reset(f)	memset((f)->len, 0, sizeof((f)->len)), (f)->sent = 0, (f)->queued = (f)->completed = false
+
+#if EVENTFD
+#define wake_fd(e)	(e)
+#elif SELFPIPE || LOOPBACK
+#define wake_fd(e)	(e).fds[0]
+#endif
 
-struct thread_param_s {
-	struct thread_ctx_s* ctx;
+struct io_event_s {
 	struct output_thread_s* thread;
+	int events;
 };
 
-static void     output_http_thread(struct thread_param_s *param);
-static bool     handle_http(struct thread_ctx_s* ctx, cache_buffer* cache, bool* use_cache, bool lingering, int index, int sock);
-static ssize_t 	send_with_icy(struct outputstate *out, struct buffer* backlog, int sock, const void* data, size_t bytes, int flags);
-static ssize_t  send_chunked(bool chunked, struct buffer* backlog, int sock, const void* data, size_t bytes, int flags);
-static ssize_t  send_backlog(struct buffer* backlog, int sock, const void* data, size_t bytes, int flags);
+static struct reactor_s {
+	int 		id;
+	bool		running, ticking;
+	thread_type thread;
+#if !WINEVENT
+	event_event wake;
+#endif
+#if USE_EPOLL
+	int 		epoll;
+#endif
+	struct uring_s* uring;		// NULL when io_uring is not used
+} reactors[OUTPUT_REACTORS];
+
+#define REACTOR(ctx) (reactors + ((ctx) - thread_ctx) % OUTPUT_REACTORS)
+
+/* Synchronized players usually get the very same stream from LMS. The first one
+ * to start a session does the decode/encode and shares its cache, the others
+ * just drain their streambuf and serve their HTTP client from a view on that
+ * cache, each with its own read offset. A follower that falls behind a ring is
+ * disconnected rather than skipping audio. Any access to a shared cache (or its
+ * views) is done under the share's mutex, always taken after LOCK_O */
+struct output_share_s {
+	u32_t		key;
+	struct thread_ctx_s *owner;
+	cache_buffer* cache;
+	mutex_type	mutex;
+	int			refs;
+	bool		eof;		// owner won't write anymore
+	struct output_share_s* next;
+};
+
+static struct output_share_s* shares;
+static mutex_type shares_mutex;
+
+static void*	output_reactor_thread(struct reactor_s* reactor);
+static bool     session_run(struct output_thread_s* thread, int revents);
+static bool     session_fill(struct output_thread_s* thread);
+static void		session_record(struct output_thread_s* thread, u8_t* writep);
+static void		session_cache(struct output_thread_s* thread, u8_t* src, size_t size);
+static void     session_close(struct output_thread_s* thread);
+static int		session_receive(struct output_thread_s* thread);
+static int		session_respond(struct output_thread_s* thread);
+static void		session_ready(void* arg);
+static bool     handle_http(struct thread_ctx_s* ctx, cache_buffer* cache, bool* use_cache, bool lingering, int index, char** response, char* data);
+static bool		parse_npt(char* range, u32_t* ms);
+static void		frame_build(struct output_frame_s* frame, struct outputstate* out, size_t bytes);
+static size_t	frame_pending(struct output_frame_s* frame);
+static void		frame_last(struct output_frame_s* frame, bool chunked);
+static size_t	frame_send(struct output_frame_s* frame, int sock, const void* audio, size_t bytes, struct uring_s* ring, void* data);
+static size_t	frame_sent(struct output_frame_s* frame, size_t sent);
+static void		share_release(struct output_share_s* share, cache_buffer* cache);
+
+/*---------------------------------------------------------------------------*/
+static void reactor_wake(struct reactor_s* reactor) {
+#if !WINEVENT
+	wake_signal(reactor->wake);
+#endif
+}
+
+#if USE_EPOLL
+/*---------------------------------------------------------------------------*/
+static void reactor_ctl(struct output_thread_s* thread, int op, int sock, int events) {
+	struct epoll_event ev = { 0 };
+	ev.events = ((events & IO_READ) ? EPOLLIN : 0) | ((events & IO_WRITE) ? EPOLLOUT : 0);
+	ev.data.ptr = thread;
+	if (epoll_ctl(REACTOR(thread->ctx)->epoll, op, sock, &ev) < 0) {
+		LOG_ERROR("[%p]: can't update poll of socket %d (%d)", thread->ctx, sock, errno);
+	}
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+static void session_arm(struct output_thread_s* thread, int events) {
+	if (thread->events == events) return;
+#if USE_EPOLL
+	reactor_ctl(thread, EPOLL_CTL_MOD, thread->sock != -1 ? thread->sock : thread->http, events);
+#endif
+	thread->events = events;
+}
+
+/*---------------------------------------------------------------------------*/
+static void session_disconnect(struct output_thread_s* thread, bool graceful) {
+#if USE_EPOLL
+	reactor_ctl(thread, EPOLL_CTL_DEL, thread->sock, 0);
+#endif
+	// frame memory can't be reused while io_uring might still read it
+	if (thread->frame.queued) uring_cancel(REACTOR(thread->ctx)->uring, thread);
+	frame_reset(&thread->frame);
+	NFREE(thread->response.data);
+	if (graceful) shutdown_socket(thread->sock);
+	else closesocket(thread->sock);
+	thread->sock = -1;
+	thread->pending = 0;
+	thread->starved = false;
+
+	// back to listening
+	thread->events = 0;
+	session_arm(thread, IO_READ);
+}
 
 /*---------------------------------------------------------------------------*/
 bool _output_lingers(struct thread_ctx_s* ctx, int index) {
@@ -73,6 +220,7 @@ void _output_terminate(struct thread_ctx_s* ctx, int index) {
 	for (int i = 0; i < ARRAY_COUNT(ctx->output_thread); i++) {
 		if (ctx->output_thread[i].index == index) ctx->output_thread[i].terminate = true;
 	}
+	reactor_wake(REACTOR(ctx));
 }
 
 /*---------------------------------------------------------------------------*/
@@ -80,17 +228,179 @@ void _output_terminate_below(struct thread_ctx_s* ctx, int index) {
 	for (int i = 0; i < ARRAY_COUNT(ctx->output_thread); i++) {
 		if (ctx->output_thread[i].index < index) ctx->output_thread[i].terminate = true;
 	}
+	reactor_wake(REACTOR(ctx));
+}
+
+/*---------------------------------------------------------------------------*/
+void _output_stop(struct thread_ctx_s* ctx, struct output_thread_s* thread) {
+	// reactor owns the session, so ask it to release it and wait (LOCK_O is released while waiting)
+	thread->running = false;
+	reactor_wake(REACTOR(ctx));
+	while (thread->active) metrics_cond_wait(&thread->cond, ctx->outputbuf->mutex, METRICS_LOCK_O, ctx);
+}
+
+/*---------------------------------------------------------------------------*/
+void output_wake(struct thread_ctx_s* ctx) {
+	bool kick = false;
+
+	// no lock, worst case is that the reactor timer will catch it
+	for (int i = 0; i < ARRAY_COUNT(ctx->output_thread); i++) {
+		struct output_thread_s* thread = ctx->output_thread + i;
+		if (thread->active && thread->starved) thread->kick = kick = true;
+	}
+
+	if (kick) reactor_wake(REACTOR(ctx));
+}
+
+/*---------------------------------------------------------------------------*/
+static void share_lock(struct output_thread_s* thread) {
+	if (thread->share) mutex_lock(thread->share->mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+static void share_unlock(struct output_thread_s* thread) {
+	if (thread->share) mutex_unlock(thread->share->mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+static struct output_share_s* share_create(struct thread_ctx_s* ctx, cache_buffer* cache) {
+	struct output_share_s* share = calloc(1, sizeof(struct output_share_s));
+	if (!share) return NULL;
+
+	share->key = ctx->output.source;
+	share->owner = ctx;
+	share->cache = cache;
+	share->refs = 1;
+	mutex_create(share->mutex);
+
+	mutex_lock(shares_mutex);
+	share->next = shares;
+	shares = share;
+	mutex_unlock(shares_mutex);
+
+	return share;
+}
+
+/*---------------------------------------------------------------------------*/
+static void share_release(struct output_share_s* share, cache_buffer* cache) {
+	bool last;
+
+	mutex_lock(shares_mutex);
+	mutex_lock(share->mutex);
+
+	// owner leaving means no more data, a follower just releases its view
+	if (cache == share->cache) share->eof = true;
+	else if (cache) cache_delete(cache);
+
+	last = --share->refs == 0;
+	mutex_unlock(share->mutex);
+
+	if (last) {
+		struct output_share_s** p = &shares;
+		while (*p != share) p = &(*p)->next;
+		*p = share->next;
+	}
+
+	mutex_unlock(shares_mutex);
+
+	if (last) {
+		cache_delete(share->cache);
+		mutex_destroy(share->mutex);
+		free(share);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static struct output_share_s* share_find(struct thread_ctx_s* ctx, const char* owner) {
+	for (struct output_share_s* share = shares; share; share = share->next) {
+		if (share->eof || share->key != ctx->output.source || share->owner == ctx) continue;
+		if (!owner || !strcasecmp(owner, share->owner->cli_id)) return share;
+	}
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+bool output_follow(u32_t track, struct thread_ctx_s *ctx) {
+	struct outputstate* out = &ctx->output;
+	struct output_share_s* share;
+	char owner[sizeof(ctx->cli_id)] = "";
+	char key[256];
+
+	// what makes the encoded stream identical: request, track and encoding
+	snprintf(key, sizeof(key), "%x|%x|%s|%c|%d|%u|%u|%u|%u|%d|%d", out->request, track, out->mimetype, out->codec,
+			 out->encode.mode, out->encode.sample_size, out->encode.channels, out->encode.sample_rate,
+			 out->supported_rates[0], ctx->config.flac_header, ctx->config.L24_format);
+	out->source = hash32(key);
+	out->share = NULL;
+
+	if (out->encode.flow || !ctx->config.use_cli) return false;
+
+	mutex_lock(shares_mutex);
+	if ((share = share_find(ctx, NULL)) != NULL) strcpy(owner, share->owner->cli_id);
+	mutex_unlock(shares_mutex);
+
+	if (!*owner) return false;
+
+	// same request and track is not enough, we must be synchronized with owner (cached, LMS is not asked here)
+	if (!sync_cache_has(ctx, owner)) return false;
+
+	// share might have gone meanwhile
+	mutex_lock(shares_mutex);
+	if ((share = share_find(ctx, owner)) != NULL) {
+		// need the whole history
+		mutex_lock(share->mutex);
+		if (!share->cache->total || !share->cache->scope(share->cache, 0)) {
+			share->refs++;
+			out->share = share;
+		}
+		mutex_unlock(share->mutex);
+	}
+	mutex_unlock(shares_mutex);
+
+	if (out->share) LOG_INFO("[%p]: following stream of %s (key:%x)", ctx, owner, out->source);
+	return out->share != NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+bool output_stored(struct thread_ctx_s *ctx) {
+	struct outputstate* out = &ctx->output;
+	char* id = NULL;
+
+	// leftover of a track that failed to start
+	if (out->stored) cache_delete(out->stored);
+	out->stored = NULL;
+	out->tcache = 0;
+
+	// only whole library tracks are played identically again
+	if (out->encode.flow || out->encode.mode == ENCODE_NULL || !out->duration || out->metadata.remote || !out->metadata.url) return false;
+
+	// everything that makes the body (duration is shorter when track starts with a seek)
+	(void)! asprintf(&id, "%s|%u|%s|%s|%c|%u|%u|%d|%u|%u|%u|%d|%d|%d|%u|%d|%u", out->metadata.url, out->duration,
+					 ctx->config.mode, out->mimetype, out->codec, out->sample_size, out->sample_rate, out->encode.mode,
+					 out->encode.sample_rate, out->encode.sample_size, out->encode.channels, out->supported_rates[0],
+					 ctx->config.L24_format, ctx->config.flac_header, out->next_replay_gain, out->fade_mode, out->fade_secs);
+
+	out->tcache = tcache_key(id);
+	out->stored = tcache_open(out->tcache);
+	NFREE(id);
+
+	if (!out->stored) return false;
+
+	// exact length is known
+	out->length = out->stored->total;
+	LOG_INFO("[%p]: serving from transcode cache (key:%016" PRIx64 ", %zu bytes)", ctx, out->tcache, out->stored->total);
+	return true;
 }
 
 /*---------------------------------------------------------------------------*/
 bool output_start(struct thread_ctx_s *ctx) {
-	struct thread_param_s *param = calloc(sizeof(struct thread_param_s), 1);
+	struct output_thread_s* thread;
 	size_t slot;
 
 	LOCK_O;
 
-	// first try to find a non-running thread
-	for (slot = 0; slot < ARRAY_COUNT(ctx->output_thread) && ctx->output_thread[slot].running; slot++);
+	// first try to find a non-running session
+	for (slot = 0; slot < ARRAY_COUNT(ctx->output_thread) && ctx->output_thread[slot].active; slot++);
 
 	// none found, then use the lowest index lingering one
 	if (slot == ARRAY_COUNT(ctx->output_thread)) for (size_t i = 0; i < ARRAY_COUNT(ctx->output_thread); i++) {
@@ -102,283 +412,535 @@ bool output_start(struct thread_ctx_s *ctx) {
 
 	/* something weird happened like LMS did not flush us but keep sending strms. I've 
 	 * seen that with a live radio statio, that suddenly responded by 404. Si is is 
-	 * fine for stream and decoder, but output threads are stuck waiting */
+	 * fine for stream and decoder, but output sessions are stuck waiting */
 	if (slot == ARRAY_COUNT(ctx->output_thread)) {
-		LOG_ERROR("[%p]: can't find a free thread, we should not be here!!! (s:%d)", ctx, ctx->output.state);
+		LOG_ERROR("[%p]: can't find a free session, we should not be here!!! (s:%d)", ctx, ctx->output.state);
 		if (ctx->output.state < OUTPUT_RUNNING) {
-			LOG_ERROR("[%p]: terminating all threads immediately", ctx);
+			LOG_ERROR("[%p]: terminating all sessions immediately", ctx);
 			for (slot = 0; slot < ARRAY_COUNT(ctx->output_thread); slot++) {
-				ctx->output_thread[slot].running = false;
-				UNLOCK_O;
-				pthread_join(ctx->output_thread[slot].thread, NULL);
-				LOCK_O;
+				if (ctx->output_thread[slot].active) _output_stop(ctx, ctx->output_thread + slot);
 			}
 			// restarting from slot 0
 			slot = 0;
 		} else {
+			UNLOCK_O;
+			if (ctx->output.share) share_release(ctx->output.share, NULL);
+			ctx->output.share = NULL;
 			return false;
 		}
 	}
 
 	// found something, now need to terminate it if it lingers
-	param->thread = ctx->output_thread + slot;
+	thread = ctx->output_thread + slot;
 
-	if (param->thread->running) {
-		param->thread->running = false;
-		UNLOCK_O;
-		LOG_INFO("[%p]: joining thread index:%d (slot:%d)", ctx, param->thread->index, param->thread->slot);
-		pthread_join(param->thread->thread, NULL);
-	} else {
-		UNLOCK_O;
+	if (thread->active) {
+		LOG_INFO("[%p]: stopping session index:%d (slot:%d)", ctx, thread->index, thread->slot);
+		_output_stop(ctx, thread);
 	}
 
-	// it's calloc
-	param->thread->index = ctx->output.index;
-	param->thread->running = true;
-	param->thread->terminate = false;
-	param->ctx = ctx;
+	// other threads look these up under LOCK_O (_output_lingers, _output_terminate...)
+	thread->index = ctx->output.index;
+	thread->running = true;
+	thread->terminate = false;
+	thread->ctx = ctx;
+
+	UNLOCK_O;
 
 	// find a free port
 	ctx->output.port = sq_local_port;
-	for (int i = 0; i < 2 * MAX_PLAYER && param->thread->http <= 0; i++) {
+	for (int i = 0; i < 2 * MAX_PLAYER && thread->http <= 0; i++) {
 		struct in_addr host;
 		host.s_addr = INADDR_ANY;
-		param->thread->http = bind_socket(host, &ctx->output.port, SOCK_STREAM);
-		if (param->thread->http <= 0) ctx->output.port++;
+		thread->http = bind_socket(host, &ctx->output.port, SOCK_STREAM);
+		if (thread->http <= 0) ctx->output.port++;
 	}
 
 	// and listen to it
-	if (param->thread->http <= 0 || listen(param->thread->http, 1)) {
-		closesocket(param->thread->http);
-		param->thread->http = -1;
-		free(param);
+	if (thread->http <= 0 || listen(thread->http, 1)) {
+		closesocket(thread->http);
+		thread->http = -1;
+		LOCK_O;
+		thread->running = false;
+		UNLOCK_O;
+		if (ctx->output.share) share_release(ctx->output.share, NULL);
+		ctx->output.share = NULL;
 		return false;
 	}
 
-	LOG_INFO("[%p]: start thread index:%d (slot:%d)", ctx, param->thread->index, param->thread->slot);
-	pthread_create(&param->thread->thread, NULL, (void *(*)(void*)) &output_http_thread, param);
-
-	return true;
-}
-
-/*---------------------------------------------------------------------------*/
-static void output_http_thread(struct thread_param_s *param) {
-	int sock = -1;
-	bool use_cache = false, acquired = false, http_ready = false, finished = false;
-	fd_set rfds, wfds;
-	struct buffer __obuf, *obuf = &__obuf, backlog;
-	struct output_thread_s *thread = param->thread;
-	struct thread_ctx_s *ctx = param->ctx;
-	unsigned drain_count = DRAIN_MAX;
-	u32_t start = gettime_ms();
-	FILE *store = NULL;
+	// reactor must never block on accept()
+	set_nonblock(thread->http);
 
 	enum cache_type_e cache_type = CACHE_INFINITE;
-	if (ctx->config.cache == HTTP_CACHE_MEMORY) cache_type = CACHE_RING;
+	if (ctx->config.cache == HTTP_CACHE_MEMORY) cache_type = CACHE_MIRROR;
 	else if (ctx->config.cache == HTTP_CACHE_DISK && ctx->output.duration) cache_type = CACHE_FILE;
-	cache_buffer *cache = cache_create(cache_type, 0);
 
-	buf_init(obuf, 128*1024);
-	buf_init(&backlog, max(ctx->output.icy.interval, MAX_BLOCK) + ICY_LEN_MAX + 2 + 16);
+	if (ctx->output.share) {
+		// follower reads from the owner's cache
+		thread->share = ctx->output.share;
+		mutex_lock(thread->share->mutex);
+		thread->cache = cache_view(thread->share->cache);
+		mutex_unlock(thread->share->mutex);
+		cache_type = CACHE_VIEW;
+		ctx->output.share = NULL;
+	} else {
+		if (ctx->output.stored) cache_type = CACHE_STORED;
+		thread->cache = ctx->output.stored ? ctx->output.stored : cache_create(cache_type, 0);
+		ctx->output.stored = NULL;
+		// what the cache had to read ahead from disk is there
+		cache_notify(thread->cache, session_ready, ctx);
+		// followers are only found through CLI
+		thread->share = ctx->config.use_cli && !ctx->output.encode.flow ? share_create(ctx, thread->cache) : NULL;
+	}
+
+	// obuf holds the same share of audio as outputbuf, just less of it
+	buf_init_mirror(&thread->obuf, min(max(ctx->outputbuf->size / 16, 128*1024), 1024*1024));
 
-	free(param);
+	thread->sock = -1;
+	thread->use_cache = thread->acquired = thread->http_ready = thread->finished = false;
+	thread->starved = thread->kick = thread->drained = false;
+	thread->pending = thread->drain = 0;
+	thread->response.data = NULL;
+	frame_reset(&thread->frame);
+	thread->start = thread->polled = gettime_ms();
+	thread->store = NULL;
+
+	// keep what we produce if it can be replayed
+	if (cache_type == CACHE_STORED || cache_type == CACHE_VIEW || ctx->output.encode.flow) thread->record = NULL;
+	else thread->record = tcache_record(ctx->output.tcache);
 
 	if (*ctx->config.store_prefix) {
 		char name[STR_LEN];
 		snprintf(name, sizeof(name), "%s/" BRIDGE_URL "%u-out#%u#.%s", ctx->config.store_prefix, thread->index, 
 			thread->http, mimetype_to_ext(ctx->output.mimetype));
-		store = fopen(name, "wb");
+		thread->store = spool_open(fopen(name, "wb"), 0);
 	}
 
-	LOG_INFO("[%p]: thread index:%d (slot:%d) started, listening socket %u (cache:%d)", ctx, thread->index, thread->slot, thread->http, cache_type);
+	LOG_INFO("[%p]: start session index:%d (slot:%d), listening socket %u (cache:%d)", ctx, thread->index, thread->slot, thread->http, cache_type);
 
-	while (thread->running && !thread->terminate) {
-		if (sock == -1) {
-			struct timeval timeout = { 0, 50 * 1000 };
+	// hand it over to the reactor
+	LOCK_O;
+	thread->active = true;
+	thread->events = IO_READ;
+	UNLOCK_O;
 
-			FD_ZERO(&rfds);
-			FD_SET(thread->http, &rfds);
+#if USE_EPOLL
+	reactor_ctl(thread, EPOLL_CTL_ADD, thread->http, IO_READ);
+#else
+	reactor_wake(REACTOR(ctx));
+#endif
 
-			if (select(thread->http + 1, &rfds, NULL, NULL, &timeout) > 0) {
-				sock = accept(thread->http, NULL, NULL);
-				set_nonblock(sock);
-				http_ready = finished = false;
-				buf_flush(&backlog);
-				FD_ZERO(&wfds);
-				FD_ZERO(&rfds);
-			}
+	return true;
+}
 
-			if (sock != -1 && thread->running) {
-				LOG_INFO("[%p]: got HTTP connection %u", ctx, sock);
-			} else continue;
-		}
-
-		// don't need to loop too fast as we use a write fd
-		FD_SET(sock, &rfds);
-		bool res = true;
-		struct timeval timeout = { 0, TIMEOUT * 1000 };
-		int n = select(sock + 1, &rfds, &wfds, NULL, &timeout);
-		
-		// need to wait till we have an initialized codec
-		if (!acquired && n > 0) {
-			// don't bother locking decoder, there is no race condition
-			if (ctx->decode.new_stream) {
-				// and yes, Windows is so bad that we can't use select() as a timer...
-				usleep(25 * 1000);
-				continue;
-			}
-			acquired = true;
+/*---------------------------------------------------------------------------*/
+static bool session_run(struct output_thread_s* thread, int revents) {
+	struct thread_ctx_s* ctx = thread->ctx;
+	struct buffer* obuf = &thread->obuf;
+	struct output_frame_s* frame = &thread->frame;
+	cache_buffer* cache = thread->cache;
+	bool follower = thread->share && thread->share->cache != cache;
+	bool stored = cache->type == CACHE_STORED;
+	int events = IO_READ;
+	bool res = true;
+
+	// re-inject what could not be processed while waiting for codec
+	revents |= thread->pending;
+	thread->pending = 0;
+	thread->starved = false;
+	thread->polled = gettime_ms();
+
+	if (thread->sock == -1) {
+		if (!(revents & IO_READ)) return true;
+
+		int sock = accept(thread->http, NULL, NULL);
+		if (sock == -1) return true;
+
+		set_nonblock(sock);
+		thread->http_ready = thread->finished = false;
+		thread->request.len = 0;
+		thread->response.data = NULL;
+		*thread->request.data = '\0';
+		frame_reset(frame);
+
+		// stop listening while we have a client
+		session_arm(thread, 0);
+		thread->sock = sock;
+#if USE_EPOLL
+		reactor_ctl(thread, EPOLL_CTL_ADD, sock, IO_READ);
+#endif
+		thread->events = IO_READ;
+
+		LOG_INFO("[%p]: got HTTP connection %u", ctx, sock);
+		return true;
+	}
 
+	// need to wait till we have an initialized codec
+	if (!thread->acquired && revents && !(revents & IO_ERROR)) {
+		// don't bother locking decoder, there is no race condition
+		if (ctx->decode.new_stream) {
+			// don't poll socket until decoder wakes us up (or timer)
+			thread->pending = revents;
+			session_arm(thread, 0);
+			thread->starved = true;
+			return true;
+		}
+		thread->acquired = true;
+
+		// follower and transcode cache have nothing to encode
+		if (!follower && !stored) {
 			LOCK_O;
-			_output_new_stream(obuf, store, ctx);
+			u8_t* writep = obuf->writep;
+			_output_new_stream(obuf, thread->store, ctx);
+			session_record(thread, writep);
 			UNLOCK_O;
+		}
+
+		LOG_INFO("[%p]: got codec, drain is %u (waited %u)", ctx, obuf->size, gettime_ms() - thread->start);
+	}
+
+	// should be the HTTP headers, only handled once they have all arrived (and last response has gone)
+	if ((revents & IO_READ) && !(revents & IO_ERROR) && !thread->response.data) {
+		int received = session_receive(thread);
+
+		if (received > 0) {
+			share_lock(thread);
+			thread->http_ready = handle_http(ctx, cache, &thread->use_cache, thread->lingering, thread->index,
+											 &thread->response.data, thread->request.data);
+			thread->response.close = !thread->http_ready;
+			thread->response.len = thread->response.data ? strlen(thread->response.data) : 0;
+			thread->response.sent = 0;
+			res = thread->response.data != NULL;
+
+			// follower has no other source than cache so continue from where we are 
+			if ((follower || stored) && !thread->use_cache) {
+				cache->set_offset(cache, cache->total);
+				thread->use_cache = true;
+			}
+
+			share_unlock(thread);
 
-			LOG_INFO("[%p]: got codec, drain is %u (waited %u)", ctx, obuf->size, gettime_ms() - start);
+			// response has started, don't handle what was pipelined after these headers mid-stream
+			thread->request.len = 0;
+			*thread->request.data = '\0';
+		} else if (received < 0) {
+			res = false;
 		}
+	}
 
-		// should be the HTTP headers
-		if (n > 0 && FD_ISSET(sock, &rfds)) {
-			http_ready = res = handle_http(ctx, cache, &use_cache, thread->lingering, thread->index, sock);
+	// response headers go first and when socket can take them, alone if there is no body
+	if (res && thread->response.data && !(revents & IO_ERROR)) {
+		int sent = session_respond(thread);
+		if (sent < 0 || (sent > 0 && thread->response.close)) {
+			res = false;
+		} else if (!sent) {
+			session_arm(thread, IO_WRITE);
+			return true;
 		}
-	
-		// something wrong happened or master connection closed
-		if (n < 0 || !res) {
-			// don't forget to linger if device disconnects us before we can sent last chunk
-			if (finished) {
-				LOG_WARN("[%p]: remote closed socket before lingering (%d)", ctx, sock);
-				thread->lingering = true;
-			} 
-
-			LOG_INFO("[%p]: HTTP close %d (bytes %zd) (n:%d res:%d)", ctx, sock, cache->total, n, res);
-			closesocket(sock);
-			sock = -1;
-
-			/* when streaming fails, decode will be completed but new_stream never happened, 
-			 * so output thread is blocked until the player closes the connection at which 
-			 * point we must exit and release slimproto (case where bytes == 0)	*/
-			if (n < 0 && !cache->total && ctx->decode.state == DECODE_COMPLETE) {
-				ctx->output.completed = true;
-				LOG_ERROR("[%p]: streaming failed, exiting", ctx);
-				break;
-			}
-			continue;
+	}
+
+	// something wrong happened or master connection closed
+	if ((revents & IO_ERROR) || !res) {
+		// don't forget to linger if device disconnects us before we can sent last chunk
+		if (thread->finished) {
+			LOG_WARN("[%p]: remote closed socket before lingering (%d)", ctx, thread->sock);
+			thread->lingering = true;
 		}
 
-		// got a connection but a select timeout, so no HTTP headers yet
-		if (!http_ready) continue;
+		LOG_INFO("[%p]: HTTP close %d (bytes %zd) (error:%d res:%d)", ctx, thread->sock, cache->total, (revents & IO_ERROR) != 0, res);
+		session_disconnect(thread, false);
 
-		LOCK_O;
+		/* when streaming fails, decode will be completed but new_stream never happened, 
+		 * so output session is blocked until the player closes the connection at which 
+		 * point we must exit and release slimproto (case where bytes == 0)	*/
+		if ((revents & IO_ERROR) && !cache->total && ctx->decode.state == DECODE_COMPLETE) {
+			ctx->output.completed = true;
+			LOG_ERROR("[%p]: streaming failed, exiting", ctx);
+			return false;
+		}
+		return true;
+	}
+
+	// got a connection but no HTTP headers yet
+	if (!thread->http_ready) {
+		session_arm(thread, IO_READ);
+		return true;
+	}
 
-		// slimproto has not released us yet or we have been stopped
-		if (ctx->output.state != OUTPUT_RUNNING) {
+	LOCK_O;
+
+	// slimproto has not released us yet or we have been stopped
+	if (ctx->output.state != OUTPUT_RUNNING) {
+		thread->starved = true;
+		UNLOCK_O;
+		session_arm(thread, IO_READ);
+		return true;
+	}
+
+	/* _output_fill pulls some data from outpubuf and make it ready in obuf for HTTP layer. It
+	 * returns true if there is still data to process, whether it actually produces bytes or 
+	 * not. So it is important to call and test it before checking decoder state as we should 
+	 * only bother when there is nothing more to do (for the current track) as we don't want to
+	 * consume next track's data. Draining starts as soon as decoder is COMPLETE or ERROR (no 
+	 * LOCK_D, not critical) and STMd will only be requested when "complete" has been set, so 2
+	 * different tracks will never co-exist in outpufbuf. In flow mode, STMd will be sent as soon
+	 * as decode finishes *and* track has already started, so two tracks will co-exist in outputbuf
+	 * and this is needed for crossfade. Pulling audio from outputbuf must be continuous and 
+	 * draining will self-reset every time a decoding restarts. There is a risk that if a player 
+	 * has a very large buffer, the whole next track is decoded (COMPLETE), sent in outputbuf, 
+	 * transfered to obuf which is then fully sent to the player before that track even starts, so
+	 * as soon as it actually starts, decoder states moves to STOPPED, STMd is sent but new data 
+	 * does not arrive before the test below happens, so output closes the socks and lingers. Note
+	 * as well that the drain timer only starts when decoder is STOPPED and after all outputbuf has
+	 * been processed, so it's very unlikey that while emptying obuf, the decoder has not restarted 
+	 * if there is a next track. The lingering mode is here so that players that re-open the 
+	 * connection even after everything has been sent (Sonos during a pause) can be served */
+
+	if (ctx->output.encode.flow) {
+		if (!session_fill(thread) && ctx->decode.state == DECODE_STOPPED) {
+			u32_t now = gettime_ms();
+			if (!thread->drain) thread->drain = now + DRAIN_MAX;
+			else if ((s32_t) (now - thread->drain) >= 0) thread->drained = true;
+		} else {
+			thread->drain = 0;
+			thread->drained = false;
+		}
+	} else if (follower) {
+		share_lock(thread);
+		// owner's ring has overwritten what we had not sent yet, let player reconnect
+		if (cache_view_lost(cache)) {
+			LOG_WARN("[%p]: too slow for shared cache, closing %d (offset %zu, total %zu)", ctx, thread->sock,
+					 cache->tell(cache), cache->total);
+			share_unlock(thread);
 			UNLOCK_O;
-			continue;
+			session_disconnect(thread, false);
+			return true;
 		}
-
-		/* _output_fill pulls some data from outpubuf and make it ready in obuf for HTTP layer. It
-		 * returns true if there is still data to process, whether it actually produces bytes or 
-		 * not. So it is important to call and test it before checking decoder state as we should 
-		 * only bother when there is nothing more to do (for the current track) as we don't want to
-		 * consume next track's data. Draining starts as soon as decoder is COMPLETE or ERROR (no 
-		 * LOCK_D, not critical) and STMd will only be requested when "complete" has been set, so 2
-		 * different tracks will never co-exist in outpufbuf. In flow mode, STMd will be sent as soon
-		 * as decode finishes *and* track has already started, so two tracks will co-exist in outputbuf
-		 * and this is needed for crossfade. Pulling audio from outputbuf must be continuous and 
-		 * draining will self-reset every time a decoding restarts. There is a risk that if a player 
-		 * has a very large buffer, the whole next track is decoded (COMPLETE), sent in outputbuf, 
-		 * transfered to obuf which is then fully sent to the player before that track even starts, so
-		 * as soon as it actually starts, decoder states moves to STOPPED, STMd is sent but new data 
-		 * does not arrive before the test below happens, so output closes the socks and lingers. Note
-		 * as well that drain_count is not a proper timer, but it starts only to decrement when decoder
-		 * is STOPPED and after all outputbuf has been process, so when still sending obuf, the time 
-		 * counted depends when the player releases the wfds, which is not predictible. Still, as soon 
-		 * as obuf is empty, this is chunks of TIMEOUT, so it's very unlikey that while emptying
-		 * obuf, the decoder has not restarted if there	is a next track. The lingering mode is here so
-		 * that players that re-open the connection even after everything has been sent (Sonos during a
-		 * pause) can be served */
-
-		if (ctx->output.encode.flow) {
-			// drain_count is not really time, but close enough
-			if (!_output_fill(obuf, store, ctx) && ctx->decode.state == DECODE_STOPPED) drain_count--;
-			else drain_count = DRAIN_MAX;
-		} else if (drain_count && !_output_fill(obuf, store, ctx) && ctx->decode.state > DECODE_RUNNING) {
-			// full track pulled from outputbuf, draining from obuf
-			_output_end_stream(obuf, ctx);
+		// done when owner has written everything and we have read it all
+		if (!thread->drained && thread->share->eof && !cache->pending(cache)) {
 			ctx->output.completed = true;
-			drain_count = 0;
+			thread->drained = true;
+			thread->use_cache = false;
+			wake_controller(ctx);
+			LOG_INFO("[%p]: draining from shared cache (%zu bytes)", ctx, cache->total);
+		}
+		share_unlock(thread);
+	} else if (stored) {
+		// whole body is already there, done when it has all been read
+		share_lock(thread);
+		if (!thread->drained && !cache->pending(cache)) {
+			ctx->output.completed = true;
+			thread->drained = true;
+			thread->use_cache = false;
+			wake_controller(ctx);
+			LOG_INFO("[%p]: draining from transcode cache (%zu bytes)", ctx, cache->total);
+		}
+		share_unlock(thread);
+	} else if (!thread->drained && !session_fill(thread) && ctx->decode.state > DECODE_RUNNING) {
+		// full track pulled from outputbuf, draining from obuf once encoders have delivered all
+		u8_t* writep = obuf->writep;
+		bool done = _output_end_stream(obuf, ctx);
+		session_record(thread, writep);
+		if (done) {
+			// body is complete unless decoder failed
+			if (thread->record) tcache_close(thread->record, ctx->decode.state == DECODE_COMPLETE);
+			thread->record = NULL;
+			ctx->output.completed = true;
+			thread->drained = true;
 			wake_controller(ctx);
 			LOG_INFO("[%p]: draining (%zu bytes)", ctx, cache->total);
 		}
+	}
 
-		/* now we are surely running but for the forgetful, we need this backlog mechanism because
-		 * we can't use a blocking socket. If we don't, the output buffer gets lock while we block
-		 * in send and the whole slimproto state machine is stalled. Still, the reality of the use
-		 * of it seems to be limited to writing the trailing \r\n in chunked mode, probably because
-		 * we wait for socket to be writable. But in theory, a writable socket does not guarantee
-		 * there is enough available space */
-
-		if (!FD_ISSET(sock, &wfds) && (use_cache || _buf_used(obuf) || _buf_used(&backlog))) {
-			// we can't write but we have to, let's wait for select() 
-			FD_SET(sock, &wfds);
-		} else if (_buf_used(&backlog)) {
-			// we have some backlog, give it priority
-			send_backlog(&backlog, sock, NULL, 0, 0);
-		} else if (use_cache || _buf_used(obuf)) {
-			// only get what we can process (ignore result because all is always sent/backlog'd)
-			size_t chunk = ctx->output.icy.active ? ctx->output.icy.remain : MAX_BLOCK, bytes = chunk;
-			uint8_t* readp = NULL;
-
-			// try to source from cache first if we have to
-			if (use_cache) {
-				readp = cache->read_inner(cache, &bytes);
-				if (!readp) use_cache = false;
-			}
+	/* now we are surely running but for the forgetful, we can't use a blocking socket. If we 
+	 * do, the output buffer gets lock while we block in send and the whole slimproto state 
+	 * machine is stalled. A writable socket does not guarantee there is enough available space
+	 * so a frame (chunk header, audio, ICY and trailer) might only be partially sent. The frame
+	 * remembers where it stopped and audio that did not go is not consumed from its source 
+	 * (obuf or cache) so it is picked-up again on next call to complete that frame */
+
+	share_lock(thread);
+
+	// io_uring is done with the frame, consume the audio it took (always queued from obuf)
+	if (frame->completed) {
+		frame->completed = false;
+		size_t sent = frame_sent(frame, max(frame->result, 0));
+		session_cache(thread, obuf->readp, sent);
+		_buf_inc_readp(obuf, sent);
+		metrics_add(&ctx->metrics.send_bytes, sent);
+		if (frame_busy(frame)) metrics_add(&ctx->metrics.send_blocked, 1);
+	}
 
-			// if nothing in cache, then we are (back to) normal source
-			if (!readp && _buf_used(obuf)) {
-				bytes = min(_buf_cont_read(obuf), chunk);
-				cache->write(cache, obuf->readp, bytes);
-				readp = obuf->readp;
-				_buf_inc_readp(obuf, bytes);
+	if (frame->queued) {
+		// nothing to do until io_uring completes the frame, reactor will call us then
+	} else if (!(revents & IO_WRITE) && (thread->use_cache || _buf_used(obuf) || frame_busy(frame))) {
+		// we can't write but we have to, let's wait for reactor
+		events |= IO_WRITE;
+	} else if (thread->use_cache && !ctx->output.icy.active && !ctx->output.chunked && !frame_busy(frame) && cache->pending(cache)) {
+		// no framing to insert, so let the cache send directly (nothing when it has to read disk first)
+		ssize_t sent = cache->send_to(cache, thread->sock, MAX_SENDFILE);
+		if (sent > 0) metrics_add(&ctx->metrics.send_bytes, sent);
+		else if (sent < 0) metrics_add(&ctx->metrics.send_blocked, 1);
+		if (sent) events |= IO_WRITE;
+		else thread->starved = true;
+		LOG_SDEBUG("[%p] sent %zd bytes from cache (total: %zu)", ctx, sent, cache->total);
+	} else if (thread->use_cache || _buf_used(obuf) || frame_busy(frame)) {
+		// complete current frame or only get what we can process in a new one
+		bool busy = frame_busy(frame);
+		size_t chunk = busy ? frame_pending(frame) : ctx->output.icy.active ? ctx->output.icy.remain : MAX_BLOCK;
+		size_t bytes = chunk, sent = 0;
+		uint8_t* readp = NULL;
+		bool cached = false, reading = false;
+
+		// try to source from cache first if we have to
+		if (chunk && thread->use_cache) {
+			readp = cache->read_inner(cache, &bytes);
+			cached = readp != NULL;
+			// cache has more but it is on disk, it will wake us up once read
+			reading = !readp && cache->pending(cache);
+			if (!readp && !reading && !follower) thread->use_cache = false;
+		}
+
+		// if nothing in cache, then we are (back to) normal source
+		if (chunk && !readp && !reading && _buf_used(obuf)) {
+			bytes = min(_buf_cont_read(obuf), chunk);
+			// disk cache writes in background, don't take more than it can queue (will be polled)
+			if (!busy) bytes = min(bytes, cache->room(cache));
+			if (bytes) readp = obuf->readp;
+		}
+
+		if (reading) {
+			thread->starved = true;
+		} else if (readp || busy) {
+			if (!readp) bytes = 0;
+			if (!busy) frame_build(frame, &ctx->output, bytes);
+			// only frames that do not reference cache can be queued as cache memory can move
+			sent = frame_send(frame, thread->sock, readp, bytes, cached ? NULL : REACTOR(ctx)->uring, thread);
+
+			// only consume what has been sent, the rest will be needed to complete the frame
+			if (cached) {
+				if (sent < bytes) cache->set_offset(cache, cache->tell(cache) - (bytes - sent));
+			} else if (readp) {
+				session_cache(thread, readp, sent);
+				_buf_inc_readp(obuf, sent);
 			}
 
-			// some might be in backlog, but it will be sent later (we never really know anyway what send() does)
-			if (readp) send_with_icy(&ctx->output, &backlog, sock, readp, bytes, 0);
-			else FD_ZERO(&wfds);
-	
-			LOG_SDEBUG("[%p] sent %u bytes (total: %u)", ctx, bytes, cache->total);
-		} else if (finished) {
-			LOG_INFO("[%p]: socket %d closed, now lingering", ctx, sock);
-			thread->lingering = true;
-			shutdown_socket(sock);
-			sock = -1;
-		} else if (!drain_count) {
-			if (ctx->output.chunked) send_backlog(&backlog, sock, "0\r\n\r\n", 5, 0);
-			finished = true;
-			LOG_INFO("[%p]: full data sent (%zu)", ctx, cache->total);
+			metrics_add(&ctx->metrics.send_bytes, sent);
+			// queued frame will call us back when completed
+			if (!frame->queued) {
+				if (frame_busy(frame)) metrics_add(&ctx->metrics.send_blocked, 1);
+				events |= IO_WRITE;
+			}
 		} else {
-			// we don't have anything to send, let select read or sleep
-			FD_ZERO(&wfds);
+			thread->starved = true;
 		}
 
+		LOG_SDEBUG("[%p] sent %zu bytes (total: %zu)", ctx, sent, cache->total);
+	} else if (thread->finished) {
+		LOG_INFO("[%p]: socket %d closed, now lingering", ctx, thread->sock);
+		thread->lingering = true;
+		share_unlock(thread);
 		UNLOCK_O;
+		session_disconnect(thread, true);
+		return true;
+	} else if (thread->drained) {
+		// last chunk will be completed before we close if it can't be sent at once
+		frame_last(frame, ctx->output.chunked);
+		frame_send(frame, thread->sock, NULL, 0, REACTOR(ctx)->uring, thread);
+		// owner has written all in cache
+		if (thread->share && !follower) thread->share->eof = true;
+		thread->finished = true;
+		if (!frame->queued) events |= IO_WRITE;
+		LOG_INFO("[%p]: full data sent (%zu)", ctx, cache->total);
+	} else {
+		// we don't have anything to send, wait for decoder (or timer)
+		thread->starved = true;
 	}
 
-	LOG_INFO("[%p]: finishing thread index:%d (slot:%d) - sent %zu bytes", ctx, thread->index, thread->slot, cache->total);
+	share_unlock(thread);
+	UNLOCK_O;
+
+	session_arm(thread, events);
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool session_fill(struct output_thread_s* thread) {
+	struct thread_ctx_s* ctx = thread->ctx;
+	u64_t start = metrics_on ? metrics_now() : 0;
+	size_t used = _buf_used(ctx->outputbuf);
+	u8_t* writep = thread->obuf.writep;
+
+	bool more = _output_fill(&thread->obuf, thread->store, ctx);
+	session_record(thread, writep);
+	if (start) metrics_observe(&ctx->metrics.fill, metrics_now() - start);
 
-	buf_destroy(&backlog);
-	buf_destroy(obuf);
-	cache_delete(cache);
+	// renderer pull rate, used to size next track's outputbuf
+	if (_buf_used(ctx->outputbuf) < used) ctx->output.pull.bytes += used - _buf_used(ctx->outputbuf);
+
+	// outputbuf space might have been released
+	wakeup_signal(&ctx->decode.wake);
+
+	return more;
+}
+
+/*---------------------------------------------------------------------------*/
+static void session_record(struct output_thread_s* thread, u8_t* writep) {
+	struct buffer* obuf = &thread->obuf;
+	if (!thread->record || writep == obuf->writep) return;
+
+	// whatever has been added to obuf since writep, in case it is not mirrored
+	size_t bytes = obuf->writep >= writep ? obuf->writep - writep : obuf->size - (writep - obuf->writep);
+	size_t out = min(bytes, (size_t) (_buf_end(obuf) - writep));
+
+	tcache_write(thread->record, writep, out);
+	if (bytes > out) tcache_write(thread->record, obuf->buf, bytes - out);
+}
+
+/*---------------------------------------------------------------------------*/
+static void session_cache(struct output_thread_s* thread, u8_t* src, size_t size) {
+	// audio is only taken within cache's room, so anything short means replays will be shifted
+	size_t cached = thread->cache->write(thread->cache, src, size);
+	if (cached < size) LOG_ERROR("[%p]: cache only took %zu/%zu bytes at %zu", thread->ctx, cached, size, thread->cache->total);
+}
+
+/*---------------------------------------------------------------------------*/
+static void session_close(struct output_thread_s* thread) {
+	struct thread_ctx_s* ctx = thread->ctx;
+
+	LOG_INFO("[%p]: finishing session index:%d (slot:%d) - sent %zu bytes", ctx, thread->index, thread->slot, thread->cache->total);
+
+	// a queued frame points to obuf, it must be done before anything is released
+	if (thread->frame.queued) uring_cancel(REACTOR(ctx)->uring, thread);
+	buf_destroy(&thread->obuf);
+	NFREE(thread->response.data);
+
+	if (thread->share) share_release(thread->share, thread->cache);
+	else cache_delete(thread->cache);
+	thread->share = NULL;
 
 	// in chunked mode, a full chunk might not have been sent (due to TCP)
-	if (sock != -1) shutdown_socket(sock);
+	frame_reset(&thread->frame);
+
+	if (thread->sock != -1) {
+#if USE_EPOLL
+		reactor_ctl(thread, EPOLL_CTL_DEL, thread->sock, 0);
+#endif
+		shutdown_socket(thread->sock);
+	}
+#if USE_EPOLL
+	reactor_ctl(thread, EPOLL_CTL_DEL, thread->http, 0);
+#endif
 	shutdown_socket(thread->http);
-	if (store) fclose(store);
+	if (thread->store) spool_close(thread->store, false);
+	// track has not been fully produced
+	if (thread->record) tcache_close(thread->record, false);
+	thread->record = NULL;
 
 	LOCK_O;
 
-	thread->http = -1;
+	thread->sock = thread->http = -1;
 	thread->lingering = false;
+	thread->starved = false;
 
 	if (ctx->output.encode.flow) {
 		_output_end_stream(NULL, ctx);
@@ -386,115 +948,437 @@ static void output_http_thread(struct thread_param_s *param) {
 		ctx->output.completed = true;
 	}
 
-	if (thread->running) {
-		// if we self-terminate, nobody will join us so free resources now
-		pthread_detach(thread->thread);
-		thread->running = false;
-	}
+	// if we self-terminate, nobody waits for us
+	thread->running = false;
+	thread->active = false;
+	pthread_cond_broadcast(&thread->cond);
 
 	UNLOCK_O;
-	LOG_INFO("[%p]: exited thread index:%d (slot:%d)", ctx, thread->index, thread->slot);
+	LOG_INFO("[%p]: exited session index:%d (slot:%d)", ctx, thread->index, thread->slot);
 }
 
-/*----------------------------------------------------------------------------*/
-ssize_t send_backlog(struct buffer* backlog, int sock, const void* data, size_t bytes, int flags) {
-	// if there is no backlog buffer, it should be a blocking socket so just send
-	if (!backlog) return send(sock, data, bytes, flags);
+/*---------------------------------------------------------------------------*/
+static int reactor_wait(struct reactor_s* reactor, struct io_event_s* events, int max, int timeout) {
+	int count = 0;
+#if USE_EPOLL
+	struct epoll_event ev[MAX_EVENTS];
+	int n = epoll_wait(reactor->epoll, ev, min(max, MAX_EVENTS), timeout);
+
+	for (int i = 0; i < n; i++) {
+		// this is our wake event
+		if (!ev[i].data.ptr) {
+			wake_clear(wake_fd(reactor->wake));
+			continue;
+		}
+		events[count].thread = ev[i].data.ptr;
+		events[count++].events = ((ev[i].events & EPOLLIN) ? IO_READ : 0) | ((ev[i].events & EPOLLOUT) ? IO_WRITE : 0) |
+							     ((ev[i].events & (EPOLLERR | EPOLLHUP)) ? IO_ERROR : 0);
+	}
+#else
+	fd_set rfds, wfds;
+	int maxfd = -1;
+
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+
+#if !WINEVENT
+	FD_SET(wake_fd(reactor->wake), &rfds);
+	maxfd = wake_fd(reactor->wake);
+#else
+	// no selectable wake event, so we have to use a timer
+	if (timeout < 0) timeout = TIMEOUT;
+#endif
+
+	for (int i = reactor->id; i < MAX_PLAYER; i += OUTPUT_REACTORS) {
+		for (int j = 0; j < ARRAY_COUNT(thread_ctx[i].output_thread); j++) {
+			struct output_thread_s* thread = thread_ctx[i].output_thread + j;
+			int sock = thread->sock != -1 ? thread->sock : thread->http;
+			if (!thread->active || !thread->events) continue;
+			if (thread->events & IO_READ) FD_SET(sock, &rfds);
+			if (thread->events & IO_WRITE) FD_SET(sock, &wfds);
+			maxfd = max(maxfd, sock);
+		}
+	}
 
-	// try to flush backlog if any
-	for (ssize_t sent = 0; _buf_used(backlog) && sent >= 0;) {
-		sent = send(sock, backlog->readp, _buf_cont_read(backlog), flags);
-		if (sent > 0) _buf_inc_readp(backlog, sent);
+	// and yes, Windows is so bad that we can't use select() as a timer...
+	if (maxfd < 0) {
+		usleep(timeout * 1000);
+		return 0;
 	}
 
-	ssize_t sent = 0;
+	struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+	int n = select(maxfd + 1, &rfds, &wfds, NULL, timeout < 0 ? NULL : &tv);
 
-	// try to send data if backlog is flushed
-	if (!_buf_used(backlog)) {
-		sent = send(sock, data, bytes, flags);
-		if (sent < 0) sent = 0;
+	if (n < 0) {
+		LOG_WARN("reactor %d select error %d", reactor->id, last_error());
+		usleep(TIMEOUT * 1000);
 	}
 
-	// store what we have not sent
-	_buf_write(backlog, (u8_t*) data + sent, bytes - sent);
+	if (n <= 0) return 0;
+
+#if !WINEVENT
+	if (FD_ISSET(wake_fd(reactor->wake), &rfds)) {
+		wake_clear(wake_fd(reactor->wake));
+	}
+#endif
+
+	for (int i = reactor->id; i < MAX_PLAYER && count < max; i += OUTPUT_REACTORS) {
+		for (int j = 0; j < ARRAY_COUNT(thread_ctx[i].output_thread) && count < max; j++) {
+			struct output_thread_s* thread = thread_ctx[i].output_thread + j;
+			int sock = thread->sock != -1 ? thread->sock : thread->http;
+			if (!thread->active || !thread->events) continue;
+			events[count].thread = thread;
+			events[count].events = (FD_ISSET(sock, &rfds) ? IO_READ : 0) | (FD_ISSET(sock, &wfds) ? IO_WRITE : 0);
+			if (events[count].events) count++;
+		}
+	}
+#endif
 
-	// we always accept the whole block
-	return bytes;
+	return count;
 }
 
-/*----------------------------------------------------------------------------*/
-static ssize_t send_chunked(bool chunked, struct buffer *backlog, int sock, const void *data, size_t bytes, int flags) {
-	if (!chunked) return send_backlog(backlog, sock, data, bytes, flags);
-	
-	char chunk[16];
-	itoa(bytes, chunk, 16);
-	strcat(chunk, "\r\n");
+/*---------------------------------------------------------------------------*/
+static void *output_reactor_thread(struct reactor_s* reactor) {
+	while (reactor->running) {
+		struct io_event_s events[MAX_EVENTS];
+		int n = reactor_wait(reactor, events, MAX_EVENTS, reactor->ticking ? TIMEOUT : -1);
+
+		for (int i = 0; i < n; i++) {
+			struct output_thread_s* thread = events[i].thread;
+			// stale event or session to be closed below
+			if (!thread->active || !thread->running || thread->terminate) continue;
+			if (!session_run(thread, events[i].events)) session_close(thread);
+		}
+
+		// frames that io_uring has completed (their eventfd is our wake event)
+		void* data;
+		int res;
+		while (reactor->uring && uring_reap(reactor->uring, &data, &res)) {
+			struct output_thread_s* thread = data;
+			thread->frame.queued = false;
+			thread->frame.completed = true;
+			thread->frame.result = res;
+			if (!thread->active || !thread->running || thread->terminate) continue;
+			// nothing sent means socket is full, anything else than -EAGAIN is fatal
+			int revents = res > 0 ? IO_WRITE : (!res || res == -EAGAIN) ? 0 : IO_ERROR;
+			if (!session_run(thread, revents)) session_close(thread);
+		}
+
+		// release sessions that are done and serve the starved ones 
+		u32_t now = gettime_ms();
+		reactor->ticking = false;
 
-	send_backlog(backlog, sock, chunk, strlen(chunk), flags);
-	ssize_t sent = send_backlog(backlog, sock, data, bytes, flags);
-	send_backlog(backlog, sock, "\r\n", 2, flags);
+		for (int i = reactor->id; i < MAX_PLAYER; i += OUTPUT_REACTORS) {
+			for (int j = 0; j < ARRAY_COUNT(thread_ctx[i].output_thread); j++) {
+				struct output_thread_s* thread = thread_ctx[i].output_thread + j;
+				if (!thread->active) continue;
 
-	return sent;
+				if (!thread->running || thread->terminate) {
+					session_close(thread);
+				} else if (thread->starved && (thread->kick || now - thread->polled >= TIMEOUT)) {
+					thread->kick = false;
+					if (!session_run(thread, 0)) session_close(thread);
+				}
+
+				if (thread->active && thread->starved) reactor->ticking = true;
+			}
+		}
+
+		// all sessions' frames go in one call
+		if (reactor->uring) uring_submit(reactor->uring);
+	}
+
+	return NULL;
 }
 
-/*----------------------------------------------------------------------------*/
-static ssize_t send_with_icy(struct outputstate* out, struct buffer *backlog, int sock, const void *data, size_t bytes, int flags) {
-	// first send remaining data bytes wich are always smaller or equal to icy.remain
-	bytes = send_chunked(out->chunked, backlog, sock, data, bytes, flags);
+/*---------------------------------------------------------------------------*/
+bool output_reactor_init(void) {
+	mutex_create(shares_mutex);
+
+	for (int i = 0; i < OUTPUT_REACTORS; i++) {
+		struct reactor_s* reactor = reactors + i;
+
+		reactor->id = i;
+		reactor->ticking = false;
+#if USE_EPOLL
+		struct epoll_event ev = { 0 };
+		reactor->epoll = epoll_create1(0);
+		if (reactor->epoll < 0) {
+			LOG_ERROR("can't create reactor %d (%d)", i, errno);
+			return false;
+		}
+#endif
+#if !WINEVENT
+		wake_create(reactor->wake);
+#endif
+#if URING
+		// at most one frame per session in flight
+		unsigned sessions = (MAX_PLAYER + OUTPUT_REACTORS - 1) / OUTPUT_REACTORS * ARRAY_COUNT(thread_ctx[0].output_thread);
+		reactor->uring = uring_create(sessions, wake_fd(reactor->wake));
+		if (reactor->uring) LOG_INFO("reactor %d using io_uring", i);
+#endif
+#if USE_EPOLL
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, wake_fd(reactor->wake), &ev);
+#endif
+		reactor->running = true;
+		pthread_create(&reactor->thread, NULL, (void* (*)(void*)) &output_reactor_thread, reactor);
+	}
+
+	LOG_INFO("started %d http reactors", OUTPUT_REACTORS);
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+void output_reactor_end(void) {
+	for (int i = 0; i < OUTPUT_REACTORS; i++) {
+		struct reactor_s* reactor = reactors + i;
+		if (!reactor->running) continue;
+
+		reactor->running = false;
+		reactor_wake(reactor);
+		pthread_join(reactor->thread, NULL);
+
+		// what is left must be released, including unfinished transcode cache recordings
+		for (int j = reactor->id; j < MAX_PLAYER; j += OUTPUT_REACTORS) {
+			for (int k = 0; k < ARRAY_COUNT(thread_ctx[j].output_thread); k++) {
+				if (thread_ctx[j].output_thread[k].active) session_close(thread_ctx[j].output_thread + k);
+			}
+		}
+#if USE_EPOLL
+		close(reactor->epoll);
+#endif
+		uring_destroy(reactor->uring);
+		reactor->uring = NULL;
+#if !WINEVENT
+		wake_close(reactor->wake);
+#endif
+	}
 
-	// ICY not active, just send
-	if (!out->icy.active) return bytes;
+	mutex_destroy(shares_mutex);
+}
 
-	out->icy.remain -= bytes;
-	LOG_DEBUG("[%p]: ICY remains %zu (sending %zu)", out, out->icy.remain, bytes);
 
-	// ICY is active
-	if (!out->icy.remain) {
+/*----------------------------------------------------------------------------*/
+static void frame_build(struct output_frame_s* frame, struct outputstate* out, size_t bytes) {
+	frame_reset(frame);
+	frame->len[FRAME_AUDIO] = bytes;
+
+	// ICY block comes right after the last audio bytes of an interval (bytes is never larger)
+	if (out->icy.active) {
+		out->icy.remain -= bytes;
+		LOG_DEBUG("[%p]: ICY remains %zu (sending %zu)", out, out->icy.remain, bytes);
+	}
+
+	if (out->icy.active && !out->icy.remain) {
 		int len_16 = 0;
-		char* buffer = calloc(ICY_LEN_MAX, 1);
 
 		if (out->icy.updated) {
 			char *format = (out->icy.artwork && *out->icy.artwork) ?
 							"NStreamTitle='%s%s%s';StreamURL='%s';" :
 							"NStreamTitle='%s%s%s';";
 			// there is room for 1 extra byte at the beginning for length
-			int len = snprintf(buffer, ICY_LEN_MAX, format,
+			int len = snprintf((char*) frame->icy, ICY_LEN_MAX, format,
 							 out->icy.artist, *out->icy.artist ? " - " : "",
 							 out->icy.title, out->icy.artwork) - 1;
 
+			len = min(len, ICY_LEN_MAX - 2);
 			len_16 = (len + 15) / 16;
-			memset(buffer + len + 1, 0, len_16 * 16 - len);
-			buffer[0] = len_16;
+			memset(frame->icy + len + 1, 0, len_16 * 16 - len);
 
 			LOG_INFO("[%p]: ICY update of %d bytes (%d blocks)\n\t%s\n\t%s\n\t%s", out, len, len_16, out->icy.artist, out->icy.title, out->icy.artwork);
 		}
 
-		send_chunked(out->chunked, backlog, sock, buffer, len_16 * 16 + 1, flags);
-		free(buffer);
+		frame->icy[0] = len_16;
+		frame->len[FRAME_ICY] = len_16 * 16 + 1;
 
 		out->icy.remain = out->icy.interval;
 		out->icy.updated = false;
 	}
 
-	return bytes;
+	// audio and ICY block share the same chunk
+	if (out->chunked) {
+		itoa(bytes + frame->len[FRAME_ICY], frame->head, 16);
+		strcat(frame->head, "\r\n");
+		frame->len[FRAME_HEAD] = strlen(frame->head);
+		memcpy(frame->tail, "\r\n", 2);
+		frame->len[FRAME_TAIL] = 2;
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static void frame_last(struct output_frame_s* frame, bool chunked) {
+	frame_reset(frame);
+	if (!chunked) return;
+
+	// zero-length chunk and its trailer make the "0\r\n\r\n" terminator
+	strcpy(frame->head, "0\r\n");
+	frame->len[FRAME_HEAD] = 3;
+	memcpy(frame->tail, "\r\n", 2);
+	frame->len[FRAME_TAIL] = 2;
+}
+
+/*----------------------------------------------------------------------------*/
+static size_t frame_pending(struct output_frame_s* frame) {
+	// audio bytes of the frame not sent yet
+	size_t done = frame->sent > frame->len[FRAME_HEAD] ? frame->sent - frame->len[FRAME_HEAD] : 0;
+	return frame->len[FRAME_AUDIO] - min(done, frame->len[FRAME_AUDIO]);
 }
 
 /*----------------------------------------------------------------------------*/
-static bool handle_http(struct thread_ctx_s *ctx, cache_buffer* cache, bool *use_cache, bool lingering, int index, int sock) {
-	char* body = NULL, * request = NULL, * p = NULL;
+static size_t frame_send(struct output_frame_s* frame, int sock, const void* audio, size_t bytes, struct uring_s* ring, void* data) {
+	/* Send what remains of the frame in a single call. Audio is not owned by the frame, so
+	 * caller provides its unsent part (might be less than what the frame needs) and only the
+	 * parts before a missing piece of audio can go. Returns how many audio bytes were sent. 
+	 * When a ring is provided, the frame is queued instead and nothing is sent until it has
+	 * been completed, so audio must stay where it is till then (see frame_sent) */
+	const void* base[FRAME_PARTS] = { frame->head, audio, frame->icy, frame->tail };
+	size_t pending = frame_pending(frame), skip = frame->sent;
+	io_vec iov[FRAME_PARTS];
+	int count = 0;
+
+	for (int i = 0; i < FRAME_PARTS; i++) {
+		size_t len = frame->len[i];
+
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+
+		// audio is always provided from where it stopped
+		if (i == FRAME_AUDIO) {
+			len = min(pending, bytes);
+			if (len) {
+				io_vec_set(iov[count], base[i], len);
+				count++;
+			}
+			skip = 0;
+			if (len < pending) break;
+		} else {
+			io_vec_set(iov[count], (u8_t*) base[i] + skip, len - skip);
+			count++;
+			skip = 0;
+		}
+	}
+
+	if (!count) return 0;
+
+#if URING
+	if (ring && uring_send(ring, sock, iov, count, data)) {
+		frame->queued = true;
+		return 0;
+	}
+#endif
+
+#if WIN
+	DWORD sent;
+	if (WSASend(sock, iov, count, &sent, 0, NULL, NULL) == SOCKET_ERROR) return 0;
+#else
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+	ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	if (sent <= 0) return 0;
+#endif
+
+	return frame_sent(frame, sent);
+}
+
+/*----------------------------------------------------------------------------*/
+static size_t frame_sent(struct output_frame_s* frame, size_t sent) {
+	// account for what went on the wire and return how much of it was audio
+	size_t pending = frame_pending(frame);
+	frame->sent += sent;
+	pending -= frame_pending(frame);
+
+	// frame is complete
+	if (!frame_busy(frame)) frame_reset(frame);
+
+	return pending;
+}
+
+/*----------------------------------------------------------------------------*/
+static int session_receive(struct output_thread_s* thread) {
+	// returns 1 when whole headers are there, 0 when they are still expected and -1 on error/close
+	while (!strstr(thread->request.data, "\r\n\r\n")) {
+		size_t room = HTTP_REQUEST_MAX - thread->request.len;
+
+		if (!room) {
+			LOG_WARN("[%p]: HTTP request exceeds %d bytes", thread->ctx, HTTP_REQUEST_MAX);
+			return -1;
+		}
+
+		ssize_t n = recv(thread->sock, thread->request.data + thread->request.len, room, 0);
+		if (n == 0) return -1;
+		if (n < 0) return last_error() == ERROR_WOULDBLOCK ? 0 : -1;
+
+		thread->request.len += n;
+		thread->request.data[thread->request.len] = '\0';
+	}
+
+	return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+static int session_respond(struct output_thread_s* thread) {
+	// returns 1 when whole response has been sent, 0 when socket is full and -1 on error
+	while (thread->response.sent < thread->response.len) {
+		ssize_t n = send(thread->sock, thread->response.data + thread->response.sent,
+						 thread->response.len - thread->response.sent, MSG_NOSIGNAL);
+		if (n < 0) return last_error() == ERROR_WOULDBLOCK ? 0 : -1;
+		thread->response.sent += n;
+	}
+
+	NFREE(thread->response.data);
+	return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+static void session_ready(void* arg) {
+	// from spool's thread, starved sessions of that player are kicked
+	output_wake((struct thread_ctx_s*) arg);
+}
+
+/*---------------------------------------------------------------------------*/
+static bool http_parse_request(char* data, char** request, key_data_t* headers, size_t max) {
+	// data holds complete headers and is not modified, request and headers must be freed
+	size_t count = 0;
+	char* eol = strstr(data, "\r\n");
+
+	headers[0].key = headers[0].data = NULL;
+	*request = strndup(data, eol - data);
+	if (!strchr(*request, ' ')) return false;
+
+	for (char* line = eol + 2; (eol = strstr(line, "\r\n")) != line && count < max - 1; line = eol + 2) {
+		char* colon = memchr(line, ':', eol - line);
+		if (!colon) continue;
+
+		char* value = colon + 1;
+		while (*value == ' ' || *value == '\t') value++;
+
+		headers[count].key = strndup(line, colon - line);
+		headers[count].data = strndup(value, eol - value);
+		count++;
+		headers[count].key = headers[count].data = NULL;
+	}
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool handle_http(struct thread_ctx_s *ctx, cache_buffer* cache, bool *use_cache, bool lingering, int index, char** response, char* data) {
+	char* request = NULL, * p = NULL;
 	key_data_t headers[64], resp[16] = { { NULL, NULL } };
-	int len, id;
+	int id;
 
-	if (!http_parse_simple(sock, &request, headers, &body, &len)) {
+	if (!http_parse_request(data, &request, headers, ARRAY_COUNT(headers))) {
 		LOG_WARN("[%p]: http parsing error %s", ctx, request);
-		NFREE(body);
 		NFREE(request);
 		kd_free(headers);
 		return false;
 	}
 
 	// we could always claim to be 1.1 though
-	char* head = NULL, *response = NULL;
+	char* head = NULL;
 	enum { ANY, SONOS, CHROMECAST } type;
 	bool send_body = strstr(request, "HEAD") == NULL;
 	
@@ -527,7 +1411,12 @@ static bool handle_http(struct thread_ctx_s *ctx, cache_buffer* cache, bool *use
 	// handle various DLNA headers
 	if ((p = kd_lookup(headers, "transferMode.dlna.org")) != NULL) kd_add(resp, "transferMode.dlna.org", p);
 	if (kd_lookup(headers, "getcontentFeatures.dlna.org")) {
-		char* dlna_features = format_to_dlna(ctx->output.format, cache->infinite, !ctx->output.duration && !ctx->output.encode.flow);
+		u32_t ms = 0;
+		size_t offset;
+		LOCK_O;
+		bool time_seek = _output_seek(index, &ms, &offset, ctx);
+		UNLOCK_O;
+		char* dlna_features = format_to_dlna(ctx->output.format, cache->infinite, !ctx->output.duration && !ctx->output.encode.flow, time_seek);
 		kd_add(resp, "contentFeatures.dlna.org", dlna_features);
 		free(dlna_features);
 	}
@@ -545,6 +1434,7 @@ static bool handle_http(struct thread_ctx_s *ctx, cache_buffer* cache, bool *use
 	}
 	else {
 		// by defautl use cache and restart from 0 (will be changed below if needed)
+		bool resumed = cache->tell(cache) != 0;
 		*use_cache = true;
 		cache->set_offset(cache, 0);
 		int64_t length = ctx->output.length;
@@ -557,7 +1447,33 @@ static bool handle_http(struct thread_ctx_s *ctx, cache_buffer* cache, bool *use
 		 * proper range request but we need to answer 206 without a content-range (which is not
 		 * compliant) or it fails as well */
 
-		if ((p = kd_lookup(headers, "Range")) != NULL && cache->total) {
+		// frames are re-numbered by passthrough codecs, only their seek table knows where time is
+		char *npt = kd_lookup(headers, "TimeSeekRange.dlna.org");
+		bool seek = false;
+		size_t seek_offset = 0;
+		u32_t ms = 0;
+
+		if (npt && cache->total && parse_npt(npt, &ms)) {
+			LOCK_O;
+			seek = _output_seek(index, &ms, &seek_offset, ctx) && cache->scope(cache, seek_offset) == 0;
+			UNLOCK_O;
+			// time seek is only advertised when possible, otherwise handle request as usual
+			if (!seek) LOG_INFO("[%p]: time seek cannot be satisfied %s, ignored", ctx, npt);
+		}
+
+		if (seek) {
+			if (ctx->output.duration) {
+				kd_vadd(resp, "TimeSeekRange.dlna.org", "npt=%u.%03u-%u.%03u/%u.%03u bytes=%zu-%zu/*", ms / 1000, ms % 1000,
+						ctx->output.duration / 1000, ctx->output.duration % 1000, ctx->output.duration / 1000, 
+						ctx->output.duration % 1000, seek_offset, cache->total - 1);
+			} else {
+				kd_vadd(resp, "TimeSeekRange.dlna.org", "npt=%u.%03u-/* bytes=%zu-%zu/*", ms / 1000, ms % 1000,
+						seek_offset, cache->total - 1);
+			}
+			cache->set_offset(cache, seek_offset);
+			LOG_INFO("[%p]: serving time %u (asked %s) from %zu->%zu", ctx, ms, npt, seek_offset, cache->total - 1);
+			length = 0;
+		} else if ((p = kd_lookup(headers, "Range")) != NULL && cache->total) {
 			size_t offset = 0;
 			(void)!sscanf(p, "bytes=%zu", &offset);
 
@@ -605,7 +1521,7 @@ static bool handle_http(struct thread_ctx_s *ctx, cache_buffer* cache, bool *use
 			LOG_INFO("[%p]: won't resend from start when fully served", ctx);
 		} else if (cache->total) {
 			// see Sonos above but also Sonos re-opens stream when icy to add it (not a resume!)
-			if (type == SONOS && !ctx->output.icy.active) length = UINT32_MAX;
+			if (type == SONOS && !ctx->output.icy.active && (cache->type != CACHE_STORED || resumed)) length = UINT32_MAX;
 			LOG_INFO("[%p]: serving with cache from %zu (cached:%zu)", ctx, cache->total - cache->level(cache), cache->total);
 		} else {
 			// normal request, don't use cache
@@ -631,14 +1547,32 @@ static bool handle_http(struct thread_ctx_s *ctx, cache_buffer* cache, bool *use
 
 	// unless instructed otherwise use a 200 with the correct HTTP version
 	if (!head) head = ctx->output.chunked ? "HTTP/1.1 200 OK" : "HTTP/1.0 200 OK";
-	response = http_send(sock, head, resp);
-	LOG_INFO("[%p]: responding:\n%s", ctx, response);
 
-	NFREE(body);
-	NFREE(response);
+	// reactor sends it when socket is ready
+	char* dump = kd_dump(resp);
+	if (asprintf(response, "%s\r\n%s", head, dump) < 0) *response = NULL;
+	LOG_INFO("[%p]: responding:\n%s", ctx, *response);
+
+	NFREE(dump);
 	NFREE(request);
 	kd_free(resp);
 	kd_free(headers);
 
 	return send_body;
 }
+
+/*---------------------------------------------------------------------------*/
+static bool parse_npt(char* range, u32_t* ms) {
+	unsigned hours, minutes;
+	double seconds;
+
+	// npt=<seconds>[.frac]- or npt=<h>:<mm>:<ss>[.frac]-
+	if ((range = strcasestr(range, "npt=")) == NULL) return false;
+	range += 4;
+
+	if (sscanf(range, "%u:%u:%lf", &hours, &minutes, &seconds) == 3) seconds += hours * 3600 + minutes * 60;
+	else if (sscanf(range, "%lf", &seconds) != 1 || seconds < 0) return false;
+
+	*ms = seconds * 1000;
+	return true;
+}
@@ -0,0 +1,485 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Philippe 2015-2023, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Vector versions of the PCM kernels of output.c. They only process the bulk of
+ * a chunk and return how much they did, the scalar loops in output.c remain the
+ * reference and take the tail (and whatever format is not handled here). Results
+ * must be bit-exact with the scalar code, including the 47 bits saturation. */
+
+#include "squeezelite.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86	1
+#include <immintrin.h>
+#elif defined(__GNUC__) && (defined(__ARM_NEON) || defined(__ARM_NEON__)) && !defined(__ARM_BIG_ENDIAN)
+#define SIMD_NEON	1
+#include <arm_neon.h>
+#endif
+
+extern log_level	output_loglevel;
+static log_level 	*loglevel = &output_loglevel;
+
+#define MAX_VAL32 0x7fffffffffffLL
+
+static size_t none_pack(void *dst, u32_t *src, size_t frames, u8_t channels, u8_t sample_size, int endian) { return 0; }
+static size_t none_gain(s32_t *iptr, u32_t gain, u8_t shift, size_t count) { return 0; }
+static size_t none_cross(s32_t *iptr, s32_t *cptr, s32_t *fade, u32_t gain_in, u32_t gain_out, u8_t shift, size_t count) { return 0; }
+
+size_t (*simd_pack)(void *dst, u32_t *src, size_t frames, u8_t channels, u8_t sample_size, int endian) = none_pack;
+size_t (*simd_gain)(s32_t *iptr, u32_t gain, u8_t shift, size_t count) = none_gain;
+size_t (*simd_cross)(s32_t *iptr, s32_t *cptr, s32_t *fade, u32_t gain_in, u32_t gain_out, u8_t shift, size_t count) = none_cross;
+
+#if SIMD_X86 || SIMD_NEON
+/*
+ Saturation is done on the input side so that only 32 bits compares are needed:
+ x * gain stays within +/-MAX_VAL32 as long as |x| <= MAX_VAL32 / gain, anything
+ beyond is replaced by the shifted saturation value. When that limit does not fit
+ in 32 bits, no sample can saturate.
+*/
+struct gain_s {
+	bool clamp;
+	int bits;
+	s32_t limit, hi, lo;
+};
+
+static bool gain_setup(u32_t gain, u8_t shift, struct gain_s *p) {
+	// signed 32x32 multiplies only
+	if (gain >= 0x80000000 || (shift != 0 && shift != 8 && shift != 16 && shift != 24)) return false;
+
+	p->bits = 16 + shift;
+	p->clamp = gain && MAX_VAL32 / gain <= 0x7fffffff;
+	p->limit = p->clamp ? MAX_VAL32 / gain : 0x7fffffff;
+	p->hi = MAX_VAL32 >> p->bits;
+	p->lo = -MAX_VAL32 >> p->bits;
+
+	return true;
+}
+
+/*
+ Crossfade has one fade value per sample and is only vectorized without replay
+ gain: x * (65536 - fade) + c * fade is then within [-2^47, 2^47 - 1] and -2^47
+ and -MAX_VAL32 give the same value once shifted by at least 16 bits, so the
+ saturation is a no-op.
+*/
+static bool cross_setup(u32_t gain_in, u32_t gain_out, u8_t shift) {
+	return gain_in == 65536 && gain_out == 65536 && (shift == 0 || shift == 8 || shift == 16 || shift == 24);
+}
+#endif
+
+#if SIMD_X86
+/*---------------------------------------------------------------------------*/
+/*                                   SSE2                                    */
+/*---------------------------------------------------------------------------*/
+#define SSE2 __attribute__((target("sse2")))
+
+static inline SSE2 __m128i sse2_load(u32_t *src, u8_t channels) {
+	__m128i a = _mm_loadu_si128((__m128i*) src);
+	if (channels == 2) return a;
+	// keep left channel of 4 frames
+	a = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+	return _mm_unpacklo_epi64(a, _mm_shuffle_epi32(_mm_loadu_si128((__m128i*) (src + 4)), _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+static inline SSE2 __m128i sse2_swap16(__m128i v) {
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+// signed x times positive g (per lane), 64 bits results of even and odd lanes
+static inline SSE2 void sse2_mul(__m128i x, __m128i g, __m128i *even, __m128i *odd) {
+	__m128i sign = _mm_srai_epi32(x, 31);
+	__m128i godd = _mm_srli_epi64(g, 32);
+	*even = _mm_sub_epi64(_mm_mul_epu32(x, g), _mm_and_si128(_mm_slli_epi64(sign, 32), _mm_slli_epi64(g, 32)));
+	*odd = _mm_sub_epi64(_mm_mul_epu32(_mm_srli_epi64(x, 32), godd), _mm_and_si128(sign, _mm_slli_epi64(godd, 32)));
+}
+
+// arithmetic shift of 64 bits lanes, re-interleaved as 32 bits results
+static inline SSE2 __m128i sse2_shift(__m128i even, __m128i odd, int bits) {
+	__m128i mask = _mm_set_epi32(0, -1, 0, -1);
+	if (bits <= 32) {
+		__m128i n = _mm_cvtsi32_si128(bits);
+		even = _mm_srl_epi64(even, n);
+		odd = _mm_slli_epi64(_mm_srl_epi64(odd, n), 32);
+	} else {
+		__m128i n = _mm_cvtsi32_si128(bits - 32);
+		even = _mm_sra_epi32(_mm_srli_epi64(even, 32), n);
+		odd = _mm_sra_epi32(odd, n);
+	}
+	return _mm_or_si128(_mm_and_si128(mask, even), _mm_andnot_si128(mask, odd));
+}
+
+static inline SSE2 __m128i sse2_select(__m128i mask, __m128i a, __m128i b) {
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/*---------------------------------------------------------------------------*/
+static SSE2 size_t sse2_pack(void *dst, u32_t *src, size_t frames, u8_t channels, u8_t sample_size, int endian) {
+	size_t i, count = (frames * channels) & ~3;
+	u8_t *optr = dst;
+
+	// 24 bits would require a byte shuffle, 32 bits stereo little endian is a memcpy
+	if ((sample_size != 16 && sample_size != 32) || (sample_size == 32 && endian && channels == 2)) return 0;
+
+	for (i = 0; i < count; i += 4, src += 4 / channels * 2) {
+		__m128i v = sse2_load(src, channels);
+		if (sample_size == 16) {
+			v = _mm_srai_epi32(v, 16);
+			v = _mm_packs_epi32(v, v);
+			if (!endian) v = sse2_swap16(v);
+			_mm_storel_epi64((__m128i*) optr, v);
+			optr += 8;
+		} else {
+			if (!endian) {
+				v = sse2_swap16(v);
+				v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+				v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+			}
+			_mm_storeu_si128((__m128i*) optr, v);
+			optr += 16;
+		}
+	}
+
+	return count / channels;
+}
+
+/*---------------------------------------------------------------------------*/
+static SSE2 size_t sse2_gain(s32_t *iptr, u32_t gain, u8_t shift, size_t count) {
+	struct gain_s p;
+	size_t i;
+
+	count &= ~3;
+
+	if (gain == 65536) {
+		__m128i n = _mm_cvtsi32_si128(shift);
+		for (i = 0; i < count; i += 4) {
+			__m128i x = _mm_loadu_si128((__m128i*) (iptr + i));
+			_mm_storeu_si128((__m128i*) (iptr + i), _mm_sra_epi32(x, n));
+		}
+		return count;
+	}
+
+	if (!gain_setup(gain, shift, &p)) return 0;
+
+	__m128i g = _mm_set1_epi32(gain);
+	__m128i limit = _mm_set1_epi32(p.limit), nlimit = _mm_set1_epi32(-p.limit);
+	__m128i hi = _mm_set1_epi32(p.hi), lo = _mm_set1_epi32(p.lo);
+
+	for (i = 0; i < count; i += 4) {
+		__m128i x = _mm_loadu_si128((__m128i*) (iptr + i)), even, odd, r;
+		sse2_mul(x, g, &even, &odd);
+		r = sse2_shift(even, odd, p.bits);
+		if (p.clamp) {
+			r = sse2_select(_mm_cmpgt_epi32(x, limit), hi, r);
+			r = sse2_select(_mm_cmplt_epi32(x, nlimit), lo, r);
+		}
+		_mm_storeu_si128((__m128i*) (iptr + i), r);
+	}
+
+	return count;
+}
+
+/*---------------------------------------------------------------------------*/
+static SSE2 size_t sse2_cross(s32_t *iptr, s32_t *cptr, s32_t *fade, u32_t gain_in, u32_t gain_out, u8_t shift, size_t count) {
+	size_t i;
+
+	if (!cross_setup(gain_in, gain_out, shift)) return 0;
+
+	__m128i unity = _mm_set1_epi32(65536);
+	count &= ~3;
+
+	for (i = 0; i < count; i += 4) {
+		__m128i x = _mm_loadu_si128((__m128i*) (iptr + i));
+		__m128i c = _mm_loadu_si128((__m128i*) (cptr + i));
+		__m128i w_out = _mm_loadu_si128((__m128i*) (fade + i)), w_in = _mm_sub_epi32(unity, w_out);
+		__m128i xe, xo, ce, co;
+		sse2_mul(x, w_in, &xe, &xo);
+		sse2_mul(c, w_out, &ce, &co);
+		_mm_storeu_si128((__m128i*) (iptr + i), sse2_shift(_mm_add_epi64(xe, ce), _mm_add_epi64(xo, co), 16 + shift));
+	}
+
+	return count;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                   AVX2                                    */
+/*---------------------------------------------------------------------------*/
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i avx2_load(u32_t *src, u8_t channels) {
+	__m256i a = _mm256_loadu_si256((__m256i*) src);
+	if (channels == 2) return a;
+	// keep left channel of 8 frames
+	__m256i idx = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	__m256i b = _mm256_loadu_si256((__m256i*) (src + 8));
+	return _mm256_permute2x128_si256(_mm256_permutevar8x32_epi32(a, idx), _mm256_permutevar8x32_epi32(b, idx), 0x20);
+}
+
+static inline AVX2 __m256i avx2_shift(__m256i even, __m256i odd, int bits) {
+	if (bits <= 32) {
+		__m128i n = _mm_cvtsi32_si128(bits);
+		even = _mm256_srl_epi64(even, n);
+		odd = _mm256_slli_epi64(_mm256_srl_epi64(odd, n), 32);
+	} else {
+		__m128i n = _mm_cvtsi32_si128(bits - 32);
+		even = _mm256_sra_epi32(_mm256_srli_epi64(even, 32), n);
+		odd = _mm256_sra_epi32(odd, n);
+	}
+	return _mm256_blend_epi32(even, odd, 0xaa);
+}
+
+/*---------------------------------------------------------------------------*/
+static AVX2 size_t avx2_pack(void *dst, u32_t *src, size_t frames, u8_t channels, u8_t sample_size, int endian) {
+	size_t i, count = (frames * channels) & ~7;
+	u8_t *optr = dst;
+	__m256i shuffle;
+
+	if (sample_size == 8 || (sample_size == 32 && endian && channels == 2)) return 0;
+
+	if (sample_size == 16) {
+		shuffle = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+								   1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	} else if (sample_size == 24 && endian) {
+		shuffle = _mm256_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1,
+								   1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+	} else if (sample_size == 24) {
+		shuffle = _mm256_setr_epi8(3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1,
+								   3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1);
+	} else {
+		shuffle = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+								   3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	}
+
+	for (i = 0; i < count; i += 8, src += 8 / channels * 2) {
+		__m256i v = avx2_load(src, channels);
+		if (sample_size == 16) {
+			__m128i s;
+			v = _mm256_srai_epi32(v, 16);
+			s = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+			if (!endian) s = _mm_shuffle_epi8(s, _mm256_castsi256_si128(shuffle));
+			_mm_storeu_si128((__m128i*) optr, s);
+			optr += 16;
+		} else if (sample_size == 24) {
+			// 12 bytes per lane, then make them contiguous
+			v = _mm256_shuffle_epi8(v, shuffle);
+			v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+			_mm_storeu_si128((__m128i*) optr, _mm256_castsi256_si128(v));
+			_mm_storel_epi64((__m128i*) (optr + 16), _mm256_extracti128_si256(v, 1));
+			optr += 24;
+		} else {
+			if (!endian) v = _mm256_shuffle_epi8(v, shuffle);
+			_mm256_storeu_si256((__m256i*) optr, v);
+			optr += 32;
+		}
+	}
+
+	return count / channels;
+}
+
+/*---------------------------------------------------------------------------*/
+static AVX2 size_t avx2_gain(s32_t *iptr, u32_t gain, u8_t shift, size_t count) {
+	struct gain_s p;
+	size_t i;
+
+	count &= ~7;
+
+	if (gain == 65536) {
+		__m128i n = _mm_cvtsi32_si128(shift);
+		for (i = 0; i < count; i += 8) {
+			__m256i x = _mm256_loadu_si256((__m256i*) (iptr + i));
+			_mm256_storeu_si256((__m256i*) (iptr + i), _mm256_sra_epi32(x, n));
+		}
+		return count;
+	}
+
+	if (!gain_setup(gain, shift, &p)) return 0;
+
+	__m256i g = _mm256_set1_epi32(gain);
+	__m256i limit = _mm256_set1_epi32(p.limit), nlimit = _mm256_set1_epi32(-p.limit);
+	__m256i hi = _mm256_set1_epi32(p.hi), lo = _mm256_set1_epi32(p.lo);
+
+	for (i = 0; i < count; i += 8) {
+		__m256i x = _mm256_loadu_si256((__m256i*) (iptr + i));
+		__m256i r = avx2_shift(_mm256_mul_epi32(x, g), _mm256_mul_epi32(_mm256_srli_epi64(x, 32), g), p.bits);
+		if (p.clamp) {
+			r = _mm256_blendv_epi8(r, hi, _mm256_cmpgt_epi32(x, limit));
+			r = _mm256_blendv_epi8(r, lo, _mm256_cmpgt_epi32(nlimit, x));
+		}
+		_mm256_storeu_si256((__m256i*) (iptr + i), r);
+	}
+
+	return count;
+}
+
+/*---------------------------------------------------------------------------*/
+static AVX2 size_t avx2_cross(s32_t *iptr, s32_t *cptr, s32_t *fade, u32_t gain_in, u32_t gain_out, u8_t shift, size_t count) {
+	size_t i;
+
+	if (!cross_setup(gain_in, gain_out, shift)) return 0;
+
+	__m256i unity = _mm256_set1_epi32(65536);
+	count &= ~7;
+
+	for (i = 0; i < count; i += 8) {
+		__m256i x = _mm256_loadu_si256((__m256i*) (iptr + i));
+		__m256i c = _mm256_loadu_si256((__m256i*) (cptr + i));
+		__m256i w_out = _mm256_loadu_si256((__m256i*) (fade + i)), w_in = _mm256_sub_epi32(unity, w_out);
+		__m256i even = _mm256_add_epi64(_mm256_mul_epi32(x, w_in), _mm256_mul_epi32(c, w_out));
+		__m256i odd = _mm256_add_epi64(_mm256_mul_epi32(_mm256_srli_epi64(x, 32), _mm256_srli_epi64(w_in, 32)),
+									   _mm256_mul_epi32(_mm256_srli_epi64(c, 32), _mm256_srli_epi64(w_out, 32)));
+		_mm256_storeu_si256((__m256i*) (iptr + i), avx2_shift(even, odd, 16 + shift));
+	}
+
+	return count;
+}
+#endif
+
+#if SIMD_NEON
+/*---------------------------------------------------------------------------*/
+/*                                   NEON                                    */
+/*---------------------------------------------------------------------------*/
+static size_t neon_pack(void *dst, u32_t *src, size_t frames, u8_t channels, u8_t sample_size, int endian) {
+	size_t i, count = (frames * channels) & ~7;
+	u8_t *optr = dst;
+
+	if (sample_size == 8 || (sample_size == 32 && endian && channels == 2)) return 0;
+
+	for (i = 0; i < count; i += 8, src += 8 / channels * 2) {
+		uint32x4_t a, b;
+
+		if (channels == 2) {
+			a = vld1q_u32(src);
+			b = vld1q_u32(src + 4);
+		} else {
+			// keep left channel of 8 frames
+			a = vld2q_u32(src).val[0];
+			b = vld2q_u32(src + 8).val[0];
+		}
+
+		if (sample_size == 16) {
+			uint16x8_t v = vcombine_u16(vshrn_n_u32(a, 16), vshrn_n_u32(b, 16));
+			if (!endian) v = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(v)));
+			vst1q_u16((u16_t*) optr, v);
+			optr += 16;
+		} else if (sample_size == 24) {
+			uint8x8x3_t v;
+			uint8x8_t b1 = vmovn_u16(vcombine_u16(vmovn_u32(vshrq_n_u32(a, 8)), vmovn_u32(vshrq_n_u32(b, 8))));
+			uint8x8_t b2 = vmovn_u16(vcombine_u16(vmovn_u32(vshrq_n_u32(a, 16)), vmovn_u32(vshrq_n_u32(b, 16))));
+			uint8x8_t b3 = vmovn_u16(vcombine_u16(vmovn_u32(vshrq_n_u32(a, 24)), vmovn_u32(vshrq_n_u32(b, 24))));
+			v.val[0] = endian ? b1 : b3;
+			v.val[1] = b2;
+			v.val[2] = endian ? b3 : b1;
+			vst3_u8(optr, v);
+			optr += 24;
+		} else {
+			if (!endian) {
+				a = vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(a)));
+				b = vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(b)));
+			}
+			vst1q_u32((u32_t*) optr, a);
+			vst1q_u32((u32_t*) optr + 4, b);
+			optr += 32;
+		}
+	}
+
+	return count / channels;
+}
+
+/*---------------------------------------------------------------------------*/
+static size_t neon_gain(s32_t *iptr, u32_t gain, u8_t shift, size_t count) {
+	struct gain_s p;
+	size_t i;
+
+	count &= ~3;
+
+	if (gain == 65536) {
+		int32x4_t n = vdupq_n_s32(-shift);
+		for (i = 0; i < count; i += 4) vst1q_s32(iptr + i, vshlq_s32(vld1q_s32(iptr + i), n));
+		return count;
+	}
+
+	if (!gain_setup(gain, shift, &p)) return 0;
+
+	int32x2_t g = vdup_n_s32(gain);
+	int64x2_t n = vdupq_n_s64(-p.bits);
+	int32x4_t limit = vdupq_n_s32(p.limit), nlimit = vdupq_n_s32(-p.limit);
+	int32x4_t hi = vdupq_n_s32(p.hi), lo = vdupq_n_s32(p.lo);
+
+	for (i = 0; i < count; i += 4) {
+		int32x4_t x = vld1q_s32(iptr + i);
+		int64x2_t l = vshlq_s64(vmull_s32(vget_low_s32(x), g), n);
+		int64x2_t h = vshlq_s64(vmull_s32(vget_high_s32(x), g), n);
+		int32x4_t r = vcombine_s32(vmovn_s64(l), vmovn_s64(h));
+		if (p.clamp) {
+			r = vbslq_s32(vcgtq_s32(x, limit), hi, r);
+			r = vbslq_s32(vcltq_s32(x, nlimit), lo, r);
+		}
+		vst1q_s32(iptr + i, r);
+	}
+
+	return count;
+}
+
+/*---------------------------------------------------------------------------*/
+static size_t neon_cross(s32_t *iptr, s32_t *cptr, s32_t *fade, u32_t gain_in, u32_t gain_out, u8_t shift, size_t count) {
+	size_t i;
+
+	if (!cross_setup(gain_in, gain_out, shift)) return 0;
+
+	int32x4_t unity = vdupq_n_s32(65536);
+	int64x2_t n = vdupq_n_s64(-(16 + shift));
+	count &= ~3;
+
+	for (i = 0; i < count; i += 4) {
+		int32x4_t x = vld1q_s32(iptr + i), c = vld1q_s32(cptr + i);
+		int32x4_t w_out = vld1q_s32(fade + i), w_in = vsubq_s32(unity, w_out);
+		int64x2_t l = vmlal_s32(vmull_s32(vget_low_s32(x), vget_low_s32(w_in)), vget_low_s32(c), vget_low_s32(w_out));
+		int64x2_t h = vmlal_s32(vmull_s32(vget_high_s32(x), vget_high_s32(w_in)), vget_high_s32(c), vget_high_s32(w_out));
+		vst1q_s32(iptr + i, vcombine_s32(vmovn_s64(vshlq_s64(l, n)), vmovn_s64(vshlq_s64(h, n))));
+	}
+
+	return count;
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+void output_simd_init(void) {
+	char *name = "none";
+
+#if SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		simd_pack = avx2_pack;
+		simd_gain = avx2_gain;
+		simd_cross = avx2_cross;
+		name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		simd_pack = sse2_pack;
+		simd_gain = sse2_gain;
+		simd_cross = sse2_cross;
+		name = "sse2";
+	}
+#elif SIMD_NEON
+	simd_pack = neon_pack;
+	simd_gain = neon_gain;
+	simd_cross = neon_cross;
+	name = "neon";
+#endif
+
+	LOG_INFO("PCM kernels using %s", name);
+}
@@ -28,10 +28,10 @@
 extern log_level 	decode_loglevel;
 static log_level 	*loglevel = &decode_loglevel;
 
-#define LOCK_D   mutex_lock(ctx->decode.mutex);
-#define UNLOCK_D mutex_unlock(ctx->decode.mutex);
-#define LOCK_O   mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(ctx->outputbuf->mutex)
+#define LOCK_D   metrics_lock(ctx->decode.mutex, METRICS_LOCK_D, ctx);
+#define UNLOCK_D metrics_unlock(ctx->decode.mutex, METRICS_LOCK_D, ctx);
+#define LOCK_O   metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
 
 // macros to map to processing functions - currently only resample.c
 // this can be made more generic when multiple processing mechanisms get added
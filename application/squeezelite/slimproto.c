@@ -61,12 +61,12 @@
 extern log_level slimproto_loglevel;
 static log_level *loglevel = &slimproto_loglevel;
 
-#define LOCK_S   mutex_lock(ctx->streambuf->mutex)
-#define UNLOCK_S mutex_unlock(ctx->streambuf->mutex)
-#define LOCK_O   mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(ctx->outputbuf->mutex)
-#define LOCK_D   mutex_lock(ctx->decode.mutex)
-#define UNLOCK_D mutex_unlock(ctx->decode.mutex)
+#define LOCK_S   metrics_lock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define UNLOCK_S metrics_unlock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define LOCK_O   metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define LOCK_D   metrics_lock(ctx->decode.mutex, METRICS_LOCK_D, ctx)
+#define UNLOCK_D metrics_unlock(ctx->decode.mutex, METRICS_LOCK_D, ctx)
 #define LOCK_P   mutex_lock(ctx->mutex)
 #define UNLOCK_P mutex_unlock(ctx->mutex)
 
@@ -78,6 +78,7 @@ static u8_t		pcm_channels[] = { 1, 2 };
 
 static bool process_start(u8_t format, u32_t rate, u8_t size, u8_t channels,
 						  u8_t endianness, struct thread_ctx_s *ctx);
+static void _output_size(struct metadata_s *metadata, struct thread_ctx_s *ctx);
 
 /*---------------------------------------------------------------------------*/
 void send_packet(u8_t *packet, size_t len, sockfd sock) {
@@ -226,6 +227,28 @@ static void sendSETDName(const char *name, sockfd sock) {
 	send_packet((u8_t *)name, strlen(name) + 1, sock);
 }
 
+/*---------------------------------------------------------------------------*/
+static u32_t stream_request(in_addr_t ip, struct strm_packet *strm, char *header, unsigned len) {
+	char request[MAX_HEADER + 64], *p;
+
+	// only the request line matters, minus our own player id
+	memcpy(request, header, len);
+	request[len] = '\0';
+	if ((p = strpbrk(request, "\r\n")) != NULL) *p = '\0';
+
+	if ((p = strcasestr(request, "player=")) != NULL) {
+		char *q = p + strcspn(p, "& ");
+		memmove(p, q, strlen(q) + 1);
+	}
+
+	// then where it is sent and what format is expected
+	p = request + strlen(request);
+	sprintf(p, "|%x|%hu|%c|%c|%c|%c", ip, strm->server_port, strm->format, strm->pcm_sample_rate,
+			strm->pcm_sample_size, strm->pcm_channels);
+
+	return hash32(request);
+}
+
 /*---------------------------------------------------------------------------*/
 static void process_strm(u8_t *pkt, int len, struct thread_ctx_s *ctx) {
 	struct strm_packet *strm = (struct strm_packet *)pkt;
@@ -289,6 +312,7 @@ static void process_strm(u8_t *pkt, int len, struct thread_ctx_s *ctx) {
 			ctx->output.state = OUTPUT_RUNNING;
 			ctx->output.start_at = jiffies;
 			UNLOCK_O;
+			output_wake(ctx);
 			sendSTAT("STMr", 0, ctx);
 		}
 		break;
@@ -314,6 +338,7 @@ static void process_strm(u8_t *pkt, int len, struct thread_ctx_s *ctx) {
 			}
 
 			ctx->output.next_replay_gain = unpackN(&strm->replay_gain);
+			ctx->output.request = stream_request(ip, strm, header, header_len);
 			ctx->output.fade_mode = strm->transition_type - '0';
 			ctx->output.fade_secs = strm->transition_period;
 
@@ -368,6 +393,7 @@ static void process_cont(u8_t *pkt, int len, struct thread_ctx_s *ctx) {
 			ctx->stream.meta_interval = ctx->stream.meta_next = cont->metaint;
 		}
 		UNLOCK_S;
+		wakeup_signal(&ctx->stream.wake);
 		wake_controller(ctx);
 	}
 }
@@ -568,15 +594,6 @@ static void slimproto_run(struct thread_ctx_s *ctx) {
 				wake = true;
 			}
 
-			if (ctx->cli_sock > 0 && (int) (gettime_ms() - ctx->cli_timeout) > 0) {
-				if (!mutex_trylock(ctx->cli_mutex)) {
-					LOG_INFO("[%p] Closing CLI socket %d", ctx, ctx->cli_sock);
-					closesocket(ctx->cli_sock);
-					ctx->cli_sock = -1;
-					mutex_unlock(ctx->cli_mutex);
-				}
-			}
-
 			timeouts = 0;
 
 		} else if (++timeouts > 35) {
@@ -623,6 +640,9 @@ static void slimproto_run(struct thread_ctx_s *ctx) {
 			}
 		}
 
+		// have sync group at hand so that track start never waits for LMS
+		sync_cache_refresh(ctx);
+
 		if (wake || now - ctx->slim_run.last > 100 || ctx->slim_run.last > now) {
 			bool _sendSTMs = false;
 			bool _sendDSCO = false;
@@ -729,14 +749,17 @@ static void slimproto_run(struct thread_ctx_s *ctx) {
 				!ctx->sentSTMl && ctx->decode.state == DECODE_READY) {
 				if (ctx->autostart == 0) {
 					ctx->decode.state = DECODE_RUNNING;
+					wakeup_signal(&ctx->decode.wake);
 					_sendSTMl = true;
 					ctx->sentSTMl = true;
 				} else if (ctx->autostart == 1) {
 					ctx->decode.state = DECODE_RUNNING;
+					wakeup_signal(&ctx->decode.wake);
 					LOCK_O;
-					// release output thread now that we are decoding
+					// release output session now that we are decoding
 					ctx->output.state = OUTPUT_RUNNING;
 					UNLOCK_O;
+					output_wake(ctx);
 				}
 				ctx->callback(ctx->MR, SQ_PLAY);
 				// autostart 2 and 3 require cont to be received first
@@ -936,12 +959,6 @@ static void slimproto(struct thread_ctx_s *ctx) {
 			usleep(100000);
 		}
 
-		mutex_lock(ctx->cli_mutex);
-		if (ctx->cli_sock != -1) {
-			closesocket(ctx->cli_sock);
-			ctx->cli_sock = -1;
-		}
-		mutex_unlock(ctx->cli_mutex);
 		closesocket(ctx->sock);
 
 		if (ctx->new_server_cap)	{
@@ -974,7 +991,7 @@ void slimproto_thread_init(struct thread_ctx_s *ctx) {
 
 	ctx->slimproto_ip = 0;
 	ctx->slimproto_port = PORT;
-	ctx->cli_sock = ctx->sock = -1;
+	ctx->sock = -1;
 	ctx->running = true;
 
 	if (strcmp(ctx->config.server, "?")) {
@@ -1022,7 +1039,16 @@ static bool process_start(u8_t format, u32_t rate, u8_t size, u8_t channels, u8_
 	// try to handle next track failed stream where we jump over N tracks
 	info.index = ctx->render.index != -1 ? out->index - ctx->render.index : 0;
 	info.flow = out->encode.flow;
-	_buf_resize(ctx->outputbuf, ctx->config.outputbuf_size);
+
+	// learn how much faster than real-time the renderer pulled previous track
+	if (out->pull.rate && out->pull.bytes && now - out->pull.start > 1000) {
+		u32_t burst = (out->pull.bytes * 1000 / out->pull.rate) * 100 / (now - out->pull.start);
+		burst = max(burst, 100);
+		burst = min(burst, 100 * BUFFER_MAX_SCALE);
+		out->pull.burst = (3 * out->pull.burst + burst) / 4;
+	}
+	out->pull.bytes = 0;
+	out->pull.start = now;
 	UNLOCK_O;
 
 	/*
@@ -1073,6 +1099,9 @@ static bool process_start(u8_t format, u32_t rate, u8_t size, u8_t channels, u8_
 	// in flow mode we now have eveything, just initialize codec
 	if (out->encode.flow) {
 		if (out->icy.active) output_set_icy(&info.metadata, ctx);
+		LOCK_O;
+		_output_size(&info.metadata, ctx);
+		UNLOCK_O;
 		metadata_free(&info.metadata);
 		return codec_open(out->codec, out->sample_size, out->sample_rate,
 			out->channels, out->in_endian, ctx);
@@ -1249,7 +1278,16 @@ static bool process_start(u8_t format, u32_t rate, u8_t size, u8_t channels, u8_
 		out->out_endian = (out->format == 'w');
 		out->length = ctx->config.stream_length;				
 
-		if (codec_open(out->codec, out->sample_size, out->sample_rate, out->channels,
+		// when a synchronized player already encodes the same stream, just drain ours
+		bool follow = output_follow(hash, ctx);
+		// same when that exact body has been produced before (upstream is still fetched)
+		bool stored = !follow && output_stored(ctx);
+
+		LOCK_O;
+		_output_size(&info.metadata, ctx);
+		UNLOCK_O;
+
+		if (codec_open(follow || stored ? '-' : out->codec, out->sample_size, out->sample_rate, out->channels,
 			out->in_endian, ctx) &&	output_start(ctx)) {
 
 			strcpy(info.mimetype, out->mimetype);
@@ -1281,3 +1319,27 @@ static bool process_start(u8_t format, u32_t rate, u8_t size, u8_t channels, u8_
 
 	return ret;
 }
+
+/*---------------------------------------------------------------------------*/
+static void _output_size(struct metadata_s *metadata, struct thread_ctx_s *ctx) {
+	struct outputstate* out = &ctx->output;
+	size_t size = ctx->config.outputbuf_size;
+
+	/* Configured size is for CD audio, so scale it by the data rate of what outputbuf 
+	 * will hold (source in THRU mode, decoded frames otherwise) and by how greedy the 
+	 * renderer has been. In flow mode, the previous track might still be there */
+	if (out->encode.mode == ENCODE_THRU) out->pull.rate = out->bitrate * 1000 / 8;
+	else out->pull.rate = (out->sample_rate ? out->sample_rate : metadata->sample_rate) * BYTES_PER_FRAME;
+
+	if (_buf_used(ctx->outputbuf)) return;
+
+	if (out->pull.rate) {
+		size = (u64_t) size * out->pull.rate / (44100 * BYTES_PER_FRAME) * out->pull.burst / 100;
+		size = max(size, OUTPUTBUF_IDLE_SIZE);
+		size = min(size, ctx->config.outputbuf_size * BUFFER_MAX_SCALE);
+		size -= size % BYTES_PER_FRAME;
+	}
+
+	size = _buf_resize_budget(ctx->outputbuf, size, OUTPUTBUF_IDLE_SIZE);
+	LOG_INFO("[%p]: outputbuf %zu bytes (rate:%u B/s, burst:%u%%)", ctx, size, out->pull.rate, out->pull.burst);
+}
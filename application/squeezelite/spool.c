@@ -0,0 +1,398 @@
+/*
+ *  Spool - write-behind for files written from time-critical paths
+ *
+ *	(c) Philippe, philippe_44@outlook.com
+ *
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "platform.h"
+#include "spool.h"
+
+#if WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define SPOOL_BLOCK		(64*1024)
+#define SPOOL_SIZE		(16*SPOOL_BLOCK)
+#define SPOOL_AHEAD		(4*SPOOL_BLOCK)
+#define SPOOL_IDLE		500
+
+/* The queue is a ring of the file's last bytes. 'aligned' is where next block will
+ * be written from and it's always a multiple of SPOOL_BLOCK, 'synced' is what has
+ * reached the disk (tails are written when idle so it can be above 'aligned') and
+ * 'written' is what has been accepted. Ring must keep everything from 'aligned'. Once
+ * a write has failed, 'synced' does not move and blocks are dropped without being 
+ * written, so what is between 'synced' and 'aligned' is lost. Reading ahead is one
+ * pending request at 'want' that thread serves before writing, into 'ahead' */
+struct spool_s {
+	FILE* file;
+	int fd;
+	uint8_t* buffer;
+	size_t size;
+	uint64_t aligned, synced, written;
+	bool closing, discard, error;
+	void (*done)(void* arg, bool ok);
+	void* arg;
+	struct {
+		uint8_t* buffer;
+		uint64_t offset, want;
+		size_t len;
+		bool fetching, failed;
+		void (*ready)(void* arg);
+		void* arg;
+	} ahead;
+	struct spool_s* next;
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER, done = PTHREAD_COND_INITIALIZER;
+static struct spool_s *spools, *busy;
+static bool running;
+
+static void* spool_thread(void* arg);
+
+#if WIN
+static int64_t file_pwrite(int fd, const void* buf, size_t count, uint64_t offset) {
+	OVERLAPPED ov = { .Offset = (DWORD) offset, .OffsetHigh = (DWORD) (offset >> 32) };
+	DWORD bytes;
+	return WriteFile((HANDLE) _get_osfhandle(fd), buf, (DWORD) count, &bytes, &ov) ? bytes : -1;
+}
+
+static int64_t file_pread(int fd, void* buf, size_t count, uint64_t offset) {
+	OVERLAPPED ov = { .Offset = (DWORD) offset, .OffsetHigh = (DWORD) (offset >> 32) };
+	DWORD bytes;
+	return ReadFile((HANDLE) _get_osfhandle(fd), buf, (DWORD) count, &bytes, &ov) ? bytes : -1;
+}
+#else
+#define file_pwrite	pwrite
+#define file_pread	pread
+#endif
+
+/*---------------------------------------------------------------------------*/
+spool_t* spool_open(FILE* file, size_t size) {
+	if (!file) return NULL;
+
+	struct spool_s* spool = calloc(1, sizeof(struct spool_s));
+	if (spool) {
+		// blocks are written in one go so ring is made of a whole number of them
+		spool->size = size ? (size + SPOOL_BLOCK - 1) / SPOOL_BLOCK * SPOOL_BLOCK : SPOOL_SIZE;
+		spool->buffer = malloc(spool->size);
+	}
+
+	if (!spool || !spool->buffer) {
+		if (spool) free(spool);
+		fclose(file);
+		return NULL;
+	}
+
+	spool->file = file;
+	spool->fd = fileno(file);
+
+	pthread_mutex_lock(&mutex);
+	spool->next = spools;
+	spools = spool;
+
+	// thread only lives while there are spools
+	if (!running) {
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		running = pthread_create(&thread, &attr, spool_thread, NULL) == 0;
+		pthread_attr_destroy(&attr);
+	}
+
+	pthread_mutex_unlock(&mutex);
+	return spool;
+}
+
+/*---------------------------------------------------------------------------*/
+spool_t* spool_load(FILE* file) {
+	if (!file || fseek(file, 0, SEEK_END)) {
+		if (file) fclose(file);
+		return NULL;
+	}
+
+	// whole file is on disk, so there is nothing to write and ring is just a block
+	uint64_t size = ftell(file);
+	spool_t* spool = spool_open(file, SPOOL_BLOCK);
+	if (!spool) return NULL;
+
+	pthread_mutex_lock(&mutex);
+	spool->synced = spool->written = size;
+	spool->aligned = size - size % SPOOL_BLOCK;
+	pthread_mutex_unlock(&mutex);
+
+	return spool;
+}
+
+/*---------------------------------------------------------------------------*/
+void spool_close(spool_t* spool, bool discard) {
+	if (!spool) return;
+	pthread_mutex_lock(&mutex);
+	spool->closing = true;
+	spool->discard = discard;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+void spool_finish(spool_t* spool, void (*done)(void* arg, bool ok), void* arg) {
+	if (!spool) {
+		if (done) done(arg, false);
+		return;
+	}
+
+	pthread_mutex_lock(&mutex);
+	spool->closing = true;
+	spool->done = done;
+	spool->arg = arg;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+size_t spool_write(spool_t* spool, const void* src, size_t size) {
+	pthread_mutex_lock(&mutex);
+
+	size = min(size, spool->size - (size_t) (spool->written - spool->aligned));
+	size_t offset = spool->written % spool->size;
+	size_t cont = min(size, spool->size - offset);
+
+	// this part of the ring is not used by the thread, it only reads below 'written'
+	memcpy(spool->buffer + offset, src, cont);
+	memcpy(spool->buffer, (uint8_t*) src + cont, size - cont);
+
+	// only wake thread when a new block is complete
+	if ((spool->written - spool->aligned) / SPOOL_BLOCK != (spool->written + size - spool->aligned) / SPOOL_BLOCK) {
+		pthread_cond_signal(&wake);
+	}
+	spool->written += size;
+
+	pthread_mutex_unlock(&mutex);
+	return size;
+}
+
+/*---------------------------------------------------------------------------*/
+size_t spool_room(spool_t* spool) {
+	pthread_mutex_lock(&mutex);
+	size_t room = spool->size - (size_t) (spool->written - spool->aligned);
+	pthread_mutex_unlock(&mutex);
+	return room;
+}
+
+/*---------------------------------------------------------------------------*/
+size_t spool_synced(spool_t* spool) {
+	pthread_mutex_lock(&mutex);
+	size_t synced = spool->synced;
+	pthread_mutex_unlock(&mutex);
+	return synced;
+}
+
+/*---------------------------------------------------------------------------*/
+size_t spool_read(spool_t* spool, void* dst, size_t offset, size_t size) {
+	pthread_mutex_lock(&mutex);
+	uint64_t synced = spool->synced, aligned = spool->aligned, written = spool->written;
+	pthread_mutex_unlock(&mutex);
+
+	if (offset >= written) return 0;
+	size = min(size, (size_t) (written - offset));
+
+	// what has reached the disk, the rest is still in the ring (only we can overwrite it)
+	size_t bytes = 0, disk = offset < synced ? min(size, (size_t) (synced - offset)) : 0;
+
+	while (bytes < disk) {
+		int64_t n = file_pread(spool->fd, (uint8_t*) dst + bytes, disk - bytes, offset + bytes);
+		if (n <= 0) return bytes;
+		bytes += n;
+	}
+
+	// after a failed write, what is neither on disk nor in the ring is lost
+	if (offset + bytes < aligned) return bytes;
+
+	size_t from = (offset + bytes) % spool->size;
+	size_t cont = min(size - bytes, spool->size - from);
+	memcpy((uint8_t*) dst + bytes, spool->buffer + from, cont);
+	memcpy((uint8_t*) dst + bytes + cont, spool->buffer, size - bytes - cont);
+
+	return size;
+}
+
+/*---------------------------------------------------------------------------*/
+size_t spool_peek(spool_t* spool, void* dst, size_t offset, size_t size) {
+	pthread_mutex_lock(&mutex);
+
+	uint64_t synced = spool->synced, aligned = spool->aligned, written = spool->written;
+	size_t bytes = 0;
+
+	if (offset < synced) {
+		// only once, from what has been read ahead, the rest will come with next call
+		if (!spool->ahead.fetching && offset >= spool->ahead.offset && offset < spool->ahead.offset + spool->ahead.len) {
+			bytes = min(size, (size_t) (spool->ahead.offset + spool->ahead.len - offset));
+			memcpy(dst, spool->ahead.buffer + (offset - spool->ahead.offset), bytes);
+		} else if (!spool->ahead.fetching && !spool->ahead.failed) {
+			if (!spool->ahead.buffer) spool->ahead.buffer = malloc(SPOOL_AHEAD);
+			spool->ahead.want = offset;
+			spool->ahead.fetching = spool->ahead.buffer != NULL;
+			pthread_cond_signal(&wake);
+		}
+	} else if (offset < written && offset >= aligned) {
+		// not on disk yet so still in the ring
+		size_t from = offset % spool->size;
+		size_t cont = min(size, spool->size - from);
+		bytes = min(size, (size_t) (written - offset));
+		cont = min(cont, bytes);
+		memcpy(dst, spool->buffer + from, cont);
+		memcpy((uint8_t*) dst + cont, spool->buffer, bytes - cont);
+	}
+
+	pthread_mutex_unlock(&mutex);
+	return bytes;
+}
+
+/*---------------------------------------------------------------------------*/
+void spool_notify(spool_t* spool, void (*ready)(void* arg), void* arg) {
+	pthread_mutex_lock(&mutex);
+	spool->ahead.ready = ready;
+	spool->ahead.arg = arg;
+	pthread_mutex_unlock(&mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+void spool_rewind(spool_t* spool) {
+	pthread_mutex_lock(&mutex);
+	// can't let thread finish a write or a read-ahead from before
+	while (busy == spool) pthread_cond_wait(&done, &mutex);
+	spool->aligned = spool->synced = spool->written = 0;
+	spool->error = false;
+	spool->ahead.len = 0;
+	spool->ahead.fetching = spool->ahead.failed = false;
+	pthread_mutex_unlock(&mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+static void* spool_thread(void* arg) {
+	bool idle = false;
+
+	pthread_mutex_lock(&mutex);
+
+	while (spools) {
+		struct spool_s *spool, **prev;
+		uint64_t from = 0;
+		size_t len = 0;
+
+		// find something to do: read-ahead, full blocks, then tails when idle or closing
+		for (prev = &spools; (spool = *prev) != NULL; prev = &spool->next) {
+			size_t pending = spool->written - spool->aligned;
+			if (spool->ahead.fetching && !spool->closing) break;
+			if (spool->closing && spool->discard) break;
+			if (pending >= SPOOL_BLOCK) {
+				from = spool->aligned;
+				len = pending - pending % SPOOL_BLOCK;
+				break;
+			}
+			if ((idle || spool->closing) && spool->synced < spool->written && !spool->error) {
+				from = spool->synced;
+				len = spool->written - spool->synced;
+				break;
+			}
+			if (spool->closing) break;
+		}
+
+		// nothing to do for a while, allow tails to be written
+		if (!spool) {
+			struct timespec ts;
+			timespec_get(&ts, TIME_UTC);
+			ts.tv_nsec += SPOOL_IDLE * 1000000L;
+			ts.tv_sec += ts.tv_nsec / 1000000000L;
+			ts.tv_nsec %= 1000000000L;
+			idle = pthread_cond_timedwait(&wake, &mutex, &ts) == ETIMEDOUT;
+			continue;
+		}
+
+		// only what is on disk is read ahead, the ring has the rest
+		if (spool->ahead.fetching && !spool->closing) {
+			from = spool->ahead.want;
+			len = min(SPOOL_AHEAD, (size_t) (spool->synced - from));
+			busy = spool;
+			pthread_mutex_unlock(&mutex);
+
+			size_t bytes = 0;
+			while (bytes < len) {
+				int64_t n = file_pread(spool->fd, spool->ahead.buffer + bytes, len - bytes, from + bytes);
+				if (n < 0 && errno == EINTR) continue;
+				if (n <= 0) break;
+				bytes += n;
+			}
+
+			pthread_mutex_lock(&mutex);
+			busy = NULL;
+			pthread_cond_broadcast(&done);
+
+			// a failed read would be requested again and again
+			spool->ahead.offset = from;
+			spool->ahead.len = bytes;
+			spool->ahead.failed = !bytes;
+			spool->ahead.fetching = false;
+
+			void (*ready)(void*) = spool->ahead.ready;
+			void* arg = spool->ahead.arg;
+			pthread_mutex_unlock(&mutex);
+			if (ready) ready(arg);
+			pthread_mutex_lock(&mutex);
+			continue;
+		}
+
+		// spool is closed and has nothing left
+		if (!len) {
+			*prev = spool->next;
+			pthread_mutex_unlock(&mutex);
+			bool ok = fclose(spool->file) == 0 && !spool->error;
+			if (spool->done) spool->done(spool->arg, ok);
+			free(spool->ahead.buffer);
+			free(spool->buffer);
+			free(spool);
+			pthread_mutex_lock(&mutex);
+			continue;
+		}
+
+		// never write across the end of the ring
+		len = min(len, spool->size - (size_t) (from % spool->size));
+		busy = spool;
+		pthread_mutex_unlock(&mutex);
+
+		// on error, data is lost but we can't let the queue stay full
+		size_t bytes = 0;
+		while (bytes < len && !spool->error) {
+			int64_t n = file_pwrite(spool->fd, spool->buffer + from % spool->size + bytes, len - bytes, from + bytes);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) break;
+			bytes += n;
+		}
+
+		pthread_mutex_lock(&mutex);
+		if (bytes < len) spool->error = true;
+		busy = NULL;
+		pthread_cond_broadcast(&done);
+
+		if (from == spool->aligned && len % SPOOL_BLOCK == 0) spool->aligned += len;
+		// only what has been written is synced, once failed nothing is anymore
+		if (!spool->error) spool->synced = max(spool->synced, from + len);
+	}
+
+	running = false;
+	pthread_mutex_unlock(&mutex);
+
+	return NULL;
+}
@@ -0,0 +1,53 @@
+/*
+ *  Spool - write-behind for files written from time-critical paths
+ *
+ *	(c) Philippe, philippe_44@outlook.com
+ *
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "platform.h"
+
+/* A spool sits in front of a file and never lets its user wait for the disk. Data
+ * is copied into a bounded memory queue and a single background thread, shared by
+ * all spools, writes it in large blocks aligned on file offsets. What is left when
+ * the queue is idle for a while (or closed) is written as is. When the queue is
+ * full, spool_write only takes what fits, caller decides to come back later or to
+ * drop. Data can be read back whether it has reached the disk or not, and the same
+ * thread can read ahead for those who must not wait for the disk either. Besides the
+ * background thread, a spool must be used by one thread at a time */
+
+typedef struct spool_s spool_t;
+
+// spool owns the file from now on (NULL file returns NULL). Leave size to 0 for default
+spool_t* spool_open(FILE* file, size_t size);
+// same for a file that already has all its data and will only be read back
+spool_t* spool_load(FILE* file);
+// pending data is written (unless discarded) and file is closed, all in background
+void spool_close(spool_t* spool, bool discard);
+// same, then done is called from background with whether all data has reached the file
+// (NULL spool calls done at once with false)
+void spool_finish(spool_t* spool, void (*done)(void* arg, bool ok), void* arg);
+// returns how much has been accepted, might be less than size when queue is full
+size_t spool_write(spool_t* spool, const void* src, size_t size);
+// how much can be written now
+size_t spool_room(spool_t* spool);
+// read from offset what has been written so far, from disk or from queue (stops at what a failed write lost)
+size_t spool_read(spool_t* spool, void* dst, size_t offset, size_t size);
+// same as spool_read but never waits for the disk. What is on disk is only returned once
+// it has been read ahead in background, otherwise that is started and 0 is returned
+size_t spool_peek(spool_t* spool, void* dst, size_t offset, size_t size);
+// ready is called from background each time a read-ahead is done
+void spool_notify(spool_t* spool, void (*ready)(void* arg), void* arg);
+// data below that offset is on disk and can be read from the file directly
+size_t spool_synced(spool_t* spool);
+// restart from offset 0, discarding what has not been written yet
+void spool_rewind(spool_t* spool);
@@ -18,6 +18,10 @@
 
 #define OUTPUTBUF_SIZE	(4*1024*1024)
 #define STREAMBUF_SIZE	(1024*1024)
+#define ARENA_SIZE		(64*1024*1024)
+#define BUFFER_BUDGET	(256*1024*1024)
+#define CACHE_BUDGET	(128*1024*1024)
+#define TCACHE_SIZE		1024		// in MB
 
 typedef enum {SQ_NONE, SQ_SET_TRACK, SQ_PLAY, SQ_TRANSITION, SQ_PAUSE, SQ_UNPAUSE,
 			  SQ_STOP, SQ_VOLUME, SQ_MUTE, SQ_TIME, SQ_TRACK_INFO, SQ_ONOFF, SQ_NEW_METADATA,
@@ -77,7 +81,8 @@ struct track_param
 
 typedef bool (*sq_callback_t)(void *caller, sq_action_t action, ...);
 
-void				sq_init(struct in_addr host, uint16_t port, char *model_name);
+void				sq_init(struct in_addr host, uint16_t port, char *model_name, size_t arena_size, size_t buffer_budget, size_t cache_budget,
+									 char *tcache_dir, size_t tcache_size);
 void				sq_stop(void);
 
 // only name cannot be NULL
@@ -97,3 +102,9 @@ bool				sq_close(void *desc);
 bool 				sq_is_remote(const char *urn);
 void*				sq_get_ptr(sq_dev_handle_t handle);
 bool				sq_icy_active(sq_dev_handle_t handle);
+
+// histograms of other modules exposed on /metrics (labels are 'name="value",...')
+void*				sq_metrics_register(const char *name, const char *help, const char *labels);
+void				sq_metrics_unregister(void *handle);
+void				sq_metrics_observe(void *handle, uint32_t us);
+bool				sq_metrics_active(void);
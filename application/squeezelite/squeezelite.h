@@ -19,7 +19,7 @@
  *
  */
 
-// make may define: SELFPIPE, RESAMPLE, RESAMPLE_MP, VISEXPORT, DSD, LINKALL to influence build
+// make may define: SELFPIPE, URING, RESAMPLE, RESAMPLE_MP, VISEXPORT, DSD, LINKALL to influence build
 
 // build detection
 #include "platform.h"
@@ -52,6 +52,16 @@
 #define LOOPBACK  1
 #endif
 
+// io_uring needs an eventfd to wake reactors, kernel support is checked at run time
+#if !defined(URING) && LINUX && EVENTFD && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define URING	  1
+#endif
+#endif
+#if !defined(URING)
+#define URING	  0
+#endif
+
 #if !LINKALL
 
 // dynamically loaded libraries at run time
@@ -134,6 +144,7 @@
 #include "cross_log.h"
 #include "cross_net.h"
 #include "cross_util.h"
+#include "spool.h"
 
 // we'll give venerable squeezelite the benefit of "old" int's
 typedef uint64_t u64_t;
@@ -230,7 +241,15 @@ void _wake_create(event_event*);
 typedef enum { EVENT_TIMEOUT = 0, EVENT_READ, EVENT_WAKE } event_type;
 struct thread_ctx_s;
 
+// a signal is never lost: it stays pending until the waiter consumes it
+struct wakeup_s {
+	mutex_type mutex;
+	pthread_cond_t cond;
+	bool pending, waiting;
+};
+
 char*		next_param(char *src, char c);
+size_t		http_headers_end(char *data, size_t len, size_t offset, int *endtok);
 void 		server_addr(char *server, in_addr_t *ip_ptr, unsigned *port_ptr);
 void 		set_readwake_handles(event_handle handles[], sockfd s, event_event e);
 event_type 	wait_readwake(event_handle handles[], int timeout);
@@ -238,16 +257,35 @@ void 		packN(u32_t *dest, u32_t val);
 void 		packn(u16_t *dest, u16_t val);
 u32_t 		unpackN(u32_t *src);
 u16_t 		unpackn(u16_t *src);
+void		wakeup_create(struct wakeup_s *w);
+void		wakeup_destroy(struct wakeup_s *w);
+void		wakeup_signal(struct wakeup_s *w);
+void		wakeup_wait(struct wakeup_s *w, u32_t timeout);
 
 // buffer.c
+#define CACHE_LINE	64
+
+/* readp is only moved by the consumer and writep by the producer, each on their own
+ * cache line. They are published with release/acquire so that a spsc buffer's producer
+ * can fill it between _buf_produce and buf_produced without holding the mutex */
 struct buffer {
+	union {
+		u8_t *readp;
+		u8_t __rpad[CACHE_LINE];
+	};
+	union {
+		u8_t *writep;
+		u8_t __wpad[CACHE_LINE];
+	};
 	u8_t *buf;
-	u8_t *readp;
-	u8_t *writep;
 	u8_t *wrap;
 	size_t size;
 	size_t base_size;
+	size_t mirror;		// size of mirrored zone (0 if none)
+	size_t charged;		// size accounted in global budget
 	mutex_type mutex;
+	bool spsc;
+	mutex_type producer;	// held by producer while filling (spsc only)
 };
 
 // _* called with mutex locked
@@ -255,6 +293,7 @@ unsigned 	_buf_used(struct buffer *buf);
 unsigned 	_buf_space(struct buffer *buf);
 unsigned 	_buf_cont_read(struct buffer *buf);
 unsigned 	_buf_cont_write(struct buffer *buf);
+u8_t*		_buf_end(struct buffer *buf);
 void 		_buf_inc_readp(struct buffer *buf, unsigned by);
 void 		_buf_inc_writep(struct buffer *buf, unsigned by);
 unsigned 	_buf_read(void *dst, struct buffer *src, unsigned btes);
@@ -264,9 +303,61 @@ void 		buf_adjust(struct buffer *buf, size_t mod);
 void 		_buf_resize(struct buffer *buf, size_t size);
 void 		_buf_unwrap(struct buffer *buf, size_t cont);
 void 		buf_init(struct buffer *buf, size_t size);
+void 		buf_init_mirror(struct buffer *buf, size_t size);
+void 		buf_init_spsc(struct buffer *buf, size_t size);
+u8_t*		_buf_produce(struct buffer *buf, size_t *space);
+void		buf_produced(struct buffer *buf, unsigned by);
 void 		buf_destroy(struct buffer *buf);
 bool 		_buf_reset(struct buffer *buf);
 
+// bridge-wide pool of pre-faulted slabs lent to big (non-mirrored) buffers
+struct buf_arena_stats {
+	u64_t borrowed, reused;		// slab requests and how many found an idle slab
+	u64_t created, evicted;		// slabs mapped and unmapped
+	u64_t fallback;				// requests served by malloc (cap reached)
+	size_t held, used, cap;		// bytes
+};
+
+void		buf_arena_init(size_t cap);
+void		buf_arena_end(void);
+void		buf_arena_stats(struct buf_arena_stats *stats);
+
+// global memory budget shared by buffers sized per track
+void		buf_budget_init(size_t budget);
+size_t		_buf_resize_budget(struct buffer *buf, size_t size, size_t floor);
+
+// lock-free single producer / single consumer ring
+struct spsc {
+	u8_t *buf;
+	size_t size;			// power of 2
+	size_t readp, writep;	// free-running counters
+};
+
+bool		spsc_init(struct spsc *ring, size_t size);
+void		spsc_destroy(struct spsc *ring);
+void		spsc_reset(struct spsc *ring);
+size_t		spsc_used(struct spsc *ring);
+size_t		spsc_space(struct spsc *ring);
+size_t		spsc_write(struct spsc *ring, const void *src, size_t size);
+size_t		spsc_read(struct spsc *ring, void *dst, size_t size);
+
+// main.c
+void		metadata_cache_flush(struct thread_ctx_s *ctx, bool refresh);
+void		sync_cache_flush(struct thread_ctx_s *ctx);
+void		sync_cache_refresh(struct thread_ctx_s *ctx);
+bool		sync_cache_has(struct thread_ctx_s *ctx, const char *player);
+
+// cli.c
+/* rsp is NULL on failure and must be freed by the callback, which is called from CLI thread.
+ * That thread is the one completing requests, so a callback can use cli_send_async but
+ * cli_send_cmd fails (NULL) as it would wait forever */
+typedef void (*cli_cb_t)(char *rsp, void *arg);
+
+void		cli_init(void);
+void		cli_end(void);
+char*		cli_send_cmd(char *cmd, bool query, bool decode, struct thread_ctx_s *ctx);
+bool		cli_send_async(char *cmd, bool query, bool decode, cli_cb_t callback, void *arg, struct thread_ctx_s *ctx);
+
 // slimproto.c
 void 		slimproto_close(struct thread_ctx_s *ctx);
 void 		slimproto_reset(struct thread_ctx_s *ctx);
@@ -277,12 +368,13 @@ void 		wake_controller(struct thread_ctx_s *ctx);
 
 // stream.c
 typedef enum { STOPPED = 0, DISCONNECT, STREAMING_WAIT,
-			   STREAMING_BUFFERING, STREAMING_FILE, STREAMING_HTTP, SEND_HEADERS, RECV_HEADERS } stream_state;
+			   STREAMING_BUFFERING, STREAMING_FILE, STREAMING_HTTP, SEND_HEADERS, RECV_HEADERS,
+			   CONNECTING, SSL_CONNECTING } stream_state;
 typedef enum { DISCONNECT_OK = 0, LOCAL_DISCONNECT = 1, REMOTE_DISCONNECT = 2, UNREACHABLE = 3, TIMEOUT = 4 } disconnect_code;
 
 struct streamstate {
 	stream_state state;
-	FILE* store;
+	spool_t* store;
 	disconnect_code disconnect;
 	char *header;
 	size_t header_len;
@@ -299,6 +391,19 @@ struct streamstate {
 	size_t header_mlen;
 	struct sockaddr_in addr;
 	char host[256];
+	struct wakeup_s wake;	// streambuf has space or a new stream is set
+	struct {
+		u32_t deadline;		// for connection and SSL handshake
+		bool ssl, fallback;	// use SSL, retry in plain if that fails
+		short events;		// what SSL handshake is waiting for
+	} connect;
+	struct {
+		char *request;		// initial request (or file name) to re-open at an offset
+		size_t len;
+		bool file;
+		bool pending;		// waiting for response to a range request
+	} range;
+	u32_t generation;		// bumped (under producer) when fd or stream changes, to detect it while filling
 	struct {
 		char header[2048];
 		unsigned len, threshold;
@@ -340,6 +445,7 @@ void 		stream_file(const char *header, size_t header_len, unsigned threshold, st
 void 		stream_sock(u32_t ip, u16_t port, bool use_ssl, bool use_ogg, const char *header, size_t header_len, unsigned threshold, 
 						bool cont_wait, struct thread_ctx_s *ctx);
 bool 		stream_disconnect(struct thread_ctx_s *ctx);
+bool		_stream_range(u64_t from, u64_t to, struct thread_ctx_s *ctx);
 
 // decode.c
 typedef enum { DECODE_STOPPED = 0, DECODE_READY, DECODE_RUNNING, DECODE_COMPLETE, DECODE_ERROR } decode_state;
@@ -349,6 +455,7 @@ struct decodestate {
 	bool new_stream;
 	u32_t frames;
 	mutex_type mutex;
+	struct wakeup_s wake;	// streambuf has data or outputbuf has space
 	void *handle;
 #if PROCESS
 	void *process_handle;
@@ -390,6 +497,30 @@ unsigned 	decode_newstream(unsigned sample_rate, int supported_rates[],
 bool 		codec_open(u8_t codec, u8_t sample_size, u32_t sample_rate,
 					   u8_t	channels, u8_t endianness, struct thread_ctx_s *ctx);
 
+// mp4.c
+struct mp4_s;
+typedef int (*mp4_parse_t)(struct mp4_s *mp4, char *type, u8_t *data, u32_t len, struct thread_ctx_s *ctx);
+
+struct mp4_s {
+	u64_t	pos;			// position in file of streambuf's readp
+	u32_t	consume;		// bytes to skip before going on
+	unsigned trak, play;	// current track and the playable one (set by codec)
+	char	*boxes;			// boxes that codec wants to parse, comma separated
+	mp4_parse_t parse;		// called with each of these, in full
+	u64_t	mdat, mdat_len, moov_end;	// when moov is after mdat
+	struct {
+		u32_t size, count;			// fixed size (or 0) and number of samples
+		u32_t filled, left, index;	// entries acquired, to acquire and next sample
+		struct mp4_block_s **blocks;
+	} stsz;
+};
+
+void		mp4_open(struct mp4_s *mp4, char *boxes, mp4_parse_t parse);
+void		mp4_close(struct mp4_s *mp4);
+int			_mp4_header(struct mp4_s *mp4, struct thread_ctx_s *ctx);
+u32_t		mp4_sample_size(struct mp4_s *mp4);
+void		mp4_sample_next(struct mp4_s *mp4);
+
 #if PROCESS
 // process.c
 void 		process_samples(struct thread_ctx_s *ctx);
@@ -416,9 +547,15 @@ void 		resample_end(struct thread_ctx_s *ctx);
 // output.c
 
 #define	OUTPUTBUF_IDLE_SIZE (256*1024)
+// configured buffer sizes are for CD audio, others are scaled by their data rate
+#define CD_BYTES_PER_SEC	(44100 * 2 * 2)
+#define BUFFER_MAX_SCALE	4
 
 #define ICY_LEN_MAX		(255*16+1)
 #define METADATA_UPDATE_TIME	5000
+// sync group is not queried more often than that, failures back off up to the max
+#define SYNC_REFRESH_TIME		1000
+#define SYNC_BACKOFF_MAX		(60*1000)
 
 // real value is 576x2=1152 samples@44100kHz = 26.122 ms but we want a bit more blocks
 #define MP3_SILENCE_DURATION 26
@@ -432,13 +569,50 @@ typedef enum { FADE_NONE = 0, FADE_CROSSFADE, FADE_IN, FADE_OUT, FADE_INOUT } fa
 
 typedef enum { ENCODE_THRU, ENCODE_NULL, ENCODE_PCM, ENCODE_FLAC, ENCODE_AAC, ENCODE_MP3 } encode_mode;
 
-// parameters for the output management thread
+enum { FRAME_HEAD, FRAME_AUDIO, FRAME_ICY, FRAME_TAIL, FRAME_PARTS };
+
+// what goes on the wire for a block of audio: chunk header, audio, ICY block and chunk trailer
+struct output_frame_s {
+	char	head[16], tail[2];
+	u8_t	icy[ICY_LEN_MAX];
+	size_t	len[FRAME_PARTS];	// length of each part (audio is not owned)
+	size_t	sent;				// bytes of the whole frame already sent
+	bool	queued, completed;	// handed to io_uring and waiting for completion (result)
+	int		result;
+};
+
+#define HTTP_REQUEST_MAX	4096
+
+// parameters for the output http sessions (served by shared reactors, see output_http.c)
 struct output_thread_s {
 	bool			running, lingering;
 	bool			terminate;
-	thread_type 	thread;
+	bool			active;			// session resources are owned by a reactor
 	int				http;			// listening socket of http server
 	int 			index, slot;
+	struct thread_ctx_s *ctx;
+	pthread_cond_t	cond;			// signaled when session is released
+	// below is only used by the reactor
+	int				sock;			// connected HTTP client
+	struct {						// request received so far, parsed once headers are complete
+		char		data[HTTP_REQUEST_MAX + 1];
+		size_t		len;
+	} request;
+	struct {						// response headers, sent before any of the body
+		char		*data;
+		size_t		len, sent;
+		bool		close;			// there is no body
+	} response;
+	int				events, pending;	// polled events and events on hold
+	bool			starved, kick;	// nothing to do but wait for data/timer
+	bool			use_cache, acquired, http_ready, finished, drained;
+	u32_t			start, polled, drain;
+	spool_t		*store;
+	struct tcache_rec_s *record;	// body being kept in transcode cache
+	struct cache_buffer_s *cache;
+	struct output_share_s *share;	// cache shared with synchronized players
+	struct buffer	obuf;
+	struct output_frame_s frame;	// frame being sent, might be partially
 };
 
 // info for the track being sent to the http renderer (not played)
@@ -454,6 +628,11 @@ struct outputstate {
 	u32_t 	duration;       // duration of track in ms, 0 if unknown
 	u32_t	offset;			// offset of track in ms (for flow mode)
 	u32_t	bitrate;	  	// as per name
+	u32_t	request;		// hash of stream request (without player) and strm format
+	u32_t	source;			// hash of request, track and encoding, to detect identical streams
+	struct output_share_s *share;	// set when following another player's stream
+	u64_t	tcache;			// key in transcode cache (0 if track can't be cached)
+	struct cache_buffer_s *stored;	// set when track is served from transcode cache
 	int64_t length;			// HTTP content-length (-1:no chunked, -3 chunked if possible, >=0 fake length)
 	int 	index;			// track counter (see output_thread)
 	u16_t	port;			// port of latest thread (mainy used for codc)
@@ -480,6 +659,16 @@ struct outputstate {
 		size_t size, count;
 		u8_t *buffer;
 	} header;
+	// frame index of passthrough track, to answer time seeks from cache
+	struct {
+		int index;			// track it has been built for
+		u32_t sample_rate;
+		size_t count, size;
+		struct seekpoint_s {
+			u64_t sample;
+			size_t offset;	// bytes sent since start of track
+		} *points;
+	} seektable;
 	// only useful with decode mode
 	fade_state  fade; 		// fading state
 	unsigned 	fade_secs;  // set by slimproto
@@ -501,7 +690,15 @@ struct outputstate {
 		void* codec_private;	// whatever the codec does not want us to see
 		u8_t	*buffer;	// interim codec buffer (optional)
 		size_t	count;		// # of *frames* in buffer or # of silence blocks to send (null mode)
+		struct encoder_s *encoder;	// encoder thread (when not in parallel flac)
+		struct encoder_s *worker;	// per player encoder thread, kept across tracks
 	} encode;				// format of what being sent to player
+	struct {
+		u32_t	rate;		// expected outputbuf bytes/s of the track (0 if unknown)
+		u32_t	start;		// when track was started
+		u32_t	burst;		// how faster than real-time renderer pulls (%)
+		u64_t	bytes;		// pulled from outputbuf for the track
+	} pull;
 };
 
 // http renderer state (track being played)
@@ -528,15 +725,92 @@ bool		_output_lingers(struct thread_ctx_s* ctx, int index);
 void 		_output_terminate(struct thread_ctx_s* ctx, int index);
 void 		_output_terminate_below(struct thread_ctx_s* ctx, int index);
 
-bool		_output_fill(struct buffer *buf, FILE *store, struct thread_ctx_s *ctx);
-void 		_output_new_stream(struct buffer *buf, FILE *store, struct thread_ctx_s *ctx);
-void 		_output_end_stream(struct buffer *buf, struct thread_ctx_s *ctx);
+bool		_output_fill(struct buffer *buf, spool_t *store, struct thread_ctx_s *ctx);
+void 		_output_new_stream(struct buffer *buf, spool_t *store, struct thread_ctx_s *ctx);
+bool 		_output_end_stream(struct buffer *buf, struct thread_ctx_s *ctx);
 void 		_checkfade(bool, struct thread_ctx_s *ctx);
 void 		_checkduration(u32_t frames, struct thread_ctx_s *ctx);
+void		_output_seektable(u32_t sample_rate, struct thread_ctx_s *ctx);
+void		_output_seekpoint(u64_t sample, size_t offset, struct thread_ctx_s *ctx);
+bool		_output_seek(int index, u32_t *ms, size_t *offset, struct thread_ctx_s *ctx);
 
 // output_http.c
 bool 		output_flush(struct thread_ctx_s *ctx, bool full);
 bool		output_start(struct thread_ctx_s *ctx);
+bool		output_follow(u32_t track, struct thread_ctx_s *ctx);
+bool		output_stored(struct thread_ctx_s *ctx);
+void		output_wake(struct thread_ctx_s *ctx);
+void		_output_stop(struct thread_ctx_s *ctx, struct output_thread_s *thread);
+bool		output_reactor_init(void);
+void		output_reactor_end(void);
+
+// uring.c
+struct uring_s* uring_create(unsigned entries, int eventfd);
+void		uring_destroy(struct uring_s* ring);
+#if URING
+bool		uring_send(struct uring_s* ring, int sock, const struct iovec* iov, int count, void* data);
+#endif
+void		uring_cancel(struct uring_s* ring, void* data);
+int			uring_submit(struct uring_s* ring);
+bool		uring_reap(struct uring_s* ring, void** data, int* res);
+
+// tcache.c
+void		tcache_init(const char *dir, size_t cap);
+void		tcache_end(void);
+u64_t		tcache_key(const char *id);
+struct cache_buffer_s *tcache_open(u64_t key);
+struct tcache_rec_s *tcache_record(u64_t key);
+void		tcache_write(struct tcache_rec_s *rec, const void *src, size_t size);
+void		tcache_close(struct tcache_rec_s *rec, bool commit);
+
+// output_simd.c
+void		output_simd_init(void);
+extern size_t (*simd_pack)(void *dst, u32_t *src, size_t frames, u8_t channels, u8_t sample_size, int endian);
+extern size_t (*simd_gain)(s32_t *iptr, u32_t gain, u8_t shift, size_t count);
+extern size_t (*simd_cross)(s32_t *iptr, s32_t *cptr, s32_t *fade, u32_t gain_in, u32_t gain_out, u8_t shift, size_t count);
+
+// metrics.c
+#define METRICS_BUCKETS	22		// log2 buckets from 1µs to 2^20µs (~1s), then +Inf
+
+typedef enum { METRICS_LOCK_S, METRICS_LOCK_D, METRICS_LOCK_O, METRICS_LOCKS } metrics_lock_e;
+
+struct metrics_hist_s {
+	u32_t	count;
+	u64_t	sum;				// in µs
+	u32_t	buckets[METRICS_BUCKETS];
+};
+
+struct metrics_s {
+	struct metrics_hist_s lock_wait[METRICS_LOCKS], lock_hold[METRICS_LOCKS];
+	u64_t	lock_at[METRICS_LOCKS];	// when the lock was acquired
+	struct metrics_hist_s decode, fill;
+	u64_t	send_bytes, send_blocked;
+};
+
+extern volatile bool metrics_on;
+
+void		metrics_init(void);
+void		metrics_end(void);
+void		metrics_barrier(struct thread_ctx_s *ctx);
+u64_t		metrics_now(void);
+void		metrics_observe(struct metrics_hist_s *hist, u64_t us);
+void		_metrics_lock(mutex_type *mutex, struct metrics_s *m, metrics_lock_e id);
+void		_metrics_unlock(mutex_type *mutex, struct metrics_s *m, metrics_lock_e id);
+void		_metrics_cond_wait(pthread_cond_t *cond, mutex_type *mutex, struct metrics_s *m, metrics_lock_e id);
+
+// to be used in LOCK_x/UNLOCK_x definitions
+#define metrics_lock(m, id, ctx) (metrics_on ? _metrics_lock(&(m), &(ctx)->metrics, id) : (void) mutex_lock(m))
+#define metrics_unlock(m, id, ctx) (metrics_on ? _metrics_unlock(&(m), &(ctx)->metrics, id) : \
+								   ((ctx)->metrics.lock_at[id] = 0, (void) mutex_unlock(m)))
+#define metrics_cond_wait(c, m, id, ctx) (metrics_on ? _metrics_cond_wait(c, &(m), &(ctx)->metrics, id) : \
+										  (void) pthread_cond_wait(c, &(m)))
+
+// counters updated by more than one thread
+#if WIN
+#define metrics_add(p, v)	((void) InterlockedExchangeAdd64((volatile LONG64*) (p), (v)))
+#else
+#define metrics_add(p, v)	((void) __atomic_fetch_add(p, v, __ATOMIC_RELAXED))
+#endif
 
 /***************** main thread context**************/
 typedef struct {
@@ -593,7 +867,7 @@ struct thread_ctx_s {
 	char		server_port[5+1];
 	char		server_ip[4*(3+1)+1];
 	u16_t		cli_port;
-	sockfd 		sock, fd, cli_sock;
+	sockfd 		sock, fd;
 #if USE_SSL
 	void		*ssl;  			// void to no include openssl headers
 	bool		ssl_error;
@@ -601,7 +875,23 @@ struct thread_ctx_s {
 	u16_t		voltage;
 	char		cli_id[18];		// (6*2)+(5*':')+NULL
 	mutex_type	cli_mutex;
-	u32_t		cli_timeout;
+	struct {					// protected by cli_mutex, flushed by CLI notifications
+		u32_t generation;
+		int next;
+		struct {
+			int token;
+			u32_t hash;
+			u32_t at;			// when it was queried, position moves from there when playing
+			bool playing;
+			struct metadata_s metadata;
+		} slots[4];
+	} metadata_cache;
+	struct {					// protected by cli_mutex, flushed by CLI sync notifications
+		u32_t generation;
+		bool valid, pending;
+		char *players;			// players synchronized with us, NULL when none
+		u32_t last, retry, backoff;
+	} sync_cache;
 	struct output_thread_s output_thread[5];
 	bool 		decode_running, stream_running;
 	thread_type	decode_thread, stream_thread;
@@ -616,6 +906,7 @@ struct thread_ctx_s {
 	sq_callback_t	callback;
 	void			*MR;
 	u8_t 	last_command;
+	struct metrics_s	metrics;
 };
 
 extern struct thread_ctx_s 	thread_ctx[MAX_PLAYER];
@@ -627,6 +918,7 @@ extern char  				sq_model_name[];
 extern struct codec *codecs[MAX_CODECS];
 struct codec*	register_thru(void);
 void		 	deregister_thru(void);
+struct codec*	register_drain(void);
 struct codec*	register_flac(void);
 void		 	deregister_flac(void);
 struct codec*	register_flac_thru(void);
@@ -59,16 +59,86 @@ static struct {
 extern log_level	stream_loglevel;
 static log_level 	*loglevel = &stream_loglevel;
 
-#define LOCK_S   mutex_lock(ctx->streambuf->mutex)
-#define UNLOCK_S mutex_unlock(ctx->streambuf->mutex)
+#define LOCK_S   metrics_lock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define UNLOCK_S metrics_unlock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
 
 #define PTR_U32(p)	((u32_t) (*(u32_t*)p))
+#define CONNECT_TIMEOUT	(10*1000)
 
 #if USE_SSL
 
 static SSL_CTX *SSLctx = NULL;
 static int SSLcount = 0;
 
+/* SSL sessions are shared by all players so that a new connection to the same host 
+ * (next track, another player) resumes instead of doing a full handshake. Sessions 
+ * are given by OpenSSL once negotiated (TLS 1.3 sends tickets after handshake) */
+#define SSL_SESSIONS	32
+
+static struct {
+	bool init;
+	mutex_type mutex;
+	struct {
+		char key[256 + 8];
+		SSL_SESSION *session;
+		u32_t used;
+	} slots[SSL_SESSIONS];
+} sessions;
+
+static void session_key(struct thread_ctx_s *ctx, char *key, size_t size) {
+	snprintf(key, size, "%s:%hu", *ctx->stream.host ? ctx->stream.host : inet_ntoa(ctx->stream.addr.sin_addr),
+			 ntohs(ctx->stream.addr.sin_port));
+}
+
+static int session_new(SSL *ssl, SSL_SESSION *session) {
+	struct thread_ctx_s *ctx = SSL_get_app_data(ssl);
+	char key[256 + 8];
+	int i, slot = 0;
+
+	if (!ctx) return 0;
+	session_key(ctx, key, sizeof(key));
+
+	// same host or empty or least recently used
+	mutex_lock(sessions.mutex);
+	for (i = 0; i < SSL_SESSIONS && strcmp(sessions.slots[i].key, key); i++) {
+		if ((s32_t) (sessions.slots[i].used - sessions.slots[slot].used) < 0 || !sessions.slots[i].session) slot = i;
+	}
+	if (i < SSL_SESSIONS) slot = i;
+	if (sessions.slots[slot].session) SSL_SESSION_free(sessions.slots[slot].session);
+	strcpy(sessions.slots[slot].key, key);
+	sessions.slots[slot].session = session;
+	sessions.slots[slot].used = gettime_ms();
+	mutex_unlock(sessions.mutex);
+
+	// we keep that reference
+	return 1;
+}
+
+static void session_resume(struct thread_ctx_s *ctx) {
+	char key[256 + 8];
+	int i;
+
+	session_key(ctx, key, sizeof(key));
+
+	mutex_lock(sessions.mutex);
+	for (i = 0; i < SSL_SESSIONS && strcmp(sessions.slots[i].key, key); i++);
+	if (i < SSL_SESSIONS && sessions.slots[i].session) {
+		SSL_set_session(ctx->ssl, sessions.slots[i].session);
+		sessions.slots[i].used = gettime_ms();
+	}
+	mutex_unlock(sessions.mutex);
+}
+
+static void sessions_flush(void) {
+	mutex_lock(sessions.mutex);
+	for (int i = 0; i < SSL_SESSIONS; i++) {
+		if (sessions.slots[i].session) SSL_SESSION_free(sessions.slots[i].session);
+		sessions.slots[i].session = NULL;
+		*sessions.slots[i].key = '\0';
+	}
+	mutex_unlock(sessions.mutex);
+}
+
 static int _last_error(struct thread_ctx_s* ctx) {
 	if (!ctx->ssl) return last_error();
 	return ctx->ssl_error ? ECONNABORTED : ERROR_WOULDBLOCK;
@@ -85,6 +155,17 @@ static int _recv(struct thread_ctx_s *ctx, void *buffer, size_t bytes, int optio
 	return n;
 }
 
+static int _peek(struct thread_ctx_s *ctx, void *buffer, size_t bytes) {
+	if (!ctx->ssl) return recv(ctx->fd, buffer, bytes, MSG_PEEK);
+	int n = SSL_peek(ctx->ssl, (u8_t*) buffer, bytes);
+	if (n <= 0) {
+		int err = SSL_get_error(ctx->ssl, n);
+		if (err == SSL_ERROR_ZERO_RETURN) return 0;
+		ctx->ssl_error = (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE);
+	}
+	return n;
+}
+
 static int _send(struct thread_ctx_s *ctx, void *buffer, size_t bytes, int options) {
 	if (!ctx->ssl) return send(ctx->fd, buffer, bytes, options);
 	int n = 0;
@@ -114,6 +195,7 @@ static int _poll(struct thread_ctx_s *ctx, struct pollfd *pollinfo, int timeout)
 }
 #else
 #define _recv(ctx, buf, n, opt) recv(ctx->fd, buf, n, opt)
+#define _peek(ctx, buf, n) recv(ctx->fd, buf, n, MSG_PEEK)
 #define _send(ctx, buf, n, opt) send(ctx->fd, buf, n, opt)
 #define _poll(ctx, pollinfo, timeout) poll(pollinfo, 1, timeout)
 #define _last_error(x) last_error()
@@ -169,18 +251,24 @@ static void _disconnect(stream_state state, disconnect_code disconnect, struct t
 	if (ctx->stream.ogg.state == STREAM_OGG_PAGE && ctx->stream.ogg.data) free(ctx->stream.ogg.data);
 	ctx->stream.ogg.data = NULL;
 #endif
-	if (ctx->stream.store) fclose(ctx->stream.store);
+	if (ctx->stream.store) spool_close(ctx->stream.store, false);
+	ctx->stream.store = NULL;
+	wakeup_signal(&ctx->decode.wake);
 	wake_controller(ctx);
 }
 
-static int connect_socket(bool use_ssl, struct thread_ctx_s *ctx) {
+/* Connection and TLS handshake are done by the stream thread so that slimproto never 
+ * waits for a slow remote. _connect_start only initiates a non-blocking connect then
+ * the stream thread moves from CONNECTING to SSL_CONNECTING (if needed) and finally to 
+ * SEND_HEADERS. Any failure falls back to a plain socket if that was requested */
+static bool _connect_start(bool use_ssl, bool fallback, struct thread_ctx_s *ctx) {
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
 
 	LOG_INFO("[%p]: connecting to %s:%d", ctx, inet_ntoa(ctx->stream.addr.sin_addr), ntohs(ctx->stream.addr.sin_port));
 
 	if (sock < 0) {
 		LOG_ERROR("[%p]: failed to create socket", ctx);
-		return sock;
+		return false;
 	}
 
 	/* This is to force at least Windows to not have gigantic TCP buffer that cause a
@@ -195,49 +283,96 @@ static int connect_socket(bool use_ssl, struct thread_ctx_s *ctx) {
 	set_nonblock(sock);
 	set_nosigpipe(sock);
 
-	if (tcp_connect_timeout(sock, ctx->stream.addr, 10*1000) < 0) {
-		LOG_WARN("[%p]: unable to connect to server", ctx);
-		closesocket(sock);
-		return -1;
+	if (connect(sock, (struct sockaddr*) &ctx->stream.addr, sizeof(ctx->stream.addr)) < 0) {
+		int error = last_error();
+		if (error != ERROR_WOULDBLOCK && error != EINPROGRESS) {
+			LOG_WARN("[%p]: unable to connect to server (%d)", ctx, error);
+			closesocket(sock);
+			return false;
+		}
 	}
 
+	ctx->fd = sock;
+	ctx->stream.state = CONNECTING;
+	ctx->stream.connect.ssl = use_ssl;
+	ctx->stream.connect.fallback = fallback;
+	ctx->stream.connect.deadline = gettime_ms() + CONNECT_TIMEOUT;
+
+	return true;
+}
+
+static void _connect_failed(struct thread_ctx_s *ctx) {
 #if USE_SSL
-	if (use_ssl) {
-		ctx->ssl = SSL_new(SSLctx);
-		SSL_set_fd(ctx->ssl, sock);
+	if (ctx->ssl) {
+		SSL_free(ctx->ssl);
+		ctx->ssl = NULL;
+	}
+#endif
+	// try one more time with plain socket
+	if (ctx->stream.connect.fallback) {
+		closesocket(ctx->fd);
+		ctx->fd = -1;
+		if (_connect_start(false, false, ctx)) return;
+	}
 
-		// add SNI
-		if (*ctx->stream.host) SSL_set_tlsext_host_name(ctx->ssl, ctx->stream.host);
+	_disconnect(DISCONNECT, UNREACHABLE, ctx);
+}
 
-		// try to connect (socket is non-blocking)
-		while (1) {
-			int status, err = 0;
+#if USE_SSL
+static void _ssl_handshake(struct thread_ctx_s *ctx) {
+	int status, err = 0;
 
-			ERR_clear_error();
-			status = SSL_connect(ctx->ssl);
+	ERR_clear_error();
+	status = SSL_connect(ctx->ssl);
 
-			// successful negotiation
-			if (status == 1) break;
+	// successful negotiation
+	if (status == 1) {
+		LOG_INFO("[%p]: streaming with SSL%s", ctx, SSL_session_reused(ctx->ssl) ? " (resumed)" : "");
+		ctx->stream.state = SEND_HEADERS;
+		return;
+	}
 
-			// error or non-blocking requires more time
-			if (status < 0) {
-				err = SSL_get_error(ctx->ssl, status);
-				if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) continue;
-			}
+	// non-blocking requires more time, wait for what it needs
+	if (status < 0) {
+		err = SSL_get_error(ctx->ssl, status);
+		if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+			ctx->stream.connect.events = err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+			return;
+		}
+	}
 
-			LOG_WARN("[%p]: unable to open SSL socket %d (%d)", ctx, status, err);
+	LOG_WARN("[%p]: unable to open SSL socket %d (%d)", ctx, status, err);
+	_connect_failed(ctx);
+}
+#endif
 
-			closesocket(sock);
-			SSL_free(ctx->ssl);
-			ctx->ssl = NULL;
+static void _connect_done(struct thread_ctx_s *ctx) {
+	int error = 0;
+	unsigned int len = sizeof(error);
 
-			return -1;
-		}
-		LOG_INFO("[%p]: streaming with SSL", ctx);
-	} else ctx->ssl = NULL;
+	if (getsockopt(ctx->fd, SOL_SOCKET, SO_ERROR, (void*) &error, &len) < 0 || error) {
+		LOG_WARN("[%p]: unable to connect to server (%d)", ctx, error);
+		_connect_failed(ctx);
+		return;
+	}
+
+#if USE_SSL
+	if (ctx->stream.connect.ssl) {
+		ctx->ssl = SSL_new(SSLctx);
+		SSL_set_fd(ctx->ssl, ctx->fd);
+		SSL_set_app_data(ctx->ssl, ctx);
+
+		// add SNI
+		if (*ctx->stream.host) SSL_set_tlsext_host_name(ctx->ssl, ctx->stream.host);
+		session_resume(ctx);
+
+		ctx->stream.state = SSL_CONNECTING;
+		_ssl_handshake(ctx);
+		return;
+	}
 #endif
 
-	return sock;
+	ctx->stream.state = SEND_HEADERS;
 }
 
 static u32_t inline itohl(u32_t littlelong) {
@@ -263,9 +398,8 @@ static size_t memfind(const u8_t* haystack, size_t n, const char* needle, size_t
   * full packets (as a vorbis_comment can have a very large artwork. It works only at the page
   * level, which means there is a risk of missing the searched comment if they are not on the
   * first page of the vorbis_comment packet... nothing is perfect */
-static void stream_ogg(struct thread_ctx_s* ctx, size_t n) {
+static void stream_ogg(struct thread_ctx_s* ctx, u8_t *p, size_t n) {
 	if (ctx->stream.ogg.state == STREAM_OGG_OFF) return;
-	u8_t* p = ctx->streambuf->writep;
 
 	while (n) {
 		size_t consumed = min(ctx->stream.ogg.miss, n);
@@ -387,12 +521,12 @@ static void stream_ogg(struct thread_ctx_s* ctx, size_t n) {
 	}
 }
 #else
-static void stream_ogg(struct thread_ctx_s* ctx, size_t n) {
+static void stream_ogg(struct thread_ctx_s* ctx, u8_t *p, size_t n) {
 	if (!ctx->stream.ogg.active) return;
 
 	// fill sync buffer with all what we have
 	char* buffer = OG(&go, sync_buffer, &ctx->stream.ogg.sync, n);
-	memcpy(buffer, ctx->streambuf->writep, n);
+	memcpy(buffer, p, n);
 	OG(&go, sync_wrote, &ctx->stream.ogg.sync, n);
 
 	// extract a page from sync buffer
@@ -486,20 +620,34 @@ static void *stream_thread(struct thread_ctx_s *ctx) {
 
 		if (ctx->fd < 0 || !space || ctx->stream.state <= STREAMING_WAIT) {
 			UNLOCK_S;
-			usleep(100 * 1000);
+			// woken up by decoder (space) or controller (new stream)
+			wakeup_wait(&ctx->stream.wake, 1000);
 			continue;
 		}
 
 		if (ctx->stream.state == STREAMING_FILE) {
 
-			int n = read(ctx->fd, ctx->streambuf->writep, space);
+			// fill without LOCK_S so that decoder is not blocked meanwhile
+			u8_t *writep = _buf_produce(ctx->streambuf, &space);
+			u32_t generation = ctx->stream.generation;
+			UNLOCK_S;
+			int n = read(ctx->fd, writep, space);
+			buf_produced(ctx->streambuf, max(n, 0));
+			LOCK_S;
+
+			// file was re-opened elsewhere, closed or replaced, what we've read is gone
+			if (generation != ctx->stream.generation) {
+				UNLOCK_S;
+				continue;
+			}
+
 			if (n == 0) {
 				LOG_INFO("[%p] end of stream", ctx);
 				_disconnect(DISCONNECT, DISCONNECT_OK, ctx);
 			}
 			if (n > 0) {
-				_buf_inc_writep(ctx->streambuf, n);
 				ctx->stream.bytes += n;
+				wakeup_signal(&ctx->decode.wake);
 				LOG_SDEBUG("[%p] ctx->streambuf read %d bytes", ctx, n);
 			}
 			if (n < 0) {
@@ -516,6 +664,18 @@ static void *stream_thread(struct thread_ctx_s *ctx) {
 			pollinfo.events = POLLIN;
 			if (ctx->stream.state == SEND_HEADERS) {
 				pollinfo.events |= POLLOUT;
+			} else if (ctx->stream.state == CONNECTING) {
+				pollinfo.events = POLLOUT;
+			} else if (ctx->stream.state == SSL_CONNECTING) {
+				pollinfo.events = ctx->stream.connect.events;
+			}
+
+			if ((ctx->stream.state == CONNECTING || ctx->stream.state == SSL_CONNECTING) &&
+				(s32_t) (gettime_ms() - ctx->stream.connect.deadline) > 0) {
+				LOG_WARN("[%p]: timeout connecting to server", ctx);
+				_connect_failed(ctx);
+				UNLOCK_S;
+				continue;
 			}
 		}
 
@@ -531,10 +691,25 @@ static void *stream_thread(struct thread_ctx_s *ctx) {
 				continue;
 			}
 
+			if (ctx->stream.state == CONNECTING) {
+				_connect_done(ctx);
+				UNLOCK_S;
+				continue;
+			}
+
+#if USE_SSL
+			if (ctx->stream.state == SSL_CONNECTING) {
+				_ssl_handshake(ctx);
+				UNLOCK_S;
+				continue;
+			}
+#endif
+
 			if ((pollinfo.revents & POLLOUT) && ctx->stream.state == SEND_HEADERS) {
 				if (send_header(ctx)) ctx->stream.state = RECV_HEADERS;
 				ctx->stream.header_mlen = ctx->stream.header_len;
 				ctx->stream.header_len = 0;
+				ctx->stream.endtok = 0;
 				UNLOCK_S;
 				continue;
 			}
@@ -544,10 +719,15 @@ static void *stream_thread(struct thread_ctx_s *ctx) {
 				// get response headers
 				if (ctx->stream.state == RECV_HEADERS) {
 
-					// read one byte at a time to catch end of header
-					char c;
+					/* Peek at whatever is available but only consume up to the end of
+					 * headers so that body stays in socket for the regular path (icy 
+					 * interval is not known yet and we might have to wait for cont) */
+					char *p = ctx->stream.header + ctx->stream.header_len;
+					int endtok = ctx->stream.endtok;
+
+					int n = _peek(ctx, p, MAX_HEADER - 1 - ctx->stream.header_len);
+					if (n > 0) n = _recv(ctx, p, http_headers_end(p, n, ctx->stream.header_len, &endtok), 0);
 
-					int n = _recv(ctx, &c, 1, 0);
 					if (n <= 0) {
 						if (n < 0 && _last_error(ctx) == ERROR_WOULDBLOCK) {
 							UNLOCK_S;
@@ -556,20 +736,14 @@ static void *stream_thread(struct thread_ctx_s *ctx) {
 						LOG_WARN("[%p] error reading headers: %s", ctx, n ? strerror(_last_error(ctx)) : "closed");
 #if USE_SSL
 						if (!ctx->ssl && !ctx->stream.header_len) {
-							int sock;
-
 							// let's restart with SSL this time
 							ctx->stream.header_len = ctx->stream.header_mlen;
+							ctx->stream.endtok = 0;
 							closesocket(ctx->fd);
 							ctx->fd = -1;
 							LOG_INFO("[%p] now attempting with SSL", ctx);
 
-							// stay locked for slimproto (I know it can be long)
-							sock = connect_socket(true, ctx);
-
-							if (sock >= 0) {
-								ctx->fd = sock;
-								ctx->stream.state = SEND_HEADERS;
+							if (_connect_start(true, false, ctx)) {
 								UNLOCK_S;
 								continue;
 							}
@@ -580,24 +754,27 @@ static void *stream_thread(struct thread_ctx_s *ctx) {
 						continue;
 					}
 
-					*(ctx->stream.header + ctx->stream.header_len) = c;
-					ctx->stream.header_len++;
-
-					if (ctx->stream.header_len > MAX_HEADER - 1) {
-						LOG_ERROR("[%p]: received headers too long: %u", ctx, ctx->stream.header_len);
-						_disconnect(DISCONNECT, LOCAL_DISCONNECT, ctx);
-					}
-
-					if (ctx->stream.header_len > 1 && (c == '\r' || c == '\n')) {
-						ctx->stream.endtok++;
-						if (ctx->stream.endtok == 4) {
-							*(ctx->stream.header + ctx->stream.header_len) = '\0';
-							LOG_INFO("[%p]: headers: len: %d\n%s", ctx, ctx->stream.header_len, ctx->stream.header);
+					// what has actually been read might be less than what we peeked
+					http_headers_end(p, n, ctx->stream.header_len, &ctx->stream.endtok);
+					ctx->stream.header_len += n;
+
+					if (ctx->stream.endtok == 4) {
+						*(ctx->stream.header + ctx->stream.header_len) = '\0';
+						LOG_INFO("[%p]: headers: len: %d\n%s", ctx, ctx->stream.header_len, ctx->stream.header);
+						if (ctx->stream.range.pending) {
+							// server must honor the range or we'd be reading the wrong bytes
+							ctx->stream.range.pending = false;
+							if (!strstr(ctx->stream.header, " 206 ")) {
+								LOG_WARN("[%p]: range request not honored", ctx);
+								_disconnect(DISCONNECT, REMOTE_DISCONNECT, ctx);
+							} else ctx->stream.state = STREAMING_HTTP;
+						} else {
 							ctx->stream.state = ctx->stream.cont_wait ? STREAMING_WAIT : STREAMING_BUFFERING;
 							wake_controller(ctx);
 						}
-					} else {
-						ctx->stream.endtok = 0;
+					} else if (ctx->stream.header_len >= MAX_HEADER - 1) {
+						LOG_ERROR("[%p]: received headers too long: %u", ctx, ctx->stream.header_len);
+						_disconnect(DISCONNECT, LOCAL_DISCONNECT, ctx);
 					}
 
 					UNLOCK_S;
@@ -656,13 +833,27 @@ static void *stream_thread(struct thread_ctx_s *ctx) {
 
 				// stream body into streambuf
 				} else {
-					space = min(_buf_space(ctx->streambuf), _buf_cont_write(ctx->streambuf));
+					u8_t *writep = _buf_produce(ctx->streambuf, &space);
 
 					if (ctx->stream.meta_interval) {
 						space = min(space, ctx->stream.meta_next);
 					}
 
-					int n = _recv(ctx, ctx->streambuf->writep, space, 0);
+					/* fill without LOCK_S so that decoder is not blocked meanwhile, socket
+					 * can't be closed as stream_disconnect waits for the producer */
+					u32_t generation = ctx->stream.generation;
+					UNLOCK_S;
+					int n = _recv(ctx, writep, space, 0);
+					if (n > 0 && ctx->stream.store) spool_write(ctx->stream.store, writep, n);
+					buf_produced(ctx->streambuf, max(n, 0));
+					LOCK_S;
+
+					// connection was re-opened, closed or replaced, so what we've read is gone
+					if (generation != ctx->stream.generation) {
+						UNLOCK_S;
+						continue;
+					}
+
 					if (n == 0) {
 						LOG_INFO("[%p]: end of stream (t:%" PRId64 ")", ctx, ctx->stream.bytes);
 						_disconnect(DISCONNECT, DISCONNECT_OK, ctx);
@@ -673,10 +864,10 @@ static void *stream_thread(struct thread_ctx_s *ctx) {
 					}
 
 					if (n > 0) {
-						if (ctx->stream.store) fwrite(ctx->streambuf->writep, 1, n, ctx->stream.store);
-						stream_ogg(ctx, n);
-						_buf_inc_writep(ctx->streambuf, n);
+						// data are still there as we are the only one writing
+						stream_ogg(ctx, writep, n);
 						ctx->stream.bytes += n;
+						wakeup_signal(&ctx->decode.wake);
 						if (ctx->stream.meta_interval) {
 							ctx->stream.meta_next -= n;
 						}
@@ -704,6 +895,7 @@ static void *stream_thread(struct thread_ctx_s *ctx) {
 
 #if USE_SSL
 	if (!--SSLcount) {
+		sessions_flush();
 		SSL_CTX_free(SSLctx);
 		SSLctx = NULL;
 	}
@@ -748,16 +940,25 @@ bool stream_thread_init(unsigned streambuf_size, struct thread_ctx_s *ctx) {
 	LOG_DEBUG("[%p]: streambuf size: %u", ctx, streambuf_size);
 	ctx->streambuf = &ctx->__s_buf;
 
-	buf_init(ctx->streambuf, ((streambuf_size / (BYTES_PER_FRAME * 3)) * BYTES_PER_FRAME * 3));
+	buf_init_spsc(ctx->streambuf, ((streambuf_size / (BYTES_PER_FRAME * 3)) * BYTES_PER_FRAME * 3));
 	if (ctx->streambuf->buf == NULL) {
 		LOG_ERROR("[%p]: unable to malloc buffer", ctx);
 		return false;
 	}
 
 #if USE_SSL
+	if (!sessions.init) {
+		mutex_create(sessions.mutex);
+		sessions.init = true;
+	}
 	if (!SSLctx) {
 		SSLctx = SSL_CTX_new(SSLv23_client_method());
-		if (SSLctx) SSL_CTX_set_options(SSLctx, SSL_OP_NO_SSLv2);
+		if (SSLctx) {
+			SSL_CTX_set_options(SSLctx, SSL_OP_NO_SSLv2);
+			// we keep client sessions ourselves
+			SSL_CTX_set_session_cache_mode(SSLctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+			SSL_CTX_sess_set_new_cb(SSLctx, session_new);
+		}
 	}
 	SSLcount++;
 	ctx->ssl = NULL;
@@ -767,8 +968,14 @@ bool stream_thread_init(unsigned streambuf_size, struct thread_ctx_s *ctx) {
 	ctx->stream.state = STOPPED;
 	ctx->stream.header = malloc(MAX_HEADER);
 	ctx->stream.header[0] = '\0';
+	ctx->stream.range.request = malloc(MAX_HEADER);
+	ctx->stream.range.len = 0;
 	ctx->fd = -1;
 
+	// stream thread is first to start and last to stop so it owns decoder's wakeup as well
+	wakeup_create(&ctx->stream.wake);
+	wakeup_create(&ctx->decode.wake);
+
 	touch_memory(ctx->streambuf->buf, ctx->streambuf->size);
 
 	pthread_attr_init(&attr);
@@ -784,20 +991,67 @@ void stream_close(struct thread_ctx_s *ctx) {
 	LOCK_S;
 	ctx->stream_running = false;
 	UNLOCK_S;
+	wakeup_signal(&ctx->stream.wake);
 	pthread_join(ctx->stream_thread, NULL);
+	wakeup_destroy(&ctx->stream.wake);
+	wakeup_destroy(&ctx->decode.wake);
 	free(ctx->stream.header);
+	free(ctx->stream.range.request);
 	buf_destroy(ctx->streambuf);
 }
 
+/*---------------------------------------------------------------------------*/
+static void _stream_size(struct thread_ctx_s *ctx) {
+	struct outputstate *out = &ctx->output;
+	size_t size = ctx->config.streambuf_size, floor = size / BUFFER_MAX_SCALE;
+	u32_t rate = 0;
+
+	/* Configured size is for CD audio so scale it by the source data rate, when 
+	 * known. Mp4 containers need room to parse their moov atom so never shrink */
+	if (out->codec == 'p') rate = out->sample_rate * out->channels * out->sample_size / 8;
+	else if (out->bitrate) rate = out->bitrate * 1000 / 8;
+
+	if ((ctx->codec && (ctx->codec->id == 'l' || ctx->codec->id == 'A')) || 
+		(out->codec != 'p' && out->sample_size == '5') ||
+		strcasestr(out->mimetype, "mp4") || strcasestr(out->mimetype, "m4a")) floor = size;
+
+	if (rate) {
+		size = (u64_t) size * rate / CD_BYTES_PER_SEC;
+		size = max(size, floor);
+		size = min(size, ctx->config.streambuf_size * BUFFER_MAX_SCALE);
+	}
+
+	// keep a multiple of 3 frames like at init
+	size = (size / (BYTES_PER_FRAME * 3)) * BYTES_PER_FRAME * 3;
+	size = _buf_resize_budget(ctx->streambuf, size, floor);
+	LOG_INFO("[%p]: streambuf %zu bytes (rate:%u B/s)", ctx, size, rate);
+}
+
+static void _stream_generation(struct thread_ctx_s *ctx) {
+	// a fill that started before a new stream must not be accounted to it
+	mutex_lock(ctx->streambuf->producer);
+	ctx->stream.generation++;
+	mutex_unlock(ctx->streambuf->producer);
+}
+
 void stream_file(const char *header, size_t header_len, unsigned threshold, struct thread_ctx_s *ctx) {
 	buf_flush(ctx->streambuf);
 
 	LOCK_S;
+	_stream_generation(ctx);
+
+	_stream_size(ctx);
 
 	ctx->stream.header_len = header_len;
 	memcpy(ctx->stream.header, header, header_len);
 	*(ctx->stream.header+header_len) = '\0';
 
+	// keep file name in case decoder needs to re-open it
+	memcpy(ctx->stream.range.request, ctx->stream.header, header_len + 1);
+	ctx->stream.range.len = header_len;
+	ctx->stream.range.file = true;
+	ctx->stream.range.pending = false;
+
 	LOG_INFO("[%p]: opening local file: %s", ctx, ctx->stream.header);
 
 #if WIN
@@ -823,10 +1077,10 @@ void stream_file(const char *header, size_t header_len, unsigned threshold, stru
 	ctx->stream.threshold = threshold;
 
 	UNLOCK_S;
+	wakeup_signal(&ctx->stream.wake);
 }
 
 void stream_sock(u32_t ip, u16_t port, bool use_ssl, bool use_ogg, const char *header, size_t header_len, unsigned threshold, bool cont_wait, struct thread_ctx_s *ctx) {
-	int sock;
 	char *p;
 
 	memset(&ctx->stream.addr, 0, sizeof(ctx->stream.addr));
@@ -841,25 +1095,21 @@ void stream_sock(u32_t ip, u16_t port, bool use_ssl, bool use_ogg, const char *h
 	}
 
 	port = ntohs(port);
-	sock = connect_socket(use_ssl || port == 443, ctx);
 
-	// try one more time with plain socket
-	if (sock < 0 && port == 443 && !use_ssl) sock = connect_socket(false, ctx);
+	buf_flush(ctx->streambuf);
 
-	if (sock < 0) {
-		LOCK_S;
+	LOCK_S;
+	_stream_generation(ctx);
+
+	// connection is made by stream thread, 443 is tried with SSL first then plain
+	if (!_connect_start(use_ssl || port == 443, port == 443 && !use_ssl, ctx)) {
 		ctx->stream.state = DISCONNECT;
 		ctx->stream.disconnect = UNREACHABLE;
 		UNLOCK_S;
 		return;
 	}
 
-	buf_flush(ctx->streambuf);
-
-	LOCK_S;
-
-	ctx->fd = sock;
-	ctx->stream.state = SEND_HEADERS;
+	_stream_size(ctx);
 	ctx->stream.cont_wait = cont_wait;
 	ctx->stream.meta_interval = 0;
 	ctx->stream.meta_next = 0;
@@ -869,6 +1119,12 @@ void stream_sock(u32_t ip, u16_t port, bool use_ssl, bool use_ogg, const char *h
 	memcpy(ctx->stream.header, header, header_len);
 	*(ctx->stream.header+header_len) = '\0';
 
+	// header will be overwritten by response, keep request in case decoder needs a range
+	memcpy(ctx->stream.range.request, ctx->stream.header, header_len + 1);
+	ctx->stream.range.len = header_len;
+	ctx->stream.range.file = false;
+	ctx->stream.range.pending = false;
+
 	LOG_INFO("[%p]: header: %s", ctx, ctx->stream.header);
 
 	ctx->stream.sent_headers = false;
@@ -895,18 +1151,21 @@ void stream_sock(u32_t ip, u16_t port, bool use_ssl, bool use_ogg, const char *h
 
 	if (*ctx->config.store_prefix) {
 		char name[STR_LEN];
-		snprintf(name, sizeof(name), "%s/" BRIDGE_URL "%u-in#%u#.%s", ctx->config.store_prefix, ctx->output.index, sock, ctx->codec->types);
-		ctx->stream.store = fopen(name, "wb");
+		snprintf(name, sizeof(name), "%s/" BRIDGE_URL "%u-in#%u#.%s", ctx->config.store_prefix, ctx->output.index, ctx->fd, ctx->codec->types);
+		ctx->stream.store = spool_open(fopen(name, "wb"), 0);
 	} else {
 		ctx->stream.store = NULL;
 	}
 
 	UNLOCK_S;
+	wakeup_signal(&ctx->stream.wake);
 }
 
 bool stream_disconnect(struct thread_ctx_s* ctx) {
 	bool disc = false;
 	LOCK_S;
+	// stream thread might be filling without LOCK_S
+	mutex_lock(ctx->streambuf->producer);
 #if USE_SSL
 	if (ctx->ssl) {
 		SSL_shutdown(ctx->ssl);
@@ -919,6 +1178,7 @@ bool stream_disconnect(struct thread_ctx_s* ctx) {
 		ctx->fd = -1;
 		disc = true;
 	}
+	ctx->stream.generation++;
 	ctx->stream.state = STOPPED;
 #if USE_LIBOGG
 	if (ctx->stream.ogg.active) {
@@ -929,8 +1189,91 @@ bool stream_disconnect(struct thread_ctx_s* ctx) {
 	if (ctx->stream.ogg.state == STREAM_OGG_PAGE && ctx->stream.ogg.data) free(ctx->stream.ogg.data);
 	ctx->stream.ogg.data = NULL;
 #endif
-	if (ctx->stream.store) fclose(ctx->stream.store);
+	if (ctx->stream.store) spool_close(ctx->stream.store, false);
+	ctx->stream.store = NULL;
 
+	mutex_unlock(ctx->streambuf->producer);
 	UNLOCK_S;
+	wakeup_signal(&ctx->decode.wake);
 	return disc;
 }
+
+/*---------------------------------------------------------------------------*/
+/* Used by decoders that need data that is not where the stream is (mp4 with moov
+ * after mdat). The current connection is dropped and re-opened with a range request
+ * (or file is re-opened at offset). Streambuf is emptied and from that point, it will
+ * only receive data from <from> to <to> (0 means end of resource) */
+bool _stream_range(u64_t from, u64_t to, struct thread_ctx_s *ctx) {
+	bool ssl = ctx->stream.connect.ssl;
+	char *p, *request = ctx->stream.range.request;
+
+	if (!ctx->stream.range.len) return false;
+
+	// must have LOCK_S and stream thread might be filling without it
+	mutex_lock(ctx->streambuf->producer);
+
+#if USE_SSL
+	if (ctx->ssl) {
+		SSL_shutdown(ctx->ssl);
+		SSL_free(ctx->ssl);
+		ctx->ssl = NULL;
+	}
+#endif
+	if (ctx->fd != -1) closesocket(ctx->fd);
+	ctx->fd = -1;
+
+	// whatever is in streambuf is now useless
+	ctx->stream.generation++;
+	_buf_inc_readp(ctx->streambuf, _buf_used(ctx->streambuf));
+	ctx->stream.meta_interval = ctx->stream.meta_next = ctx->stream.meta_left = 0;
+
+	mutex_unlock(ctx->streambuf->producer);
+
+	if (ctx->stream.range.file) {
+#if WIN
+		ctx->fd = open(request, O_RDONLY | O_BINARY);
+#else
+		ctx->fd = open(request, O_RDONLY);
+#endif
+		if (ctx->fd < 0 || lseek(ctx->fd, from, SEEK_SET) != (off_t) from) {
+			LOG_WARN("[%p]: can't re-open file %s at %" PRIu64, ctx, request, from);
+			_disconnect(DISCONNECT, LOCAL_DISCONNECT, ctx);
+			return false;
+		}
+		ctx->stream.state = STREAMING_FILE;
+	} else {
+		char range[64], *line = request;
+		size_t len = 0;
+
+		if (to) snprintf(range, sizeof(range), "Range: bytes=%" PRIu64 "-%" PRIu64, from, to);
+		else snprintf(range, sizeof(range), "Range: bytes=%" PRIu64 "-", from);
+
+		// copy request up to the empty line that ends it, except any previous range
+		while ((p = strstr(line, "\r\n")) != NULL && p != line) {
+			if (strncasecmp(line, "Range:", 6)) {
+				memcpy(ctx->stream.header + len, line, p + 2 - line);
+				len += p + 2 - line;
+			}
+			line = p + 2;
+		}
+
+		if (!p || len + strlen(range) + 4 >= MAX_HEADER) {
+			LOG_WARN("[%p]: can't build range request", ctx);
+			_disconnect(DISCONNECT, LOCAL_DISCONNECT, ctx);
+			return false;
+		}
+
+		ctx->stream.header_len = len + sprintf(ctx->stream.header + len, "%s\r\n\r\n", range);
+		ctx->stream.range.pending = true;
+
+		LOG_INFO("[%p]: re-opening with %s", ctx, range);
+
+		if (!_connect_start(ssl, false, ctx)) {
+			_disconnect(DISCONNECT, UNREACHABLE, ctx);
+			return false;
+		}
+	}
+
+	wakeup_signal(&ctx->stream.wake);
+	return true;
+}
@@ -0,0 +1,322 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Philippe 2015-2023, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Transcode cache: the HTTP body of fully sent tracks is kept in a directory, one
+ * file per key where the key is a hash of whatever makes that body (track, encoding
+ * parameters...) so that a replay can be served without decoding and encoding. A
+ * body is recorded through a spool in <key>.tmp and renamed once complete, so a
+ * file under its key is always whole. Entries are listed with their size and last
+ * use in an index file and the least recently used are deleted when the total goes
+ * over the cap. Files that are not in the index (crash) are ignored. Recordings are
+ * finished from spool's thread, so tcache_end waits for those that are closed and
+ * none must be left open */
+
+#include "squeezelite.h"
+#include "cache.h"
+
+#define TCACHE_INDEX	"tcache.idx"
+#define TCACHE_SPOOL	(4*1024*1024)
+
+extern log_level	output_loglevel;
+static log_level 	*loglevel = &output_loglevel;
+
+struct tcache_rec_s {
+	u64_t	key;
+	spool_t	*spool;
+	size_t	size;
+	bool	dropped;
+};
+
+static struct {
+	bool init;
+	mutex_type mutex;
+	pthread_cond_t idle;	// no recording left to finish
+	unsigned recording;
+	char dir[STR_LEN];
+	size_t cap, used;
+	u32_t tick;
+	size_t count, max;
+	struct tcache_entry_s {
+		u64_t	key;
+		size_t	size;
+		u32_t	last;		// 0 while being recorded
+	} *entries;
+} tcache;
+
+/*---------------------------------------------------------------------------*/
+static void tcache_path(char *path, u64_t key, const char *ext) {
+	snprintf(path, STR_LEN, "%s/%016" PRIx64 "%s", tcache.dir, key, ext);
+}
+
+/*---------------------------------------------------------------------------*/
+static struct tcache_entry_s *tcache_find(u64_t key) {
+	for (size_t i = 0; i < tcache.count; i++) if (tcache.entries[i].key == key) return tcache.entries + i;
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static struct tcache_entry_s *tcache_add(u64_t key) {
+	if (tcache.count == tcache.max) {
+		size_t max = tcache.max ? 2 * tcache.max : 64;
+		struct tcache_entry_s *entries = realloc(tcache.entries, max * sizeof(struct tcache_entry_s));
+		if (!entries) return NULL;
+		tcache.entries = entries;
+		tcache.max = max;
+	}
+
+	struct tcache_entry_s *entry = tcache.entries + tcache.count++;
+	memset(entry, 0, sizeof(struct tcache_entry_s));
+	entry->key = key;
+	return entry;
+}
+
+/*---------------------------------------------------------------------------*/
+static void tcache_remove(struct tcache_entry_s *entry) {
+	tcache.used -= entry->size;
+	*entry = tcache.entries[--tcache.count];
+}
+
+/*---------------------------------------------------------------------------*/
+// called with mutex locked
+static void tcache_save(void) {
+	char path[STR_LEN];
+	snprintf(path, sizeof(path), "%s/" TCACHE_INDEX, tcache.dir);
+
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		LOG_WARN("can't write transcode cache index %s", path);
+		return;
+	}
+
+	for (size_t i = 0; i < tcache.count; i++) {
+		struct tcache_entry_s *entry = tcache.entries + i;
+		if (entry->last) fprintf(file, "%016" PRIx64 " %zu %u\n", entry->key, entry->size, entry->last);
+	}
+
+	fclose(file);
+}
+
+/*---------------------------------------------------------------------------*/
+// called with mutex locked
+static void tcache_evict(void) {
+	while (tcache.used > tcache.cap) {
+		struct tcache_entry_s *oldest = NULL;
+		char path[STR_LEN];
+
+		for (size_t i = 0; i < tcache.count; i++) {
+			struct tcache_entry_s *entry = tcache.entries + i;
+			if (entry->last && (!oldest || entry->last < oldest->last)) oldest = entry;
+		}
+
+		if (!oldest) break;
+
+		// an open file can't be deleted on some systems, try again later
+		tcache_path(path, oldest->key, "");
+		if (remove(path) && errno != ENOENT) break;
+
+		LOG_INFO("transcode cache evicts %016" PRIx64 " (%zu bytes)", oldest->key, oldest->size);
+		tcache_remove(oldest);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+void tcache_init(const char *dir, size_t cap) {
+	char path[STR_LEN];
+	u64_t key;
+	size_t size;
+	u32_t last;
+
+	if (tcache.init) return;
+
+	mutex_create(tcache.mutex);
+	pthread_cond_init(&tcache.idle, NULL);
+	tcache.init = true;
+
+	if (!dir || !*dir || !cap) return;
+
+	strncpy(tcache.dir, dir, sizeof(tcache.dir) - 1);
+	tcache.cap = cap;
+
+	snprintf(path, sizeof(path), "%s/" TCACHE_INDEX, tcache.dir);
+	FILE *file = fopen(path, "r");
+
+	while (file && fscanf(file, "%" SCNx64 " %zu %u", &key, &size, &last) == 3) {
+		struct tcache_entry_s *entry = tcache_add(key);
+		if (!entry) break;
+		entry->size = size;
+		entry->last = last;
+		tcache.used += size;
+		tcache.tick = max(tcache.tick, last);
+	}
+
+	if (file) fclose(file);
+
+	LOG_INFO("transcode cache in %s, %zu entries (%zu/%zu bytes)", tcache.dir, tcache.count, tcache.used, tcache.cap);
+}
+
+/*---------------------------------------------------------------------------*/
+void tcache_end(void) {
+	if (!tcache.init) return;
+
+	mutex_lock(tcache.mutex);
+	while (tcache.recording) pthread_cond_wait(&tcache.idle, &tcache.mutex);
+	if (tcache.cap) tcache_save();
+	NFREE(tcache.entries);
+	tcache.count = tcache.max = 0;
+	tcache.cap = tcache.used = 0;
+	tcache.tick = 0;
+	tcache.init = false;
+	mutex_unlock(tcache.mutex);
+
+	pthread_cond_destroy(&tcache.idle);
+	mutex_destroy(tcache.mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+// FNV-1a, 0 is reserved for "not cacheable"
+u64_t tcache_key(const char *id) {
+	u64_t key = 0xcbf29ce484222325ULL;
+
+	if (!tcache.cap || !id) return 0;
+
+	for (; *id; id++) {
+		key ^= (u8_t) *id;
+		key *= 0x100000001b3ULL;
+	}
+
+	return key ? key : 1;
+}
+
+/*---------------------------------------------------------------------------*/
+struct cache_buffer_s *tcache_open(u64_t key) {
+	struct cache_buffer_s *cache = NULL;
+	char path[STR_LEN];
+
+	if (!key) return NULL;
+	mutex_lock(tcache.mutex);
+
+	struct tcache_entry_s *entry = tcache_find(key);
+
+	if (entry && entry->last) {
+		tcache_path(path, key, "");
+		cache = cache_load(fopen(path, "rb"));
+
+		// file is gone or is not what was recorded
+		if (cache && cache->total == entry->size) {
+			entry->last = ++tcache.tick;
+		} else {
+			LOG_WARN("transcode cache entry %016" PRIx64 " is invalid", key);
+			if (cache) cache_delete(cache);
+			cache = NULL;
+			remove(path);
+			tcache_remove(entry);
+			tcache_save();
+		}
+	}
+
+	mutex_unlock(tcache.mutex);
+	return cache;
+}
+
+/*---------------------------------------------------------------------------*/
+struct tcache_rec_s *tcache_record(u64_t key) {
+	struct tcache_rec_s *rec = NULL;
+	char path[STR_LEN];
+
+	if (!key) return NULL;
+	mutex_lock(tcache.mutex);
+
+	// only one recording of a given key at a time
+	if (!tcache_find(key) && (rec = calloc(1, sizeof(struct tcache_rec_s))) != NULL) {
+		struct tcache_entry_s *entry = tcache_add(key);
+
+		// entry owns the temporary file name, so it can be removed before anybody reuses it
+		tcache_path(path, key, ".tmp");
+		rec->key = key;
+		rec->spool = entry ? spool_open(fopen(path, "wb"), TCACHE_SPOOL) : NULL;
+
+		if (rec->spool) {
+			tcache.recording++;
+			LOG_INFO("transcode cache records %016" PRIx64, key);
+		} else {
+			// spool has closed whatever fopen created
+			if (entry) {
+				remove(path);
+				tcache_remove(entry);
+			}
+			NFREE(rec);
+		}
+	}
+
+	mutex_unlock(tcache.mutex);
+	return rec;
+}
+
+/*---------------------------------------------------------------------------*/
+void tcache_write(struct tcache_rec_s *rec, const void *src, size_t size) {
+	// body is useless as soon as anything is missing
+	if (rec->dropped) return;
+	rec->size += size;
+	rec->dropped = spool_write(rec->spool, src, size) != size;
+	if (rec->dropped) LOG_WARN("transcode cache can't keep up, dropping %016" PRIx64, rec->key);
+}
+
+/*---------------------------------------------------------------------------*/
+// called from spool's thread once file is closed
+static void tcache_done(void *arg, bool ok) {
+	struct tcache_rec_s *rec = arg;
+	char tmp[STR_LEN], path[STR_LEN];
+
+	tcache_path(tmp, rec->key, ".tmp");
+	tcache_path(path, rec->key, "");
+
+	mutex_lock(tcache.mutex);
+
+	struct tcache_entry_s *entry = tcache_find(rec->key);
+	ok = ok && entry && !rec->dropped && rec->size;
+
+	// a stale file (not in index) might be there and some systems won't replace it
+	if (ok) {
+		remove(path);
+		ok = !rename(tmp, path);
+	}
+
+	if (ok) {
+		entry->size = rec->size;
+		entry->last = ++tcache.tick;
+		tcache.used += rec->size;
+		LOG_INFO("transcode cache stores %016" PRIx64 " (%zu bytes)", rec->key, rec->size);
+		tcache_evict();
+		tcache_save();
+	} else {
+		remove(tmp);
+		if (entry) tcache_remove(entry);
+	}
+
+	if (!--tcache.recording) pthread_cond_signal(&tcache.idle);
+	mutex_unlock(tcache.mutex);
+	free(rec);
+}
+
+/*---------------------------------------------------------------------------*/
+void tcache_close(struct tcache_rec_s *rec, bool commit) {
+	rec->dropped |= !commit;
+	spool_finish(rec->spool, tcache_done, rec);
+}
@@ -23,12 +23,12 @@
 extern log_level decode_loglevel;
 static log_level *loglevel = &decode_loglevel;
 
-#define LOCK_S   mutex_lock(ctx->streambuf->mutex)
-#define UNLOCK_S mutex_unlock(ctx->streambuf->mutex)
-#define LOCK_O   mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(ctx->outputbuf->mutex)
-#define LOCK_O_direct   mutex_lock(ctx->outputbuf->mutex)
-#define UNLOCK_O_direct mutex_unlock(ctx->outputbuf->mutex)
+#define LOCK_S   metrics_lock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define UNLOCK_S metrics_unlock(ctx->streambuf->mutex, METRICS_LOCK_S, ctx)
+#define LOCK_O   metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define LOCK_O_direct   metrics_lock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
+#define UNLOCK_O_direct metrics_unlock(ctx->outputbuf->mutex, METRICS_LOCK_O, ctx)
 #define IF_DIRECT(x)    { x }
 #define IF_PROCESS(x)
 
@@ -112,5 +112,59 @@ struct codec *register_thru(void) {
 void deregister_thru(void) {
 }
 
+/*---------------------------------------------------------------------------*/
+/* A player following another one's encoded stream (see output_follow) does not
+ * need any decoding but its streambuf must still be consumed so that stream and
+ * slimproto behave as usual, including STMd at the end */
+static decode_state drain_decode(struct thread_ctx_s *ctx) {
+	unsigned int in;
+
+	LOCK_S;
+
+	in = _buf_used(ctx->streambuf);
+
+	if (ctx->stream.state <= DISCONNECT && in == 0) {
+		UNLOCK_S;
+		return DECODE_COMPLETE;
+	}
+
+	if (ctx->decode.new_stream) {
+		LOG_INFO("[%p]: draining stream (following)", ctx);
+		ctx->decode.new_stream = false;
+	}
+
+	_buf_inc_readp(ctx->streambuf, min(in, _buf_cont_read(ctx->streambuf)));
+
+	UNLOCK_S;
+
+	return DECODE_RUNNING;
+}
+
+/*---------------------------------------------------------------------------*/
+static void drain_open(u8_t sample_size, u32_t sample_rate, u8_t	channels, u8_t endianness, struct thread_ctx_s *ctx) {
+	LOG_INFO("[%p]: drain codec", ctx);
+}
+
+/*---------------------------------------------------------------------------*/
+static void drain_close(struct thread_ctx_s *ctx) {
+}
+
+/*---------------------------------------------------------------------------*/
+struct codec *register_drain(void) {
+	static struct codec ret = {
+		'-',          // id
+		"-",   		  // types
+		0,            // min read
+		0,            // min space
+		drain_open,   // open
+		drain_close,  // close
+		drain_decode, // decode
+		true,         // thru
+	};
+
+	LOG_INFO("using drain");
+	return &ret;
+}
+
 
 
@@ -0,0 +1,297 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Philippe 2015-2023, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Minimal io_uring used by the HTTP reactors to batch their sends, straight on
+ * the syscalls so that there is no liburing dependency. Each request has a slot
+ * that holds its msghdr and iovec until completion as the kernel might only read
+ * them when the socket becomes writable. Completions are signalled on an eventfd
+ * so that they wake the reactor like any other event. When the kernel can't do
+ * it (too old, disabled by policy...) uring_create returns NULL and the caller
+ * keeps using plain sendmsg. Completions are moved from the kernel's queue to a
+ * list of done requests, so that uring_cancel can wait for some of them without
+ * losing the others' */
+
+#include "squeezelite.h"
+
+extern log_level	output_loglevel;
+static log_level 	*loglevel = &output_loglevel;
+
+#if URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_IOV	FRAME_PARTS
+#define URING_RETRY	3
+
+struct uring_s {
+	int 		fd;
+	unsigned 	entries, queued;
+	unsigned 	*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned 	*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void 		*ring;
+	size_t		ring_size, sqes_size;
+	struct uring_req_s {
+		void			*data;
+		int				sock;
+		bool			pending;	// kernel has not completed it yet
+		int				res;
+		struct msghdr	msg;
+		struct iovec	iov[URING_IOV];
+		struct uring_req_s *next;
+	} *reqs, *free, *done, **done_tail;
+};
+
+/*---------------------------------------------------------------------------*/
+struct uring_s* uring_create(unsigned entries, int eventfd) {
+	struct io_uring_params params = { 0 };
+	struct uring_s* ring = calloc(1, sizeof(struct uring_s));
+	if (!ring) return NULL;
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) {
+		LOG_INFO("io_uring not available (%d)", errno);
+		free(ring);
+		return NULL;
+	}
+
+	// single mmap and internal poll of sockets (5.7) are required
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_FAST_POLL)) {
+		LOG_INFO("io_uring is too old (features 0x%x)", params.features);
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+
+	ring->entries = params.sq_entries;
+	ring->ring_size = max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+						  params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	ring->reqs = calloc(ring->entries, sizeof(struct uring_req_s));
+
+	if (ring->ring == MAP_FAILED || ring->sqes == MAP_FAILED || !ring->reqs ||
+		syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &eventfd, 1) < 0) {
+		LOG_ERROR("can't map io_uring (%d)", errno);
+		if (ring->ring == MAP_FAILED) ring->ring = NULL;
+		if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+		uring_destroy(ring);
+		return NULL;
+	}
+
+	u8_t* base = ring->ring;
+	ring->sq_head = (unsigned*) (base + params.sq_off.head);
+	ring->sq_tail = (unsigned*) (base + params.sq_off.tail);
+	ring->sq_mask = (unsigned*) (base + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*) (base + params.sq_off.array);
+	ring->cq_head = (unsigned*) (base + params.cq_off.head);
+	ring->cq_tail = (unsigned*) (base + params.cq_off.tail);
+	ring->cq_mask = (unsigned*) (base + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) (base + params.cq_off.cqes);
+
+	for (unsigned i = 0; i < ring->entries; i++) {
+		ring->reqs[i].next = ring->free;
+		ring->free = ring->reqs + i;
+	}
+	ring->done_tail = &ring->done;
+
+	return ring;
+}
+
+/*---------------------------------------------------------------------------*/
+void uring_destroy(struct uring_s* ring) {
+	if (!ring) return;
+	if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+	if (ring->ring) munmap(ring->ring, ring->ring_size);
+	close(ring->fd);
+	free(ring->reqs);
+	free(ring);
+}
+
+/*---------------------------------------------------------------------------*/
+static struct io_uring_sqe* uring_sqe(struct uring_s* ring) {
+	unsigned tail = *ring->sq_tail;
+
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries) return NULL;
+
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = ring->sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+
+	return sqe;
+}
+
+/*---------------------------------------------------------------------------*/
+static void uring_push(struct uring_s* ring) {
+	// sqe returned by uring_sqe is filled, kernel can have it
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+}
+
+/*---------------------------------------------------------------------------*/
+static void uring_pump(struct uring_s* ring) {
+	unsigned head = *ring->cq_head;
+
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe* cqe = ring->cqes + (head & *ring->cq_mask);
+		struct uring_req_s* req = (struct uring_req_s*) (uintptr_t) cqe->user_data;
+
+		// cancellations have no request
+		if (req) {
+			req->pending = false;
+			req->res = cqe->res;
+			req->next = NULL;
+			*ring->done_tail = req;
+			ring->done_tail = &req->next;
+		}
+
+		__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+bool uring_send(struct uring_s* ring, int sock, const struct iovec* iov, int count, void* data) {
+	struct uring_req_s* req = ring->free;
+	struct io_uring_sqe* sqe;
+
+	// no slot, caller will send by itself
+	if (!req || count > URING_IOV || (sqe = uring_sqe(ring)) == NULL) return false;
+	ring->free = req->next;
+
+	req->data = data;
+	req->sock = sock;
+	req->pending = true;
+	memcpy(req->iov, iov, count * sizeof(struct iovec));
+	memset(&req->msg, 0, sizeof(req->msg));
+	req->msg.msg_iov = req->iov;
+	req->msg.msg_iovlen = count;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = sock;
+	sqe->addr = (uintptr_t) &req->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uintptr_t) req;
+	uring_push(ring);
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+void uring_cancel(struct uring_s* ring, void* data) {
+	bool pending;
+
+	/* the kernel might still read the requests' buffers, so they are cancelled and we
+	 * wait till they have completed (cancelled or not), then nobody is told */
+	for (unsigned i = 0; i < ring->entries; i++) {
+		struct uring_req_s* req = ring->reqs + i;
+		struct io_uring_sqe* sqe;
+
+		if (req->data != data || !req->pending) continue;
+
+		// make room by handing over what is queued, kernel might need room for completions
+		for (int retry = 0; (sqe = uring_sqe(ring)) == NULL && retry < URING_RETRY; retry++) {
+			uring_pump(ring);
+			uring_submit(ring);
+		}
+
+		// can't be cancelled, so make the send complete on its own
+		if (!sqe) {
+			LOG_WARN("io_uring can't cancel send on %d, shutting it down", req->sock);
+			shutdown(req->sock, SHUT_RDWR);
+			continue;
+		}
+
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uintptr_t) req;
+		sqe->user_data = 0;
+		uring_push(ring);
+	}
+
+	for (;;) {
+		uring_pump(ring);
+
+		pending = false;
+		for (unsigned i = 0; i < ring->entries; i++) {
+			if (ring->reqs[i].data == data && ring->reqs[i].pending) pending = true;
+		}
+		if (!pending) break;
+
+		uring_submit(ring);
+		if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+			LOG_ERROR("io_uring can't wait for cancellation %d", errno);
+			break;
+		}
+	}
+
+	// completions are in the done list but there is nobody to tell anymore
+	for (unsigned i = 0; i < ring->entries; i++) {
+		if (ring->reqs[i].data == data) ring->reqs[i].data = NULL;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+int uring_submit(struct uring_s* ring) {
+	if (!ring->queued) return 0;
+
+	int n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 0, 0, NULL, 0);
+	if (n > 0) ring->queued -= n;
+	else if (n < 0) LOG_WARN("io_uring submit error %d", errno);
+
+	return n;
+}
+
+/*---------------------------------------------------------------------------*/
+bool uring_reap(struct uring_s* ring, void** data, int* res) {
+	uring_pump(ring);
+
+	// skip completions whose requester is gone
+	while (ring->done) {
+		struct uring_req_s* req = ring->done;
+
+		if ((ring->done = req->next) == NULL) ring->done_tail = &ring->done;
+
+		*data = req->data;
+		*res = req->res;
+
+		req->data = NULL;
+		req->next = ring->free;
+		ring->free = req;
+
+		if (*data) return true;
+	}
+
+	return false;
+}
+
+#else
+
+struct uring_s* uring_create(unsigned entries, int eventfd) { return NULL; }
+void uring_destroy(struct uring_s* ring) { }
+void uring_cancel(struct uring_s* ring, void* data) { }
+int	uring_submit(struct uring_s* ring) { return 0; }
+bool uring_reap(struct uring_s* ring, void** data, int* res) { return false; }
+
+#endif
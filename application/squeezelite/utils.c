@@ -165,3 +165,61 @@ u16_t unpackn(u16_t* src) {
 
 	 return ret && ret[0] ? ret : NULL;
  }
+
+/*
+Finds the end of HTTP response headers received in pieces, which is 4 CR/LF in a
+row (not counting one that starts the response). Offset is how much of the response
+has been scanned already and endtok carries the count, it must be reset for every
+new response. Returns how many bytes are headers, whatever follows is body
+*/
+size_t http_headers_end(char* data, size_t len, size_t offset, int* endtok) {
+	size_t i;
+
+	for (i = 0; i < len && *endtok < 4; i++) {
+		if (offset + i && (data[i] == '\r' || data[i] == '\n')) (*endtok)++;
+		else *endtok = 0;
+	}
+
+	return i;
+}
+
+/*
+Replaces polling between stream, decode and output threads. Producers signal
+when they add data or space, consumers wait only when nothing was pending. The
+timeout is a safety net, not a polling period
+*/
+void wakeup_create(struct wakeup_s* w) {
+	mutex_create(w->mutex);
+	pthread_cond_init(&w->cond, NULL);
+	w->pending = w->waiting = false;
+}
+
+void wakeup_destroy(struct wakeup_s* w) {
+	pthread_cond_destroy(&w->cond);
+	mutex_destroy(w->mutex);
+}
+
+void wakeup_signal(struct wakeup_s* w) {
+	mutex_lock(w->mutex);
+	w->pending = true;
+	if (w->waiting) pthread_cond_signal(&w->cond);
+	mutex_unlock(w->mutex);
+}
+
+void wakeup_wait(struct wakeup_s* w, u32_t timeout) {
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (timeout % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	mutex_lock(w->mutex);
+	w->waiting = true;
+	while (!w->pending && pthread_cond_timedwait(&w->cond, &w->mutex, &ts) == 0);
+	w->waiting = w->pending = false;
+	mutex_unlock(w->mutex);
+}
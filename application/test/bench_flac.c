@@ -0,0 +1,166 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Philippe 2015-2023, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Parallel FLAC encoding the way output.c's worker pool does it: audio is cut in jobs
+ * of contiguous blocks, each worker keeps one encoder that it sets up, initializes and
+ * finishes for every job (that is the only way to get the last block out). Reported is
+ * the encoding speed (in x real-time) for jobs of 1 to 32 blocks and 1 to n workers,
+ * so both the per-job cost and how throughput scales with workers show. Each case must
+ * produce the same number of frames and bytes whatever the number of workers.
+ *   bench_flac [-v] [-s seed] [-w max workers] [-l level] [-r rate] [-t seconds] */
+
+#include "squeezelite.h"
+#include "FLAC/stream_encoder.h"
+#include "harness.h"
+
+#define BLOCKSIZE	4096
+#define CHANNELS	2
+#define SAMPLE_SIZE	24
+#define MAX_WORKERS	64
+
+static s32_t *pcm;
+static size_t total;
+static unsigned level = 8, rate = 96000;
+
+static struct {
+	mutex_type mutex;
+	size_t next, count, blocks;
+	u64_t bytes, frames;
+	bool failed;
+} pool;
+
+/*---------------------------------------------------------------------------*/
+static FLAC__StreamEncoderWriteStatus write_callback(const FLAC__StreamEncoder *encoder, const FLAC__byte buffer[], size_t bytes, unsigned samples, unsigned current_frame, void *client_data) {
+	u64_t *counters = (u64_t*) client_data;
+
+	// like workers, ignore the job's stream header
+	if (samples) {
+		counters[0] += bytes;
+		counters[1]++;
+	}
+
+	return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+static void *worker(void *arg) {
+	FLAC__StreamEncoder *codec = FLAC__stream_encoder_new();
+	u64_t counters[2] = { 0 };
+	bool ok = codec != NULL;
+
+	while (ok) {
+		mutex_lock(pool.mutex);
+		size_t job = pool.next++;
+		mutex_unlock(pool.mutex);
+
+		if (job >= pool.count) break;
+
+		size_t frames = min(pool.blocks * BLOCKSIZE, total - job * pool.blocks * BLOCKSIZE);
+
+		// same settings as flac_mt_worker
+		ok &= FLAC__stream_encoder_set_verify(codec, false);
+		ok &= FLAC__stream_encoder_set_compression_level(codec, level);
+		ok &= FLAC__stream_encoder_set_channels(codec, CHANNELS);
+		ok &= FLAC__stream_encoder_set_bits_per_sample(codec, SAMPLE_SIZE);
+		ok &= FLAC__stream_encoder_set_sample_rate(codec, rate);
+		ok &= FLAC__stream_encoder_set_blocksize(codec, BLOCKSIZE);
+		ok &= FLAC__stream_encoder_set_streamable_subset(codec, false);
+		ok &= !FLAC__stream_encoder_init_stream(codec, write_callback, NULL, NULL, NULL, counters);
+		if (ok) ok = FLAC__stream_encoder_process_interleaved(codec, (FLAC__int32*) pcm + job * pool.blocks * BLOCKSIZE * CHANNELS, frames);
+		ok &= FLAC__stream_encoder_finish(codec);
+	}
+
+	mutex_lock(pool.mutex);
+	pool.bytes += counters[0];
+	pool.frames += counters[1];
+	if (!ok) pool.failed = true;
+	mutex_unlock(pool.mutex);
+
+	if (codec) FLAC__stream_encoder_delete(codec);
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static double bench(size_t blocks, int workers, u64_t *bytes) {
+	pthread_t threads[MAX_WORKERS];
+	u64_t start;
+
+	pool.next = 0;
+	pool.blocks = blocks;
+	pool.count = (total + blocks * BLOCKSIZE - 1) / (blocks * BLOCKSIZE);
+	pool.bytes = pool.frames = 0;
+	pool.failed = false;
+
+	start = harness_now();
+	for (int i = 0; i < workers; i++) pthread_create(threads + i, NULL, worker, NULL);
+	for (int i = 0; i < workers; i++) pthread_join(threads[i], NULL);
+	double speed = total * 1E6 / rate / (harness_now() - start);
+
+	CHECK(!pool.failed, "%zu blocks, %d workers: encoding failed", blocks, workers);
+	CHECK(pool.frames == (total + BLOCKSIZE - 1) / BLOCKSIZE, "%zu blocks, %d workers: %" PRIu64 " frames",
+		  blocks, workers, pool.frames);
+	if (*bytes) CHECK(pool.bytes == *bytes, "%zu blocks, %d workers: %" PRIu64 " bytes instead of %" PRIu64,
+					  blocks, workers, pool.bytes, *bytes);
+	*bytes = pool.bytes;
+
+	return speed;
+}
+
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[]) {
+	int count = sysconf(_SC_NPROCESSORS_ONLN), seconds = 30;
+
+	harness_init(argc, argv);
+	for (int i = 1; i < argc - 1; i++) {
+		if (!strcmp(argv[i], "-w")) count = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "-l")) level = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "-r")) rate = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "-t")) seconds = atoi(argv[i + 1]);
+	}
+	count = min(max(count, 1), MAX_WORKERS);
+
+	// two tones and some noise so that predictors have something to do
+	total = (size_t) rate * seconds;
+	pcm = malloc(total * CHANNELS * sizeof(s32_t));
+	for (size_t i = 0; i < total; i++) {
+		double t = (double) i / rate;
+		pcm[2*i] = (s32_t) (0x300000 * sin(2 * M_PI * 440 * t)) + (s32_t) (harness_rand() & 0xfff) - 0x800;
+		pcm[2*i + 1] = (s32_t) (0x300000 * sin(2 * M_PI * 660 * t)) + (s32_t) (harness_rand() & 0xfff) - 0x800;
+	}
+
+	mutex_create(pool.mutex);
+	printf("FLAC-%u r:%u s:%u c:%u, %d s of audio, speed in x real-time\n", level, rate, SAMPLE_SIZE, CHANNELS, seconds);
+
+	for (size_t blocks = 1; blocks <= 32; blocks *= 2) {
+		u64_t bytes = 0;
+
+		printf("%2zu blocks/job ", blocks);
+		for (int workers = 1; workers <= count; workers = workers < count && workers * 2 > count ? count : workers * 2) {
+			printf(" %2d:%7.1f", workers, bench(blocks, workers, &bytes));
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+
+	mutex_destroy(pool.mutex);
+	free(pcm);
+
+	return harness_done("bench_flac");
+}
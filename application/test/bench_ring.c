@@ -0,0 +1,164 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Philippe 2015-2023, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Mirrored rings against plain ones, for the memory cache (CACHE_MIRROR vs CACHE_RING)
+ * and for struct buffer (buf_init_mirror vs buf_init). Everything read is compared to
+ * what was written, so a corrupted ring fails the run. That check is in the timings and
+ * costs the same for all cases.
+ *   bench_ring [-v] [-s seed] [-m MB moved per case] */
+
+#include "squeezelite.h"
+#include "cache.h"
+#include "harness.h"
+
+#define RING_SIZE	(256 * 1024)
+#define CHUNK_MAX	(16 * 1024)
+#define FRAME_MAX	(4 * 1024)
+#define PERIOD		1000003		// prime, so that data never lines up with ring sizes
+#define SIZES		4096
+
+static u8_t pattern[PERIOD + CHUNK_MAX];
+static size_t chunks[SIZES], frames[SIZES];
+
+static void report(const char *name, u64_t bytes, u64_t elapsed, u64_t ops, const char *what, u64_t items, const char *per) {
+	printf("%-24s %8.1f MB/s  %6.3f %s per %s\n", name, bytes / (double) elapsed, (double) ops / items, what, per);
+}
+
+/*---------------------------------------------------------------------------*/
+static void bench_cache(enum cache_type_e type, bool inner, u64_t total) {
+	static u8_t dst[CHUNK_MAX];
+	cache_buffer *cache = cache_create(type, RING_SIZE);
+	char name[32];
+	u64_t written = 0, read = 0, calls = 0, start;
+	int i;
+
+	snprintf(name, sizeof(name), "cache %s %s", type == CACHE_MIRROR ? "mirror" : "ring", inner ? "read_inner" : "read");
+	if (cache->type != type) {
+		printf("%-24s not available\n", name);
+		cache_delete(cache);
+		return;
+	}
+
+	start = harness_now();
+
+	for (i = 0; written < total; i++) {
+		size_t n = chunks[i % SIZES];
+
+		cache->write(cache, pattern + written % PERIOD, n);
+		written += n;
+
+		// sessions replay from an offset, read back what has just been written
+		cache->set_offset(cache, read);
+		while (read < written) {
+			size_t size = written - read;
+			u8_t *p = dst;
+
+			if (inner) p = cache->read_inner(cache, &size);
+			else size = cache->read(cache, dst, size, 0);
+
+			calls++;
+			if (!p || !size) {
+				CHECK(false, "%s: nothing to read at %" PRIu64, name, read);
+				break;
+			}
+
+			CHECK(!memcmp(p, pattern + read % PERIOD, size), "%s: corrupted at %" PRIu64, name, read);
+			read += size;
+		}
+	}
+
+	report(name, read, harness_now() - start, calls, "reads", i, "chunk");
+	cache_delete(cache);
+}
+
+/*---------------------------------------------------------------------------*/
+static void bench_buffer(bool mirror, u64_t total) {
+	struct buffer buf;
+	const char *name = mirror ? "buffer mirror" : "buffer plain";
+	u64_t produced = 0, consumed = 0, unwraps = 0, start;
+	int i = 0, j = 0;
+
+	if (mirror) buf_init_mirror(&buf, RING_SIZE);
+	else buf_init(&buf, RING_SIZE);
+
+	if (mirror && !buf.mirror) {
+		printf("%-24s not available\n", name);
+		buf_destroy(&buf);
+		return;
+	}
+
+	start = harness_now();
+
+	while (consumed < total) {
+		// producer fills as much as it can
+		while (_buf_space(&buf) >= chunks[i % SIZES]) {
+			size_t n = chunks[i++ % SIZES];
+			_buf_write(&buf, pattern + produced % PERIOD, n);
+			produced += n;
+		}
+
+		// decoder wants whole frames to be contiguous
+		while (_buf_used(&buf) >= frames[j % SIZES]) {
+			size_t n = frames[j++ % SIZES];
+
+			if (_buf_cont_read(&buf) < n) {
+				_buf_unwrap(&buf, n);
+				unwraps++;
+			}
+
+			CHECK(_buf_cont_read(&buf) >= n, "%s: unwrap failed at %" PRIu64, name, consumed);
+			CHECK(!memcmp(buf.readp, pattern + consumed % PERIOD, n), "%s: corrupted at %" PRIu64, name, consumed);
+			_buf_inc_readp(&buf, n);
+			consumed += n;
+		}
+	}
+
+	report(name, consumed, harness_now() - start, unwraps, "unwraps", j, "frame");
+	buf_destroy(&buf);
+}
+
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[]) {
+	u64_t total = 1024;
+
+	harness_init(argc, argv);
+	for (int i = 1; i < argc - 1; i++) if (!strcmp(argv[i], "-m")) total = atoi(argv[i + 1]);
+	total *= 1024 * 1024;
+
+	for (size_t i = 0; i < sizeof(pattern); i++) pattern[i] = harness_rand();
+	memcpy(pattern + PERIOD, pattern, CHUNK_MAX);
+
+	for (int i = 0; i < SIZES; i++) {
+		chunks[i] = 1 + harness_rand() % CHUNK_MAX;
+		frames[i] = 1 + harness_rand() % FRAME_MAX;
+	}
+
+	printf("ring of %u bytes, chunks up to %u, frames up to %u, %" PRIu64 " MB per case\n",
+		   RING_SIZE, CHUNK_MAX, FRAME_MAX, total >> 20);
+
+	bench_cache(CACHE_RING, true, total);
+	bench_cache(CACHE_MIRROR, true, total);
+	bench_cache(CACHE_RING, false, total);
+	bench_cache(CACHE_MIRROR, false, total);
+	bench_buffer(false, total);
+	bench_buffer(true, total);
+
+	return harness_done("bench_ring");
+}
@@ -0,0 +1,244 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Philippe 2015-2023, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Vector PCM kernels against the scalar loops of output.c. Every kernel this CPU can
+ * run is first checked to be bit-exact on random and edge-case input, then timed in
+ * frames/s. Like output.c, the scalar code finishes what a kernel leaves. Gain and
+ * crossfade work in place so their input is copied back each round, for all kernels.
+ *   bench_simd [-v] [-s seed] [-t ms per case] */
+
+// all kernels are needed, not only the one output_simd_init picks
+#include "output_simd.c"
+
+#include "harness.h"
+
+#define FRAMES		4096		// typical chunk
+#define ROUNDS		20000
+
+typedef size_t (*pack_t)(void *dst, u32_t *src, size_t frames, u8_t channels, u8_t sample_size, int endian);
+typedef size_t (*gain_t)(s32_t *iptr, u32_t gain, u8_t shift, size_t count);
+typedef size_t (*cross_t)(s32_t *iptr, s32_t *cptr, s32_t *fade, u32_t gain_in, u32_t gain_out, u8_t shift, size_t count);
+
+static struct kernel_s {
+	const char *name;
+	pack_t pack;
+	gain_t gain;
+	cross_t cross;
+	bool usable;
+} kernels[] = {
+	{ "scalar", none_pack, none_gain, none_cross, true },
+#if SIMD_X86
+	{ "sse2", sse2_pack, sse2_gain, sse2_cross },
+	{ "avx2", avx2_pack, avx2_gain, avx2_cross },
+#elif SIMD_NEON
+	{ "neon", neon_pack, neon_gain, neon_cross, true },
+#endif
+};
+
+/*---------------------------------------------------------------------------*/
+/*                  reference, same as scalar code of output.c               */
+/*---------------------------------------------------------------------------*/
+static void ref_pack(void *dst, u32_t *src, size_t frames, u8_t channels, u8_t sample_size, int endian) {
+	size_t count = frames * channels;
+	u8_t *optr = dst;
+
+	// mono is left channel
+	for (; count--; src += channels == 2 ? 1 : 2) {
+		u32_t sample = *src;
+		if (sample_size == 16) {
+			u16_t v = endian ? sample >> 16 : ((sample >> 24) & 0xff) | ((sample >> 8) & 0xff00);
+			memcpy(optr, &v, 2);
+			optr += 2;
+		} else if (sample_size == 24) {
+			*optr++ = endian ? sample >> 8 : sample >> 24;
+			*optr++ = sample >> 16;
+			*optr++ = endian ? sample >> 24 : sample >> 8;
+		} else {
+			u32_t v = endian ? sample : ((sample >> 24) & 0xff) | ((sample >> 8) & 0xff00) |
+										((sample << 8) & 0xff0000) | ((sample << 24) & 0xff000000);
+			memcpy(optr, &v, 4);
+			optr += 4;
+		}
+	}
+}
+
+static void ref_gain(s32_t *iptr, u32_t gain, u8_t shift, size_t count) {
+	while (count--) {
+		if (gain == 65536) {
+			*iptr = *iptr >> shift;
+			iptr++;
+		} else {
+			s64_t sample = *iptr * (s64_t) gain;
+			if (sample > MAX_VAL32) sample = MAX_VAL32;
+			else if (sample < -MAX_VAL32) sample = -MAX_VAL32;
+			*iptr++ = sample >> (16 + shift);
+		}
+	}
+}
+
+static void ref_cross(s32_t *iptr, s32_t *cptr, s32_t *fade, u32_t gain_in, u32_t gain_out, u8_t shift, size_t count) {
+	while (count--) {
+		s64_t sample = ((*iptr * (s64_t) gain_in) >> 16) * (65536L - *fade) + ((*cptr++ * (s64_t) gain_out) >> 16) * *fade;
+		fade++;
+		if (sample > MAX_VAL32) sample = MAX_VAL32;
+		else if (sample < -MAX_VAL32) sample = -MAX_VAL32;
+		*iptr++ = sample >> (16 + shift);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/*                     kernel for the bulk, reference for the tail           */
+/*---------------------------------------------------------------------------*/
+static void do_pack(struct kernel_s *k, void *dst, u32_t *src, size_t frames, u8_t channels, u8_t sample_size, int endian) {
+	size_t done = k->pack(dst, src, frames, channels, sample_size, endian);
+	ref_pack((u8_t*) dst + done * channels * (sample_size / 8), src + done * 2, frames - done, channels, sample_size, endian);
+}
+
+static void do_gain(struct kernel_s *k, s32_t *iptr, u32_t gain, u8_t shift, size_t count) {
+	size_t done = k->gain(iptr, gain, shift, count);
+	ref_gain(iptr + done, gain, shift, count - done);
+}
+
+static void do_cross(struct kernel_s *k, s32_t *iptr, s32_t *cptr, s32_t *fade, u32_t gain_in, u32_t gain_out, u8_t shift, size_t count) {
+	size_t done = k->cross(iptr, cptr, fade, gain_in, gain_out, shift, count);
+	ref_cross(iptr + done, cptr + done, fade + done, gain_in, gain_out, shift, count - done);
+}
+
+/*---------------------------------------------------------------------------*/
+static s32_t sample(void) {
+	switch (harness_rand() % 8) {
+		case 0: return INT32_MIN;
+		case 1: return INT32_MAX;
+		case 2: return -(s32_t) (harness_rand() % 1000);
+		default: return harness_rand();
+	}
+}
+
+static u32_t gain(void) {
+	static const u32_t gains[] = { 65536, 0, 1, 65535, 65537, 32768, 200000, 0x7fffffff, 0x80000000 };
+	return harness_rand() % 2 ? gains[harness_rand() % (sizeof(gains) / sizeof(*gains))] : harness_rand() % 300000;
+}
+
+static void check(struct kernel_s *k) {
+	static s32_t in[FRAMES * 2], cross[FRAMES * 2], fade[FRAMES * 2], a[FRAMES * 2], b[FRAMES * 2];
+	static u8_t o1[FRAMES * 8], o2[FRAMES * 8];
+
+	for (int round = 0; round < ROUNDS; round++) {
+		// odd sizes so that tails are exercised
+		size_t frames = harness_rand() % (round % 2 ? 64 : FRAMES);
+		u8_t shift = (harness_rand() % 4) * 8;
+		u8_t channels = 1 + harness_rand() % 2, sample_size = (2 + harness_rand() % 3) * 8;
+		int endian = harness_rand() % 2;
+		u32_t g = gain(), gain_in = harness_rand() % 4 ? 65536 : gain(), gain_out = harness_rand() % 4 ? 65536 : gain();
+
+		for (size_t i = 0; i < frames * 2; i++) {
+			in[i] = sample();
+			cross[i] = sample();
+			fade[i] = harness_rand() % 65537;
+		}
+
+		memset(o1, 0, sizeof(o1));
+		memset(o2, 0, sizeof(o2));
+		do_pack(k, o1, (u32_t*) in, frames, channels, sample_size, endian);
+		ref_pack(o2, (u32_t*) in, frames, channels, sample_size, endian);
+		CHECK(!memcmp(o1, o2, sizeof(o1)), "%s pack differs (frames:%zu ch:%u size:%u endian:%d)",
+			  k->name, frames, channels, sample_size, endian);
+
+		memcpy(a, in, frames * 8);
+		memcpy(b, in, frames * 8);
+		do_gain(k, a, g, shift, frames * 2);
+		ref_gain(b, g, shift, frames * 2);
+		CHECK(!memcmp(a, b, frames * 8), "%s gain differs (frames:%zu gain:%u shift:%u)", k->name, frames, g, shift);
+
+		memcpy(a, in, frames * 8);
+		memcpy(b, in, frames * 8);
+		do_cross(k, a, cross, fade, gain_in, gain_out, shift, frames * 2);
+		ref_cross(b, cross, fade, gain_in, gain_out, shift, frames * 2);
+		CHECK(!memcmp(a, b, frames * 8), "%s cross differs (frames:%zu in:%u out:%u shift:%u)",
+			  k->name, frames, gain_in, gain_out, shift);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static void bench(struct kernel_s *k, u64_t duration) {
+	static s32_t in[FRAMES * 2], work[FRAMES * 2], cross[FRAMES * 2], fade[FRAMES * 2];
+	static u8_t out[FRAMES * 8];
+	static const u8_t sizes[] = { 16, 24, 32 };
+	u64_t start, frames;
+
+	for (size_t i = 0; i < FRAMES * 2; i++) {
+		// realistic levels, with a few samples clipping
+		in[i] = (s32_t) harness_rand() >> (harness_rand() % 64 ? 2 : 0);
+		cross[i] = (s32_t) harness_rand() >> 2;
+		fade[i] = (i / 2) * 65536 / FRAMES;
+	}
+
+	for (int channels = 2; channels >= 1; channels--) {
+		for (size_t s = 0; s < sizeof(sizes); s++) {
+			for (int endian = 1; endian >= 0; endian--) {
+				for (start = harness_now(), frames = 0; harness_now() - start < duration; frames += FRAMES) {
+					do_pack(k, out, (u32_t*) in, FRAMES, channels, sizes[s], endian);
+				}
+				printf("%-8s pack %s %2u bits %s  %8.2f Mframes/s\n", k->name, channels == 2 ? "stereo" : "mono  ",
+					   sizes[s], endian ? "le" : "be", frames / (double) (harness_now() - start));
+			}
+		}
+	}
+
+	for (start = harness_now(), frames = 0; harness_now() - start < duration; frames += FRAMES) {
+		memcpy(work, in, sizeof(work));
+		do_gain(k, work, 0x9000, 0, FRAMES * 2);
+	}
+	printf("%-8s gain                    %8.2f Mframes/s\n", k->name, frames / (double) (harness_now() - start));
+
+	for (start = harness_now(), frames = 0; harness_now() - start < duration; frames += FRAMES) {
+		memcpy(work, in, sizeof(work));
+		do_cross(k, work, cross, fade, 65536, 65536, 0, FRAMES * 2);
+	}
+	printf("%-8s cross                   %8.2f Mframes/s\n", k->name, frames / (double) (harness_now() - start));
+}
+
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[]) {
+	u64_t duration = 200;
+
+	harness_init(argc, argv);
+	for (int i = 1; i < argc - 1; i++) if (!strcmp(argv[i], "-t")) duration = atoi(argv[i + 1]);
+
+#if SIMD_X86
+	__builtin_cpu_init();
+	kernels[1].usable = __builtin_cpu_supports("sse2");
+	kernels[2].usable = __builtin_cpu_supports("avx2");
+#endif
+
+	// bit-exactness first, timings of a wrong kernel are meaningless
+	for (size_t i = 1; i < sizeof(kernels) / sizeof(*kernels); i++) {
+		if (!kernels[i].usable) printf("%s not supported by this CPU\n", kernels[i].name);
+		else check(kernels + i);
+	}
+
+	if (!harness_failed) {
+		for (size_t i = 0; i < sizeof(kernels) / sizeof(*kernels); i++) {
+			if (kernels[i].usable) bench(kernels + i, duration * 1000);
+		}
+	}
+
+	return harness_done("bench_simd");
+}
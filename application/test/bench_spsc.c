@@ -0,0 +1,197 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Philippe 2015-2023, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* streambuf contention with many players. Each player has a feeder writing into a
+ * socket, a stream thread that polls it and receives into streambuf and a decode
+ * thread that consumes frames while holding the buffer mutex, like decoders do.
+ * The stream thread either receives with the mutex held (plain mirrored buffer) or
+ * between _buf_produce and buf_produced (spsc buffer). Reported are the throughput
+ * of all players and how long decoders waited for the mutex. Everything consumed is
+ * compared to what was fed.
+ *   bench_spsc [-v] [-s seed] [-p players] [-t seconds per case] */
+
+#include "squeezelite.h"
+#include "harness.h"
+
+#define FRAME		(8 * 1024)
+#define FEED		(16 * 1024)
+#define PERIOD		1000003
+
+static u8_t pattern[PERIOD + FEED];
+static volatile bool running;
+
+struct player_s {
+	struct buffer buf;
+	struct wakeup_s stream_wake, decode_wake;
+	bool spsc;
+	int fds[2];
+	pthread_t feeder, stream, decode;
+	u64_t fed, consumed, errors;
+	u64_t locks, lock_wait, lock_max;
+};
+
+/*---------------------------------------------------------------------------*/
+static void *feeder_thread(struct player_s *p) {
+	while (running) {
+		ssize_t n = send(p->fds[0], pattern + p->fed % PERIOD, FEED, MSG_NOSIGNAL);
+		if (n <= 0) break;
+		p->fed += n;
+	}
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static void *stream_thread(struct player_s *p) {
+	struct pollfd pfd = { p->fds[1], POLLIN, 0 };
+
+	while (running) {
+		size_t space;
+		ssize_t n = 0;
+
+		if (poll(&pfd, 1, 10) <= 0) continue;
+
+		mutex_lock(p->buf.mutex);
+
+		if (p->spsc) {
+			u8_t *writep = _buf_produce(&p->buf, &space);
+			mutex_unlock(p->buf.mutex);
+			if (space) n = recv(p->fds[1], writep, space, 0);
+			buf_produced(&p->buf, max(n, 0));
+		} else {
+			space = min(_buf_space(&p->buf), _buf_cont_write(&p->buf));
+			if (space) n = recv(p->fds[1], p->buf.writep, space, 0);
+			if (n > 0) _buf_inc_writep(&p->buf, n);
+			mutex_unlock(p->buf.mutex);
+		}
+
+		if (n > 0) wakeup_signal(&p->decode_wake);
+		else if (!space) wakeup_wait(&p->stream_wake, 10);
+	}
+
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static void *decode_thread(struct player_s *p) {
+	while (running) {
+		u64_t start = harness_now(), wait;
+		size_t n;
+
+		mutex_lock(p->buf.mutex);
+
+		wait = harness_now() - start;
+		p->locks++;
+		p->lock_wait += wait;
+		if (wait > p->lock_max) p->lock_max = wait;
+
+		// a decoder holds the mutex for its whole step
+		n = min(_buf_used(&p->buf), _buf_cont_read(&p->buf));
+		n = min(n, FRAME);
+		if (n) {
+			if (memcmp(p->buf.readp, pattern + p->consumed % PERIOD, n)) p->errors++;
+			_buf_inc_readp(&p->buf, n);
+			p->consumed += n;
+		}
+
+		mutex_unlock(p->buf.mutex);
+
+		if (n) wakeup_signal(&p->stream_wake);
+		else wakeup_wait(&p->decode_wake, 10);
+	}
+
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static void bench(bool spsc, int count, int seconds) {
+	struct player_s *players = calloc(count, sizeof(struct player_s));
+	u64_t consumed = 0, locks = 0, lock_wait = 0, lock_max = 0, errors = 0, start;
+	bool mirrored = true;
+
+	running = true;
+
+	for (int i = 0; i < count; i++) {
+		struct player_s *p = players + i;
+
+		p->spsc = spsc;
+		if (spsc) buf_init_spsc(&p->buf, STREAMBUF_SIZE);
+		else buf_init_mirror(&p->buf, STREAMBUF_SIZE);
+		if (!p->buf.mirror) mirrored = false;
+
+		wakeup_create(&p->stream_wake);
+		wakeup_create(&p->decode_wake);
+		socketpair(AF_UNIX, SOCK_STREAM, 0, p->fds);
+
+		pthread_create(&p->feeder, NULL, (void *(*)(void*)) feeder_thread, p);
+		pthread_create(&p->stream, NULL, (void *(*)(void*)) stream_thread, p);
+		pthread_create(&p->decode, NULL, (void *(*)(void*)) decode_thread, p);
+	}
+
+	start = harness_now();
+	sleep(seconds);
+	running = false;
+
+	for (int i = 0; i < count; i++) {
+		struct player_s *p = players + i;
+
+		pthread_join(p->stream, NULL);
+		pthread_join(p->decode, NULL);
+		shutdown(p->fds[1], SHUT_RDWR);
+		pthread_join(p->feeder, NULL);
+		close(p->fds[0]);
+		close(p->fds[1]);
+
+		consumed += p->consumed;
+		errors += p->errors;
+		locks += p->locks;
+		lock_wait += p->lock_wait;
+		if (p->lock_max > lock_max) lock_max = p->lock_max;
+
+		wakeup_destroy(&p->stream_wake);
+		wakeup_destroy(&p->decode_wake);
+		buf_destroy(&p->buf);
+	}
+
+	printf("%-6s %2d players%s  %8.1f MB/s  decoder lock wait avg %6.2f us, max %6" PRIu64 " us\n",
+		   spsc ? "spsc" : "locked", count, mirrored ? "" : " (not mirrored)",
+		   consumed / (double) (harness_now() - start), locks ? lock_wait / (double) locks : 0.0, lock_max);
+	CHECK(!errors, "%s: %" PRIu64 " corrupted frames", spsc ? "spsc" : "locked", errors);
+
+	free(players);
+}
+
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[]) {
+	int count = 32, seconds = 3;
+
+	harness_init(argc, argv);
+	for (int i = 1; i < argc - 1; i++) {
+		if (!strcmp(argv[i], "-p")) count = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "-t")) seconds = atoi(argv[i + 1]);
+	}
+
+	for (size_t i = 0; i < sizeof(pattern); i++) pattern[i] = harness_rand();
+	memcpy(pattern + PERIOD, pattern, FEED);
+
+	bench(false, count, seconds);
+	bench(true, count, seconds);
+
+	return harness_done("bench_spsc");
+}
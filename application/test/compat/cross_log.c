@@ -0,0 +1,14 @@
+/* stands for crosstools' cross_log.c */
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "cross_log.h"
+
+void logprint(const char *fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
@@ -0,0 +1,13 @@
+/* stands for crosstools' cross_log.h, everything goes to stderr */
+
+#pragma once
+
+typedef enum { lSILENCE = 0, lERROR, lWARN, lINFO, lDEBUG, lSDEBUG } log_level;
+
+void logprint(const char *fmt, ...);
+
+#define LOG_ERROR(fmt, ...)		do { if (*loglevel >= lERROR) logprint(fmt "\n", ##__VA_ARGS__); } while (0)
+#define LOG_WARN(fmt, ...)		do { if (*loglevel >= lWARN) logprint(fmt "\n", ##__VA_ARGS__); } while (0)
+#define LOG_INFO(fmt, ...)		do { if (*loglevel >= lINFO) logprint(fmt "\n", ##__VA_ARGS__); } while (0)
+#define LOG_DEBUG(fmt, ...)		do { if (*loglevel >= lDEBUG) logprint(fmt "\n", ##__VA_ARGS__); } while (0)
+#define LOG_SDEBUG(fmt, ...)	do { if (*loglevel >= lSDEBUG) logprint(fmt "\n", ##__VA_ARGS__); } while (0)
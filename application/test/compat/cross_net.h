@@ -0,0 +1,25 @@
+/* stands for crosstools' cross_net.h, declarations only */
+
+#pragma once
+
+#include <stdbool.h>
+#include <netinet/in.h>
+
+typedef struct key_data_s {
+	char *key, *data;
+} key_data_t;
+
+int		bind_socket(struct in_addr host, unsigned short *port, int mode);
+int		tcp_connect_timeout(int sd, const struct sockaddr_in addr, int ms);
+void	set_nonblock(int s);
+void	set_block(int s);
+void	set_nosigpipe(int s);
+int		shutdown_socket(int sd);
+bool	http_parse_simple(int sock, char **request, key_data_t *rkd, char **body, int *len);
+char*	http_send(int sock, char *method, key_data_t *rkd);
+char*	kd_lookup(key_data_t *kd, char *key);
+bool	kd_add(key_data_t *kd, char *key, char *value);
+bool	kd_vadd(key_data_t *kd, char *key, char *fmt, ...);
+char*	kd_dump(key_data_t *kd);
+void	kd_free(key_data_t *kd);
+int		getRequest(int sock, char *buf, int size);
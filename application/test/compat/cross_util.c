@@ -0,0 +1,16 @@
+/* stands for crosstools' cross_util.c, only what the tests link */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "cross_util.h"
+
+void touch_memory(uint8_t *buf, size_t size) {
+	for (size_t i = 0; i < size; i += 4096) buf[i] = 0;
+}
+
+uint32_t hash32(char *str) {
+	uint32_t hash = 5381;
+	while (*str) hash = hash * 33 ^ (uint8_t) *str++;
+	return hash;
+}
@@ -0,0 +1,33 @@
+/* stands for crosstools' cross_util.h, only touch_memory and hash32 are implemented */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#define NFREE(p) if (p) { free(p); p = NULL; }
+
+#ifndef min
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#endif
+
+#ifndef max
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+#endif
+
+typedef struct {
+	int dummy;
+} cross_queue_t;
+
+uint32_t	gettime_ms(void);
+uint64_t	gettime_ms64(void);
+char*		itoa(int value, char *str, int radix);
+uint32_t	hash32(char *str);
+char*		strcasestr(const char *haystack, const char *needle);
+char*		stristr(const char *haystack, const char *needle);
+char*		url_decode(char *str);
+char*		url_encode(char *str);
+void		touch_memory(uint8_t *buf, size_t size);
+int			_mutex_timedlock(pthread_mutex_t *m, uint32_t ms);
@@ -0,0 +1,36 @@
+/* stands for libogg's ogg.h, declarations only */
+
+#pragma once
+
+#include <stdint.h>
+
+typedef int64_t ogg_int64_t;
+
+typedef struct {
+	unsigned char *header;
+	long header_len;
+	unsigned char *body;
+	long body_len;
+} ogg_page;
+
+typedef struct {
+	unsigned char *packet;
+	long bytes, b_o_s, e_o_s;
+	ogg_int64_t granulepos, packetno;
+} ogg_packet;
+
+typedef struct { int dummy; } ogg_stream_state;
+typedef struct { int dummy; } ogg_sync_state;
+
+int			ogg_stream_init(ogg_stream_state *os, int serialno);
+int			ogg_stream_clear(ogg_stream_state *os);
+int			ogg_stream_reset_serialno(ogg_stream_state *os, int serialno);
+int			ogg_stream_pagein(ogg_stream_state *os, ogg_page *og);
+int			ogg_stream_packetout(ogg_stream_state *os, ogg_packet *op);
+int			ogg_sync_clear(ogg_sync_state *oy);
+char*		ogg_sync_buffer(ogg_sync_state *oy, long size);
+int			ogg_sync_wrote(ogg_sync_state *oy, long bytes);
+int			ogg_sync_pageout(ogg_sync_state *oy, ogg_page *og);
+int			ogg_page_bos(const ogg_page *og);
+int			ogg_page_serialno(const ogg_page *og);
+ogg_int64_t	ogg_page_granulepos(const ogg_page *og);
@@ -0,0 +1,37 @@
+/* stands for crosstools' platform.h, Linux only */
+
+#pragma once
+
+#define LINUX		1
+#define WIN			0
+#define OSX			0
+#define FREEBSD		0
+#define SUNOS		0
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define last_error() 		errno
+#define ERROR_WOULDBLOCK	EWOULDBLOCK
+#define closesocket(s)		close(s)
+
+#ifndef min
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#endif
+
+#ifndef max
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+#endif
@@ -0,0 +1,84 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Philippe 2015-2023, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <time.h>
+
+#include "squeezelite.h"
+#include "harness.h"
+
+log_level	slimproto_loglevel = lERROR;
+log_level	slimmain_loglevel = lERROR;
+log_level	stream_loglevel = lERROR;
+log_level	decode_loglevel = lERROR;
+log_level	output_loglevel = lERROR;
+log_level	main_loglevel = lERROR;
+log_level	util_loglevel = lERROR;
+log_level	cast_loglevel = lERROR;
+
+// metrics are never enabled here, locks only need to link
+volatile bool metrics_on = false;
+
+void _metrics_lock(mutex_type *mutex, struct metrics_s *m, metrics_lock_e id) {
+	mutex_lock(*mutex);
+}
+
+void _metrics_unlock(mutex_type *mutex, struct metrics_s *m, metrics_lock_e id) {
+	m->lock_at[id] = 0;
+	mutex_unlock(*mutex);
+}
+
+unsigned harness_failed;
+static u32_t seed = 1;
+
+/*---------------------------------------------------------------------------*/
+void harness_init(int argc, char *argv[]) {
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-v")) {
+			slimproto_loglevel = slimmain_loglevel = stream_loglevel = decode_loglevel = lDEBUG;
+			output_loglevel = main_loglevel = util_loglevel = cast_loglevel = lDEBUG;
+		} else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			seed = atoi(argv[++i]);
+			if (!seed) seed = 1;
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+int harness_done(const char *name) {
+	if (harness_failed) printf("%s: %u check(s) FAILED\n", name, harness_failed);
+	else printf("%s: ok\n", name);
+	return harness_failed ? 1 : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+u64_t harness_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*---------------------------------------------------------------------------*/
+u32_t harness_rand(void) {
+	// xorshift32, same sequence everywhere for a given seed
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
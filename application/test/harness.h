@@ -0,0 +1,47 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Philippe 2015-2023, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* What tests and benchmarks share. They run pieces of the bridge outside of it, so
+ * harness.c stands for what main and the modules not linked would otherwise provide.
+ * This does not include squeezelite.h, that is up to the program (it can include a
+ * source file to reach static functions and squeezelite.h has no include guard) */
+
+extern unsigned harness_failed;
+
+// report a failure but keep going so that a run shows all of them
+#define CHECK(cond, ...) do {							\
+	if (!(cond)) {										\
+		harness_failed++;								\
+		fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);	\
+		fprintf(stderr, __VA_ARGS__);					\
+		fputc('\n', stderr);							\
+	}													\
+} while (0)
+
+// -v sets all loglevels to lDEBUG, -s <n> sets the random seed
+void		harness_init(int argc, char *argv[]);
+int			harness_done(const char *name);
+uint64_t	harness_now(void);				// in µs
+uint32_t	harness_rand(void);
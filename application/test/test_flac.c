@@ -0,0 +1,371 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Philippe 2015-2023, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* flac thru on streams joined in the middle. Each corpus starts with the tail of a
+ * frame then has frames numbered from k, with bodies full of false sync words. They
+ * go through flac_decode in random chunks, called like decode_thread does, while the
+ * output is taken in random amounts. What comes out must be a "fLaC" header and the
+ * same frames numbered from 0 with their CRCs recomputed, and there must be one seek
+ * point per frame. CRCs of the expected stream are computed bit by bit, not with the
+ * tables of flac_thru.c. Streams that have their own "fLaC" header, followed by a
+ * padding block full of false sync words, must go through unchanged and be indexed.
+ *   test_flac [-v] [-s seed] */
+
+// static functions and tables are needed
+#include "flac_thru.c"
+
+#include "harness.h"
+
+#define STREAM_SIZE		(48 * 1024)
+#define OUTPUT_SIZE		(40 * 1024)
+#define ROUNDS			10
+#define FRAMES			200
+#define MAX_BODY		9000
+
+static const struct corpus_s {
+	const char *name;
+	u64_t first;				// number of first frame
+	u8_t codes[2];				// block size/rate and channels/sample size
+	u8_t extra[4];				// block size and rate at end of header
+	size_t extra_len;
+	u16_t block_size;
+	u32_t sample_rate;
+	u8_t channels, sample_size;
+} corpora[] = {
+	{ "4096@44100 stereo 16 bits", 70000, { 0xc9, 0x18 }, { 0 }, 0, 4096, 44100, 2, 16 },
+	{ "1152@50000 mono 24 bits", 5, { 0x7d, 0x0c }, { 0x04, 0x7f, 0xc3, 0x50 }, 4, 1152, 50000, 1, 24 },
+	{ "192@88200 side 20 bits", 3000000, { 0x6e, 0x8a }, { 0xbf, 0x22, 0x74 }, 3, 192, 88200, 2, 20 },
+};
+
+static struct {
+	u32_t sample_rate;
+	size_t count;
+	u64_t sample[FRAMES + 1];
+	size_t offset[FRAMES + 1];
+} seek;
+
+/*---------------------------------------------------------------------------*/
+/*                    what the rest of the bridge provides                   */
+/*---------------------------------------------------------------------------*/
+void _output_seektable(u32_t sample_rate, struct thread_ctx_s *ctx) {
+	seek.sample_rate = sample_rate;
+	seek.count = 0;
+}
+
+void _output_seekpoint(u64_t sample, size_t offset, struct thread_ctx_s *ctx) {
+	if (seek.count < FRAMES + 1) {
+		seek.sample[seek.count] = sample;
+		seek.offset[seek.count] = offset;
+	}
+	seek.count++;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                               reference                                   */
+/*---------------------------------------------------------------------------*/
+static u8_t ref_crc8(u8_t *data, size_t n) {
+	u8_t crc = 0;
+	while (n--) {
+		crc ^= *data++;
+		for (int i = 0; i < 8; i++) crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+	return crc;
+}
+
+static u16_t ref_crc16(u8_t *data, size_t n, u16_t crc) {
+	while (n--) {
+		crc ^= *data++ << 8;
+		for (int i = 0; i < 8; i++) crc = crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1;
+	}
+	return crc;
+}
+
+static size_t ref_utf8(u64_t v, u8_t *buf) {
+	size_t len;
+
+	if (v < 0x80) {
+		*buf = v;
+		return 1;
+	}
+
+	// each extra byte carries 6 bits and takes one from the first one
+	for (len = 2; len < 7 && v >> (5 * len + 1); len++);
+	buf[0] = (0xff00 >> len) | (v >> 6 * (len - 1));
+	for (size_t i = 1; i < len; i++) buf[i] = 0x80 | ((v >> 6 * (len - 1 - i)) & 0x3f);
+
+	return len;
+}
+
+// a complete frame, with header then body and CRC-16
+static size_t ref_frame(const struct corpus_s *corpus, u64_t number, u8_t *body, size_t len, u8_t *out) {
+	size_t n = 0;
+
+	out[n++] = 0xff;
+	out[n++] = 0xf8;
+	out[n++] = corpus->codes[0];
+	out[n++] = corpus->codes[1];
+	n += ref_utf8(number, out + n);
+	memcpy(out + n, corpus->extra, corpus->extra_len);
+	n += corpus->extra_len;
+	out[n] = ref_crc8(out, n);
+	n++;
+
+	if (len) memcpy(out + n, body, len);
+	n += len;
+
+	u16_t crc = ref_crc16(out, n, 0);
+	out[n++] = crc >> 8;
+	out[n++] = crc;
+
+	return n;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                  corpus                                   */
+/*---------------------------------------------------------------------------*/
+static size_t body(const struct corpus_s *corpus, u64_t number, u8_t *out) {
+	size_t len = 20 + harness_rand() % MAX_BODY;
+
+	for (size_t i = 0; i < len; i++) out[i] = harness_rand();
+
+	// plant what looks like sync words, the header of this frame or a lone 0xff at the end
+	for (int traps = harness_rand() % 8; traps; traps--) {
+		size_t at = harness_rand() % (len - 16);
+		switch (harness_rand() % 4) {
+			case 0: out[at] = 0xff; out[at + 1] = 0xf8 | (harness_rand() & 0x07); break;
+			case 1: out[at] = 0xff; out[at + 1] = 0xff; out[at + 2] = 0xf8; break;
+			case 2: ref_frame(corpus, number, NULL, 0, out + at); break;
+			case 3: out[len - 1] = 0xff; break;
+		}
+	}
+
+	return len;
+}
+
+// in is what is received mid-stream, expected what must be sent. Returns frames count
+static size_t corpus_build(const struct corpus_s *corpus, u8_t *in, size_t *in_len, u8_t *expected, size_t *expected_len, size_t *offsets) {
+	static u8_t data[MAX_BODY + 32];
+	size_t frames = 1 + harness_rand() % FRAMES, len;
+	u32_t combo;
+
+	/* tail of a previous frame, that has to be skipped, with the header of the frame
+	 * before first but a wrong CRC-8 */
+	*in_len = 32 + harness_rand() % 5000;
+	for (size_t i = 0; i < *in_len; i++) in[i] = harness_rand() % 0xff;
+	len = ref_frame(corpus, corpus->first - 1, NULL, 0, in + *in_len / 2) - 2;
+	in[*in_len / 2 + len - 1] ^= 0x01;
+
+	// "fLaC" and a streaminfo block that has only what the first frame tells
+	memcpy(expected, "fLaC\x80\x00\x00\x22", 8);
+	memset(expected + 8, 0, 34);
+	expected[8] = expected[10] = corpus->block_size >> 8;
+	expected[9] = expected[11] = corpus->block_size;
+	combo = (corpus->sample_rate << 12) | ((corpus->channels - 1) << 9) | ((corpus->sample_size - 1) << 4);
+	for (int i = 0; i < 4; i++) expected[18 + i] = combo >> (3 - i) * 8;
+	*expected_len = 42;
+
+	for (size_t i = 0; i < frames; i++) {
+		len = body(corpus, corpus->first + i, data);
+		*in_len += ref_frame(corpus, corpus->first + i, data, len, in + *in_len);
+		offsets[i] = *expected_len;
+		*expected_len += ref_frame(corpus, i, data, len, expected + *expected_len);
+	}
+
+	return frames;
+}
+
+// a whole file, with "fLaC", STREAMINFO and padding, sent as it is
+static size_t corpus_build_header(const struct corpus_s *corpus, u8_t *in, size_t *in_len, size_t *offsets) {
+	static u8_t data[MAX_BODY + 32];
+	size_t frames = 1 + harness_rand() % FRAMES, len = harness_rand() % 5000;
+	u32_t combo = (corpus->sample_rate << 12) | ((corpus->channels - 1) << 9) | ((corpus->sample_size - 1) << 4);
+
+	memcpy(in, "fLaC\x00\x00\x00\x22", 8);
+	memset(in + 8, 0, 34);
+	in[8] = in[10] = corpus->block_size >> 8;
+	in[9] = in[11] = corpus->block_size;
+	for (int i = 0; i < 4; i++) in[18 + i] = combo >> (3 - i) * 8;
+
+	in[42] = 0x81;
+	in[43] = len >> 16;
+	in[44] = len >> 8;
+	in[45] = len;
+	*in_len = 46;
+	for (size_t i = 0; i < len; i++) in[(*in_len)++] = i % 3 ? 0xff : 0xf8;
+
+	for (size_t i = 0; i < frames; i++) {
+		len = body(corpus, i, data);
+		offsets[i] = *in_len;
+		*in_len += ref_frame(corpus, i, data, len, in + *in_len);
+	}
+
+	return frames;
+}
+
+/*---------------------------------------------------------------------------*/
+static size_t run(struct codec *codec, struct thread_ctx_s *ctx, u8_t *in, size_t in_len, u8_t *out, size_t out_size) {
+	decode_state state = DECODE_RUNNING;
+	size_t fed = 0, len = 0;
+
+	ctx->stream.state = STREAMING_HTTP;
+	ctx->decode.new_stream = true;
+	codec->open(0, 0, 0, 0, ctx);
+
+	for (int loops = 0; state == DECODE_RUNNING; loops++) {
+		size_t n;
+
+		if (loops > 1000000) {
+			CHECK(false, "decoder stuck, %zu/%zu bytes fed", fed, in_len);
+			break;
+		}
+
+		// stream_thread brings what has arrived
+		n = 1 + harness_rand() % 20000;
+		n = min(n, in_len - fed);
+
+		// often end just after a 0xff, that might start a sync word
+		if (harness_rand() % 2) {
+			u8_t *p = memchr(in + fed + n / 2, 0xff, n - n / 2);
+			if (p) n = p - (in + fed) + 1;
+		}
+		fed += _buf_write(ctx->streambuf, in + fed, n);
+		if (fed == in_len) ctx->stream.state = DISCONNECT;
+
+		// decode_thread conditions to call the codec
+		if (_buf_space(ctx->outputbuf) > codec->min_space &&
+			(_buf_used(ctx->streambuf) > codec->min_read_bytes || ctx->stream.state <= DISCONNECT)) {
+			state = codec->decode(ctx);
+		}
+
+		// output takes what it can
+		n = harness_rand() % 30000;
+		n = min(n, _buf_used(ctx->outputbuf));
+		if (len + n > out_size) break;
+		len += _buf_read(out + len, ctx->outputbuf, n);
+	}
+
+	if (len + _buf_used(ctx->outputbuf) <= out_size) len += _buf_read(out + len, ctx->outputbuf, _buf_used(ctx->outputbuf));
+	codec->close(ctx);
+
+	return len;
+}
+
+/*---------------------------------------------------------------------------*/
+static void check_corpus(struct codec *codec, const struct corpus_s *corpus) {
+	static struct thread_ctx_s ctx;
+	size_t size = 42 + FRAMES * (MAX_BODY + 64) + 5000;
+	u8_t *in = malloc(size), *expected = malloc(size), *out = malloc(size);
+	size_t offsets[FRAMES];
+
+	ctx.streambuf = &ctx.__s_buf;
+	ctx.outputbuf = &ctx.__o_buf;
+	ctx.config.flac_header = FLAC_DEFAULT_HEADER;
+	buf_init(ctx.streambuf, STREAM_SIZE);
+	buf_init(ctx.outputbuf, OUTPUT_SIZE);
+
+	for (int round = 0; round < ROUNDS; round++) {
+		size_t in_len, expected_len, frames = corpus_build(corpus, in, &in_len, expected, &expected_len, offsets);
+		size_t len = run(codec, &ctx, in, in_len, out, size), at;
+
+		for (at = 0; at < min(len, expected_len) && out[at] == expected[at]; at++);
+		CHECK(len == expected_len && at == len, "%s: %zu bytes sent instead of %zu, first difference at %zu (round %d)",
+			  corpus->name, len, expected_len, at, round);
+
+		CHECK(seek.sample_rate == corpus->sample_rate, "%s: seek table at %u", corpus->name, seek.sample_rate);
+		CHECK(seek.count == frames, "%s: %zu seek points for %zu frames", corpus->name, seek.count, frames);
+		for (size_t i = 0; i < min(frames, seek.count); i++) {
+			if (seek.sample[i] != i * corpus->block_size || seek.offset[i] != offsets[i]) {
+				CHECK(false, "%s: frame %zu seek point at sample %" PRIu64 " offset %zu instead of %zu",
+					  corpus->name, i, seek.sample[i], seek.offset[i], offsets[i]);
+				break;
+			}
+		}
+
+		buf_flush(ctx.streambuf);
+		buf_flush(ctx.outputbuf);
+	}
+
+	for (int round = 0; round < ROUNDS; round++) {
+		size_t in_len, frames = corpus_build_header(corpus, in, &in_len, offsets);
+		size_t len = run(codec, &ctx, in, in_len, out, size), at;
+
+		for (at = 0; at < min(len, in_len) && out[at] == in[at]; at++);
+		CHECK(len == in_len && at == len, "%s with header: %zu bytes sent instead of %zu, first difference at %zu (round %d)",
+			  corpus->name, len, in_len, at, round);
+
+		CHECK(seek.sample_rate == corpus->sample_rate, "%s with header: seek table at %u", corpus->name, seek.sample_rate);
+		CHECK(seek.count == frames, "%s with header: %zu seek points for %zu frames", corpus->name, seek.count, frames);
+		for (size_t i = 0; i < min(frames, seek.count); i++) {
+			if (seek.sample[i] != i * corpus->block_size || seek.offset[i] != offsets[i]) {
+				CHECK(false, "%s with header: frame %zu seek point at sample %" PRIu64 " offset %zu instead of %zu",
+					  corpus->name, i, seek.sample[i], seek.offset[i], offsets[i]);
+				break;
+			}
+		}
+
+		buf_flush(ctx.streambuf);
+		buf_flush(ctx.outputbuf);
+	}
+
+	buf_destroy(ctx.streambuf);
+	buf_destroy(ctx.outputbuf);
+	free(in);
+	free(expected);
+	free(out);
+}
+
+/*---------------------------------------------------------------------------*/
+static void check_sync(void) {
+	u8_t data[] = { 0x00, 0xff, 0x00, 0xff, 0xf7, 0xff, 0xf9, 0x12, 0xff };
+
+	CHECK(find_sync(data, sizeof(data), 0) == 5, "sync word not found");
+	CHECK(find_sync(data, sizeof(data), 6) == 8, "0xff at the end is not a possible sync");
+	CHECK(find_sync(data, 5, 0) == 5, "sync word found in 0xfff7");
+	CHECK(find_sync(data, 0, 0) == 0, "sync word found in nothing");
+}
+
+/*---------------------------------------------------------------------------*/
+static void check_crc(void) {
+	static u8_t data[1024];
+
+	for (size_t i = 0; i < sizeof(data); i++) data[i] = harness_rand();
+
+	for (int round = 0; round < 10000; round++) {
+		size_t from = harness_rand() % 64, n = harness_rand() % (sizeof(data) - from);
+		u16_t crc = harness_rand();
+		CHECK(calc_crc16(data + from, n, crc) == ref_crc16(data + from, n, crc),
+			  "crc16 differs on %zu bytes at %zu", n, from);
+		CHECK(calc_crc8(data + from, n, 0) == ref_crc8(data + from, n), "crc8 differs on %zu bytes at %zu", n, from);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[]) {
+	struct codec *codec;
+
+	harness_init(argc, argv);
+	codec = register_flac_thru();
+
+	check_sync();
+	check_crc();
+	for (size_t i = 0; i < sizeof(corpora) / sizeof(*corpora); i++) check_corpus(codec, corpora + i);
+
+	return harness_done("test_flac");
+}
@@ -0,0 +1,132 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Philippe 2015-2023, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Response headers are read like stream_thread does: peek whatever has arrived, only
+ * consume up to the end of headers, then count again on what recv really returned.
+ * Responses arrive split at every possible point and recv may return less than was
+ * peeked. Headers must be exactly what is before the body and the body must be left
+ * untouched in the socket.
+ *   test_headers [-v] [-s seed] */
+
+#include "squeezelite.h"
+#include "harness.h"
+
+static const struct {
+	const char *name;
+	const char *response;
+	size_t body;			// where body starts, 0 when headers never end
+} cases[] = {
+	{ "http", "HTTP/1.1 200 OK\r\nContent-Type: audio/flac\r\nContent-Length: 1000\r\n\r\nfLaC\r\n\r\n\x01\x02", 67 },
+	{ "icy", "ICY 200 OK\r\nicy-metaint: 16000\r\nicy-name: radio\r\n\r\n\xff\xfb\x90\x64", 51 },
+	{ "body starting with CR/LF", "HTTP/1.0 206 Partial Content\r\nContent-Range: bytes 10-20/30\r\n\r\n\r\n\n\r\x01", 63 },
+	{ "leading CR/LF", "\r\nHTTP/1.0 200 OK\r\nServer: x\r\n\r\nbody", 32 },
+	{ "any 4 CR/LF end headers", "HTTP/1.0 200 OK\r\nX-Odd: a\rb\nc\r\n\r\r\nbody", 33 },
+	{ "LF only does not end", "HTTP/1.0 200 OK\nServer: x\n\nbody", 0 },
+};
+
+/*---------------------------------------------------------------------------*/
+static size_t arrived(size_t len, int step, size_t chunk) {
+	// 0 chunk means random arrival
+	size_t n = chunk ? (step + 1) * chunk : (step + 1) * (1 + harness_rand() % 64);
+	return n < len ? n : len;
+}
+
+/* returns headers length or 0 when too long, *pos is how much has been taken
+ * from the socket */
+static size_t read_headers(const char *response, size_t len, size_t chunk, bool short_reads, char *header, size_t *pos) {
+	size_t header_len = 0;
+	int endtok = 0;
+
+	*pos = 0;
+
+	for (int step = 0; endtok != 4; step++) {
+		size_t avail = arrived(len, step, chunk) - *pos;
+		int peeked = endtok;
+		char *p = header + header_len;
+
+		// nothing more will come
+		if (!avail && *pos == len) break;
+
+		// peek then only consume headers
+		size_t n = min(avail, MAX_HEADER - 1 - header_len);
+		memcpy(p, response + *pos, n);
+		n = http_headers_end(p, n, header_len, &peeked);
+		if (short_reads && n > 1) n = 1 + harness_rand() % n;
+
+		// count again on what has really been read
+		http_headers_end(p, n, header_len, &endtok);
+		header_len += n;
+		*pos += n;
+
+		if (header_len >= MAX_HEADER - 1) return 0;
+	}
+
+	return endtok == 4 ? header_len : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static void check_case(int index) {
+	static char header[MAX_HEADER];
+	const char *response = cases[index].response;
+	size_t len = strlen(response), body = cases[index].body;
+
+	for (size_t chunk = 0; chunk <= len; chunk++) {
+		for (int short_reads = 0; short_reads < 2; short_reads++) {
+			size_t pos, n = read_headers(response, len, chunk, short_reads, header, &pos);
+
+			CHECK(n == body, "%s: headers of %zu bytes instead of %zu (chunk:%zu short:%d)",
+				  cases[index].name, n, body, chunk, short_reads);
+			if (n) {
+				CHECK(pos == body, "%s: %zu bytes taken from socket instead of %zu", cases[index].name, pos, body);
+				CHECK(!memcmp(header, response, n), "%s: headers corrupted", cases[index].name);
+			}
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static void check_limits(void) {
+	static char header[MAX_HEADER * 2], response[MAX_HEADER * 2];
+	size_t pos;
+	int endtok;
+
+	// headers that never end are stopped at MAX_HEADER
+	memset(response, 'a', sizeof(response));
+	CHECK(read_headers(response, sizeof(response), 100, false, header, &pos) == 0, "endless headers accepted");
+	CHECK(pos == MAX_HEADER - 1, "endless headers read %zu bytes", pos);
+
+	// a count left from a previous response must be reset or nothing is read
+	endtok = 4;
+	CHECK(http_headers_end(response, 10, 0, &endtok) == 0, "scan went on after the end of headers");
+	endtok = 0;
+	CHECK(http_headers_end("\r\n\r\nx", 5, 1, &endtok) == 4 && endtok == 4, "end of headers not found");
+	endtok = 0;
+	CHECK(http_headers_end("\r\n\r\nx", 5, 0, &endtok) == 5 && endtok == 0, "first CR/LF of a response counted");
+}
+
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[]) {
+	harness_init(argc, argv);
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) check_case(i);
+	check_limits();
+
+	return harness_done("test_headers");
+}
@@ -0,0 +1,272 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Philippe 2015-2023, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* The mp4 walker on synthetic aac files with a sample table much larger than
+ * streambuf, moov before or after mdat, a box to skip that is larger than streambuf,
+ * 64 bits mdat and fixed sample size. Files arrive in random chunks and the walker is
+ * driven like m4a_thru does. Every sample must come out intact, esds must be given in
+ * full once and moov at end must take two range requests, to moov then to mdat.
+ *   test_mp4 [-v] [-s seed] */
+
+#include "squeezelite.h"
+#include "harness.h"
+
+#define STREAM_SIZE		(256 * 1024)
+#define SAMPLES			100000
+#define ESDS_LEN		40
+
+static const struct case_s {
+	const char *name;
+	bool moov_first, large, fixed;
+} cases[] = {
+	{ "moov first", true, false, false },
+	{ "moov at end", false, false, false },
+	{ "moov first, 64 bits mdat", true, true, false },
+	{ "moov at end, fixed size", false, false, true },
+};
+
+static u32_t sizes[SAMPLES];
+
+static struct {
+	u8_t *data;
+	size_t len, pos, end;
+	int ranges;
+} file;
+
+static int esds_count;
+
+/*---------------------------------------------------------------------------*/
+/*                    what the rest of the bridge provides                   */
+/*---------------------------------------------------------------------------*/
+bool _stream_range(u64_t from, u64_t to, struct thread_ctx_s *ctx) {
+	// what was received is from before the new range
+	_buf_inc_readp(ctx->streambuf, _buf_used(ctx->streambuf));
+	file.pos = from;
+	file.end = to ? to + 1 : file.len;
+	file.ranges++;
+	ctx->stream.state = STREAMING_HTTP;
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                   file                                    */
+/*---------------------------------------------------------------------------*/
+static void put32(u8_t *p, u32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static size_t box(u8_t *p, const char *type, u32_t len) {
+	put32(p, len);
+	memcpy(p + 4, type, 4);
+	return 8;
+}
+
+static u8_t sample_byte(u32_t sample, u32_t k) {
+	return sample * 131 + k;
+}
+
+// moov > trak > mdia > minf > stbl > stsd > mp4a > esds then stbl > stsz
+static size_t build_moov(u8_t *p, bool fixed) {
+	size_t mp4a = 36 + ESDS_LEN, stsd = 16 + mp4a, stsz = 20 + (fixed ? 0 : 4 * SAMPLES);
+	size_t stbl = 8 + stsd + stsz, minf = 8 + stbl, mdia = 8 + minf, trak = 8 + mdia, moov = 8 + trak;
+	u8_t *start = p;
+
+	p += box(p, "moov", moov);
+	p += box(p, "trak", trak);
+	p += box(p, "mdia", mdia);
+	p += box(p, "minf", minf);
+	p += box(p, "stbl", stbl);
+	box(p, "stsd", stsd);
+	memset(p + 8, 0, 8);
+	p += 16;
+	box(p, "mp4a", mp4a);
+	memset(p + 8, 0, 28);
+	p += 36;
+	box(p, "esds", ESDS_LEN);
+	for (int i = 8; i < ESDS_LEN; i++) p[i] = i;
+	p += ESDS_LEN;
+	box(p, "stsz", stsz);
+	memset(p + 8, 0, 4);
+	put32(p + 12, fixed ? sizes[0] : 0);
+	put32(p + 16, SAMPLES);
+	p += 20;
+	if (!fixed) for (int i = 0; i < SAMPLES; i++, p += 4) put32(p, sizes[i]);
+
+	return p - start;
+}
+
+static void build(const struct case_s *c) {
+	u64_t mdat_len = c->large ? 16 : 8;
+	u8_t *p = file.data;
+
+	for (int i = 0; i < SAMPLES; i++) {
+		sizes[i] = c->fixed ? 371 : 1 + harness_rand() % 300;
+		mdat_len += sizes[i];
+	}
+
+	// a few sizes that do not fit in 16 bits
+	if (!c->fixed) {
+		mdat_len += 70000 - sizes[5000] + 100000 - sizes[77777];
+		sizes[5000] = 70000;
+		sizes[77777] = 100000;
+	}
+
+	p += box(p, "ftyp", 16);
+	memset(p, 0, 8);
+	p += 8;
+
+	// something to skip that does not fit in streambuf
+	p += box(p, "free", STREAM_SIZE + 12345);
+	memset(p, 0xff, STREAM_SIZE + 12345 - 8);
+	p += STREAM_SIZE + 12345 - 8;
+
+	if (c->moov_first) p += build_moov(p, c->fixed);
+
+	if (c->large) {
+		p += box(p, "mdat", 1);
+		put32(p, mdat_len >> 32);
+		put32(p + 4, mdat_len);
+		p += 8;
+	} else p += box(p, "mdat", mdat_len);
+
+	for (u32_t i = 0; i < SAMPLES; i++) {
+		for (u32_t k = 0; k < sizes[i]; k++) *p++ = sample_byte(i, k);
+	}
+
+	if (!c->moov_first) p += build_moov(p, c->fixed);
+
+	// what ends the file is neither audio nor moov
+	p += box(p, "free", 64);
+	memset(p, 0x55, 56);
+	p += 56;
+
+	file.len = p - file.data;
+	file.pos = 0;
+	file.end = file.len;
+	file.ranges = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static int parse_esds(struct mp4_s *mp4, char *type, u8_t *data, u32_t len, struct thread_ctx_s *ctx) {
+	bool intact = len == ESDS_LEN && !memcmp(data + 4, "esds", 4);
+
+	for (int i = 8; intact && i < ESDS_LEN; i++) intact = data[i] == i;
+	CHECK(intact && !strcmp(type, "esds"), "esds not given in full");
+
+	esds_count++;
+	mp4->play = mp4->trak;
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static void check_case(const struct case_s *c, bool mirror) {
+	static struct thread_ctx_s ctx;
+	struct buffer *buf = ctx.streambuf = &ctx.__s_buf;
+	struct mp4_s mp4 = { 0 };
+	bool header = true;
+	u32_t sample = 0, bad = 0;
+
+	if (mirror) buf_init_mirror(buf, STREAM_SIZE);
+	else buf_init(buf, STREAM_SIZE);
+
+	build(c);
+	esds_count = 0;
+	mp4_open(&mp4, "esds", parse_esds);
+	ctx.stream.state = STREAMING_HTTP;
+
+	for (int loops = 0; ; loops++) {
+		size_t n;
+
+		if (loops > 10000000) {
+			CHECK(false, "%s: walker stuck at sample %u", c->name, sample);
+			break;
+		}
+
+		// stream_thread brings what has arrived
+		n = harness_rand() % 9000;
+		n = min(n, file.end - file.pos);
+		n = min(n, _buf_space(buf));
+		n = min(n, _buf_cont_write(buf));
+		memcpy(buf->writep, file.data + file.pos, n);
+		_buf_inc_writep(buf, n);
+		file.pos += n;
+		if (file.pos == file.end) ctx.stream.state = DISCONNECT;
+
+		// then the codec, like m4a_thru
+		if (mp4.consume) {
+			u32_t consume = min(mp4.consume, _buf_cont_read(buf));
+			_buf_inc_readp(buf, consume);
+			mp4.pos += consume;
+			mp4.consume -= consume;
+			continue;
+		}
+
+		if (header) {
+			int found = _mp4_header(&mp4, &ctx);
+			if (found < 0) {
+				CHECK(false, "%s: header parsing failed", c->name);
+				break;
+			}
+			header = found != 1;
+			continue;
+		}
+
+		u32_t size = mp4_sample_size(&mp4);
+		if (!size || (ctx.stream.state <= DISCONNECT && !_buf_used(buf))) break;
+		if (_buf_used(buf) < size) continue;
+
+		for (u32_t k = 0; k < size; k++) {
+			u8_t *p = buf->readp + k;
+			if (p >= buf->wrap) p -= buf->size;
+			if (*p != sample_byte(sample, k)) bad++;
+		}
+		if (size != sizes[sample]) bad++;
+
+		_buf_inc_readp(buf, size);
+		mp4.pos += size;
+		mp4_sample_next(&mp4);
+		sample++;
+	}
+
+	CHECK(sample == SAMPLES, "%s: %u samples instead of %u%s", c->name, sample, SAMPLES, mirror ? " (mirror)" : "");
+	CHECK(!bad, "%s: %u samples corrupted", c->name, bad);
+	CHECK(esds_count == 1, "%s: esds parsed %d times", c->name, esds_count);
+	CHECK(file.ranges == (c->moov_first ? 0 : 2), "%s: %d range requests", c->name, file.ranges);
+
+	mp4_close(&mp4);
+	buf_destroy(buf);
+}
+
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[]) {
+	harness_init(argc, argv);
+	file.data = malloc(SAMPLES * 400 + STREAM_SIZE * 2);
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+		check_case(cases + i, false);
+		check_case(cases + i, true);
+	}
+
+	free(file.data);
+	return harness_done("test_mp4");
+}